@@ -1,284 +1,925 @@
-#include "lib/structures.hpp"
+#include "lib/histogram.h"
+#include "lib/rclient.h"
+#include "lib/rng.h"
 #include <arpa/inet.h>
 #include <cassert>
+#include <cmath>
 #include <codecvt>
+#include <deque>
 #include <errno.h>
+#include <fcntl.h>
 #include <iostream>
 #include <netinet/ip.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <pthread.h>
 #include <sstream>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/epoll.h>
 #include <sys/socket.h>
+#include <sys/un.h>
 #include <unistd.h>
 #include <vector>
 using namespace std;
 
-static int32_t writeAll(int fd, char *buf, size_t n) {
-  while (n > 0) {
-    ssize_t writeSize = write(fd, buf, n);
-    if (writeSize <= 0) {
-      return -1; // Should use throw
+// prints one value per line as [type] - len: encoded size, res: value
+static void print_reply(const RcReply &r) {
+  size_t size = r.raw_len;
+  switch (r.type) {
+  case SER_STR:
+  case SER_ERR:
+    printf("[str] - len: %zu, res: %.*s\n", size, (int)r.len, r.str);
+    break;
+  case SER_NIL:
+    printf("[nil] - len: %zu, res: nil\n", size);
+    break;
+  case SER_INT:
+    printf("[int] - len: %zu, res: %ld\n", size, (long)r.integer);
+    break;
+  case SER_DBL:
+    printf("[dbl] - len: %zu, res: %g\n", size, r.dbl);
+    break;
+  case SER_ARR: {
+    RcArrayIter it = rc_array(r);
+    RcReply elem;
+    while (rc_array_next(&it, &elem)) {
+      print_reply(elem);
     }
-    assert((size_t)writeSize <= n);
-    n -= (size_t)writeSize;
-    buf += writeSize;
+    break;
+  }
+  default:
+    cout << "Bad Response" << endl;
   }
+}
 
-  return 0;
+// Reads a line of words from stdin and runs it; false at end of input. In
+// cluster mode the first argument is taken as the key to route by.
+static bool query(RcPool *pool, RcCluster *cl) {
+  string line;
+  if (!getline(cin, line)) {
+    return false;
+  }
+  istringstream l(line);
+  vector<string> cmd;
+  string word;
+  while (l >> word) {
+    cmd.push_back(word);
+  }
+  if (cmd.empty()) {
+    return true;
+  }
+  RcResult res = cl ? rc_cluster_call(cl, cmd.size() > 1 ? cmd[1] : "", cmd)
+                    : rc_call(pool, cmd).get();
+  print_reply(res.reply());
+  return true;
 }
 
-struct Packet {
-  uint32_t len;
-  vector<char> msg;
+// Benchmark mode: N threads, each driving M non-blocking connections that
+// keep up to `pipeline` requests in flight. Every reply is matched with the
+// send time of its request, so latency includes queueing in the pipeline.
+
+struct BenchConfig {
+  uint32_t threads = 1;
+  uint32_t conns = 4; // per thread
+  uint32_t pipeline = 1;
+  uint64_t requests = 100000;
+  uint64_t keyspace = 100000;
+  uint32_t value_size = 16;
+  double zipf_theta = 0; // 0 means uniform
+  // weights for get, set, zadd, zquery
+  uint32_t mix[4] = {50, 50, 0, 0};
+  // connect to the server's unixsocket instead of TCP
+  const char *unix_path = NULL;
+  // go through the client library, see lib_worker
+  bool lib = false;
+  // gets go through a client-side cache of this many keys, see cache_worker
+  uint32_t cache_keys = 0;
 };
 
-Packet parseData(char buff[MAX_BUF]) {
-  uint32_t len = 0;
-  memcpy(&len, buff, 4);
-  // cout << "The len of the received data is: " << len << endl;
-  vector<char> msg(buff + 4, buff + 4 + len + 1);
-  msg[4 + len] = '\0';
-  return {len, msg};
+static const char *k_bench_cmds[] = {"get", "set", "zadd", "zquery"};
+
+// Zipfian generator over [0, n) from Gray et al., "Quickly Generating
+// Billion-Record Synthetic Databases", as used by YCSB.
+struct Zipf {
+  uint64_t n = 0;
+  double theta = 0;
+  double alpha = 0;
+  double zetan = 0;
+  double eta = 0;
+};
+
+static double zeta(uint64_t n, double theta) {
+  double sum = 0;
+  for (uint64_t i = 1; i <= n; i++) {
+    sum += 1.0 / pow((double)i, theta);
+  }
+  return sum;
 }
 
-static int32_t readIO(int fd, Packet *packet) {
-  char buff[MAX_BUF] = {};
-  int32_t n = MAX_BUF;
-  cout << "READING" << endl;
-  ssize_t rs = read(fd, buff, n);
-  if (rs <= 0) {
-    return -1;
+static void zipf_init(Zipf *z, uint64_t n, double theta) {
+  z->n = n;
+  z->theta = theta;
+  z->alpha = 1.0 / (1.0 - theta);
+  z->zetan = zeta(n, theta);
+  double zeta2 = zeta(2, theta);
+  z->eta = (1 - pow(2.0 / n, 1 - theta)) / (1 - zeta2 / z->zetan);
+}
+
+static uint64_t zipf_next(const Zipf *z, double u) {
+  double uz = u * z->zetan;
+  if (uz < 1) {
+    return 0;
   }
-  // cout << "RS: " << rs << endl;
-  // cout << "READING" << endl;
-  n -= rs;
-  // Use this data to built a packet
-  // cout << "PARSING DATA" << endl;
-  *packet = parseData(buff);
-  return 0;
+  if (uz < 1 + pow(0.5, z->theta)) {
+    return 1;
+  }
+  uint64_t v = (uint64_t)(z->n * pow(z->eta * u - z->eta + 1, z->alpha));
+  return v < z->n ? v : z->n - 1;
 }
 
-static int32_t readAll(int fd, char *buf, size_t n) {
-  while (n > 0) {
-    ssize_t readSize = read(fd, buf, n);
-    if (readSize <= 0) {
-      return -1; // Should use throw
-    }
-    assert((size_t)readSize <= n);
-    n -= (size_t)readSize;
-    buf += readSize;
+struct BenchConn {
+  int fd = -1;
+  string wbuf;
+  size_t wsent = 0;
+  vector<char> rbuf;
+  size_t rsize = 0;
+  // send times of the requests in flight, oldest first
+  deque<uint64_t> inflight;
+};
+
+struct BenchThread;
+
+// a request in flight through the client library
+struct LibSlot {
+  BenchThread *bt = NULL;
+  uint64_t sent = 0;
+};
+
+struct BenchThread {
+  pthread_t thread;
+  const BenchConfig *cfg = NULL;
+  const Zipf *zipf = NULL;
+  uint64_t quota = 0;
+  uint64_t seed = 0;
+  uint64_t done = 0;
+  uint64_t errors = 0;
+  Histogram hist; // in ns
+
+  // --lib: replies arrive on the pool's I/O thread, under `mu`
+  RcPool *pool = NULL;
+  pthread_mutex_t mu;
+  pthread_cond_t cv;
+  vector<LibSlot> slots;
+  vector<uint32_t> free_slots;
+
+  RcCache *cache = NULL; // --cache
+};
+
+static void bench_make_args(BenchThread *bt, vector<string> &args,
+                            const string &value) {
+  const BenchConfig *cfg = bt->cfg;
+  uint32_t total = 0;
+  for (uint32_t w : cfg->mix) {
+    total += w;
+  }
+  uint32_t r = (uint32_t)(rng_step(bt->seed) % total);
+  int cmd = 0;
+  while (r >= cfg->mix[cmd]) {
+    r -= cfg->mix[cmd++];
   }
 
-  return 0;
+  uint64_t idx = 0;
+  if (bt->zipf) {
+    double u = (double)(rng_step(bt->seed) >> 11) / (double)(1ull << 53);
+    idx = zipf_next(bt->zipf, u);
+  } else {
+    idx = rng_step(bt->seed) % cfg->keyspace;
+  }
+  char key[32];
+  snprintf(key, sizeof(key), "key:%012lu", (unsigned long)idx);
+
+  switch (cmd) {
+  case 0:
+    args = {"get", key};
+    break;
+  case 1:
+    args = {"set", key, value};
+    break;
+  case 2:
+    args = {"zadd", "bench:zset", to_string(idx), key};
+    break;
+  case 3:
+    args = {"zquery", "bench:zset", to_string(idx), "", "0", "10"};
+    break;
+  }
 }
 
-static int32_t query(int fd, const char *text) {
-  uint32_t messageLen = (uint32_t)strlen(text);
-  char writeBuff[4 + messageLen];
-  memcpy(writeBuff, &messageLen, 4);
-  memcpy(writeBuff + 4, text, messageLen);
-  if (int32_t err = writeAll(fd, writeBuff, 4 + messageLen) < 0) {
-    return err;
-  }
-  char readBuff[4 + MAX_BUF + 1];
-  errno = 0;
-  Packet readPacket;
-  errno = 0;
-  int32_t err = readIO(fd, &readPacket);
-  if (err) {
-    if (errno == 0) {
-      cout << "EOF" << endl;
-    } else {
-      cout << "read () error" << endl;
+static void bench_make_req(BenchThread *bt, string &out, string &value) {
+  vector<string> args;
+  bench_make_args(bt, args, value);
+  rc_encode(out, args);
+}
+
+// Starts connecting to the server, over TCP or to `unix_path`. A
+// non-blocking connect may still be in progress when this returns.
+static int bench_socket(const char *unix_path, bool nonblock) {
+  int fd = socket(unix_path ? AF_UNIX : AF_INET,
+                  SOCK_STREAM | (nonblock ? SOCK_NONBLOCK : 0), 0);
+  if (fd < 0) {
+    return -1;
+  }
+  int rv = 0;
+  if (unix_path) {
+    struct sockaddr_un addr = {};
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, unix_path, sizeof(addr.sun_path) - 1);
+    rv = connect(fd, (const sockaddr *)&addr, sizeof(addr));
+  } else {
+    struct sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(1800);
+    addr.sin_addr.s_addr = inet_addr("127.0.0.1");
+    rv = connect(fd, (const sockaddr *)&addr, sizeof(addr));
+    int val = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &val, sizeof(val));
+  }
+  if (rv < 0 && !(nonblock && errno == EINPROGRESS)) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+static int bench_connect(const BenchConfig *cfg) {
+  int fd = bench_socket(cfg->unix_path, false);
+  if (fd >= 0) {
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+  }
+  return fd;
+}
+
+// consumes complete replies, returns false on a broken connection
+static bool bench_read(BenchThread *bt, BenchConn &c) {
+  while (true) {
+    if (c.rbuf.size() - c.rsize < 4096) {
+      c.rbuf.resize(c.rbuf.size() * 2 + 4096);
+    }
+    ssize_t rv = read(c.fd, c.rbuf.data() + c.rsize, c.rbuf.size() - c.rsize);
+    if (rv < 0 && errno == EINTR) {
+      continue;
+    }
+    if (rv < 0 && errno == EAGAIN) {
+      break;
+    }
+    if (rv <= 0) {
+      return false;
     }
-    return err;
+    c.rsize += (size_t)rv;
   }
-  // cout << "len: " << readPacket.len << endl;
-  cout << "Server Says: " << readPacket.msg.data() << endl;
-  return 0;
+
+  uint64_t now = clock_nsec();
+  size_t pos = 0;
+  while (c.rsize - pos >= 4) {
+    uint32_t len = 0;
+    memcpy(&len, &c.rbuf[pos], 4);
+    if (c.rsize - pos < 4 + (size_t)len) {
+      break;
+    }
+    if (len > 0 && c.rbuf[pos + 4] == SER_ERR) {
+      bt->errors++;
+    }
+    pos += 4 + len;
+    if (c.inflight.empty()) {
+      return false; // reply without a request
+    }
+    hist_record(&bt->hist, now - c.inflight.front());
+    c.inflight.pop_front();
+    bt->done++;
+  }
+  memmove(c.rbuf.data(), c.rbuf.data() + pos, c.rsize - pos);
+  c.rsize -= pos;
+  return true;
 }
 
-static int32_t read_full(int fd, char *buf, size_t n) {
-  while (n > 0) {
-    ssize_t rv = read(fd, buf, n);
+static bool bench_write(BenchConn &c) {
+  while (c.wsent < c.wbuf.size()) {
+    ssize_t rv = write(c.fd, c.wbuf.data() + c.wsent, c.wbuf.size() - c.wsent);
+    if (rv < 0 && errno == EINTR) {
+      continue;
+    }
+    if (rv < 0 && errno == EAGAIN) {
+      return true;
+    }
     if (rv <= 0) {
-      return -1; // error, or unexpected EOF
+      return false;
     }
-    assert((size_t)rv <= n);
-    n -= (size_t)rv;
-    buf += rv;
+    c.wsent += (size_t)rv;
   }
-  // cout << "Read Res Length" << endl;
-  return 0;
+  c.wbuf.clear();
+  c.wsent = 0;
+  return true;
 }
 
-uint32_t out_resp(char *rbuf, int32_t size) {
-  Type resType = (Type)rbuf[0];
-  string resp;
-  uint32_t len;
-  switch (resType) {
-  case Type::SER_STR:
-  case Type::SER_ERR:
-    if (size < 1 + 4) {
-      cout << "Bad Response" << endl;
-      return -1;
+static void *bench_worker(void *arg) {
+  BenchThread *bt = (BenchThread *)arg;
+  const BenchConfig *cfg = bt->cfg;
+  string value(cfg->value_size, 'x');
+  vector<BenchConn> conns(cfg->conns);
+  for (BenchConn &c : conns) {
+    c.fd = bench_connect(cfg);
+    if (c.fd < 0) {
+      perror("connect");
+      return NULL;
+    }
+  }
+
+  uint64_t sent = 0;
+  vector<struct pollfd> pfds(conns.size());
+  while (bt->done < bt->quota) {
+    for (size_t i = 0; i < conns.size(); i++) {
+      BenchConn &c = conns[i];
+      // top up the pipeline
+      while (c.inflight.size() < cfg->pipeline && sent < bt->quota) {
+        bench_make_req(bt, c.wbuf, value);
+        c.inflight.push_back(clock_nsec());
+        sent++;
+      }
+      pfds[i].fd = c.fd;
+      pfds[i].events = POLLIN | (c.wbuf.empty() ? 0 : POLLOUT);
+      pfds[i].revents = 0;
+    }
+    if (poll(pfds.data(), pfds.size(), 1000) < 0 && errno != EINTR) {
+      perror("poll");
       break;
     }
-    memcpy(&len, &rbuf[1], 4);
-    resp.append(&rbuf[5], len);
-    printf("[str] - len: %d, res: %s\n", size, resp.c_str());
-    return 4 + len + 1;
-    break;
-  case Type::SER_NIL:
-    printf("[nil] - len: %d, res: nil\n", size);
-    return 1;
-  case Type::SER_INT:
-    if (size < 1 + 8) {
-      cout << "Bad Response" << endl;
-      return -1;
-    }
-    uint64_t val;
-    memcpy(&val, &rbuf[1], 8);
-    printf("[int] - len: %d, res: %ld\n", size, val);
-    return 8 + 1;
-  case Type::SER_ARR:
-    if (size < 1 + 4) {
-      cout << "Bad Response" << endl;
-      return -1;
-    }
-    // Every element of the array is TLD (Type Value Data)
-    memcpy(&len, &rbuf[1], 4);
-    uint32_t loc = 4 + 1;
-    for (int i = 0; i < len; i++) {
-      uint32_t rv = out_resp(&rbuf[loc], size - loc);
-      if (rv < 0) {
-        return rv;
+    for (size_t i = 0; i < conns.size(); i++) {
+      BenchConn &c = conns[i];
+      bool ok = true;
+      if (pfds[i].revents & POLLOUT) {
+        ok = bench_write(c);
       }
-      loc += rv;
+      if (ok && (pfds[i].revents & (POLLIN | POLLERR | POLLHUP))) {
+        ok = bench_read(bt, c);
+      }
+      if (!ok) {
+        fprintf(stderr, "connection lost\n");
+        bt->quota = bt->done; // give up on this thread
+        break;
+      }
+    }
+  }
+  for (BenchConn &c : conns) {
+    close(c.fd);
+  }
+  return NULL;
+}
+
+static void lib_done(const RcReply *reply, void *arg) {
+  LibSlot *slot = (LibSlot *)arg;
+  BenchThread *bt = slot->bt;
+  uint64_t now = clock_nsec();
+  pthread_mutex_lock(&bt->mu);
+  hist_record(&bt->hist, now - slot->sent);
+  bt->errors += reply->type == SER_ERR ? 1 : 0;
+  bt->done++;
+  bt->free_slots.push_back((uint32_t)(slot - bt->slots.data()));
+  pthread_cond_signal(&bt->cv);
+  pthread_mutex_unlock(&bt->mu);
+}
+
+// --lib: threads share one pool and keep `pipeline` requests each in
+// flight, the way application threads would use the library
+static void *lib_worker(void *arg) {
+  BenchThread *bt = (BenchThread *)arg;
+  string value(bt->cfg->value_size, 'x');
+  vector<string> args;
+  for (uint64_t sent = 0; sent < bt->quota; sent++) {
+    pthread_mutex_lock(&bt->mu);
+    while (bt->free_slots.empty()) {
+      pthread_cond_wait(&bt->cv, &bt->mu);
     }
+    LibSlot *slot = &bt->slots[bt->free_slots.back()];
+    bt->free_slots.pop_back();
+    pthread_mutex_unlock(&bt->mu);
 
-    return loc;
+    bench_make_args(bt, args, value);
+    slot->sent = clock_nsec();
+    rc_send(bt->pool, args, &lib_done, slot);
   }
-  return 0;
+  pthread_mutex_lock(&bt->mu);
+  while (bt->done < bt->quota) {
+    pthread_cond_wait(&bt->cv, &bt->mu);
+  }
+  pthread_mutex_unlock(&bt->mu);
+  return NULL;
 }
 
-static int32_t read_res(int fd) {
-  // 4 bytes header
-  char rbuf[4 + MAX_BUF];
-  errno = 0;
-  int32_t err = read_full(fd, rbuf, 4);
-  if (err) {
-    if (errno == 0) {
-      cout << "EOF" << endl;
-    } else {
-      cout << "read () error" << endl;
+// --cache: each thread waits for every reply; gets are answered from the
+// local cache when they can be
+static void *cache_worker(void *arg) {
+  BenchThread *bt = (BenchThread *)arg;
+  string value(bt->cfg->value_size, 'x');
+  vector<string> args;
+  for (; bt->done < bt->quota; bt->done++) {
+    bench_make_args(bt, args, value);
+    uint64_t sent = clock_nsec();
+    RcResult res = args[0] == "get" ? rc_cache_get(bt->cache, args[1])
+                                    : rc_call(&bt->cache->pool, args).get();
+    hist_record(&bt->hist, clock_nsec() - sent);
+    bt->errors += res.reply().type == SER_ERR ? 1 : 0;
+  }
+  return NULL;
+}
+
+static bool parse_mix(const char *s, uint32_t mix[4]) {
+  memset(mix, 0, 4 * sizeof(uint32_t));
+  string spec = s;
+  istringstream in(spec);
+  string item;
+  uint32_t total = 0;
+  while (getline(in, item, ',')) {
+    size_t colon = item.find(':');
+    string name = item.substr(0, colon);
+    uint32_t weight =
+        colon == string::npos ? 1 : (uint32_t)atoi(item.c_str() + colon + 1);
+    bool found = false;
+    for (int i = 0; i < 4; i++) {
+      if (name == k_bench_cmds[i]) {
+        mix[i] += weight;
+        found = true;
+      }
+    }
+    if (!found) {
+      return false;
     }
-    return err;
+    total += weight;
   }
+  return total > 0;
+}
 
-  uint32_t size = 0;
-  memcpy(&size, &rbuf, 4); // assume little endian
+static void bench_usage() {
+  fprintf(stderr,
+          "usage: Client bench [-t threads] [-c conns-per-thread] "
+          "[-P pipeline]\n"
+          "                    [-n requests] [-r keyspace] [-d value-size]\n"
+          "                    [--mix get:50,set:50,zadd:0,zquery:0] "
+          "[--zipf theta]\n"
+          "                    [-s unix-socket] [--lib 1] [--cache keys]\n");
+}
 
-  // SIZE_OF_BUF _ TYPE _ LENGTH _ DATA
-  errno = 0;
-  err = read_full(fd, &rbuf[4], size);
-  if (err) {
-    if (errno == 0) {
-      cout << "EOF" << endl;
+static int bench_main(int argc, char *argv[]) {
+  BenchConfig cfg;
+  for (int i = 2; i < argc; i++) {
+    string opt = argv[i];
+    if (i + 1 >= argc) {
+      bench_usage();
+      return 1;
+    }
+    const char *val = argv[++i];
+    if (opt == "-t") {
+      cfg.threads = (uint32_t)atoi(val);
+    } else if (opt == "-c") {
+      cfg.conns = (uint32_t)atoi(val);
+    } else if (opt == "-P") {
+      cfg.pipeline = (uint32_t)atoi(val);
+    } else if (opt == "-n") {
+      cfg.requests = strtoull(val, NULL, 10);
+    } else if (opt == "-r") {
+      cfg.keyspace = strtoull(val, NULL, 10);
+    } else if (opt == "-d") {
+      cfg.value_size = (uint32_t)atoi(val);
+    } else if (opt == "--zipf") {
+      cfg.zipf_theta = atof(val);
+    } else if (opt == "-s") {
+      cfg.unix_path = val;
+    } else if (opt == "--lib") {
+      cfg.lib = atoi(val) != 0;
+    } else if (opt == "--cache") {
+      cfg.cache_keys = (uint32_t)atoi(val);
+    } else if (opt == "--mix") {
+      if (!parse_mix(val, cfg.mix)) {
+        bench_usage();
+        return 1;
+      }
     } else {
-      cout << "read () error" << endl;
+      bench_usage();
+      return 1;
+    }
+  }
+  if (!cfg.threads || !cfg.conns || !cfg.pipeline || !cfg.keyspace ||
+      cfg.zipf_theta < 0 || cfg.zipf_theta >= 1) {
+    bench_usage();
+    return 1;
+  }
+
+  Zipf zipf;
+  if (cfg.zipf_theta > 0) {
+    zipf_init(&zipf, cfg.keyspace, cfg.zipf_theta);
+  }
+  RcPool pool;
+  RcCache cache;
+  if (cfg.lib || cfg.cache_keys) {
+    RcOptions opt;
+    opt.unix_path = cfg.unix_path;
+    opt.conns = cfg.conns;
+    int err = cfg.cache_keys ? rc_cache_open(&cache, opt, cfg.cache_keys)
+                             : rc_pool_open(&pool, opt);
+    if (err < 0) {
+      fprintf(stderr, "connect: %s\n", strerror(-err));
+      return 1;
     }
-    return err;
   }
-  return out_resp(&rbuf[4], size);
+  vector<BenchThread *> threads;
+  for (uint32_t i = 0; i < cfg.threads; i++) {
+    BenchThread *bt = new BenchThread();
+    bt->cfg = &cfg;
+    bt->zipf = cfg.zipf_theta > 0 ? &zipf : NULL;
+    bt->quota = cfg.requests / cfg.threads +
+                (i < cfg.requests % cfg.threads ? 1 : 0);
+    bt->seed = k_rng_seed * (i + 1);
+    if (cfg.cache_keys) {
+      bt->cache = &cache;
+    } else if (cfg.lib) {
+      bt->pool = &pool;
+      pthread_mutex_init(&bt->mu, NULL);
+      pthread_cond_init(&bt->cv, NULL);
+      bt->slots.resize(cfg.pipeline);
+      for (uint32_t j = 0; j < cfg.pipeline; j++) {
+        bt->slots[j].bt = bt;
+        bt->free_slots.push_back(j);
+      }
+    }
+    threads.push_back(bt);
+  }
+
+  uint64_t start = clock_nsec();
+  for (BenchThread *bt : threads) {
+    void *(*worker)(void *) = cfg.cache_keys ? &cache_worker
+                              : cfg.lib      ? &lib_worker
+                                             : &bench_worker;
+    pthread_create(&bt->thread, NULL, worker, bt);
+  }
+  Histogram all;
+  uint64_t done = 0;
+  uint64_t errors = 0;
+  for (BenchThread *bt : threads) {
+    pthread_join(bt->thread, NULL);
+    hist_merge(&all, &bt->hist);
+    done += bt->done;
+    errors += bt->errors;
+  }
+  double secs = (double)(clock_nsec() - start) / 1e9;
+  if (cfg.cache_keys) {
+    rc_cache_close(&cache);
+  } else if (cfg.lib) {
+    rc_pool_close(&pool);
+  }
+
+  printf("mix:");
+  for (int i = 0; i < 4; i++) {
+    if (cfg.mix[i]) {
+      printf(" %s:%u", k_bench_cmds[i], cfg.mix[i]);
+    }
+  }
+  printf("  keys: %lu %s", (unsigned long)cfg.keyspace,
+         cfg.zipf_theta > 0 ? "zipfian" : "uniform");
+  if (cfg.zipf_theta > 0) {
+    printf("(%.2f)", cfg.zipf_theta);
+  }
+  if (cfg.cache_keys) {
+    printf("\nthreads: %u  pooled connections: %u  cached keys: %u\n",
+           cfg.threads, cfg.conns, cfg.cache_keys);
+    printf("cache hits: %lu  misses: %lu  invalidations: %lu\n",
+           (unsigned long)cache.hits, (unsigned long)cache.misses,
+           (unsigned long)cache.invalidations);
+  } else if (cfg.lib) {
+    printf("\nthreads: %u  pooled connections: %u  in flight per thread: %u\n",
+           cfg.threads, cfg.conns, cfg.pipeline);
+  } else {
+    printf("\nthreads: %u  connections: %u  pipeline: %u\n", cfg.threads,
+           cfg.threads * cfg.conns, cfg.pipeline);
+  }
+  // a get on a missing key also replies with an error
+  printf("%lu requests in %.3f s, %lu error replies\n", (unsigned long)done,
+         secs, (unsigned long)errors);
+  printf("throughput: %.0f req/s\n", secs > 0 ? done / secs : 0);
+  printf("latency usec: p50 %.1f  p99 %.1f  p99.9 %.1f  max %.1f\n",
+         hist_percentile(&all, 0.5) / 1e3, hist_percentile(&all, 0.99) / 1e3,
+         hist_percentile(&all, 0.999) / 1e3, all.max / 1e3);
+  for (BenchThread *bt : threads) {
+    delete bt;
+  }
+  return done == cfg.requests ? 0 : 1;
 }
 
-static int32_t sendReq(int fd, int32_t nstr, char **cmd) {
-  // uint32_t messageLen = (uint32_t)strlen(text);
-  // char writeBuff[4 + messageLen];
-  // memcpy(writeBuff, &messageLen, 4);
-  // memcpy(writeBuff + 4, text, messageLen);
-  uint32_t packetSize = 4;
-  for (int i = 0; i < nstr; i++)
-    packetSize += strlen(cmd[i]);
-  packetSize += 4 * nstr;
-  char packet[packetSize];
-  memcpy(&packet, &nstr, 4);
-  int cur = 4;
-  for (int i = 0; i < nstr; i++) {
-    int l = strlen(cmd[i]);
-    memcpy(&packet[cur], &l, 4);
-    cur += 4;
-    memcpy(&packet[cur], cmd[i], l);
-    cur += l;
-  }
-  // cout << "PACKETSIZE: " << packetSize << endl;
-  return writeAll(fd, packet, packetSize);
+// Connection storm: opens all connections at once, as a fleet of clients
+// restarting together would, and sends one request on each. Reports how long
+// until every connection had its reply; a listen queue that overflows shows
+// up as SYN retransmits of a second or more.
+static int storm_main(int argc, char *argv[]) {
+  uint32_t nconns = 1000;
+  const char *unix_path = NULL;
+  for (int i = 2; i + 1 < argc; i += 2) {
+    if (strcmp(argv[i], "-c") == 0) {
+      nconns = (uint32_t)atoi(argv[i + 1]);
+    } else if (strcmp(argv[i], "-s") == 0) {
+      unix_path = argv[i + 1];
+    } else {
+      fprintf(stderr, "usage: Client storm [-c conns] [-s unix-socket]\n");
+      return 1;
+    }
+  }
+  const uint64_t k_storm_timeout_ns = 30ull * 1000 * 1000 * 1000;
+  string req;
+  rc_encode(req, {"get", "storm"});
+
+  struct StormConn {
+    int fd = -1;
+    bool sent = false;
+    size_t got = 0;
+  };
+  vector<StormConn> conns(nconns);
+  Histogram hist;
+  uint32_t failed = 0;
+  uint64_t start = clock_nsec();
+  for (StormConn &c : conns) {
+    c.fd = bench_socket(unix_path, true);
+    failed += c.fd < 0 ? 1 : 0;
+  }
+  uint32_t pending = nconns - failed;
+  vector<struct pollfd> pfds;
+  vector<StormConn *> polled;
+  char buf[4096];
+  while (pending && clock_nsec() - start < k_storm_timeout_ns) {
+    pfds.clear();
+    polled.clear();
+    for (StormConn &c : conns) {
+      if (c.fd >= 0) {
+        pfds.push_back({c.fd, (short)(c.sent ? POLLIN : POLLOUT), 0});
+        polled.push_back(&c);
+      }
+    }
+    if (poll(pfds.data(), pfds.size(), 100) < 0 && errno != EINTR) {
+      perror("poll");
+      break;
+    }
+    for (size_t i = 0; i < pfds.size(); i++) {
+      StormConn &c = *polled[i];
+      short ev = pfds[i].revents;
+      if (!ev) {
+        continue;
+      }
+      bool ok = !(ev & (POLLERR | POLLHUP)) || (ev & POLLIN);
+      if (ok && !c.sent) {
+        // connected: the request is small enough to go out whole
+        ok = write(c.fd, req.data(), req.size()) == (ssize_t)req.size();
+        c.sent = true;
+      } else if (ok) {
+        ssize_t rv = read(c.fd, buf, sizeof(buf));
+        ok = rv > 0;
+        c.got += rv > 0 ? rv : 0;
+        uint32_t len = 0;
+        if (ok && c.got >= 4) {
+          memcpy(&len, buf, 4);
+        }
+        if (ok && c.got >= 4 && c.got >= 4 + len) {
+          hist_record(&hist, clock_nsec() - start);
+          close(c.fd);
+          c.fd = -1;
+          pending--;
+        }
+      }
+      if (!ok) {
+        close(c.fd);
+        c.fd = -1;
+        failed++;
+        pending--;
+      }
+    }
+  }
+  for (StormConn &c : conns) {
+    if (c.fd >= 0) {
+      close(c.fd);
+    }
+  }
+  printf("%u connections: %lu answered, %u failed, %u timed out\n", nconns,
+         (unsigned long)hist.total, failed, pending);
+  printf("time to reply ms: p50 %.1f  p99 %.1f  max %.1f\n",
+         hist_percentile(&hist, 0.5) / 1e6, hist_percentile(&hist, 0.99) / 1e6,
+         hist.max / 1e6);
+  return hist.total == nconns ? 0 : 1;
 }
 
-uint32_t query(int fd) {
-  vector<string> cmd;
-  string line;
-  getline(cin, line);
-  // cout << "THIS IS A LINE : " << line << endl;
-  istringstream l(line);
-  string word;
-  int size = 0;
-  while (l >> word) {
-    cmd.push_back(word);
-    // cout << word << endl;
-    size += word.length();
-  }
-  if (cmd.size() > 0) {
-    char *cmd_chr[cmd.size()];
-    int loc = 0;
-    for (string words : cmd) {
-      cmd_chr[loc] = new char[words.size() + 1];
-      strcpy(cmd_chr[loc++], words.c_str());
-    }
-    // query(fd, cmd_chr);
-    for (int i = 0; i < cmd.size(); i++) {
-      // cout << cmd_chr[i] << " ";
-    }
-    // cout << endl;
-    // cout << "QUERY: " << line << endl;
-    int32_t err = sendReq(fd, cmd.size(), cmd_chr);
-    if (err) {
-      cout << "Req error" << endl;
-      return err;
-    }
-    err = read_res(fd);
-    if (err < 0) {
-      cout << "Recv error" << endl;
-      return err;
+// Pub/sub fan-out: `-c` subscribers on one channel, and a publisher that
+// keeps up to `-P` publishes in flight. Each message carries its send
+// time, so the latency covers the publish, the fan-out, and the read.
+static int fanout_main(int argc, char *argv[]) {
+  uint32_t nsubs = 100;
+  uint64_t nmsgs = 10000;
+  uint32_t size = 64;
+  uint32_t window = 16;
+  const char *unix_path = NULL;
+  for (int i = 2; i + 1 < argc; i += 2) {
+    if (strcmp(argv[i], "-c") == 0) {
+      nsubs = (uint32_t)atoi(argv[i + 1]);
+    } else if (strcmp(argv[i], "-n") == 0) {
+      nmsgs = strtoull(argv[i + 1], NULL, 10);
+    } else if (strcmp(argv[i], "-d") == 0) {
+      size = (uint32_t)atoi(argv[i + 1]);
+    } else if (strcmp(argv[i], "-P") == 0) {
+      window = (uint32_t)atoi(argv[i + 1]);
+    } else if (strcmp(argv[i], "-s") == 0) {
+      unix_path = argv[i + 1];
+    } else {
+      fprintf(stderr, "usage: Client fanout [-c subscribers] [-n messages] "
+                      "[-d size] [-P pipeline] [-s unix-socket]\n");
+      return 1;
+    }
+  }
+  size = size < 8 ? 8 : size; // the send time
+  const uint64_t k_fanout_stall_ns = 10ull * 1000 * 1000 * 1000;
+  const string channel = "bench:fanout";
+
+  struct FanConn {
+    int fd = -1;
+    string partial; // an incomplete frame
+    uint64_t got = 0;
+  };
+  // the subscribers, then the publisher
+  vector<FanConn> conns(nsubs + 1);
+  int ep = epoll_create1(EPOLL_CLOEXEC);
+  string req;
+  rc_encode(req, {"subscribe", channel});
+  char buf[1 << 16];
+  for (uint32_t i = 0; i <= nsubs; i++) {
+    FanConn &c = conns[i];
+    c.fd = bench_socket(unix_path, false);
+    if (c.fd < 0) {
+      perror("connect");
+      return 1;
+    }
+    if (i < nsubs) {
+      // the confirmation is small enough to come in one read
+      if (write(c.fd, req.data(), req.size()) != (ssize_t)req.size() ||
+          read(c.fd, buf, sizeof(buf)) <= 0) {
+        perror("subscribe");
+        return 1;
+      }
+    }
+    fcntl(c.fd, F_SETFL, fcntl(c.fd, F_GETFL, 0) | O_NONBLOCK);
+    struct epoll_event ev = {};
+    ev.events = EPOLLIN;
+    ev.data.u32 = i;
+    epoll_ctl(ep, EPOLL_CTL_ADD, c.fd, &ev);
+  }
+
+  FanConn &pub = conns[nsubs];
+  string wbuf;
+  size_t wsent = 0;
+  bool want_out = false;
+  string payload(size, 'x');
+  uint64_t sent = 0, acked = 0, delivered = 0, misses = 0;
+  uint64_t want = nmsgs * nsubs;
+  Histogram hist;
+  uint64_t start = clock_nsec(), pub_end = 0, progress = start;
+  vector<struct epoll_event> events(1024);
+  bool ok = true;
+  while (ok && (delivered < want || acked < nmsgs)) {
+    while (sent < nmsgs && sent - acked < window) {
+      uint64_t now = clock_nsec();
+      memcpy(&payload[0], &now, 8);
+      rc_encode(wbuf, {"publish", channel, payload});
+      sent++;
+    }
+    while (wsent < wbuf.size()) {
+      ssize_t rv = write(pub.fd, wbuf.data() + wsent, wbuf.size() - wsent);
+      if (rv <= 0) {
+        ok = rv < 0 && errno == EAGAIN;
+        break;
+      }
+      wsent += (size_t)rv;
+    }
+    if (wsent == wbuf.size()) {
+      wbuf.clear();
+      wsent = 0;
+    }
+    if (want_out != !wbuf.empty()) {
+      want_out = !wbuf.empty();
+      struct epoll_event ev = {};
+      ev.events = EPOLLIN | (want_out ? EPOLLOUT : 0);
+      ev.data.u32 = nsubs;
+      epoll_ctl(ep, EPOLL_CTL_MOD, pub.fd, &ev);
+    }
+
+    int n = epoll_wait(ep, events.data(), (int)events.size(), 100);
+    uint64_t now = clock_nsec();
+    for (int i = 0; i < n && ok; i++) {
+      uint32_t idx = events[i].data.u32;
+      FanConn &c = conns[idx];
+      ssize_t rv = read(c.fd, buf, sizeof(buf));
+      if (rv < 0 && errno == EAGAIN) {
+        continue;
+      }
+      if (rv <= 0) {
+        fprintf(stderr, "connection lost\n");
+        ok = false;
+        continue;
+      }
+      c.partial.append(buf, (size_t)rv);
+      size_t pos = 0;
+      uint32_t len = 0;
+      while (c.partial.size() - pos >= 4) {
+        memcpy(&len, &c.partial[pos], 4);
+        if (c.partial.size() - pos < 4 + (size_t)len) {
+          break;
+        }
+        const char *frame = &c.partial[pos + 4];
+        if (idx == nsubs) {
+          // the reply to a publish, the number of subscribers reached
+          int64_t reached = 0;
+          if (len == 9 && frame[0] == SER_INT) {
+            memcpy(&reached, frame + 1, 8);
+          }
+          misses += reached == (int64_t)nsubs ? 0 : 1;
+          acked++;
+          pub_end = now;
+        } else if (len >= size) {
+          uint64_t ts = 0;
+          memcpy(&ts, frame + len - size, 8);
+          hist_record(&hist, now - ts);
+          c.got++;
+          delivered++;
+        }
+        pos += 4 + len;
+      }
+      c.partial.erase(0, pos);
+      progress = now;
+    }
+    if (now - progress > k_fanout_stall_ns) {
+      fprintf(stderr, "no progress for 10 s\n");
+      ok = false;
     }
   }
+  double secs = (double)(clock_nsec() - start) / 1e9;
+  double pub_secs = (double)(pub_end - start) / 1e9;
+  for (FanConn &c : conns) {
+    close(c.fd);
+  }
+  close(ep);
 
-  return 1;
+  printf("%u subscribers, %lu messages of %u bytes, pipeline %u\n", nsubs,
+         (unsigned long)nmsgs, size, window);
+  printf("published in %.3f s: %.0f msg/s, %lu short of all subscribers\n",
+         pub_secs, pub_secs > 0 ? acked / pub_secs : 0,
+         (unsigned long)misses);
+  printf("delivered %lu in %.3f s: %.0f msg/s, %.1f MB/s of payload\n",
+         (unsigned long)delivered, secs, secs > 0 ? delivered / secs : 0,
+         secs > 0 ? delivered * (double)size / secs / 1e6 : 0);
+  printf("latency usec: p50 %.1f  p99 %.1f  p99.9 %.1f  max %.1f\n",
+         hist_percentile(&hist, 0.5) / 1e3, hist_percentile(&hist, 0.99) / 1e3,
+         hist_percentile(&hist, 0.999) / 1e3, hist.max / 1e3);
+  return ok && delivered == want ? 0 : 1;
 }
 
 int main(int argc, char *argv[]) {
-  int fd = socket(AF_INET, SOCK_STREAM, 0);
-  if (fd < 0) {
-    perror("socket");
-    return 1;
+  if (argc > 1 && strcmp(argv[1], "bench") == 0) {
+    return bench_main(argc, argv);
   }
-
-  struct sockaddr_in addr;
-  addr.sin_family = AF_INET;
-  addr.sin_port = htons(1800);
-  addr.sin_addr.s_addr = inet_addr("127.0.0.1");
-  // fd_set_nb(fd);
-  if (connect(fd, (const sockaddr *)&addr, sizeof(addr)) < 0) {
-    perror("connect");
-    close(fd);
+  if (argc > 1 && strcmp(argv[1], "storm") == 0) {
+    return storm_main(argc, argv);
+  }
+  if (argc > 1 && strcmp(argv[1], "fanout") == 0) {
+    return fanout_main(argc, argv);
+  }
+  RcOptions opt;
+  bool cluster = false;
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "-p") == 0 && i + 1 < argc) {
+      opt.port = (uint16_t)atoi(argv[++i]);
+    } else if (strcmp(argv[i], "-c") == 0) {
+      cluster = true;
+    } else {
+      fprintf(stderr, "usage: Client [-p port] [-c]\n"
+                      "       Client bench|storm|fanout [options]\n");
+      return 1;
+    }
+  }
+  RcPool pool;
+  RcCluster cl;
+  int err = cluster ? rc_cluster_open(&cl, opt) : rc_pool_open(&pool, opt);
+  if (err < 0) {
+    fprintf(stderr, "connect: %s\n", strerror(-err));
     return 1;
   }
-  while (query(fd)) {
+  while (query(&pool, cluster ? &cl : NULL)) {
+  }
+  if (cluster) {
+    rc_cluster_close(&cl);
+  } else {
+    rc_pool_close(&pool);
   }
-  shutdown(fd, SHUT_RDWR);
-  close(fd);
   return 0;
 }
@@ -1,6 +1,8 @@
 #include "Zset.h"
 #include "avl.h"
 #include "hash.h"
+#include <algorithm>
+#include <cmath>
 
 static ZNode *znode_new(const char *name, size_t len, double score) {
   ZNode *znode = (ZNode *)malloc(sizeof(ZNode) + len);
@@ -87,6 +89,7 @@ bool zset_add(ZSet *zset, const char *name, size_t len, double score) {
     return false;
   } else { // add a new node
     node = znode_new(name, len, score);
+    zset->mem += sizeof(ZNode) + len;
     hm_insert(&zset->db, &node->hnode);
     tree_add(zset, node);
     return true;
@@ -94,10 +97,6 @@ bool zset_add(ZSet *zset, const char *name, size_t len, double score) {
 }
 // Lookup and detach from set
 ZNode *zset_pop(ZSet *zset, char *name, size_t len) {
-  // Find the node from the set
-  if (len <= 0)
-    return NULL;
-
   HKey key;
   key.node.hcode = str_hash((uint8_t *)name, len);
   key.name = name;
@@ -108,6 +107,7 @@ ZNode *zset_pop(ZSet *zset, char *name, size_t len) {
   }
   ZNode *node = container_of(found, ZNode, hnode);
   zset->tree = avl_del(&node->avlnode);
+  zset->mem -= sizeof(ZNode) + node->len;
   return node;
 }
 
@@ -129,6 +129,22 @@ ZNode *zset_query(ZSet *zset, double score, const char *name, size_t len) {
   return found ? container_of(found, ZNode, avlnode) : NULL;
 }
 
+ZNode *zset_min(ZSet *zset) {
+  AVLNode *cur = zset->tree;
+  while (cur && cur->left) {
+    cur = cur->left;
+  }
+  return cur ? container_of(cur, ZNode, avlnode) : NULL;
+}
+
+ZNode *zset_max(ZSet *zset) {
+  AVLNode *cur = zset->tree;
+  while (cur && cur->right) {
+    cur = cur->right;
+  }
+  return cur ? container_of(cur, ZNode, avlnode) : NULL;
+}
+
 ZNode *znode_offset(ZNode *node, int64_t offset) {
     AVLNode *tnode = node ? avl_offset(&node->avlnode, offset) : NULL;
     return tnode ? container_of(tnode, ZNode, avlnode) : NULL;
@@ -146,3 +162,243 @@ void zset_dispose(ZSet *zset) {
   tree_dispose(zset->tree);
   hm_destroy(&zset->db);
 }
+
+// Like Redis: 0 * inf and inf + -inf are 0, not NaN.
+static double zmerge_weigh(double score, double weight) {
+  double v = score * weight;
+  return std::isnan(v) ? 0 : v;
+}
+
+static double zmerge_agg(int agg, double acc, double v) {
+  if (agg == ZAGG_MIN) {
+    return v < acc ? v : acc;
+  }
+  if (agg == ZAGG_MAX) {
+    return v > acc ? v : acc;
+  }
+  acc += v;
+  return std::isnan(acc) ? 0 : acc;
+}
+
+void zmerge_init(ZMerge *m) {
+  m->parts.assign(m->nparts, vector<ZScored>());
+  if (!m->inter) {
+    return;
+  }
+  // the smallest source drives the intersection, the others are probed
+  size_t best = 0;
+  for (size_t i = 0; i < m->srcs.size(); i++) {
+    if (!m->srcs[i]) {
+      m->srcs.clear(); // the intersection is empty
+      m->weights.clear();
+      return;
+    }
+    if (hm_size(&m->srcs[i]->db) < hm_size(&m->srcs[best]->db)) {
+      best = i;
+    }
+  }
+  std::swap(m->srcs[0], m->srcs[best]);
+  std::swap(m->weights[0], m->weights[best]);
+}
+
+// Calls fn for each node of `zset` in the partition. A partition takes
+// every nparts-th bucket, which holds only its members once the table has
+// at least nparts buckets.
+template <typename F>
+static void zmerge_scan(const ZSet *zset, uint32_t part, uint32_t nparts,
+                        F fn) {
+  const HTab *tabs[2] = {&zset->db.ht1, &zset->db.ht2};
+  for (const HTab *htab : tabs) {
+    if (!htab->tab) {
+      continue;
+    }
+    bool strided = htab->mask + 1 >= nparts;
+    size_t step = strided ? nparts : 1;
+    for (size_t i = strided ? part : 0; i <= htab->mask; i += step) {
+      for (HNode *node = htab->tab[i]; node; node = node->next) {
+        if ((node->hcode & (nparts - 1)) == part) {
+          fn(container_of(node, ZNode, hnode));
+        }
+      }
+    }
+  }
+}
+
+// a member of the union, and a source node with its name
+struct ZAggSlot {
+  const ZNode *node = NULL;
+  uint64_t hcode = 0;
+  double score = 0;
+};
+
+static size_t zagg_pos(uint64_t hcode, size_t mask) {
+  // the low bits are the same within a partition
+  return (size_t)((hcode * 0x9E3779B97F4A7C15ull) >> 20) & mask;
+}
+
+static void zagg_grow(vector<ZAggSlot> &slots) {
+  vector<ZAggSlot> old(slots.size() * 2);
+  old.swap(slots);
+  size_t mask = slots.size() - 1;
+  for (ZAggSlot &s : old) {
+    if (!s.node) {
+      continue;
+    }
+    size_t pos = zagg_pos(s.hcode, mask);
+    while (slots[pos].node) {
+      pos = (pos + 1) & mask;
+    }
+    slots[pos] = s;
+  }
+}
+
+static bool znode_same(const ZNode *a, const ZNode *b) {
+  return a->len == b->len && memcmp(a->name, b->name, a->len) == 0;
+}
+
+// the union aggregates in a table of its own, with open addressing
+static void zmerge_union(ZMerge *m, uint32_t part, vector<ZScored> &out) {
+  vector<ZAggSlot> slots(64);
+  size_t used = 0;
+  for (size_t i = 0; i < m->srcs.size(); i++) {
+    if (!m->srcs[i]) {
+      continue;
+    }
+    double weight = m->weights[i];
+    zmerge_scan(m->srcs[i], part, m->nparts, [&](const ZNode *node) {
+      double v = zmerge_weigh(node->score, weight);
+      uint64_t hcode = node->hnode.hcode;
+      size_t mask = slots.size() - 1;
+      size_t pos = zagg_pos(hcode, mask);
+      while (slots[pos].node && (slots[pos].hcode != hcode ||
+                                 !znode_same(slots[pos].node, node))) {
+        pos = (pos + 1) & mask;
+      }
+      if (slots[pos].node) {
+        slots[pos].score = zmerge_agg(m->agg, slots[pos].score, v);
+        return;
+      }
+      slots[pos].node = node;
+      slots[pos].hcode = hcode;
+      slots[pos].score = v;
+      if (++used * 2 > slots.size()) {
+        zagg_grow(slots);
+      }
+    });
+  }
+  out.reserve(used);
+  for (ZAggSlot &s : slots) {
+    if (s.node) {
+      out.push_back(ZScored{s.score, (ZNode *)s.node});
+    }
+  }
+}
+
+static bool hcmp_node(HNode *node, HNode *key) {
+  return znode_same(container_of(node, ZNode, hnode),
+                    container_of(key, ZNode, hnode));
+}
+
+static void zmerge_inter(ZMerge *m, uint32_t part, vector<ZScored> &out) {
+  if (m->srcs.empty()) {
+    return;
+  }
+  zmerge_scan(m->srcs[0], part, m->nparts, [&](const ZNode *node) {
+    double score = zmerge_weigh(node->score, m->weights[0]);
+    for (size_t i = 1; i < m->srcs.size(); i++) {
+      HNode *found = hm_lookup(&m->srcs[i]->db, (HNode *)&node->hnode,
+                               &hcmp_node);
+      if (!found) {
+        return;
+      }
+      ZNode *other = container_of(found, ZNode, hnode);
+      double v = zmerge_weigh(other->score, m->weights[i]);
+      score = zmerge_agg(m->agg, score, v);
+    }
+    out.push_back(ZScored{score, (ZNode *)node});
+  });
+}
+
+// the order of the tree, by score, then name
+static bool zscored_less(const ZScored &a, const ZScored &b) {
+  if (a.score != b.score) {
+    return a.score < b.score;
+  }
+  const ZNode *x = a.node;
+  const ZNode *y = b.node;
+  int rv = memcmp(x->name, y->name, min(x->len, y->len));
+  return rv != 0 ? rv < 0 : x->len < y->len;
+}
+
+// Collects the partition's members with a source node each, sorts them,
+// then copies them into new nodes, allocated in the order of the tree.
+void zmerge_part(ZMerge *m, uint32_t part) {
+  vector<ZScored> &out = m->parts[part];
+  if (m->inter) {
+    zmerge_inter(m, part, out);
+  } else {
+    zmerge_union(m, part, out);
+  }
+  std::sort(out.begin(), out.end(), &zscored_less);
+  for (ZScored &item : out) {
+    item.node = znode_new(item.node->name, item.node->len, item.score);
+  }
+}
+
+size_t zmerge_size(const ZMerge *m) {
+  size_t total = 0;
+  for (const vector<ZScored> &part : m->parts) {
+    total += part.size();
+  }
+  return total;
+}
+
+size_t zmerge_finish(ZMerge *m, ZSet *dest) {
+  size_t total = zmerge_size(m);
+  hm_reserve(&dest->db, total);
+  // merges the sorted partitions, then builds the tree from the sequence
+  struct Head {
+    ZScored item;
+    size_t part;
+  };
+  auto after = [](const Head &a, const Head &b) {
+    return zscored_less(b.item, a.item);
+  };
+  vector<Head> heap;
+  vector<size_t> pos(m->parts.size(), 0);
+  for (size_t p = 0; p < m->parts.size(); p++) {
+    if (!m->parts[p].empty()) {
+      heap.push_back(Head{m->parts[p][0], p});
+    }
+  }
+  std::make_heap(heap.begin(), heap.end(), after);
+  vector<AVLNode *> nodes;
+  nodes.reserve(total);
+  while (!heap.empty()) {
+    std::pop_heap(heap.begin(), heap.end(), after);
+    Head &head = heap.back();
+    ZNode *node = head.item.node;
+    hm_insert(&dest->db, &node->hnode);
+    dest->mem += sizeof(ZNode) + node->len;
+    nodes.push_back(&node->avlnode);
+    vector<ZScored> &part = m->parts[head.part];
+    if (++pos[head.part] < part.size()) {
+      head.item = part[pos[head.part]];
+      std::push_heap(heap.begin(), heap.end(), after);
+    } else {
+      heap.pop_back();
+    }
+  }
+  dest->tree = avl_build(nodes.data(), nodes.size());
+  m->parts.clear();
+  return total;
+}
+
+void zmerge_dispose(ZMerge *m) {
+  for (vector<ZScored> &part : m->parts) {
+    for (ZScored &item : part) {
+      znode_del(item.node);
+    }
+  }
+  m->parts.clear();
+}
@@ -7,6 +7,8 @@
 struct ZSet {
   AVLNode *tree = NULL;
   HMap db;
+  // bytes held by the nodes, for maxmemory accounting
+  size_t mem = 0;
 };
 
 // A node with in the ZSet
@@ -30,6 +32,43 @@ bool zset_add(ZSet *zset, const char *name, size_t len, double score);
 ZNode *zset_pop(ZSet *zset, char *name, size_t len);
 void znode_del(ZNode *znode);
 ZNode *zset_query(ZSet *zset, double score, const char *name, size_t len);
+// the first and the last member by (score, name), NULL if empty
+ZNode *zset_min(ZSet *zset);
+ZNode *zset_max(ZSet *zset);
 ZNode *znode_offset(ZNode *node, int64_t offset);
 void zset_dispose(ZSet *zset);
 
+// ZUNIONSTORE/ZINTERSTORE. The sources are only read, so the partitions
+// can be filled on several threads at once.
+enum { ZAGG_SUM = 0, ZAGG_MIN = 1, ZAGG_MAX = 2 };
+
+// a member of the result with its score kept next to the pointer, so that
+// ordering them rarely has to look at the node
+struct ZScored {
+  double score;
+  ZNode *node;
+};
+
+struct ZMerge {
+  vector<ZSet *> srcs; // NULL for a missing key
+  vector<double> weights;
+  int agg = ZAGG_SUM;
+  bool inter = false;
+  // a power of 2; members go to a partition by their hash, so that all the
+  // scores of a member end up in the same one
+  uint32_t nparts = 1;
+  // the new nodes of each partition, sorted by (score, name)
+  vector<vector<ZScored>> parts;
+};
+
+// after the fields are set, and before the partitions are filled
+void zmerge_init(ZMerge *m);
+void zmerge_part(ZMerge *m, uint32_t part);
+// members in the result, once the partitions are filled
+size_t zmerge_size(const ZMerge *m);
+// Moves the nodes of all partitions into `dest`, an empty set. Returns the
+// number of members.
+size_t zmerge_finish(ZMerge *m, ZSet *dest);
+// frees the nodes, if zmerge_finish is not called
+void zmerge_dispose(ZMerge *m);
+
@@ -0,0 +1,822 @@
+#include "art.h"
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+using namespace std;
+
+enum { ART_N4 = 0, ART_N16 = 1, ART_N48 = 2, ART_N256 = 3 };
+
+// Prefix bytes kept in the node. The bytes past these are compared against
+// the key of a leaf below the node, which has them too.
+const uint32_t k_art_prefix = 8;
+
+struct ArtNode {
+  uint8_t type;
+  uint16_t nchild;
+  uint32_t plen;
+  uint8_t prefix[k_art_prefix];
+  // leaf whose key ends at this node, NULL if none
+  void *term;
+};
+
+// keys sorted, children in the same order
+struct ArtNode4 {
+  ArtNode h;
+  uint8_t keys[4];
+  void *child[4];
+};
+
+struct ArtNode16 {
+  ArtNode h;
+  uint8_t keys[16];
+  void *child[16];
+};
+
+struct ArtNode48 {
+  ArtNode h;
+  // slot in `child` plus 1 by key byte, 0 for none
+  uint8_t index[256];
+  void *child[48];
+};
+
+struct ArtNode256 {
+  ArtNode h;
+  void *child[256];
+};
+
+static const size_t k_node_size[] = {sizeof(ArtNode4), sizeof(ArtNode16),
+                                     sizeof(ArtNode48), sizeof(ArtNode256)};
+
+// A child pointer is either a node or a value tagged in its lowest bit.
+static bool is_leaf(const void *p) { return (uintptr_t)p & 1; }
+
+static void *make_leaf(void *val) { return (void *)((uintptr_t)val | 1); }
+
+static void *leaf_val(void *p) { return (void *)((uintptr_t)p & ~(uintptr_t)1); }
+
+static const uint8_t *leaf_key(Art *t, void *p, size_t *len) {
+  return t->key_of(leaf_val(p), len);
+}
+
+static bool leaf_eq(Art *t, void *p, const uint8_t *key, size_t len) {
+  size_t llen = 0;
+  const uint8_t *lkey = leaf_key(t, p, &llen);
+  return llen == len && memcmp(lkey, key, len) == 0;
+}
+
+static int key_cmp(const uint8_t *a, size_t alen, const uint8_t *b,
+                   size_t blen) {
+  int cmp = memcmp(a, b, alen < blen ? alen : blen);
+  if (cmp != 0) {
+    return cmp;
+  }
+  return alen < blen ? -1 : alen > blen ? 1 : 0;
+}
+
+static size_t min_sz(size_t a, size_t b) { return a < b ? a : b; }
+
+static ArtNode *node_new(Art *t, uint8_t type) {
+  ArtNode *n = (ArtNode *)calloc(1, k_node_size[type]);
+  n->type = type;
+  t->mem += k_node_size[type];
+  return n;
+}
+
+static void node_free(Art *t, ArtNode *n) {
+  t->mem -= k_node_size[n->type];
+  free(n);
+}
+
+// moves the header into a node of another size
+static void node_copy_header(ArtNode *dst, const ArtNode *src) {
+  uint8_t type = dst->type;
+  *dst = *src;
+  dst->type = type;
+}
+
+// The position of `c` among the sorted keys of a Node16, -1 if absent. One
+// compare covers all 16 keys.
+static int find16(const uint8_t *keys, uint32_t n, uint8_t c) {
+#ifdef __SSE2__
+  __m128i cmp = _mm_cmpeq_epi8(_mm_set1_epi8((char)c),
+                               _mm_loadu_si128((const __m128i *)keys));
+  uint32_t mask = (uint32_t)_mm_movemask_epi8(cmp) & ((1u << n) - 1);
+  return mask ? __builtin_ctz(mask) : -1;
+#else
+  for (uint32_t i = 0; i < n; i++) {
+    if (keys[i] == c) {
+      return (int)i;
+    }
+  }
+  return -1;
+#endif
+}
+
+// the number of keys of a Node16 below `c`
+static uint32_t rank16(const uint8_t *keys, uint32_t n, uint8_t c) {
+#ifdef __SSE2__
+  // SSE2 only compares signed bytes, flipping the top bit makes it unsigned
+  __m128i bias = _mm_set1_epi8((char)0x80);
+  __m128i k = _mm_xor_si128(_mm_loadu_si128((const __m128i *)keys), bias);
+  __m128i cmp = _mm_cmplt_epi8(k, _mm_set1_epi8((char)(c ^ 0x80)));
+  uint32_t mask = (uint32_t)_mm_movemask_epi8(cmp) & ((1u << n) - 1);
+  return (uint32_t)__builtin_popcount(mask);
+#else
+  uint32_t i = 0;
+  while (i < n && keys[i] < c) {
+    i++;
+  }
+  return i;
+#endif
+}
+
+static uint32_t rank4(const uint8_t *keys, uint32_t n, uint8_t c) {
+  uint32_t i = 0;
+  while (i < n && keys[i] < c) {
+    i++;
+  }
+  return i;
+}
+
+static void **find_child(ArtNode *n, uint8_t c) {
+  switch (n->type) {
+  case ART_N4: {
+    ArtNode4 *m = (ArtNode4 *)n;
+    for (uint32_t i = 0; i < n->nchild; i++) {
+      if (m->keys[i] == c) {
+        return &m->child[i];
+      }
+    }
+    return NULL;
+  }
+  case ART_N16: {
+    ArtNode16 *m = (ArtNode16 *)n;
+    int i = find16(m->keys, n->nchild, c);
+    return i >= 0 ? &m->child[i] : NULL;
+  }
+  case ART_N48: {
+    ArtNode48 *m = (ArtNode48 *)n;
+    return m->index[c] ? &m->child[m->index[c] - 1] : NULL;
+  }
+  default: {
+    ArtNode256 *m = (ArtNode256 *)n;
+    return m->child[c] ? &m->child[c] : NULL;
+  }
+  }
+}
+
+// Children in key order: `pos` is an index for the small nodes and a key
+// byte for the large ones. Returns NULL past the last child.
+static void *next_child(ArtNode *n, uint32_t *pos) {
+  switch (n->type) {
+  case ART_N4:
+    return *pos < n->nchild ? ((ArtNode4 *)n)->child[(*pos)++] : NULL;
+  case ART_N16:
+    return *pos < n->nchild ? ((ArtNode16 *)n)->child[(*pos)++] : NULL;
+  case ART_N48: {
+    ArtNode48 *m = (ArtNode48 *)n;
+    while (*pos < 256) {
+      uint8_t slot = m->index[(*pos)++];
+      if (slot) {
+        return m->child[slot - 1];
+      }
+    }
+    return NULL;
+  }
+  default: {
+    ArtNode256 *m = (ArtNode256 *)n;
+    while (*pos < 256) {
+      void *child = m->child[(*pos)++];
+      if (child) {
+        return child;
+      }
+    }
+    return NULL;
+  }
+  }
+}
+
+// the `pos` for next_child that skips the children up to key byte `c`
+static uint32_t pos_after(ArtNode *n, uint8_t c) {
+  switch (n->type) {
+  case ART_N4:
+    return c == 255 ? n->nchild : rank4(((ArtNode4 *)n)->keys, n->nchild, c + 1);
+  case ART_N16:
+    return c == 255 ? n->nchild
+                    : rank16(((ArtNode16 *)n)->keys, n->nchild, c + 1);
+  default:
+    return (uint32_t)c + 1;
+  }
+}
+
+// the leaf with the smallest key below `p`
+static void *min_leaf(void *p) {
+  while (!is_leaf(p)) {
+    ArtNode *n = (ArtNode *)p;
+    if (n->term) {
+      return n->term;
+    }
+    uint32_t pos = 0;
+    p = next_child(n, &pos);
+  }
+  return p;
+}
+
+// how many bytes of the prefix of `n` match the key from `depth`
+static size_t prefix_match(Art *t, ArtNode *n, const uint8_t *key, size_t len,
+                           size_t depth) {
+  size_t max = min_sz(n->plen, len - depth);
+  size_t i = 0;
+  for (; i < min_sz(max, k_art_prefix); i++) {
+    if (n->prefix[i] != key[depth + i]) {
+      return i;
+    }
+  }
+  if (i < max) {
+    size_t llen = 0;
+    const uint8_t *lkey = leaf_key(t, min_leaf(n), &llen);
+    while (i < max && lkey[depth + i] == key[depth + i]) {
+      i++;
+    }
+  }
+  return i;
+}
+
+// A lookup only checks the stored prefix bytes and skips the rest; the
+// leaf it ends on is compared in full.
+static bool prefix_maybe(ArtNode *n, const uint8_t *key, size_t len,
+                         size_t depth) {
+  return len - depth >= n->plen &&
+         memcmp(n->prefix, key + depth, min_sz(n->plen, k_art_prefix)) == 0;
+}
+
+static void add_child(Art *t, void **ref, ArtNode *n, uint8_t c, void *child) {
+  switch (n->type) {
+  case ART_N4: {
+    ArtNode4 *m = (ArtNode4 *)n;
+    if (n->nchild < 4) {
+      uint32_t i = rank4(m->keys, n->nchild, c);
+      memmove(m->keys + i + 1, m->keys + i, n->nchild - i);
+      memmove(m->child + i + 1, m->child + i, (n->nchild - i) * sizeof(void *));
+      m->keys[i] = c;
+      m->child[i] = child;
+      n->nchild++;
+      return;
+    }
+    ArtNode16 *g = (ArtNode16 *)node_new(t, ART_N16);
+    node_copy_header(&g->h, n);
+    memcpy(g->keys, m->keys, 4);
+    memcpy(g->child, m->child, 4 * sizeof(void *));
+    *ref = g;
+    node_free(t, n);
+    add_child(t, ref, &g->h, c, child);
+    return;
+  }
+  case ART_N16: {
+    ArtNode16 *m = (ArtNode16 *)n;
+    if (n->nchild < 16) {
+      uint32_t i = rank16(m->keys, n->nchild, c);
+      memmove(m->keys + i + 1, m->keys + i, n->nchild - i);
+      memmove(m->child + i + 1, m->child + i, (n->nchild - i) * sizeof(void *));
+      m->keys[i] = c;
+      m->child[i] = child;
+      n->nchild++;
+      return;
+    }
+    ArtNode48 *g = (ArtNode48 *)node_new(t, ART_N48);
+    node_copy_header(&g->h, n);
+    for (uint32_t i = 0; i < 16; i++) {
+      g->index[m->keys[i]] = (uint8_t)(i + 1);
+      g->child[i] = m->child[i];
+    }
+    *ref = g;
+    node_free(t, n);
+    add_child(t, ref, &g->h, c, child);
+    return;
+  }
+  case ART_N48: {
+    ArtNode48 *m = (ArtNode48 *)n;
+    if (n->nchild < 48) {
+      // removals leave holes
+      uint32_t slot = 0;
+      while (m->child[slot]) {
+        slot++;
+      }
+      m->child[slot] = child;
+      m->index[c] = (uint8_t)(slot + 1);
+      n->nchild++;
+      return;
+    }
+    ArtNode256 *g = (ArtNode256 *)node_new(t, ART_N256);
+    node_copy_header(&g->h, n);
+    for (uint32_t b = 0; b < 256; b++) {
+      if (m->index[b]) {
+        g->child[b] = m->child[m->index[b] - 1];
+      }
+    }
+    *ref = g;
+    node_free(t, n);
+    add_child(t, ref, &g->h, c, child);
+    return;
+  }
+  default:
+    ((ArtNode256 *)n)->child[c] = child;
+    n->nchild++;
+    return;
+  }
+}
+
+// Moves a node into a smaller size once it is well below its capacity, and
+// replaces a node left with a single entry by that entry.
+static void node_shrink(Art *t, void **ref, ArtNode *n) {
+  switch (n->type) {
+  case ART_N4: {
+    ArtNode4 *m = (ArtNode4 *)n;
+    if (n->nchild + (n->term ? 1 : 0) > 1) {
+      return;
+    }
+    if (n->nchild == 0) {
+      *ref = n->term;
+      node_free(t, n);
+      return;
+    }
+    void *child = m->child[0];
+    if (!is_leaf(child)) {
+      // the prefix of the child grows by ours and the branch byte
+      ArtNode *c = (ArtNode *)child;
+      uint8_t prefix[k_art_prefix];
+      uint32_t len = 0;
+      for (; len < k_art_prefix && len < n->plen; len++) {
+        prefix[len] = n->prefix[len];
+      }
+      if (len < k_art_prefix) {
+        prefix[len++] = m->keys[0];
+      }
+      for (uint32_t i = 0; len < k_art_prefix && i < c->plen; i++) {
+        prefix[len++] = c->prefix[i];
+      }
+      memcpy(c->prefix, prefix, len);
+      c->plen += n->plen + 1;
+    }
+    *ref = child;
+    node_free(t, n);
+    return;
+  }
+  case ART_N16: {
+    ArtNode16 *m = (ArtNode16 *)n;
+    if (n->nchild > 3) {
+      return;
+    }
+    ArtNode4 *s = (ArtNode4 *)node_new(t, ART_N4);
+    node_copy_header(&s->h, n);
+    memcpy(s->keys, m->keys, n->nchild);
+    memcpy(s->child, m->child, n->nchild * sizeof(void *));
+    *ref = s;
+    node_free(t, n);
+    return;
+  }
+  case ART_N48: {
+    ArtNode48 *m = (ArtNode48 *)n;
+    if (n->nchild > 12) {
+      return;
+    }
+    ArtNode16 *s = (ArtNode16 *)node_new(t, ART_N16);
+    node_copy_header(&s->h, n);
+    uint32_t i = 0;
+    for (uint32_t b = 0; b < 256; b++) {
+      if (m->index[b]) {
+        s->keys[i] = (uint8_t)b;
+        s->child[i++] = m->child[m->index[b] - 1];
+      }
+    }
+    *ref = s;
+    node_free(t, n);
+    return;
+  }
+  default: {
+    ArtNode256 *m = (ArtNode256 *)n;
+    if (n->nchild > 37) {
+      return;
+    }
+    ArtNode48 *s = (ArtNode48 *)node_new(t, ART_N48);
+    node_copy_header(&s->h, n);
+    uint32_t slot = 0;
+    for (uint32_t b = 0; b < 256; b++) {
+      if (m->child[b]) {
+        s->index[b] = (uint8_t)(slot + 1);
+        s->child[slot++] = m->child[b];
+      }
+    }
+    *ref = s;
+    node_free(t, n);
+    return;
+  }
+  }
+}
+
+static void remove_child(Art *t, void **ref, ArtNode *n, uint8_t c) {
+  switch (n->type) {
+  case ART_N4:
+  case ART_N16: {
+    uint8_t *keys = n->type == ART_N4 ? ((ArtNode4 *)n)->keys
+                                      : ((ArtNode16 *)n)->keys;
+    void **child = n->type == ART_N4 ? ((ArtNode4 *)n)->child
+                                     : ((ArtNode16 *)n)->child;
+    uint32_t i = n->type == ART_N4 ? rank4(keys, n->nchild, c)
+                                   : rank16(keys, n->nchild, c);
+    assert(i < n->nchild && keys[i] == c);
+    memmove(keys + i, keys + i + 1, n->nchild - i - 1);
+    memmove(child + i, child + i + 1, (n->nchild - i - 1) * sizeof(void *));
+    break;
+  }
+  case ART_N48: {
+    ArtNode48 *m = (ArtNode48 *)n;
+    m->child[m->index[c] - 1] = NULL;
+    m->index[c] = 0;
+    break;
+  }
+  default:
+    ((ArtNode256 *)n)->child[c] = NULL;
+    break;
+  }
+  n->nchild--;
+  node_shrink(t, ref, n);
+}
+
+void *art_insert(Art *t, const uint8_t *key, size_t len, void *val) {
+  assert(((uintptr_t)val & 1) == 0);
+  void *leaf = make_leaf(val);
+  void **ref = &t->root;
+  size_t depth = 0;
+  while (true) {
+    void *p = *ref;
+    if (!p) {
+      *ref = leaf;
+      t->size++;
+      return NULL;
+    }
+    if (is_leaf(p)) {
+      size_t llen = 0;
+      const uint8_t *lkey = leaf_key(t, p, &llen);
+      if (llen == len && memcmp(lkey, key, len) == 0) {
+        *ref = leaf;
+        return leaf_val(p);
+      }
+      // a node for the bytes both keys share, branching where they differ
+      size_t common = depth;
+      while (common < min_sz(len, llen) && key[common] == lkey[common]) {
+        common++;
+      }
+      ArtNode *n = node_new(t, ART_N4);
+      n->plen = (uint32_t)(common - depth);
+      memcpy(n->prefix, key + depth, min_sz(n->plen, k_art_prefix));
+      *ref = n;
+      if (llen == common) {
+        n->term = p;
+      } else {
+        add_child(t, ref, n, lkey[common], p);
+      }
+      if (len == common) {
+        n->term = leaf;
+      } else {
+        add_child(t, ref, n, key[common], leaf);
+      }
+      t->size++;
+      return NULL;
+    }
+
+    ArtNode *n = (ArtNode *)p;
+    if (n->plen) {
+      size_t m = prefix_match(t, n, key, len, depth);
+      if (m < n->plen) {
+        // split the prefix: a new node for the matching part, the old node
+        // keeps what follows the byte they differ at
+        ArtNode *s = node_new(t, ART_N4);
+        s->plen = (uint32_t)m;
+        memcpy(s->prefix, n->prefix, min_sz(m, k_art_prefix));
+        uint8_t branch = 0;
+        if (n->plen <= k_art_prefix) {
+          branch = n->prefix[m];
+          memmove(n->prefix, n->prefix + m + 1, n->plen - m - 1);
+        } else {
+          size_t llen = 0;
+          const uint8_t *lkey = leaf_key(t, min_leaf(n), &llen);
+          branch = lkey[depth + m];
+          memcpy(n->prefix, lkey + depth + m + 1,
+                 min_sz(n->plen - m - 1, k_art_prefix));
+        }
+        n->plen -= (uint32_t)(m + 1);
+        *ref = s;
+        add_child(t, ref, s, branch, n);
+        if (depth + m == len) {
+          s->term = leaf;
+        } else {
+          add_child(t, ref, s, key[depth + m], leaf);
+        }
+        t->size++;
+        return NULL;
+      }
+      depth += n->plen;
+    }
+    if (depth == len) {
+      void *old = n->term;
+      n->term = leaf;
+      if (old) {
+        return leaf_val(old);
+      }
+      t->size++;
+      return NULL;
+    }
+    void **child = find_child(n, key[depth]);
+    if (!child) {
+      add_child(t, ref, n, key[depth], leaf);
+      t->size++;
+      return NULL;
+    }
+    ref = child;
+    depth++;
+  }
+}
+
+void *art_find(Art *t, const uint8_t *key, size_t len) {
+  void *p = t->root;
+  size_t depth = 0;
+  while (p) {
+    if (is_leaf(p)) {
+      return leaf_eq(t, p, key, len) ? leaf_val(p) : NULL;
+    }
+    ArtNode *n = (ArtNode *)p;
+    if (!prefix_maybe(n, key, len, depth)) {
+      return NULL;
+    }
+    depth += n->plen;
+    if (depth == len) {
+      return n->term && leaf_eq(t, n->term, key, len) ? leaf_val(n->term)
+                                                      : NULL;
+    }
+    void **child = find_child(n, key[depth]);
+    p = child ? *child : NULL;
+    depth++;
+  }
+  return NULL;
+}
+
+void *art_delete(Art *t, const uint8_t *key, size_t len) {
+  void **ref = &t->root;
+  size_t depth = 0;
+  while (*ref) {
+    void *p = *ref;
+    if (is_leaf(p)) {
+      // only for a root leaf, the others are removed through their parent
+      if (!leaf_eq(t, p, key, len)) {
+        return NULL;
+      }
+      *ref = NULL;
+      t->size--;
+      return leaf_val(p);
+    }
+    ArtNode *n = (ArtNode *)p;
+    if (!prefix_maybe(n, key, len, depth)) {
+      return NULL;
+    }
+    depth += n->plen;
+    if (depth == len) {
+      if (!n->term || !leaf_eq(t, n->term, key, len)) {
+        return NULL;
+      }
+      void *val = leaf_val(n->term);
+      n->term = NULL;
+      node_shrink(t, ref, n);
+      t->size--;
+      return val;
+    }
+    void **child = find_child(n, key[depth]);
+    if (!child) {
+      return NULL;
+    }
+    if (is_leaf(*child)) {
+      if (!leaf_eq(t, *child, key, len)) {
+        return NULL;
+      }
+      void *val = leaf_val(*child);
+      remove_child(t, ref, n, key[depth]);
+      t->size--;
+      return val;
+    }
+    ref = child;
+    depth++;
+  }
+  return NULL;
+}
+
+// Compares the whole prefix of `n` with the key from `depth`: -1 if every
+// key below `n` sorts before the key, 1 if after, 0 if the prefix matches.
+static int prefix_cmp(Art *t, ArtNode *n, const uint8_t *key, size_t len,
+                      size_t depth) {
+  const uint8_t *full = n->prefix;
+  if (n->plen > k_art_prefix) {
+    size_t llen = 0;
+    full = leaf_key(t, min_leaf(n), &llen) + depth;
+  }
+  for (size_t i = 0; i < n->plen; i++) {
+    if (depth + i == len) {
+      // the keys below extend this one
+      return 1;
+    }
+    if (full[i] != key[depth + i]) {
+      return full[i] < key[depth + i] ? -1 : 1;
+    }
+  }
+  return 0;
+}
+
+struct ArtFrame {
+  ArtNode *n;
+  uint32_t pos; // for next_child
+};
+
+struct ArtWalk {
+  bool (*fn)(void *val, void *arg);
+  void *arg;
+  bool stop = false;
+  // nodes with children left to visit, the deepest last
+  vector<ArtFrame> stack;
+};
+
+static void walk_visit(ArtWalk *w, void *leaf) {
+  if (!w->fn(leaf_val(leaf), w->arg)) {
+    w->stop = true;
+  }
+}
+
+// starts on a subtree that lies entirely after the start key
+static void walk_enter(ArtWalk *w, void *p) {
+  if (is_leaf(p)) {
+    walk_visit(w, p);
+    return;
+  }
+  ArtNode *n = (ArtNode *)p;
+  if (n->term) {
+    walk_visit(w, n->term);
+  }
+  w->stack.push_back(ArtFrame{n, 0});
+}
+
+void art_walk(Art *t, const uint8_t *start, size_t len, bool inclusive,
+              bool (*fn)(void *val, void *arg), void *arg) {
+  ArtWalk w;
+  w.fn = fn;
+  w.arg = arg;
+  // Descend along the start key. The nodes passed stay on the stack,
+  // positioned after the branch taken, so the walk continues from there.
+  void *p = t->root;
+  size_t depth = 0;
+  while (p) {
+    if (is_leaf(p)) {
+      size_t llen = 0;
+      const uint8_t *lkey = leaf_key(t, p, &llen);
+      int cmp = key_cmp(lkey, llen, start, len);
+      if (cmp > 0 || (cmp == 0 && inclusive)) {
+        walk_visit(&w, p);
+      }
+      break;
+    }
+    ArtNode *n = (ArtNode *)p;
+    int cmp = prefix_cmp(t, n, start, len, depth);
+    if (cmp != 0) {
+      if (cmp > 0) {
+        walk_enter(&w, p);
+      }
+      break;
+    }
+    depth += n->plen;
+    if (depth == len) {
+      // the key ending here is the start, everything below follows it
+      if (n->term && inclusive) {
+        walk_visit(&w, n->term);
+      }
+      w.stack.push_back(ArtFrame{n, 0});
+      break;
+    }
+    // a key ending here is before the start
+    w.stack.push_back(ArtFrame{n, pos_after(n, start[depth])});
+    void **child = find_child(n, start[depth]);
+    p = child ? *child : NULL;
+    depth++;
+  }
+
+  while (!w.stop && !w.stack.empty()) {
+    ArtFrame &f = w.stack.back();
+    void *child = next_child(f.n, &f.pos);
+    if (!child) {
+      w.stack.pop_back();
+      continue;
+    }
+    walk_enter(&w, child);
+  }
+}
+
+void art_destroy(Art *t) {
+  vector<ArtNode *> stack;
+  if (t->root && !is_leaf(t->root)) {
+    stack.push_back((ArtNode *)t->root);
+  }
+  while (!stack.empty()) {
+    ArtNode *n = stack.back();
+    stack.pop_back();
+    uint32_t pos = 0;
+    while (void *child = next_child(n, &pos)) {
+      if (!is_leaf(child)) {
+        stack.push_back((ArtNode *)child);
+      }
+    }
+    node_free(t, n);
+  }
+  t->root = NULL;
+  t->size = 0;
+  assert(t->mem == 0);
+}
+
+// bytes of the path from the root, -1 for prefix bytes the node does not store
+static bool verify_leaf(Art *t, void *p, const vector<int> &path, bool term) {
+  size_t len = 0;
+  const uint8_t *key = leaf_key(t, p, &len);
+  if (term ? len != path.size() : len < path.size()) {
+    return false;
+  }
+  for (size_t i = 0; i < path.size(); i++) {
+    if (path[i] >= 0 && key[i] != path[i]) {
+      return false;
+    }
+  }
+  return true;
+}
+
+static bool verify_node(Art *t, void *p, vector<int> &path, size_t *leaves,
+                        size_t *mem) {
+  if (is_leaf(p)) {
+    (*leaves)++;
+    return verify_leaf(t, p, path, false);
+  }
+  ArtNode *n = (ArtNode *)p;
+  *mem += k_node_size[n->type];
+  static const uint32_t k_min[] = {0, 4, 13, 38};
+  static const uint32_t k_max[] = {4, 16, 48, 256};
+  if (n->nchild < k_min[n->type] || n->nchild > k_max[n->type] ||
+      n->nchild + (n->term ? 1 : 0) < 2) {
+    return false;
+  }
+  size_t depth = path.size();
+  for (uint32_t i = 0; i < n->plen; i++) {
+    path.push_back(i < k_art_prefix ? n->prefix[i] : -1);
+  }
+  if (n->term) {
+    (*leaves)++;
+    if (!verify_leaf(t, n->term, path, true)) {
+      return false;
+    }
+  }
+  if (n->type == ART_N4 || n->type == ART_N16) {
+    uint8_t *keys = n->type == ART_N4 ? ((ArtNode4 *)n)->keys
+                                      : ((ArtNode16 *)n)->keys;
+    for (uint32_t i = 1; i < n->nchild; i++) {
+      if (keys[i - 1] >= keys[i]) {
+        return false;
+      }
+    }
+  }
+  uint32_t nchild = 0;
+  for (uint32_t b = 0; b < 256; b++) {
+    void **child = find_child(n, (uint8_t)b);
+    if (!child) {
+      continue;
+    }
+    nchild++;
+    path.push_back((int)b);
+    bool ok = verify_node(t, *child, path, leaves, mem);
+    path.pop_back();
+    if (!ok) {
+      return false;
+    }
+  }
+  // the children in iteration order are the ones found by key
+  uint32_t pos = 0, count = 0;
+  while (next_child(n, &pos)) {
+    count++;
+  }
+  path.resize(depth);
+  return nchild == n->nchild && count == nchild;
+}
+
+bool art_verify(Art *t) {
+  size_t leaves = 0, mem = 0;
+  vector<int> path;
+  if (t->root && !verify_node(t, t->root, path, &leaves, &mem)) {
+    return false;
+  }
+  return leaves == t->size && mem == t->mem;
+}
@@ -0,0 +1,38 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// An adaptive radix tree: an ordered index of byte-string keys. Inner
+// nodes branch on one key byte and come in four sizes (4, 16, 48, and 256
+// children), growing and shrinking with their fan-out. A run of bytes
+// without branches is kept as a compressed prefix on the node below it.
+//
+// The tree does not copy keys. A leaf is the caller's value pointer, which
+// must be at least 2-byte aligned, and `key_of` gives back its key. A key
+// may be a prefix of another one; it then ends on an inner node.
+struct Art {
+  void *root = NULL;
+  size_t size = 0;
+  // bytes held by inner nodes
+  size_t mem = 0;
+  const uint8_t *(*key_of)(void *val, size_t *len) = NULL;
+};
+
+// adds or replaces a key, returns the value it replaced or NULL
+void *art_insert(Art *t, const uint8_t *key, size_t len, void *val);
+void *art_find(Art *t, const uint8_t *key, size_t len);
+// removes a key, returns its value or NULL
+void *art_delete(Art *t, const uint8_t *key, size_t len);
+
+// Calls `fn` for each value in key order, starting at the first key not
+// less than `start`, or greater than it unless `inclusive`, until `fn`
+// returns false. Reaching the start costs one descent.
+void art_walk(Art *t, const uint8_t *start, size_t len, bool inclusive,
+              bool (*fn)(void *val, void *arg), void *arg);
+
+// frees the inner nodes, the values are the caller's
+void art_destroy(Art *t);
+
+// checks the structure, for tests
+bool art_verify(Art *t);
@@ -161,3 +161,22 @@ AVLNode *avl_offset(AVLNode *node, int64_t offset) {
   }
   return node;
 }
+
+// The middle node is the root, so the sizes of the two subtrees, and with
+// them the depths, differ by at most one.
+static AVLNode *avl_build_range(AVLNode **nodes, size_t n, AVLNode *parent) {
+  if (n == 0) {
+    return NULL;
+  }
+  size_t mid = n / 2;
+  AVLNode *node = nodes[mid];
+  node->parent = parent;
+  node->left = avl_build_range(nodes, mid, node);
+  node->right = avl_build_range(nodes + mid + 1, n - mid - 1, node);
+  avl_update(node);
+  return node;
+}
+
+AVLNode *avl_build(AVLNode **nodes, size_t n) {
+  return avl_build_range(nodes, n, NULL);
+}
@@ -0,0 +1,293 @@
+#include "bitops.h"
+#include <immintrin.h>
+#include <string.h>
+#include <vector>
+using namespace std;
+
+static uint64_t load64(const uint8_t *p) {
+  uint64_t v = 0;
+  memcpy(&v, p, 8);
+  return v;
+}
+
+// bit pairs, then nibbles, then a multiply sums the bytes into the top one
+static uint64_t popcount_swar(uint64_t x) {
+  x = x - ((x >> 1) & 0x5555555555555555ull);
+  x = (x & 0x3333333333333333ull) + ((x >> 2) & 0x3333333333333333ull);
+  x = (x + (x >> 4)) & 0x0F0F0F0F0F0F0F0Full;
+  return (x * 0x0101010101010101ull) >> 56;
+}
+
+uint64_t bitcount_scalar(const uint8_t *p, size_t n) {
+  uint64_t cnt = 0;
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    cnt += popcount_swar(load64(p + i));
+  }
+  for (; i < n; i++) {
+    cnt += popcount_swar(p[i]);
+  }
+  return cnt;
+}
+
+// Four sums, so that consecutive popcnt instructions don't wait on each
+// other's result.
+__attribute__((target("popcnt"))) static uint64_t
+bitcount_popcnt_kernel(const uint8_t *p, size_t n) {
+  uint64_t c0 = 0, c1 = 0, c2 = 0, c3 = 0;
+  size_t i = 0;
+  for (; i + 32 <= n; i += 32) {
+    c0 += __builtin_popcountll(load64(p + i));
+    c1 += __builtin_popcountll(load64(p + i + 8));
+    c2 += __builtin_popcountll(load64(p + i + 16));
+    c3 += __builtin_popcountll(load64(p + i + 24));
+  }
+  for (; i + 8 <= n; i += 8) {
+    c0 += __builtin_popcountll(load64(p + i));
+  }
+  for (; i < n; i++) {
+    c0 += __builtin_popcount(p[i]);
+  }
+  return c0 + c1 + c2 + c3;
+}
+
+uint64_t bitcount_popcnt(const uint8_t *p, size_t n) {
+  if (!cpu_has_popcnt()) {
+    return bitcount_scalar(p, n);
+  }
+  return bitcount_popcnt_kernel(p, n);
+}
+
+// The count of each nibble is looked up with vpshufb, and the two halves of
+// a byte added. The byte counts accumulate for 8 blocks, at most 64 each,
+// before vpsadbw widens them into the 64-bit totals.
+__attribute__((target("avx2"))) static uint64_t
+bitcount_avx2_kernel(const uint8_t *p, size_t n) {
+  const __m256i lut = _mm256_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2,
+                                       3, 3, 4, 0, 1, 1, 2, 1, 2, 2, 3, 1, 2,
+                                       2, 3, 2, 3, 3, 4);
+  const __m256i low = _mm256_set1_epi8(0x0F);
+  const __m256i zero = _mm256_setzero_si256();
+  __m256i total = zero;
+  size_t i = 0;
+  while (i + 32 <= n) {
+    __m256i acc = zero;
+    for (int k = 0; k < 8 && i + 32 <= n; k++, i += 32) {
+      __m256i v = _mm256_loadu_si256((const __m256i *)(p + i));
+      __m256i lo = _mm256_and_si256(v, low);
+      __m256i hi = _mm256_and_si256(_mm256_srli_epi16(v, 4), low);
+      acc = _mm256_add_epi8(acc, _mm256_shuffle_epi8(lut, lo));
+      acc = _mm256_add_epi8(acc, _mm256_shuffle_epi8(lut, hi));
+    }
+    total = _mm256_add_epi64(total, _mm256_sad_epu8(acc, zero));
+  }
+  uint64_t lanes[4];
+  _mm256_storeu_si256((__m256i *)lanes, total);
+  return lanes[0] + lanes[1] + lanes[2] + lanes[3] +
+         bitcount_popcnt(p + i, n - i);
+}
+
+uint64_t bitcount_avx2(const uint8_t *p, size_t n) {
+  if (!cpu_has_avx2()) {
+    return bitcount_popcnt(p, n);
+  }
+  return bitcount_avx2_kernel(p, n);
+}
+
+uint64_t bitcount(const uint8_t *p, size_t n) { return bitcount_avx2(p, n); }
+
+// BITOP over sources that all cover [0, n)
+typedef void (*BitopDense)(int op, uint8_t *dst, size_t n,
+                           const uint8_t *const *srcs, size_t nsrc);
+
+template <int OP, typename T> static T bitop_fold(T a, T b) {
+  return OP == BITOP_AND ? a & b : OP == BITOP_OR ? a | b : a ^ b;
+}
+
+template <int OP>
+static void dense_scalar_op(uint8_t *dst, size_t n, const uint8_t *const *srcs,
+                            size_t nsrc) {
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    uint64_t v = load64(srcs[0] + i);
+    for (size_t k = 1; k < nsrc; k++) {
+      v = bitop_fold<OP>(v, load64(srcs[k] + i));
+    }
+    v = OP == BITOP_NOT ? ~v : v;
+    memcpy(dst + i, &v, 8);
+  }
+  for (; i < n; i++) {
+    uint8_t v = srcs[0][i];
+    for (size_t k = 1; k < nsrc; k++) {
+      v = bitop_fold<OP>(v, srcs[k][i]);
+    }
+    dst[i] = OP == BITOP_NOT ? (uint8_t)~v : v;
+  }
+}
+
+static void dense_scalar(int op, uint8_t *dst, size_t n,
+                         const uint8_t *const *srcs, size_t nsrc) {
+  switch (op) {
+  case BITOP_AND:
+    return dense_scalar_op<BITOP_AND>(dst, n, srcs, nsrc);
+  case BITOP_OR:
+    return dense_scalar_op<BITOP_OR>(dst, n, srcs, nsrc);
+  case BITOP_XOR:
+    return dense_scalar_op<BITOP_XOR>(dst, n, srcs, nsrc);
+  default:
+    return dense_scalar_op<BITOP_NOT>(dst, n, srcs, nsrc);
+  }
+}
+
+template <int OP>
+__attribute__((target("avx2"))) static __m256i bitop_fold256(__m256i a,
+                                                               __m256i b) {
+  return OP == BITOP_AND  ? _mm256_and_si256(a, b)
+         : OP == BITOP_OR ? _mm256_or_si256(a, b)
+                          : _mm256_xor_si256(a, b);
+}
+
+// Each block of the output is folded over all sources in registers, so
+// every source is read once and the output written once.
+template <int OP>
+__attribute__((target("avx2"))) static void
+dense_avx2_op(uint8_t *dst, size_t n, const uint8_t *const *srcs,
+              size_t nsrc) {
+  const __m256i ones = _mm256_set1_epi8(-1);
+  size_t i = 0;
+  for (; i + 64 <= n; i += 64) {
+    __m256i v0 = _mm256_loadu_si256((const __m256i *)(srcs[0] + i));
+    __m256i v1 = _mm256_loadu_si256((const __m256i *)(srcs[0] + i + 32));
+    for (size_t k = 1; k < nsrc; k++) {
+      v0 = bitop_fold256<OP>(
+          v0, _mm256_loadu_si256((const __m256i *)(srcs[k] + i)));
+      v1 = bitop_fold256<OP>(
+          v1, _mm256_loadu_si256((const __m256i *)(srcs[k] + i + 32)));
+    }
+    if (OP == BITOP_NOT) {
+      v0 = _mm256_xor_si256(v0, ones);
+      v1 = _mm256_xor_si256(v1, ones);
+    }
+    _mm256_storeu_si256((__m256i *)(dst + i), v0);
+    _mm256_storeu_si256((__m256i *)(dst + i + 32), v1);
+  }
+  if (i < n) {
+    vector<const uint8_t *> rest(srcs, srcs + nsrc);
+    for (const uint8_t *&p : rest) {
+      p += i;
+    }
+    dense_scalar_op<OP>(dst + i, n - i, rest.data(), nsrc);
+  }
+}
+
+static void dense_avx2(int op, uint8_t *dst, size_t n,
+                       const uint8_t *const *srcs, size_t nsrc) {
+  switch (op) {
+  case BITOP_AND:
+    return dense_avx2_op<BITOP_AND>(dst, n, srcs, nsrc);
+  case BITOP_OR:
+    return dense_avx2_op<BITOP_OR>(dst, n, srcs, nsrc);
+  case BITOP_XOR:
+    return dense_avx2_op<BITOP_XOR>(dst, n, srcs, nsrc);
+  default:
+    return dense_avx2_op<BITOP_NOT>(dst, n, srcs, nsrc);
+  }
+}
+
+// Splits [0, n) at the ends of the sources. Within a segment a source is
+// either there or all zeros, which make AND zero and change nothing for OR
+// and XOR, so only the sources still present are folded.
+static void bitop_segments(BitopDense dense, int op, uint8_t *dst, size_t n,
+                           const uint8_t *const *srcs, const size_t *lens,
+                           size_t nsrc) {
+  vector<const uint8_t *> live;
+  size_t pos = 0;
+  while (pos < n) {
+    size_t end = n;
+    bool ended = false;
+    live.clear();
+    for (size_t k = 0; k < nsrc; k++) {
+      if (lens[k] > pos) {
+        live.push_back(srcs[k] + pos);
+        end = lens[k] < end ? lens[k] : end;
+      } else {
+        ended = true;
+      }
+    }
+    if (op == BITOP_NOT && live.empty()) {
+      memset(dst + pos, 0xFF, end - pos);
+    } else if (live.empty() || (op == BITOP_AND && ended)) {
+      memset(dst + pos, 0, end - pos);
+    } else {
+      dense(op, dst + pos, end - pos, live.data(), live.size());
+    }
+    pos = end;
+  }
+}
+
+void bitop_scalar(int op, uint8_t *dst, size_t n, const uint8_t *const *srcs,
+                  const size_t *lens, size_t nsrc) {
+  bitop_segments(&dense_scalar, op, dst, n, srcs, lens, nsrc);
+}
+
+void bitop_avx2(int op, uint8_t *dst, size_t n, const uint8_t *const *srcs,
+                const size_t *lens, size_t nsrc) {
+  BitopDense dense = cpu_has_avx2() ? &dense_avx2 : &dense_scalar;
+  bitop_segments(dense, op, dst, n, srcs, lens, nsrc);
+}
+
+void bitop(int op, uint8_t *dst, size_t n, const uint8_t *const *srcs,
+           const size_t *lens, size_t nsrc) {
+  bitop_avx2(op, dst, n, srcs, lens, nsrc);
+}
+
+// index of the first set bit of a nonzero byte, from the top
+static int64_t first_bit(uint8_t b) {
+  return __builtin_clz((uint32_t)b) - 24;
+}
+
+// Skips the bytes that have no bit of interest: all zeros when looking for
+// a 1, all ones when looking for a 0.
+int64_t bitpos_scalar(const uint8_t *p, size_t n, int bit) {
+  uint8_t skip = bit ? 0x00 : 0xFF;
+  uint64_t skip64 = bit ? 0 : ~0ull;
+  size_t i = 0;
+  while (i + 8 <= n && load64(p + i) == skip64) {
+    i += 8;
+  }
+  while (i < n && p[i] == skip) {
+    i++;
+  }
+  if (i == n) {
+    return -1;
+  }
+  return (int64_t)i * 8 + first_bit(p[i] ^ skip);
+}
+
+__attribute__((target("avx2"))) static int64_t
+bitpos_avx2_kernel(const uint8_t *p, size_t n, int bit) {
+  uint8_t skip = bit ? 0x00 : 0xFF;
+  const __m256i vskip = _mm256_set1_epi8((char)skip);
+  size_t i = 0;
+  for (; i + 32 <= n; i += 32) {
+    __m256i v = _mm256_loadu_si256((const __m256i *)(p + i));
+    uint32_t same = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, vskip));
+    if (same != 0xFFFFFFFFu) {
+      i += __builtin_ctz(~same);
+      return (int64_t)i * 8 + first_bit(p[i] ^ skip);
+    }
+  }
+  int64_t pos = bitpos_scalar(p + i, n - i, bit);
+  return pos < 0 ? -1 : (int64_t)i * 8 + pos;
+}
+
+int64_t bitpos_avx2(const uint8_t *p, size_t n, int bit) {
+  if (!cpu_has_avx2()) {
+    return bitpos_scalar(p, n, bit);
+  }
+  return bitpos_avx2_kernel(p, n, bit);
+}
+
+int64_t bitpos(const uint8_t *p, size_t n, int bit) {
+  return bitpos_avx2(p, n, bit);
+}
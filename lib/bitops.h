@@ -0,0 +1,34 @@
+#pragma once
+
+#include "cpu.h"
+#include <stddef.h>
+#include <stdint.h>
+
+// Kernels of the bitmap commands over plain byte arrays. Bit 0 is the most
+// significant bit of the first byte, as in Redis.
+//
+// The unsuffixed functions use AVX2 where the CPU has it; the others are
+// there for tests and benchmarks. The _avx2 and _popcnt variants fall back
+// to the portable code on CPUs without the instructions.
+
+enum { BITOP_AND = 0, BITOP_OR = 1, BITOP_XOR = 2, BITOP_NOT = 3 };
+
+// number of set bits
+uint64_t bitcount(const uint8_t *p, size_t n);
+uint64_t bitcount_scalar(const uint8_t *p, size_t n);
+uint64_t bitcount_popcnt(const uint8_t *p, size_t n);
+uint64_t bitcount_avx2(const uint8_t *p, size_t n);
+
+// Writes dst[0, n) = srcs[0] op srcs[1] op ... A source shorter than `n`
+// reads as zeros past its end. NOT takes exactly one source.
+void bitop(int op, uint8_t *dst, size_t n, const uint8_t *const *srcs,
+           const size_t *lens, size_t nsrc);
+void bitop_scalar(int op, uint8_t *dst, size_t n, const uint8_t *const *srcs,
+                  const size_t *lens, size_t nsrc);
+void bitop_avx2(int op, uint8_t *dst, size_t n, const uint8_t *const *srcs,
+                const size_t *lens, size_t nsrc);
+
+// position of the first bit equal to `bit` (0 or 1), or -1
+int64_t bitpos(const uint8_t *p, size_t n, int bit);
+int64_t bitpos_scalar(const uint8_t *p, size_t n, int bit);
+int64_t bitpos_avx2(const uint8_t *p, size_t n, int bit);
@@ -0,0 +1,179 @@
+#include "cluster.h"
+#include <stdlib.h>
+#include <string.h>
+
+struct Crc16Table {
+  uint16_t t[256];
+  Crc16Table() {
+    for (uint32_t i = 0; i < 256; i++) {
+      uint16_t crc = (uint16_t)(i << 8);
+      for (int bit = 0; bit < 8; bit++) {
+        crc = crc & 0x8000 ? (uint16_t)(crc << 1 ^ 0x1021) : (uint16_t)(crc << 1);
+      }
+      t[i] = crc;
+    }
+  }
+};
+
+uint16_t crc16(const char *data, size_t len) {
+  static const Crc16Table table;
+  uint16_t crc = 0;
+  for (size_t i = 0; i < len; i++) {
+    crc = (uint16_t)(crc << 8) ^ table.t[(crc >> 8 ^ (uint8_t)data[i]) & 0xFF];
+  }
+  return crc;
+}
+
+uint32_t key_slot(const char *key, size_t len) {
+  const char *open = (const char *)memchr(key, '{', len);
+  if (open) {
+    size_t rest = len - (size_t)(open - key) - 1;
+    const char *close = (const char *)memchr(open + 1, '}', rest);
+    if (close && close > open + 1) {
+      key = open + 1;
+      len = (size_t)(close - key);
+    }
+  }
+  return crc16(key, len) & (k_cluster_slots - 1);
+}
+
+uint16_t slotmap_node(SlotMap *map, const string &addr) {
+  for (size_t i = 0; i < map->nodes.size(); i++) {
+    if (map->nodes[i] == addr) {
+      return (uint16_t)i;
+    }
+  }
+  map->nodes.push_back(addr);
+  return (uint16_t)(map->nodes.size() - 1);
+}
+
+void slotmap_assign(SlotMap *map, uint32_t lo, uint32_t hi, uint16_t node) {
+  for (uint32_t slot = lo; slot <= hi && slot < k_cluster_slots; slot++) {
+    map->owner[slot] = node;
+  }
+}
+
+const string *slotmap_owner(const SlotMap *map, uint32_t slot) {
+  uint16_t node = map->owner[slot];
+  return node == k_no_node ? NULL : &map->nodes[node];
+}
+
+vector<SlotRange> slotmap_ranges(const SlotMap *map) {
+  vector<SlotRange> ranges;
+  for (uint32_t slot = 0; slot < k_cluster_slots; slot++) {
+    uint16_t node = map->owner[slot];
+    if (node == k_no_node) {
+      continue;
+    }
+    if (!ranges.empty() && ranges.back().node == node &&
+        ranges.back().hi + 1 == slot) {
+      ranges.back().hi = slot;
+    } else {
+      SlotRange r;
+      r.lo = r.hi = slot;
+      r.node = node;
+      ranges.push_back(r);
+    }
+  }
+  return ranges;
+}
+
+size_t slotmap_count(const SlotMap *map, uint16_t node) {
+  size_t n = 0;
+  for (uint16_t owner : map->owner) {
+    n += owner == node;
+  }
+  return n;
+}
+
+static bool parse_slot(const char *s, const char *end, uint32_t *slot) {
+  if (s == end || end - s > 5) {
+    return false;
+  }
+  uint32_t v = 0;
+  for (; s < end; s++) {
+    if (*s < '0' || *s > '9') {
+      return false;
+    }
+    v = v * 10 + (uint32_t)(*s - '0');
+  }
+  *slot = v;
+  return v < k_cluster_slots;
+}
+
+bool parse_slot_range(const string &s, uint32_t *lo, uint32_t *hi) {
+  const char *p = s.data();
+  const char *end = p + s.size();
+  const char *dash = (const char *)memchr(p, '-', s.size());
+  if (!dash) {
+    return parse_slot(p, end, lo) && parse_slot(p, end, hi);
+  }
+  return parse_slot(p, dash, lo) && parse_slot(dash + 1, end, hi) &&
+         *lo <= *hi;
+}
+
+bool slotmap_parse(SlotMap *map, const string &spec) {
+  SlotMap parsed = *map;
+  uint16_t node = k_no_node;
+  size_t pos = 0;
+  while (pos < spec.size()) {
+    size_t end = spec.find(' ', pos);
+    end = end == string::npos ? spec.size() : end;
+    string word = spec.substr(pos, end - pos);
+    pos = end + 1;
+    if (word.empty()) {
+      continue;
+    }
+    uint32_t lo = 0, hi = 0;
+    if (word.find(':') != string::npos) {
+      string host;
+      uint16_t port = 0;
+      if (!parse_node_addr(word, &host, &port)) {
+        return false;
+      }
+      node = slotmap_node(&parsed, word);
+    } else if (node == k_no_node || !parse_slot_range(word, &lo, &hi)) {
+      return false;
+    } else {
+      slotmap_assign(&parsed, lo, hi, node);
+    }
+  }
+  *map = parsed;
+  return true;
+}
+
+bool parse_node_addr(const string &addr, string *host, uint16_t *port) {
+  size_t colon = addr.rfind(':');
+  if (colon == string::npos || colon == 0) {
+    return false;
+  }
+  char *endp = NULL;
+  unsigned long v = strtoul(addr.c_str() + colon + 1, &endp, 10);
+  if (endp == addr.c_str() + colon + 1 || *endp || v == 0 || v > 65535) {
+    return false;
+  }
+  *host = addr.substr(0, colon);
+  *port = (uint16_t)v;
+  return true;
+}
+
+bool parse_redirect(const char *msg, size_t len, bool *ask, uint32_t *slot,
+                    string *addr) {
+  string s(msg, len);
+  size_t p1 = s.find(' ');
+  size_t p2 = p1 == string::npos ? p1 : s.find(' ', p1 + 1);
+  if (p2 == string::npos) {
+    return false;
+  }
+  string kind = s.substr(0, p1);
+  if (kind != "MOVED" && kind != "ASK") {
+    return false;
+  }
+  const char *num = s.data() + p1 + 1;
+  string host;
+  uint16_t port = 0;
+  *ask = kind == "ASK";
+  *addr = s.substr(p2 + 1);
+  return parse_slot(num, s.data() + p2, slot) &&
+         parse_node_addr(*addr, &host, &port);
+}
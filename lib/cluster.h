@@ -0,0 +1,54 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+using namespace std;
+
+// Hash slots, as in Redis Cluster: a key belongs to slot CRC16(key) mod
+// 16384. If the key has a `{...}` section with something inside, only that
+// part is hashed, so that keys sharing it land in the same slot and can be
+// used together.
+const uint32_t k_cluster_slots = 16384;
+const uint16_t k_no_node = 0xFFFF;
+
+// CRC16-CCITT (XMODEM), the variant Redis uses
+uint16_t crc16(const char *data, size_t len);
+uint32_t key_slot(const char *key, size_t len);
+
+// Which node serves each slot. Nodes are known by their "host:port"
+// address, which is also what redirects carry.
+struct SlotMap {
+  vector<string> nodes;
+  // index into `nodes`, or k_no_node
+  vector<uint16_t> owner = vector<uint16_t>(k_cluster_slots, k_no_node);
+};
+
+struct SlotRange {
+  uint32_t lo = 0;
+  uint32_t hi = 0; // inclusive
+  uint16_t node = k_no_node;
+};
+
+// the index of a node, added if new
+uint16_t slotmap_node(SlotMap *map, const string &addr);
+void slotmap_assign(SlotMap *map, uint32_t lo, uint32_t hi, uint16_t node);
+// the address serving a slot, NULL if none
+const string *slotmap_owner(const SlotMap *map, uint32_t slot);
+// the runs of consecutive slots with the same owner, unassigned ones left out
+vector<SlotRange> slotmap_ranges(const SlotMap *map);
+size_t slotmap_count(const SlotMap *map, uint16_t node);
+
+// "N" or "N-M", within the slot space
+bool parse_slot_range(const string &s, uint32_t *lo, uint32_t *hi);
+// Assigns the slots of a spec like "127.0.0.1:7001 0-8191 127.0.0.1:7002
+// 8192-16383": each address is followed by the slots it serves.
+bool slotmap_parse(SlotMap *map, const string &spec);
+
+// splits "host:port"
+bool parse_node_addr(const string &addr, string *host, uint16_t *port);
+// Parses a "MOVED <slot> <addr>" or "ASK <slot> <addr>" error, the
+// redirects a node answers with for a key it does not serve.
+bool parse_redirect(const char *msg, size_t len, bool *ask, uint32_t *slot,
+                    string *addr);
@@ -0,0 +1,363 @@
+#include "cluster.h"
+#include "log.h"
+#include <algorithm>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+using namespace std;
+
+#pragma once
+
+enum {
+  EVICT_NOEVICTION = 0,
+  EVICT_ALLKEYS_LRU = 1,
+  EVICT_ALLKEYS_LFU = 2,
+  EVICT_VOLATILE_TTL = 3,
+};
+
+static const char *k_evict_policy_names[] = {
+    "noeviction",
+    "allkeys-lru",
+    "allkeys-lfu",
+    "volatile-ttl",
+};
+
+const uint32_t k_max_evict_samples = 64;
+
+enum {
+  IO_BACKEND_POLL = 0,
+  IO_BACKEND_URING = 1,
+};
+
+static const char *k_io_backend_names[] = {
+    "poll",
+    "io_uring",
+};
+
+// Output buffer limits of a class of clients. A client is disconnected
+// once its queued output exceeds `hard`, or stays over `soft` for
+// `soft_secs` seconds; 0 disables a limit.
+struct OutputLimit {
+  uint64_t hard = 0;
+  uint64_t soft = 0;
+  uint32_t soft_secs = 0;
+};
+
+// Client classes of the output limits. There is no replication, so no
+// connection is a replica; the class is accepted for Redis configurations.
+enum {
+  CLIENT_NORMAL = 0,
+  CLIENT_REPLICA = 1,
+  CLIENT_PUBSUB = 2,
+  CLIENT_CLASSES = 3,
+};
+
+static const char *k_client_class_names[] = {
+    "normal",
+    "replica",
+    "pubsub",
+};
+
+// runtime settings, filled from `--name value` arguments and `config set`
+static struct {
+  // 0 means no limit
+  uint64_t maxmemory = 0;
+  uint32_t maxmemory_policy = EVICT_NOEVICTION;
+  uint32_t maxmemory_samples = 5;
+  // LFU counter growth is logarithmic in the access count, see entry_touch
+  uint32_t lfu_log_factor = 10;
+  // minutes of inactivity that decrement the LFU counter by one
+  uint32_t lfu_decay_time = 1;
+  // empty logs to stdout; CONFIG SET reopens the log
+  string logfile;
+  // commands slower than this (usec) go to the slow log; negative disables
+  int64_t slowlog_slower_than = 10000;
+  uint32_t slowlog_max_len = 128;
+  // internal events slower than this (usec) are recorded; 0 disables
+  uint32_t latency_threshold_us = 1000;
+  // event loop, only read at startup; io_uring falls back to poll
+  uint32_t io_backend = IO_BACKEND_POLL;
+  // TCP port on 127.0.0.1; read at startup
+  uint32_t port = 1800;
+  // listen() queue length, capped by net.core.somaxconn; read at startup
+  uint32_t tcp_backlog = 511;
+  // path of an extra AF_UNIX listener, empty for none; read at startup
+  string unixsocket;
+  // hashes stay packed up to this many fields and this field/value length
+  uint32_t hash_max_listpack_entries = 128;
+  uint32_t hash_max_listpack_value = 64;
+  // sets of integers stay sorted arrays up to this many members
+  uint32_t set_max_intset_entries = 512;
+  // HyperLogLogs stay sparse up to this many bytes of runs
+  uint32_t hll_sparse_max_bytes = 3000;
+  // strings of at least this many bytes are stored compressed when that
+  // pays off; 0 disables
+  uint32_t value_compression_threshold = 0;
+  // keys remembered for client-side caching before the oldest are
+  // invalidated to make room; 0 for no limit
+  uint32_t tracking_table_max_keys = 1000000;
+  // clients that fall behind are disconnected, by class; the defaults are
+  // those of Redis
+  OutputLimit output_limits[CLIENT_CLASSES] = {
+      {0, 0, 0}, {256 << 20, 64 << 20, 60}, {32 << 20, 8 << 20, 60}};
+  // unparsed input and commands queued by MULTI, per connection
+  uint64_t client_query_buffer_limit = 1 << 30;
+  // keep an ordered index of the keys, for prefix scans and key ranges
+  bool key_index = false;
+  // serve only the hash slots assigned to this node; both read at startup
+  bool cluster_enabled = false;
+  // the initial slot map, "<host:port> <slots>..." for each node, see
+  // slotmap_parse; empty gives this node every slot
+  string cluster_config;
+} g_config;
+
+// parses a byte count with an optional kb/mb/gb suffix
+static bool str2mem(const string &s, uint64_t &out) {
+  char *endp = NULL;
+  unsigned long long v = strtoull(s.c_str(), &endp, 10);
+  if (endp == s.c_str()) {
+    return false;
+  }
+  uint64_t mul = 1;
+  if (strcasecmp(endp, "kb") == 0 || strcasecmp(endp, "k") == 0) {
+    mul = 1024;
+  } else if (strcasecmp(endp, "mb") == 0 || strcasecmp(endp, "m") == 0) {
+    mul = 1024 * 1024;
+  } else if (strcasecmp(endp, "gb") == 0 || strcasecmp(endp, "g") == 0) {
+    mul = 1024 * 1024 * 1024;
+  } else if (*endp) {
+    return false;
+  }
+  out = v * mul;
+  return true;
+}
+
+static bool str2u32(const string &s, uint32_t &out) {
+  char *endp = NULL;
+  unsigned long v = strtoul(s.c_str(), &endp, 10);
+  if (endp == s.c_str() || *endp || v > UINT32_MAX) {
+    return false;
+  }
+  out = (uint32_t)v;
+  return true;
+}
+
+// "<class> <hard> <soft> <soft seconds>", repeated for several classes, as
+// in Redis; sizes take suffixes. Nothing changes unless all of it parses.
+static bool parse_output_limits(const string &val) {
+  OutputLimit limits[CLIENT_CLASSES];
+  copy(g_config.output_limits, g_config.output_limits + CLIENT_CLASSES,
+       limits);
+  const char *p = val.c_str();
+  do {
+    char cls[16], hard[32], soft[32];
+    uint32_t secs = 0;
+    int end = 0;
+    if (sscanf(p, "%15s %31s %31s %u %n", cls, hard, soft, &secs, &end) !=
+        4) {
+      return false;
+    }
+    p += end;
+    uint32_t i = 0;
+    while (i < CLIENT_CLASSES && strcmp(cls, k_client_class_names[i]) != 0) {
+      i++;
+    }
+    i = strcmp(cls, "slave") == 0 ? (uint32_t)CLIENT_REPLICA : i;
+    if (i == CLIENT_CLASSES || !str2mem(hard, limits[i].hard) ||
+        !str2mem(soft, limits[i].soft)) {
+      return false;
+    }
+    limits[i].soft_secs = secs;
+  } while (*p);
+  copy(limits, limits + CLIENT_CLASSES, g_config.output_limits);
+  return true;
+}
+
+static bool config_set(const string &name, const string &val) {
+  if (name == "maxmemory") {
+    return str2mem(val, g_config.maxmemory);
+  } else if (name == "maxmemory-policy") {
+    for (uint32_t i = 0; i < sizeof(k_evict_policy_names) / sizeof(char *);
+         i++) {
+      if (val == k_evict_policy_names[i]) {
+        g_config.maxmemory_policy = i;
+        return true;
+      }
+    }
+    return false;
+  } else if (name == "maxmemory-samples") {
+    uint32_t n = 0;
+    if (!str2u32(val, n) || n == 0 || n > k_max_evict_samples) {
+      return false;
+    }
+    g_config.maxmemory_samples = n;
+    return true;
+  } else if (name == "lfu-log-factor") {
+    return str2u32(val, g_config.lfu_log_factor);
+  } else if (name == "lfu-decay-time") {
+    return str2u32(val, g_config.lfu_decay_time);
+  } else if (name == "loglevel") {
+    int level = log_level_from_name(val.c_str());
+    if (level < 0) {
+      return false;
+    }
+    log_set_level(level);
+    return true;
+  } else if (name == "logfile") {
+    if (!log_reopen(val.c_str())) {
+      return false;
+    }
+    g_config.logfile = val;
+    return true;
+  } else if (name == "slowlog-log-slower-than") {
+    char *endp = NULL;
+    long long v = strtoll(val.c_str(), &endp, 10);
+    if (endp == val.c_str() || *endp) {
+      return false;
+    }
+    g_config.slowlog_slower_than = v;
+    return true;
+  } else if (name == "slowlog-max-len") {
+    return str2u32(val, g_config.slowlog_max_len);
+  } else if (name == "latency-monitor-threshold") {
+    return str2u32(val, g_config.latency_threshold_us);
+  } else if (name == "port") {
+    uint32_t port = 0;
+    if (!str2u32(val, port) || port == 0 || port > 65535) {
+      return false;
+    }
+    g_config.port = port;
+    return true;
+  } else if (name == "tcp-backlog") {
+    return str2u32(val, g_config.tcp_backlog);
+  } else if (name == "unixsocket") {
+    g_config.unixsocket = val;
+    return true;
+  } else if (name == "hash-max-listpack-entries") {
+    return str2u32(val, g_config.hash_max_listpack_entries);
+  } else if (name == "hash-max-listpack-value") {
+    return str2u32(val, g_config.hash_max_listpack_value);
+  } else if (name == "set-max-intset-entries") {
+    return str2u32(val, g_config.set_max_intset_entries);
+  } else if (name == "hll-sparse-max-bytes") {
+    return str2u32(val, g_config.hll_sparse_max_bytes);
+  } else if (name == "value-compression-threshold") {
+    return str2u32(val, g_config.value_compression_threshold);
+  } else if (name == "tracking-table-max-keys") {
+    return str2u32(val, g_config.tracking_table_max_keys);
+  } else if (name == "client-output-buffer-limit") {
+    return parse_output_limits(val);
+  } else if (name == "client-query-buffer-limit") {
+    return str2mem(val, g_config.client_query_buffer_limit);
+  } else if (name == "key-index") {
+    if (val != "yes" && val != "no") {
+      return false;
+    }
+    g_config.key_index = val == "yes";
+    return true;
+  } else if (name == "cluster-enabled") {
+    if (val != "yes" && val != "no") {
+      return false;
+    }
+    g_config.cluster_enabled = val == "yes";
+    return true;
+  } else if (name == "cluster-config") {
+    SlotMap map;
+    if (!slotmap_parse(&map, val)) {
+      return false;
+    }
+    g_config.cluster_config = val;
+    return true;
+  } else if (name == "io-backend") {
+    for (uint32_t i = 0; i < sizeof(k_io_backend_names) / sizeof(char *);
+         i++) {
+      if (val == k_io_backend_names[i]) {
+        g_config.io_backend = i;
+        return true;
+      }
+    }
+    return false;
+  }
+  return false;
+}
+
+static bool config_get(const string &name, string &val) {
+  if (name == "maxmemory") {
+    val = to_string(g_config.maxmemory);
+  } else if (name == "maxmemory-policy") {
+    val = k_evict_policy_names[g_config.maxmemory_policy];
+  } else if (name == "maxmemory-samples") {
+    val = to_string(g_config.maxmemory_samples);
+  } else if (name == "lfu-log-factor") {
+    val = to_string(g_config.lfu_log_factor);
+  } else if (name == "lfu-decay-time") {
+    val = to_string(g_config.lfu_decay_time);
+  } else if (name == "loglevel") {
+    val = log_level_name(g_log_level);
+  } else if (name == "logfile") {
+    val = g_config.logfile;
+  } else if (name == "slowlog-log-slower-than") {
+    val = to_string(g_config.slowlog_slower_than);
+  } else if (name == "slowlog-max-len") {
+    val = to_string(g_config.slowlog_max_len);
+  } else if (name == "latency-monitor-threshold") {
+    val = to_string(g_config.latency_threshold_us);
+  } else if (name == "io-backend") {
+    val = k_io_backend_names[g_config.io_backend];
+  } else if (name == "port") {
+    val = to_string(g_config.port);
+  } else if (name == "tcp-backlog") {
+    val = to_string(g_config.tcp_backlog);
+  } else if (name == "unixsocket") {
+    val = g_config.unixsocket;
+  } else if (name == "hash-max-listpack-entries") {
+    val = to_string(g_config.hash_max_listpack_entries);
+  } else if (name == "hash-max-listpack-value") {
+    val = to_string(g_config.hash_max_listpack_value);
+  } else if (name == "set-max-intset-entries") {
+    val = to_string(g_config.set_max_intset_entries);
+  } else if (name == "hll-sparse-max-bytes") {
+    val = to_string(g_config.hll_sparse_max_bytes);
+  } else if (name == "value-compression-threshold") {
+    val = to_string(g_config.value_compression_threshold);
+  } else if (name == "tracking-table-max-keys") {
+    val = to_string(g_config.tracking_table_max_keys);
+  } else if (name == "client-output-buffer-limit") {
+    val.clear();
+    for (uint32_t i = 0; i < CLIENT_CLASSES; i++) {
+      const OutputLimit &lim = g_config.output_limits[i];
+      val += string(i ? " " : "") + k_client_class_names[i] + " " +
+             to_string(lim.hard) + " " + to_string(lim.soft) + " " +
+             to_string(lim.soft_secs);
+    }
+  } else if (name == "client-query-buffer-limit") {
+    val = to_string(g_config.client_query_buffer_limit);
+  } else if (name == "key-index") {
+    val = g_config.key_index ? "yes" : "no";
+  } else if (name == "cluster-enabled") {
+    val = g_config.cluster_enabled ? "yes" : "no";
+  } else if (name == "cluster-config") {
+    val = g_config.cluster_config;
+  } else {
+    return false;
+  }
+  return true;
+}
+
+// ./Server --maxmemory 64mb --maxmemory-policy allkeys-lru
+static bool config_parse_args(int argc, char *argv[]) {
+  for (int i = 1; i < argc; i++) {
+    if (strncmp(argv[i], "--", 2) != 0 || i + 1 >= argc) {
+      fprintf(stderr, "bad argument: %s\n", argv[i]);
+      return false;
+    }
+    if (!config_set(argv[i] + 2, argv[i + 1])) {
+      fprintf(stderr, "bad value for %s: %s\n", argv[i], argv[i + 1]);
+      return false;
+    }
+    i++;
+  }
+  return true;
+}
@@ -0,0 +1,14 @@
+#pragma once
+
+// Instruction set extensions of the running CPU, for kernels compiled with
+// a target attribute. Each is checked once.
+
+inline bool cpu_has_avx2() {
+  static const bool has = __builtin_cpu_supports("avx2");
+  return has;
+}
+
+inline bool cpu_has_popcnt() {
+  static const bool has = __builtin_cpu_supports("popcnt");
+  return has;
+}
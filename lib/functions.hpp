@@ -1,21 +1,37 @@
 
 #include "Zset.h"
+#include "bitops.h"
+#include "cluster.h"
+#include "config.hpp"
 #include "hash.h"
+#include "hll.h"
+#include "hobj.h"
+#include "lz.h"
+#include "monitor.hpp"
+#include "qlist.h"
+#include "rclient.h"
+#include "sobj.h"
 #include "structures.hpp"
 #include "unordered_map"
+#include <algorithm>
 #include <arpa/inet.h>
 #include <cassert>
 #include <cerrno>
+#include <chrono>
+#include <cmath>
+#include <cstdarg>
 #include <cstdio>
 #include <errno.h>
 #include <fcntl.h>
 #include <iostream>
 #include <iterator>
 #include <netinet/ip.h>
+#include <netinet/tcp.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/eventfd.h>
 #include <sys/socket.h>
 #include <unistd.h>
 #include <vector>
@@ -29,12 +45,85 @@ struct Entry {
   string val;
   uint32_t type = 0;
   ZSet *zset = NULL;
+  HObj *hash = NULL;
+  QList *list = NULL;
+  SObj *set = NULL;
 
   size_t heap_idx = -1;
+  // access metadata for eviction: LRU clock in ms, and a logarithmic
+  // access counter with the minute it was last decayed for LFU
+  uint32_t atime = 0;
+  uint16_t lfu_ldt = 0;
+  uint8_t lfu_cnt = 0;
+  // ENC_LZ: `val` holds a compressed block
+  uint8_t enc = ENC_RAW;
+  // equals g_data.bg_epoch while a background job may read `val` in place,
+  // see entry_unshare
+  uint64_t shared_epoch = 0;
+  // changes with every write to the key, checked by EXEC against WATCH
+  uint64_t version = 0;
 };
 
 static bool hnode_same(HNode *lhs, HNode *rhs) { return lhs == rhs; }
 
+static const uint8_t *entry_key_of(void *val, size_t *len) {
+  Entry *ent = (Entry *)val;
+  *len = ent->key.size();
+  return (const uint8_t *)ent->key.data();
+}
+
+static void keyidx_add(Entry *ent) {
+  if (g_data.keyidx_on) {
+    art_insert(&g_data.keyidx, (const uint8_t *)ent->key.data(),
+               ent->key.size(), ent);
+  }
+}
+
+static void keyidx_del(Entry *ent) {
+  if (g_data.keyidx_on) {
+    art_delete(&g_data.keyidx, (const uint8_t *)ent->key.data(),
+               ent->key.size());
+  }
+}
+
+static void keyidx_add_node(HNode *node, void *) {
+  keyidx_add(container_of(node, Entry, node));
+}
+
+// Builds or drops the key index after `key-index` changed. Building it
+// walks the whole key space once.
+static void keyidx_sync() {
+  if (g_config.key_index == g_data.keyidx_on) {
+    return;
+  }
+  g_data.keyidx_on = g_config.key_index;
+  if (g_data.keyidx_on) {
+    g_data.keyidx.key_of = &entry_key_of;
+    h_scan(&g_data.db.ht1, &keyidx_add_node, NULL);
+    h_scan(&g_data.db.ht2, &keyidx_add_node, NULL);
+  } else {
+    art_destroy(&g_data.keyidx);
+  }
+}
+
+// keeps the per-slot key counts of cluster mode
+static void cluster_count(Entry *ent, int delta) {
+  if (g_data.cluster_on) {
+    g_data.slot_keys[key_slot(ent->key.data(), ent->key.size())] += delta;
+  }
+}
+
+// bookkeeping of a key entering or leaving the key space
+static void entry_linked(Entry *ent) {
+  keyidx_add(ent);
+  cluster_count(ent, 1);
+}
+
+static void entry_unlinked(Entry *ent) {
+  keyidx_del(ent);
+  cluster_count(ent, -1);
+}
+
 static void entry_set_ttl(Entry *ent, int64_t ttl_ms) {
   if (ttl_ms < 0 && ent->heap_idx != (size_t)-1) {
     // erase an item from the heap
@@ -55,42 +144,436 @@ static void entry_set_ttl(Entry *ent, int64_t ttl_ms) {
       g_data.heap.push_back(item);
       pos = g_data.heap.size() - 1;
     }
-    // cout << pos << " " << g_data.heap.size() << endl;
     g_data.heap[pos].val = get_monotonic_usec() + (uint64_t)ttl_ms * 1000;
-    cout << g_data.heap[pos].val << endl;
     heap_update(g_data.heap.data(), pos, g_data.heap.size());
   }
 }
 
+// heap bytes owned by a string beyond the inline small-string buffer
+static size_t str_mem(const string &s) {
+  return s.capacity() > 15 ? s.capacity() + 1 : 0;
+}
+
+static size_t htab_mem(const HTab *htab) {
+  return htab->tab ? (htab->mask + 1) * sizeof(HNode *) : 0;
+}
+
+// keeps the totals of compressed strings in step, with `add` false when
+// one goes away
+static void lz_account(Entry *ent, bool add) {
+  if (ent->enc != ENC_LZ) {
+    return;
+  }
+  size_t raw = lz_raw_size((const uint8_t *)ent->val.data(), ent->val.size());
+  if (add) {
+    g_data.lz_values++;
+    g_data.lz_bytes += ent->val.size();
+    g_data.lz_raw_bytes += raw;
+  } else {
+    g_data.lz_values--;
+    g_data.lz_bytes -= ent->val.size();
+    g_data.lz_raw_bytes -= raw;
+  }
+}
+
+static size_t entry_mem(Entry *ent) {
+  size_t n = sizeof(Entry) + str_mem(ent->key) + str_mem(ent->val);
+  if (ent->zset) {
+    n += sizeof(ZSet) + ent->zset->mem;
+    n += htab_mem(&ent->zset->db.ht1) + htab_mem(&ent->zset->db.ht2);
+  }
+  if (ent->hash) {
+    HObj *h = ent->hash;
+    n += sizeof(HObj) + str_mem(h->packed);
+    if (h->map) {
+      n += sizeof(HMap) + h->mem;
+      n += htab_mem(&h->map->ht1) + htab_mem(&h->map->ht2);
+    }
+  }
+  if (ent->list) {
+    n += sizeof(QList) + ent->list->mem;
+  }
+  if (ent->set) {
+    SObj *set = ent->set;
+    n += sizeof(SObj) + set->ints.capacity() * sizeof(int64_t);
+    if (set->map) {
+      n += sizeof(HMap) + set->mem;
+      n += htab_mem(&set->map->ht1) + htab_mem(&set->map->ht2);
+    }
+  }
+  return n;
+}
+
+// memory compared against `maxmemory`
+static size_t mem_used() {
+  return g_data.used_memory + htab_mem(&g_data.db.ht1) +
+         htab_mem(&g_data.db.ht2) + g_data.keyidx.mem;
+}
+
+static uint64_t rng_next() { return rng_step(g_data.rng_state); }
+
+static uint32_t lru_clock() { return (uint32_t)(g_data.now_us / 1000); }
+
+static uint16_t lfu_minutes() {
+  return (uint16_t)(g_data.now_us / 60000000);
+}
+
+const uint8_t k_lfu_init_val = 5;
+
+// the LFU counter after applying the decay for idle minutes
+static uint8_t lfu_decayed(Entry *ent) {
+  uint16_t elapsed = (uint16_t)(lfu_minutes() - ent->lfu_ldt);
+  uint32_t periods =
+      g_config.lfu_decay_time ? elapsed / g_config.lfu_decay_time : 0;
+  return periods >= ent->lfu_cnt ? 0 : ent->lfu_cnt - periods;
+}
+
+// Records an access. Only the entry itself is written, so a read never has
+// to touch shared eviction state.
+static void entry_touch(Entry *ent) {
+  ent->atime = lru_clock();
+  if (g_config.maxmemory_policy != EVICT_ALLKEYS_LFU) {
+    return;
+  }
+  uint8_t cnt = lfu_decayed(ent);
+  if (cnt < 255) {
+    // the chance of an increment shrinks as the counter grows
+    double r = (double)(rng_next() >> 11) / (double)(1ull << 53);
+    double base = cnt > k_lfu_init_val ? cnt - k_lfu_init_val : 0;
+    if (r < 1.0 / (base * g_config.lfu_log_factor + 1)) {
+      cnt++;
+    }
+  }
+  ent->lfu_cnt = cnt;
+  ent->lfu_ldt = lfu_minutes();
+}
+
+static bool entry_eq(HNode *lhs, HNode *rhs) {
+  // Make sure the entry are the same
+  struct Entry *le = container_of(lhs, struct Entry, node);
+  struct Entry *re = container_of(rhs, struct Entry, node);
+  return le->key == re->key;
+}
+
+static Entry *entry_find(string &name) {
+  Entry key;
+  key.key.swap(name);
+  key.node.hcode = str_hash((uint8_t *)key.key.data(), key.key.size());
+  bool rehashing = g_data.db.ht2.tab != NULL;
+  uint64_t t0 = rehashing ? clock_ticks() : 0;
+  HNode *node = hm_find(&g_data.db, &key.node, &entry_eq);
+  if (rehashing) {
+    latency_add_ticks(LAT_REHASH, clock_ticks() - t0);
+  }
+  key.key.swap(name);
+  return node ? container_of(node, Entry, node) : NULL;
+}
+
+// detaches an entry from the key space, the caller disposes it
+static Entry *entry_pop(string &name) {
+  Entry key;
+  key.key.swap(name);
+  key.node.hcode = str_hash((uint8_t *)key.key.data(), key.key.size());
+  HNode *node = hm_pop(&g_data.db, &key.node, &entry_eq);
+  key.key.swap(name);
+  if (!node) {
+    return NULL;
+  }
+  Entry *ent = container_of(node, Entry, node);
+  entry_unlinked(ent);
+  return ent;
+}
+
+// lookup on behalf of a command, counts as an access
+static Entry *entry_lookup(string &name) {
+  Entry *ent = entry_find(name);
+  if (ent) {
+    entry_touch(ent);
+  }
+  return ent;
+}
+
+// creates an empty entry and adds it to the key space
+static Entry *entry_new(string &name, uint32_t type) {
+  Entry *ent = new Entry();
+  ent->key = name;
+  ent->node.hcode = str_hash((uint8_t *)ent->key.data(), ent->key.size());
+  ent->type = type;
+  if (type == T_ZSET) {
+    ent->zset = new ZSet();
+  } else if (type == T_HASH) {
+    ent->hash = new HObj();
+  } else if (type == T_LIST) {
+    ent->list = new QList();
+    ql_init(ent->list);
+  } else if (type == T_SET) {
+    ent->set = new SObj();
+  }
+  ent->lfu_cnt = k_lfu_init_val;
+  ent->lfu_ldt = lfu_minutes();
+  ent->version = ++g_data.key_version;
+  entry_touch(ent);
+  // an insert may start a resize, which allocates the new table
+  uint64_t t0 = clock_ticks();
+  bool rehashing = g_data.db.ht2.tab != NULL;
+  hm_insert(&g_data.db, &ent->node);
+  if (rehashing || g_data.db.ht2.tab) {
+    latency_add_ticks(LAT_REHASH, clock_ticks() - t0);
+  }
+  entry_linked(ent);
+  g_data.used_memory += entry_mem(ent);
+  return ent;
+}
+
 static void entry_destroy(Entry *ent) {
   switch (ent->type) {
   case T_ZSET:
     zset_dispose(ent->zset);
     delete ent->zset;
     break;
+  case T_HASH:
+    hobj_dispose(ent->hash);
+    delete ent->hash;
+    break;
+  case T_LIST:
+    ql_dispose(ent->list);
+    delete ent->list;
+    break;
+  case T_SET:
+    sobj_dispose(ent->set);
+    delete ent->set;
+    break;
   }
   delete ent;
 }
 
 static void entry_del_async(void *arg) { entry_destroy((Entry *)arg); }
 
+// Must precede any change to the string of an entry. If a background job
+// may be reading it, the buffer goes to the retired list and the entry
+// continues with a copy, or with nothing unless `keep`.
+static void entry_unshare(Entry *ent, bool keep) {
+  if (ent->shared_epoch != g_data.bg_epoch) {
+    return;
+  }
+  g_data.bg_retired.emplace_back();
+  string &old = g_data.bg_retired.back();
+  old.swap(ent->val);
+  if (keep) {
+    ent->val = old;
+  }
+  ent->shared_epoch = 0;
+}
+
+// Replaces a string value. One of at least `value-compression-threshold`
+// bytes is stored compressed if that saves an eighth or more.
+static void str_assign(Entry *ent, const string &val) {
+  entry_unshare(ent, false);
+  lz_account(ent, false);
+  uint32_t threshold = g_config.value_compression_threshold;
+  string &buf = g_data.lz_buf;
+  if (threshold && val.size() >= threshold &&
+      lz_compress((const uint8_t *)val.data(), val.size(), buf,
+                  val.size() - val.size() / 8)) {
+    // a copy sized to fit, `buf` keeps the capacity for the next one
+    string(buf).swap(ent->val);
+    ent->enc = ENC_LZ;
+  } else {
+    ent->val.assign(val);
+    ent->enc = ENC_RAW;
+  }
+  lz_account(ent, true);
+}
+
+// Stores a compressed string as plain bytes again, for the commands that
+// work on them in place.
+static void str_decode(Entry *ent) {
+  if (ent->enc != ENC_LZ) {
+    return;
+  }
+  size_t before = entry_mem(ent);
+  string raw;
+  lz_decompress((const uint8_t *)ent->val.data(), ent->val.size(), raw);
+  lz_account(ent, false);
+  ent->val.swap(raw);
+  ent->enc = ENC_RAW;
+  g_data.used_memory += entry_mem(ent) - before;
+}
+
+static size_t str_len(Entry *ent) {
+  return ent->enc == ENC_LZ ? lz_raw_size((const uint8_t *)ent->val.data(),
+                                          ent->val.size())
+                            : ent->val.size();
+}
+
+// The bytes of a string for a reply. A compressed one is decompressed into
+// a buffer that the next call reuses; the value stays compressed.
+static const string &str_value(Entry *ent) {
+  if (ent->enc != ENC_LZ) {
+    return ent->val;
+  }
+  g_data.lz_buf.clear();
+  lz_decompress((const uint8_t *)ent->val.data(), ent->val.size(),
+                g_data.lz_buf);
+  return g_data.lz_buf;
+}
+
 // dispose the entry after it got detached from the key space
 static void entry_del(Entry *ent) {
   entry_set_ttl(ent, -1);
+  lz_account(ent, false);
+  g_data.used_memory -= entry_mem(ent);
+  entry_unshare(ent, false);
 
+  // freeing these takes long enough to stall the event loop
   const size_t k_large_container_size = 10000;
+  const size_t k_large_value_size = 64 * 1024;
   bool too_big = false;
   switch (ent->type) {
+  case T_STR:
+    too_big = ent->val.size() > k_large_value_size;
+    break;
   case T_ZSET:
     too_big = hm_size(&ent->zset->db) > k_large_container_size;
     break;
+  case T_HASH:
+    too_big = hobj_size(ent->hash) > k_large_container_size;
+    break;
+  case T_LIST:
+    // a chunk is one allocation however many elements it packs
+    too_big = ent->list->nchunks > k_large_container_size;
+    break;
+  case T_SET:
+    // an intset is a single allocation
+    too_big = ent->set->map && hm_size(ent->set->map) > k_large_container_size;
+    break;
   }
 
   if (too_big) {
     thread_pool_queue(&g_data.tp, &entry_del_async, ent);
   } else {
+    uint64_t t0 = clock_ticks();
     entry_destroy(ent);
+    latency_add_ticks(LAT_FREE, clock_ticks() - t0);
+  }
+}
+
+static void evpool_insert(Entry *ent, uint64_t score) {
+  vector<EvictCandidate> &pool = g_data.evpool;
+  if (pool.size() == k_evpool_size && score <= pool[0].score) {
+    return;
+  }
+  for (size_t i = 0; i < pool.size(); i++) {
+    if (pool[i].key == ent->key) {
+      pool.erase(pool.begin() + i);
+      break;
+    }
+  }
+  size_t pos = 0;
+  while (pos < pool.size() && pool[pos].score < score) {
+    pos++;
+  }
+  if (pool.size() == k_evpool_size) {
+    // drop the weakest candidate
+    pool.erase(pool.begin());
+    pos--;
+  }
+  EvictCandidate cand;
+  cand.score = score;
+  cand.key = ent->key;
+  pool.insert(pool.begin() + pos, cand);
+}
+
+static uint64_t evict_score(Entry *ent) {
+  switch (g_config.maxmemory_policy) {
+  case EVICT_ALLKEYS_LRU:
+    return (uint32_t)(lru_clock() - ent->atime);
+  case EVICT_ALLKEYS_LFU:
+    return 255 - lfu_decayed(ent);
+  case EVICT_VOLATILE_TTL:
+    return UINT64_MAX - g_data.heap[ent->heap_idx].val;
+  }
+  return 0;
+}
+
+static void tracking_invalidate(string &key, Connection *by);
+
+// Samples a few keys into the candidate pool and evicts the best one.
+// There is no global LRU list; the pool approximates it.
+static bool evict_one() {
+  Entry *samples[k_max_evict_samples];
+  size_t n = 0;
+  if (g_config.maxmemory_policy == EVICT_VOLATILE_TTL) {
+    for (; n < g_config.maxmemory_samples && !g_data.heap.empty(); n++) {
+      size_t pos = rng_next() % g_data.heap.size();
+      samples[n] = container_of(g_data.heap[pos].ref, Entry, heap_idx);
+    }
+  } else {
+    HNode *nodes[k_max_evict_samples];
+    n = hm_sample(&g_data.db, rng_next(), nodes, g_config.maxmemory_samples);
+    for (size_t i = 0; i < n; i++) {
+      samples[i] = container_of(nodes[i], Entry, node);
+    }
   }
+  for (size_t i = 0; i < n; i++) {
+    evpool_insert(samples[i], evict_score(samples[i]));
+  }
+
+  while (!g_data.evpool.empty()) {
+    EvictCandidate cand;
+    cand.key.swap(g_data.evpool.back().key);
+    g_data.evpool.pop_back();
+    // the key may have been deleted since it was sampled
+    Entry *ent = entry_find(cand.key);
+    if (!ent) {
+      continue;
+    }
+    if (g_config.maxmemory_policy == EVICT_VOLATILE_TTL &&
+        ent->heap_idx == (size_t)-1) {
+      continue;
+    }
+    HNode *node = hm_pop(&g_data.db, &ent->node, &hnode_same);
+    assert(node == &ent->node);
+    entry_unlinked(ent);
+    tracking_invalidate(ent->key, NULL);
+    entry_del(ent);
+    g_data.evicted_keys++;
+    return true;
+  }
+  return false;
+}
+
+enum { EVICT_OK = 0, EVICT_RUNNING = 1, EVICT_FAIL = 2 };
+
+// Frees keys until used memory is back under `maxmemory`. Each call is
+// bounded in time; a large overshoot is paid off over several event loop
+// iterations while `g_data.evicting` keeps the poll timeout at zero.
+static int perform_evictions() {
+  g_data.evicting = false;
+  if (!g_config.maxmemory || mem_used() <= g_config.maxmemory) {
+    return EVICT_OK;
+  }
+  if (g_config.maxmemory_policy == EVICT_NOEVICTION) {
+    return EVICT_FAIL;
+  }
+  const uint64_t k_evict_budget_us = 500;
+  uint64_t start_us = get_monotonic_usec();
+  size_t nevicted = 0;
+  int res = EVICT_OK;
+  while (mem_used() > g_config.maxmemory) {
+    if (!evict_one()) {
+      res = EVICT_FAIL;
+      break;
+    }
+    if (++nevicted % 16 == 0 &&
+        get_monotonic_usec() - start_us > k_evict_budget_us) {
+      g_data.evicting = true;
+      res = EVICT_RUNNING;
+      break;
+    }
+  }
+  latency_add(LAT_EVICTION, get_monotonic_usec() - start_us);
+  return res;
 }
 
 static void process_timers() {
@@ -103,30 +586,92 @@ static void process_timers() {
     if (next_us >= now_us + 10000) {
       break;
     }
+    if (next->blocked || conn_subscribed(next)) {
+      // not idle, waiting on the server or for messages
+      dlist_detach(&next->idle_list);
+      next->idle_start = now_us;
+      dlist_insert_before(&g_data.idle_list, &next->idle_list);
+      continue;
+    }
 
-    printf("removing idle connection: %d\n", next->fd);
+    log_verbose("removing idle connection: %d", next->fd);
     conn_done(next);
   }
   const size_t k_max_works = 2000;
   size_t nworks = 0;
+  uint64_t t0 = clock_ticks();
   while (!g_data.heap.empty() && g_data.heap[0].val < now_us) {
     Entry *ent = container_of(g_data.heap[0].ref, Entry, heap_idx);
-    cout << ent->key << endl;
+    log_debug("expired key: %s", ent->key.c_str());
     HNode *node = hm_pop(&g_data.db, &ent->node, &hnode_same);
     assert(node == &ent->node);
+    entry_unlinked(ent);
+    tracking_invalidate(ent->key, NULL);
     entry_del(ent);
+    g_data.expired_keys++;
     if (nworks++ >= k_max_works) {
       // don't stall the server if too many keys are expiring at once
       break;
     }
   }
+  if (nworks) {
+    latency_add_ticks(LAT_EXPIRE_CYCLE, clock_ticks() - t0);
+  }
+}
+
+// the hash table of a value, NULL while it has none
+static HMap *entry_map(Entry *ent) {
+  if (ent->zset) {
+    return &ent->zset->db;
+  }
+  if (ent->hash) {
+    return ent->hash->map;
+  }
+  return ent->set ? ent->set->map : NULL;
+}
+
+// Finishes the resizes that requests left halfway, the key space's first,
+// for up to 1ms: in a loop iteration that ran no command, and every 100ms
+// otherwise. Requests alone move a few nodes each, so a table that went
+// quiet would stay split, and probed twice, indefinitely.
+static void rehash_cron() {
+  bool idle = g_data.total_commands == g_data.rehash_cmds;
+  g_data.rehash_cmds = g_data.total_commands;
+  if (g_data.rehash_keys.empty() && !hm_rehash_pending(&g_data.db)) {
+    return;
+  }
+  if (!idle && g_data.now_us - g_data.rehash_us < 100 * 1000) {
+    return;
+  }
+  g_data.rehash_us = g_data.now_us;
+  uint64_t t0 = clock_ticks();
+  uint64_t deadline = t0 + (uint64_t)(1000 * g_data.ticks_per_us);
+  while (hm_rehash_pending(&g_data.db) && clock_ticks() < deadline) {
+    hm_rehash(&g_data.db, 1000);
+  }
+  while (!g_data.rehash_keys.empty() && clock_ticks() < deadline) {
+    auto it = g_data.rehash_keys.begin();
+    string key = *it;
+    Entry *ent = entry_find(key);
+    HMap *map = ent ? entry_map(ent) : NULL;
+    if (map && hm_rehash_pending(map)) {
+      size_t before = entry_mem(ent);
+      hm_rehash(map, 1000);
+      g_data.used_memory += entry_mem(ent) - before;
+      if (hm_rehash_pending(map)) {
+        continue;
+      }
+    }
+    g_data.rehash_keys.erase(it);
+  }
+  latency_add_ticks(LAT_REHASH, clock_ticks() - t0);
 }
 
 static void fd_set_nb(int fd) {
   errno = 0;
   int flags = fcntl(fd, F_GETFL, 0);
   if (errno) {
-    perror("fcntl error");
+    log_warn("fcntl: %s", strerror(errno));
     return;
   }
 
@@ -139,6 +684,14 @@ static void fd_set_nb(int fd) {
   }
 }
 
+// replies are small and sent whole, Nagle's algorithm only delays them
+static void fd_set_nodelay(int fd) {
+  int val = 1;
+  if (setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &val, sizeof(val)) < 0) {
+    log_warn("setsockopt TCP_NODELAY: %s", strerror(errno));
+  }
+}
+
 static void connection_make(vector<Connection *> &connections,
                             Connection *con) {
   if ((size_t)con->fd >= connections.size()) {
@@ -147,22 +700,8 @@ static void connection_make(vector<Connection *> &connections,
   connections[con->fd] = con;
 }
 
-static int32_t acceptConnection(int fd, vector<Connection *> &connections) {
-  struct sockaddr_in client_addr = {};
-  socklen_t client_addr_len = sizeof(client_addr);
-  // cout << "waiting for client" << endl;
-  int conn_fd = accept(fd, (struct sockaddr *)&client_addr, &client_addr_len);
-  if (conn_fd < 0) {
-    perror("accept");
-  }
-  // cout << "Connection made <" << endl;
-  fd_set_nb(conn_fd);
-  struct Connection *con =
-      (struct Connection *)malloc(sizeof(struct Connection));
-  if (!con) {
-    close(conn_fd);
-    return -1;
-  }
+static Connection *conn_open(int conn_fd, vector<Connection *> &connections) {
+  Connection *con = new Connection();
   con->fd = conn_fd;
   con->state = REQ;
   con->read_size = 0;
@@ -171,35 +710,226 @@ static int32_t acceptConnection(int fd, vector<Connection *> &connections) {
   con->idle_start = get_monotonic_usec();
   dlist_insert_before(&g_data.idle_list, &con->idle_list);
   connection_make(connections, con);
-  cout << "Connection made <" << con->fd << ">" << endl;
-  return 0;
+  g_data.used_memory += sizeof(Connection);
+  g_data.nconnections++;
+  g_data.total_connections++;
+  con->id = g_data.total_connections;
+  log_verbose("accepted connection %d", con->fd);
+  return con;
+}
+
+// accepts per call, so one busy listener cannot starve the other work
+const int32_t k_max_accepts_per_call = 1000;
+
+// Accepts pending connections in a burst, so a connection storm drains the
+// listen queue in a few iterations instead of one connection each.
+// Returns the number accepted.
+static int32_t acceptConnection(int fd, bool tcp,
+                                vector<Connection *> &connections) {
+  int32_t n = 0;
+  while (n < k_max_accepts_per_call) {
+    int conn_fd = accept4(fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (conn_fd < 0) {
+      if (errno == EINTR || errno == ECONNABORTED) {
+        continue;
+      }
+      if (errno != EAGAIN && errno != EWOULDBLOCK) {
+        // e.g. EMFILE: the connection stays queued until an fd is freed
+        log_warn("accept: %s", strerror(errno));
+      }
+      break;
+    }
+    if (tcp) {
+      fd_set_nodelay(conn_fd);
+    }
+    conn_open(conn_fd, connections);
+    n++;
+  }
+  return n;
+}
+
+// Queued output, see Connection::outq. A connection with queued output is
+// in the RES state until all of it, and writeBuf before it, went out.
+
+// buffers per writev
+const size_t k_out_iov = 64;
+// replies queued behind an unsent one before the connection stops running
+// requests until they are out
+const size_t k_out_batch = 64 * 1024;
+
+// a framed reply or message for connections of the protocol
+static PubBuf *pubbuf_new(uint32_t proto, const string &out) {
+  PubBuf *buf = new PubBuf();
+  if (proto == PROTO_NATIVE) {
+    uint32_t len = (uint32_t)out.size();
+    buf->data.append((char *)&len, 4);
+  }
+  buf->data.append(out);
+  size_t bytes = sizeof(PubBuf) + buf->data.capacity();
+  g_data.pubsub_buf_bytes += bytes;
+  g_data.used_memory += bytes;
+  return buf;
+}
+
+// Fills `iov` with the output not sent yet, the rest of writeBuf first.
+// Returns the number of buffers.
+static size_t conn_output_iov(Connection *con, struct iovec *iov,
+                              size_t max) {
+  size_t n = 0;
+  if (con->write_sent < con->write_size) {
+    iov[n].iov_base = &con->writeBuf[con->write_sent];
+    iov[n].iov_len = con->write_size - con->write_sent;
+    n++;
+  }
+  size_t skip = con->outq_sent;
+  for (size_t i = 0; i < con->outq.size() && n < max; i++) {
+    string &data = con->outq[i]->data;
+    iov[n].iov_base = &data[skip];
+    iov[n].iov_len = data.size() - skip;
+    skip = 0;
+    n++;
+  }
+  return n;
+}
+
+// Consumes `n` bytes that were sent. Returns true once everything is out,
+// and the connection goes back to reading requests.
+static bool conn_output_sent(Connection *con, size_t n) {
+  size_t head = min(n, con->write_size - con->write_sent);
+  con->write_sent += head;
+  n -= head;
+  con->outq_bytes -= n;
+  while (n) {
+    PubBuf *buf = con->outq.front();
+    size_t part = min(n, buf->data.size() - con->outq_sent);
+    con->outq_sent += part;
+    n -= part;
+    if (con->outq_sent == buf->data.size()) {
+      con->outq.pop_front();
+      con->outq_sent = 0;
+      pubbuf_release(buf);
+    }
+  }
+  if (con->write_sent < con->write_size || !con->outq.empty()) {
+    return false;
+  }
+  con->state = REQ;
+  con->write_sent = 0;
+  con->write_size = 0;
+  conn_soft_clear(con);
+  return true;
+}
+
+// the output limits that apply, see g_config.output_limits
+static uint32_t conn_class(Connection *con) {
+  return conn_subscribed(con) ? CLIENT_PUBSUB : CLIENT_NORMAL;
+}
+
+// output not sent yet: the reply buffer and the queue behind it
+static size_t conn_output_bytes(Connection *con) {
+  return con->write_size - con->write_sent + con->outq_bytes;
+}
+
+// unparsed requests and commands queued by MULTI
+static size_t conn_input_bytes(Connection *con) {
+  return con->read_size + con->multi_bytes;
+}
+
+// Checked as output is queued, so a subscriber that stopped reading is
+// dropped by a later publish, and by clients_cron while over the soft
+// limit. Replies alone stop at k_out_batch, as the connection stops being
+// read until they are sent, so the normal class has no limits by default.
+static bool conn_over_limit(Connection *con) {
+  const OutputLimit &lim = g_config.output_limits[conn_class(con)];
+  size_t bytes = conn_output_bytes(con);
+  if (lim.hard && bytes > lim.hard) {
+    return true;
+  }
+  if (!lim.soft || bytes <= lim.soft) {
+    conn_soft_clear(con);
+    return false;
+  }
+  if (!con->outq_soft_us) {
+    con->outq_soft_us = g_data.now_us;
+    g_data.soft_limited++;
+  }
+  return g_data.now_us - con->outq_soft_us >= lim.soft_secs * 1000000ull;
+}
+
+// Closes the connections that stayed over their soft output limit with
+// nothing more queued, every 100ms while there are any.
+static void clients_cron() {
+  if (!g_data.soft_limited ||
+      g_data.now_us - g_data.clients_cron_us < 100 * 1000) {
+    return;
+  }
+  g_data.clients_cron_us = g_data.now_us;
+  for (Connection *con : g_data.connections) {
+    if (!con || !con->outq_soft_us || con->state == END ||
+        !conn_over_limit(con)) {
+      continue;
+    }
+    log_verbose("soft output limit reached on connection %d", con->fd);
+    g_data.output_limit_disconnects++;
+    conn_done(con);
+  }
+}
+
+// Queues a buffer behind the connection's unsent output. The event loop
+// starts sending it, except for the connection running the command, whose
+// output goes out once the command returns.
+static void conn_push(Connection *con, PubBuf *buf) {
+  if (con->state == END) {
+    return;
+  }
+  buf->refs++;
+  con->outq.push_back(buf);
+  con->outq_bytes += buf->data.size();
+  if (conn_over_limit(con)) {
+    log_verbose("output limit reached on connection %d", con->fd);
+    g_data.output_limit_disconnects++;
+    con->state = END;
+  } else if (con->state == REQ) {
+    con->state = RES;
+  } else {
+    return; // already sending
+  }
+  if (con != g_data.cur_conn && !con->pending_out) {
+    con->pending_out = true;
+    g_data.pending_out.push_back(con);
+  }
+}
+
+// queues output for this connection only, such as a reply
+static void conn_push_str(Connection *con, const string &out) {
+  PubBuf *buf = pubbuf_new(con->proto, out);
+  buf->refs++;
+  conn_push(con, buf);
+  pubbuf_release(buf);
 }
 
 static bool try_res(Connection *con) {
   ssize_t rv = 0;
   do {
-    ssize_t remain = con->write_size - con->write_sent;
-    rv = write(con->fd, con->writeBuf + con->write_sent, remain);
+    if (con->outq.empty()) {
+      ssize_t remain = con->write_size - con->write_sent;
+      rv = write(con->fd, con->writeBuf + con->write_sent, remain);
+    } else {
+      struct iovec iov[k_out_iov];
+      rv = writev(con->fd, iov, (int)conn_output_iov(con, iov, k_out_iov));
+    }
   } while (rv < 0 && errno == EINTR);
   if (rv < 0 && errno == EAGAIN) {
     // EAGAIN faced
     return false;
   }
   if (rv < 0) {
-    perror("write");
+    log_warn("write: %s", strerror(errno));
     con->state = END;
     return false;
   }
-  con->write_sent += (size_t)rv;
-  assert(con->write_sent <= con->write_size);
-  if (con->write_sent == con->write_size) {
-    con->state = REQ;
-    // cout << "Connection: Req" << endl;
-    con->write_sent = 0;
-    con->write_size = 0;
-    return false;
-  }
-  return true;
+  g_data.net_output_bytes += (size_t)rv;
+  return !conn_output_sent(con, (size_t)rv);
 }
 
 static void HandleRes(Connection *con) {
@@ -209,334 +939,4272 @@ static void HandleRes(Connection *con) {
 
 static unordered_map<string, string> database;
 
-static bool entry_cmp(HNode *lhs, HNode *rhs) {
-  struct Entry *le = container_of(lhs, struct Entry, node);
-  struct Entry *re = container_of(rhs, struct Entry, node);
-  return le->key == re->key && le->type == re->type;
-}
+// Reply encoders. Handlers describe a reply once; the bytes depend on the
+// protocol of the connection being served, see g_data.proto.
 
-static void out_str(string &out, string &val) {
-  out.push_back(SER_STR);
-  uint32_t len = (uint32_t)val.size();
-  out.append((char *)&len, 4);
-  out.append(val);
+static void out_decimal(string &out, char type, int64_t val) {
+  char buf[24];
+  char *end = buf + sizeof(buf);
+  char *p = end;
+  uint64_t v = val < 0 ? 0 - (uint64_t)val : (uint64_t)val;
+  do {
+    *--p = '0' + v % 10;
+    v /= 10;
+  } while (v);
+  if (val < 0) {
+    *--p = '-';
+  }
+  out.push_back(type);
+  out.append(p, end - p);
+  out.append("\r\n", 2);
 }
 
-static void out_str(string &out, char *val, size_t len) {
-  out.push_back(SER_STR);
-  out.append((char *)&len, 4);
+static void out_str(string &out, const char *val, size_t len) {
+  if (g_data.proto == PROTO_NATIVE) {
+    out.push_back(SER_STR);
+    uint32_t len32 = (uint32_t)len;
+    out.append((char *)&len32, 4);
+    out.append(val, len);
+    return;
+  }
+  out_decimal(out, '$', (int64_t)len);
   out.append(val, len);
+  out.append("\r\n", 2);
+}
+
+static void out_str(string &out, const string &val) {
+  out_str(out, val.data(), val.size());
 }
 
 static void out_int(string &out, int64_t val) {
-  out.push_back(SER_INT);
-  out.append((char *)&val, 8);
+  if (g_data.proto == PROTO_NATIVE) {
+    out.push_back(SER_INT);
+    out.append((char *)&val, 8);
+    return;
+  }
+  out_decimal(out, ':', val);
 }
 
-static void out_err(string &out, string &val) {
-  out.push_back(SER_ERR);
-  uint32_t len = (uint32_t)val.size();
-  out.append((char *)&len, 4);
-  out.append(val);
+static void out_dbl(string &out, double val) {
+  if (g_data.proto == PROTO_NATIVE) {
+    out.push_back(SER_DBL);
+    out.append((char *)&val, 8);
+    return;
+  }
+  char buf[32];
+  int n = 0;
+  if (std::isinf(val)) {
+    n = snprintf(buf, sizeof(buf), val > 0 ? "inf" : "-inf");
+  } else {
+    n = snprintf(buf, sizeof(buf), "%.17g", val);
+  }
+  if (g_data.proto == PROTO_RESP3) {
+    out.push_back(',');
+    out.append(buf, n);
+    out.append("\r\n", 2);
+  } else {
+    out_str(out, buf, n);
+  }
 }
 
-static void out_arr(string &out, uint32_t &size) {
-  out.push_back(SER_ARR);
-  cout << size << endl;
-  out.append((char *)&size, 4);
+static void out_nil(string &out) {
+  if (g_data.proto == PROTO_NATIVE) {
+    out.push_back(SER_NIL);
+  } else if (g_data.proto == PROTO_RESP3) {
+    out.append("_\r\n", 3);
+  } else {
+    out.append("$-1\r\n", 5);
+  }
 }
 
-static bool str2int(const std::string &s, int64_t &out) {
-  char *endp = NULL;
-  out = strtoll(s.c_str(), &endp, 10);
-  return endp == s.c_str() + s.size();
+// success without a value: nil natively, +OK for RESP clients
+static void out_ok(string &out) {
+  if (g_data.proto == PROTO_NATIVE) {
+    out.push_back(SER_NIL);
+  } else {
+    out.append("+OK\r\n", 5);
+  }
 }
 
-static bool entry_eq(HNode *lhs, HNode *rhs) {
-  // Make sure the entry are the same
-  struct Entry *le = container_of(lhs, struct Entry, node);
-  struct Entry *re = container_of(rhs, struct Entry, node);
+static void out_err(string &out, const string &val) {
+  if (g_data.proto == PROTO_NATIVE) {
+    out.push_back(SER_ERR);
+    uint32_t len = (uint32_t)val.size();
+    out.append((char *)&len, 4);
+    out.append(val);
+    return;
+  }
+  // RESP errors start with an upper-case code such as ERR or WRONGTYPE
+  size_t code_len = 0;
+  while (code_len < val.size() && isupper((unsigned char)val[code_len])) {
+    code_len++;
+  }
+  out.push_back('-');
+  if (code_len == 0 || (code_len < val.size() && val[code_len] != ' ')) {
+    out.append("ERR ");
+  }
+  for (char c : val) {
+    // a line break would end the error line early
+    out.push_back(c == '\r' || c == '\n' ? ' ' : c);
+  }
+  out.append("\r\n", 2);
+}
+
+static void out_arr(string &out, uint32_t size) {
+  if (g_data.proto == PROTO_NATIVE) {
+    out.push_back(SER_ARR);
+    out.append((char *)&size, 4);
+    return;
+  }
+  out_decimal(out, '*', size);
+}
+
+// a message the server pushes, such as a published one; an array outside
+// RESP3
+static void out_push(string &out, uint32_t size) {
+  if (g_data.proto == PROTO_RESP3) {
+    out_decimal(out, '>', size);
+  } else {
+    out_arr(out, size);
+  }
+}
+
+// a map of `size` key/value pairs; a flat array outside RESP3
+static void out_map(string &out, uint32_t size) {
+  if (g_data.proto == PROTO_RESP3) {
+    out_decimal(out, '%', size);
+  } else {
+    out_arr(out, size * 2);
+  }
+}
+
+// a lookup that found nothing: an error natively, null for RESP clients
+static uint32_t out_not_found(string &out) {
+  if (g_data.proto == PROTO_NATIVE) {
+    string msg = "Not found";
+    out_err(out, msg);
+  } else {
+    out_nil(out);
+  }
+  return RES_NF;
+}
+
+// Arrays whose size is only known at the end. Returns the position of the
+// header, which end_arr fills in.
+static size_t begin_arr(string &out) {
+  size_t pos = out.size();
+  if (g_data.proto == PROTO_NATIVE) {
+    out_arr(out, 0);
+  }
+  return pos;
+}
+
+static void end_arr(string &out, size_t pos, uint32_t len) {
+  if (g_data.proto == PROTO_NATIVE) {
+    memcpy(&out[pos + 1], &len, 4);
+    return;
+  }
+  string header;
+  out_decimal(header, '*', len);
+  out.insert(pos, header);
+}
+
+// frames a reply into the write buffer, the connection then sends it
+static void conn_set_reply(Connection *con, string &out) {
+  if (out.empty()) {
+    return; // the command queued its replies, see pubsub_reply
+  }
+  if (out.size() > MAX_BUF) {
+    out.clear();
+    string msg = "reply exceeds " + to_string(MAX_BUF) + " bytes";
+    out_err(out, msg);
+  }
+  if (con->state != REQ) {
+    // behind the output not sent yet
+    conn_push_str(con, out);
+    return;
+  }
+  if (con->proto == PROTO_NATIVE) {
+    // SIZE_OF_BUF _ TYPE _ LENGTH _ DATA
+    uint32_t wlen = (uint32_t)out.size();
+    memcpy(&con->writeBuf[0], &wlen, 4);
+    memcpy(&con->writeBuf[4], out.data(), out.size());
+    con->write_size = wlen + 4;
+  } else {
+    memcpy(&con->writeBuf[0], out.data(), out.size());
+    con->write_size = out.size();
+  }
+  con->state = RES;
+}
+
+static void bg_init() {
+  g_data.bg_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (g_data.bg_fd < 0) {
+    log_warn("eventfd: %s", strerror(errno));
+  }
+}
+
+// Background jobs are only possible in the server's event loop, and not
+// for a command of a transaction, which runs to completion with the others.
+static bool bg_available() {
+  return g_data.bg_fd >= 0 && g_data.cur_conn && !g_data.in_exec;
+}
+
+// Hands a finished job to the event loop, which runs its `done`, see
+// bg_complete. Called on any thread.
+static void bg_finish(BgJob *job) {
+  pthread_mutex_lock(&g_data.bg_mu);
+  g_data.bg_done.push_back(job);
+  pthread_mutex_unlock(&g_data.bg_mu);
+  uint64_t one = 1;
+  if (write(g_data.bg_fd, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+    log_warn("eventfd write: %s", strerror(errno));
+  }
+}
+
+static void bg_run(void *arg) {
+  BgJob *job = (BgJob *)arg;
+  job->run(job);
+  bg_finish(job);
+}
+
+// runs a job that no connection waits for
+static void bg_queue(BgJob *job) {
+  g_data.bg_jobs++;
+  thread_pool_queue(&g_data.tp, &bg_run, job);
+}
+
+// Runs a job for the command being executed, whose connection waits for
+// the reply that job->done passes to conn_unblock.
+static void bg_submit(BgJob *job) {
+  Connection *con = g_data.cur_conn;
+  con->blocked = true;
+  job->fd = con->fd;
+  job->conn_id = con->id;
+  bg_queue(job);
+}
+
+// The connection a job was submitted for, NULL if it closed meanwhile.
+static Connection *bg_conn(BgJob *job) {
+  if (job->fd < 0 || (size_t)job->fd >= g_data.connections.size()) {
+    return NULL;
+  }
+  Connection *con = g_data.connections[job->fd];
+  return con && con->id == job->conn_id && con->state != END ? con : NULL;
+}
+
+// Queues the reply of a blocked connection's command for the event loop
+// to send, after which the connection continues with its buffered input.
+static void conn_unblock(Connection *con, string &out) {
+  con->blocked = false;
+  // behind output being sent, the reply goes out with it
+  bool sending = con->state != REQ;
+  conn_set_reply(con, out);
+  if (!sending) {
+    con->pending_out = true;
+    g_data.pending_out.push_back(con);
+  }
+}
+
+// Called by the event loop when bg_fd is readable.
+static void bg_complete() {
+  uint64_t n = 0;
+  // reset before taking the queue, a job finishing after it signals again
+  if (read(g_data.bg_fd, &n, sizeof(n)) < 0 && errno != EAGAIN) {
+    log_warn("eventfd read: %s", strerror(errno));
+  }
+  vector<BgJob *> done;
+  pthread_mutex_lock(&g_data.bg_mu);
+  done.swap(g_data.bg_done);
+  pthread_mutex_unlock(&g_data.bg_mu);
+  for (BgJob *job : done) {
+    job->done(job);
+    g_data.bg_jobs--;
+  }
+  if (!done.empty() && g_data.bg_jobs == 0) {
+    // nothing reads the retired buffers anymore, and no entry is shared
+    vector<string>().swap(g_data.bg_retired);
+    g_data.bg_epoch++;
+  }
+}
+
+static bool str2int(const std::string &s, int64_t &out) {
+  char *endp = NULL;
+  out = strtoll(s.c_str(), &endp, 10);
+  return endp == s.c_str() + s.size();
+}
+
+static uint32_t do_expire(std::vector<std::string> &cmd, std::string &out) {
+  int64_t ttl_ms = 0;
+  if (!str2int(cmd[2], ttl_ms)) {
+    string msg = "expect int64";
+    out_err(out, msg);
+    return RES_ERR;
+  }
+
+  Entry *ent = entry_lookup(cmd[1]);
+  if (ent) {
+    entry_set_ttl(ent, ttl_ms);
+  }
+  out_int(out, ent ? 1 : 0);
+  return RES_OK;
+}
+
+static uint32_t do_ttl(std::vector<std::string> &cmd, std::string &out) {
+  Entry *ent = entry_lookup(cmd[1]);
+  if (!ent) {
+    out_int(out, -2);
+    return RES_OK;
+  }
+
+  if (ent->heap_idx == (size_t)-1) {
+    out_int(out, -1);
+    return RES_OK;
+  }
+
+  uint64_t expire_at = g_data.heap[ent->heap_idx].val;
+  uint64_t now_us = get_monotonic_usec();
+  out_int(out, expire_at > now_us ? (expire_at - now_us) / 1000 : 0);
+  return RES_OK;
+}
+
+// subcommands and options are case-insensitive
+static bool arg_is(const string &arg, const char *name) {
+  return strcasecmp(arg.c_str(), name) == 0;
+}
+
+static uint32_t out_wrongtype(string &out) {
+  string msg = "WRONGTYPE Operation against a key holding the wrong kind of value";
+  out_err(out, msg);
+  return RES_ERR;
+}
+
+static uint32_t do_get(vector<string> &cmd, string &out) {
+  Entry *ent = entry_lookup(cmd[1]);
+  if (!ent) {
+    return out_not_found(out);
+  }
+  if (ent->type != T_STR) {
+    return out_wrongtype(out);
+  }
+
+  if (str_len(ent) > MAX_BUF) {
+    // a bitmap, not copied only to be refused by try_req
+    string msg = "reply exceeds " + to_string(MAX_BUF) + " bytes";
+    out_err(out, msg);
+    return RES_ERR;
+  }
+  out_str(out, str_value(ent));
+  return RES_OK;
+}
+
+static uint32_t do_del(vector<string> &cmd, string &out) {
+  Entry *ent = entry_pop(cmd[1]);
+  if (ent) {
+    entry_del(ent);
+  }
+  out_int(out, ent ? 1 : 0);
+  return RES_OK;
+}
+
+static uint32_t do_set(vector<string> &cmd, string &out) {
+  Entry *ent = entry_lookup(cmd[1]);
+  if (ent && ent->type != T_STR) {
+    return out_wrongtype(out);
+  }
+  if (!ent) {
+    ent = entry_new(cmd[1], T_STR);
+  }
+  size_t before = entry_mem(ent);
+  // copied rather than swapped so the arguments stay intact for the slow log
+  str_assign(ent, cmd[2]);
+  g_data.used_memory += entry_mem(ent) - before;
+  out_ok(out);
+  return RES_OK;
+}
+// TYPE - SIZE - DATA
+static void pack_str(HNode *node, void *container) {
+  string &out = *(string *)container;
+  out_str(out, str_value(container_of(node, Entry, node)));
+}
+static uint32_t do_keys(vector<string> &cmd, string &out) {
+  uint32_t size = (uint32_t)hm_size(&g_data.db);
+  out_arr(out, size);
+  h_scan(&g_data.db.ht1, pack_str, &out);
+  h_scan(&g_data.db.ht2, pack_str, &out);
+  return 0;
+}
+
+static uint32_t do_zscore(vector<string> &cmd, string &out) {
+  Entry *ent = entry_lookup(cmd[1]);
+  if (!ent) {
+    return out_not_found(out);
+  }
+  if (ent->type != T_ZSET) {
+    return out_wrongtype(out);
+  }
+
+  string &member = cmd[2];
+  ZNode *znode = zset_lookup(ent->zset, member.data(), member.length());
+  if (!znode) {
+    out_nil(out);
+    return RES_NF;
+  }
+  out_dbl(out, znode->score);
+  return RES_OK;
+}
+
+static uint32_t do_zadd(vector<string> &cmd, string &out) {
+  double score = atof(cmd[2].c_str());
+  Entry *ent = entry_lookup(cmd[1]);
+  if (ent && ent->type != T_ZSET) {
+    return out_wrongtype(out);
+  }
+  if (!ent) {
+    ent = entry_new(cmd[1], T_ZSET);
+  }
+  size_t before = entry_mem(ent);
+  zset_add(ent->zset, cmd[3].data(), cmd[3].length(), score);
+  g_data.used_memory += entry_mem(ent) - before;
+  out_ok(out);
+  return RES_OK;
+}
+
+static uint32_t do_zquery(vector<string> &cmd, string &out) {
+  double score = atof(cmd[2].c_str());
+  string &name = cmd[3];
+  int64_t offset = 0;
+  int64_t limit = 0;
+  if (!str2int(cmd[4], offset) || !str2int(cmd[5], limit)) {
+    string msg = "expect int64";
+    out_err(out, msg);
+    return RES_ERR;
+  }
+  Entry *ent = entry_lookup(cmd[1]);
+  if (!ent) {
+    return out_not_found(out);
+  }
+  if (ent->type != T_ZSET) {
+    return out_wrongtype(out);
+  }
+  ZSet *s = ent->zset;
+  ZNode *znode = zset_query(s, score, name.data(), name.length());
+  znode = znode_offset(znode, offset);
+  size_t arr = begin_arr(out);
+  uint32_t n = 0;
+  while (znode && n < limit) {
+    out_str(out, znode->name, znode->len);
+    out_dbl(out, znode->score);
+    znode = znode_offset(znode, 1);
+    n++;
+  }
+  // a flat list of member, score pairs
+  end_arr(out, arr, 2 * n);
+  return RES_OK;
+}
+
+// Pops up to `count` members from the low (or high) end of a sorted set,
+// adding member, score pairs to `out`. The key goes with the last member.
+static size_t zpop_members(string &key, Entry *ent, bool max, size_t count,
+                           string &out) {
+  ZSet *zset = ent->zset;
+  size_t before = entry_mem(ent);
+  size_t n = 0;
+  while (n < count) {
+    ZNode *node = max ? zset_max(zset) : zset_min(zset);
+    if (!node) {
+      break;
+    }
+    zset_pop(zset, node->name, node->len);
+    out_str(out, node->name, node->len);
+    out_dbl(out, node->score);
+    znode_del(node);
+    n++;
+  }
+  g_data.used_memory += entry_mem(ent) - before;
+  if (hm_size(&zset->db) == 0) {
+    entry_del(entry_pop(key));
+  }
+  return n;
+}
+
+// zpopmin/zpopmax key [count]: a flat list of member, score pairs, lowest
+// (highest) score first, empty for a missing key
+static uint32_t do_zpop(vector<string> &cmd, string &out, bool max) {
+  int64_t count = 1;
+  if (cmd.size() > 3) {
+    string msg = "ERR syntax error";
+    out_err(out, msg);
+    return RES_ERR;
+  }
+  if (cmd.size() == 3 && (!str2int(cmd[2], count) || count < 0)) {
+    string msg = "ERR value is out of range, must be positive";
+    out_err(out, msg);
+    return RES_ERR;
+  }
+  Entry *ent = entry_lookup(cmd[1]);
+  if (ent && ent->type != T_ZSET) {
+    return out_wrongtype(out);
+  }
+  size_t arr = begin_arr(out);
+  size_t n = ent ? zpop_members(cmd[1], ent, max, (size_t)count, out) : 0;
+  end_arr(out, arr, 2 * (uint32_t)n);
+  return RES_OK;
+}
+
+static uint32_t do_zpopmin(vector<string> &cmd, string &out) {
+  return do_zpop(cmd, out, false);
+}
+
+static uint32_t do_zpopmax(vector<string> &cmd, string &out) {
+  return do_zpop(cmd, out, true);
+}
+
+// the reply of BZPOPMIN/BZPOPMAX: [key, member, score]. Popping for a
+// waiter is a write of its own, outside cmd_call.
+static void bzpop_reply(string &key, Entry *ent, bool max, string &out,
+                        Connection *by) {
+  ent->version = ++g_data.key_version;
+  tracking_invalidate(key, by);
+  out_arr(out, 3);
+  out_str(out, key);
+  zpop_members(key, ent, max, 1, out);
+}
+
+// a timed out BZPOPMIN/BZPOPMAX, a null array as in Redis
+static void bzpop_out_nil(string &out) {
+  if (g_data.proto == PROTO_RESP2) {
+    out.append("*-1\r\n");
+  } else {
+    out_nil(out);
+  }
+}
+
+// bzpopmin/bzpopmax key [key ...] timeout: pops from the first key with
+// members. If none has any, the connection blocks until a write gives one
+// of them members, or for `timeout` seconds (0 is forever) and then gets
+// nil. Inside EXEC it does not block.
+static uint32_t do_bzpop(vector<string> &cmd, string &out, bool max) {
+  const string &arg = cmd.back();
+  char *end = NULL;
+  double timeout = strtod(arg.c_str(), &end);
+  if (arg.empty() || end != arg.c_str() + arg.size() ||
+      !(fabs(timeout) <= 1e9)) {
+    string msg = "ERR timeout is not a float or out of range";
+    out_err(out, msg);
+    return RES_ERR;
+  }
+  if (timeout < 0) {
+    string msg = "ERR timeout is negative";
+    out_err(out, msg);
+    return RES_ERR;
+  }
+  size_t nkeys = cmd.size() - 2;
+  for (size_t i = 1; i <= nkeys; i++) {
+    Entry *ent = entry_lookup(cmd[i]);
+    if (ent && ent->type != T_ZSET) {
+      return out_wrongtype(out);
+    }
+    if (ent) {
+      bzpop_reply(cmd[i], ent, max, out, g_data.cur_conn);
+      return RES_OK;
+    }
+  }
+  Connection *con = g_data.cur_conn;
+  if (!con || g_data.in_exec) {
+    bzpop_out_nil(out);
+    return RES_NF;
+  }
+  con->blocked = true;
+  con->bzpop_max = max;
+  for (size_t i = 1; i <= nkeys; i++) {
+    vector<string> &keys = con->bzpop_keys;
+    if (find(keys.begin(), keys.end(), cmd[i]) == keys.end()) {
+      keys.push_back(cmd[i]);
+      g_data.bzpop_waiters[cmd[i]].push_back(con);
+    }
+  }
+  if (timeout > 0) {
+    HeapItem item;
+    item.ref = &con->bzpop_heap_idx;
+    item.val = get_monotonic_usec() + (uint64_t)(timeout * 1e6);
+    g_data.bzpop_heap.push_back(item);
+    size_t pos = g_data.bzpop_heap.size() - 1;
+    heap_update(g_data.bzpop_heap.data(), pos, g_data.bzpop_heap.size());
+  }
+  g_data.blocked_clients++;
+  return RES_OK;
+}
+
+static uint32_t do_bzpopmin(vector<string> &cmd, string &out) {
+  return do_bzpop(cmd, out, false);
+}
+
+static uint32_t do_bzpopmax(vector<string> &cmd, string &out) {
+  return do_bzpop(cmd, out, true);
+}
+
+// Hands members of the keys written by the last command, or by all of
+// EXEC, to the connections waiting on them, the longest waiting first.
+// Each wakeup is a pop from the front of the key's queue.
+static void bzpop_serve() {
+  vector<string> keys;
+  keys.swap(g_data.bzpop_ready);
+  uint32_t proto = g_data.proto;
+  for (string &key : keys) {
+    while (true) {
+      auto it = g_data.bzpop_waiters.find(key);
+      Entry *ent = entry_find(key);
+      if (it == g_data.bzpop_waiters.end() || !ent ||
+          ent->type != T_ZSET) {
+        break;
+      }
+      Connection *con = it->second.front();
+      bzpop_unwait(con);
+      string out;
+      g_data.proto = con->proto;
+      bzpop_reply(key, ent, con->bzpop_max, out, con);
+      g_data.proto = proto;
+      conn_unblock(con, out);
+    }
+  }
+}
+
+// Times out the waits due within a millisecond, next_timer_ms rounds down.
+// Called by the event loop before it sends the pending replies.
+static void bzpop_expire() {
+  uint64_t now_us = get_monotonic_usec();
+  vector<HeapItem> &heap = g_data.bzpop_heap;
+  while (!heap.empty() && heap[0].val <= now_us + 1000) {
+    Connection *con = container_of(heap[0].ref, Connection, bzpop_heap_idx);
+    bzpop_unwait(con);
+    string out;
+    g_data.proto = con->proto;
+    bzpop_out_nil(out);
+    g_data.proto = PROTO_NATIVE;
+    conn_unblock(con, out);
+  }
+}
+
+// total members from which ZUNIONSTORE/ZINTERSTORE use the thread pool
+const size_t k_zmerge_par_members = 64 * 1024;
+// partitions of a parallel merge, a few per thread to even out the work
+const uint32_t k_zmerge_parts = 16;
+
+static void zmerge_part_run(void *arg, size_t part) {
+  zmerge_part((ZMerge *)arg, (uint32_t)part);
+}
+
+// ZUNIONSTORE/ZINTERSTORE dest numkeys key [key ...] [WEIGHTS w [w ...]]
+// [AGGREGATE SUM|MIN|MAX]. A large merge is split over the thread pool
+// while the event loop waits, so the sources cannot change under it.
+static uint32_t zmerge_store(vector<string> &cmd, string &out, bool inter) {
+  int64_t nkeys = 0;
+  if (!str2int(cmd[2], nkeys) || nkeys < 1) {
+    string msg = "ERR at least 1 input key is needed for '" + cmd[0] +
+                 "' command";
+    out_err(out, msg);
+    return RES_ERR;
+  }
+  ZMerge m;
+  m.inter = inter;
+  size_t first = 3;
+  size_t rest = first + (size_t)nkeys;
+  bool ok = rest <= cmd.size();
+  m.weights.assign(ok ? (size_t)nkeys : 0, 1.0);
+  while (ok && rest < cmd.size()) {
+    if (arg_is(cmd[rest], "weights") && rest + nkeys < cmd.size()) {
+      for (size_t i = 0; i < (size_t)nkeys; i++) {
+        const string &w = cmd[rest + 1 + i];
+        char *end = NULL;
+        m.weights[i] = strtod(w.c_str(), &end);
+        if (w.empty() || end != w.c_str() + w.size() ||
+            std::isnan(m.weights[i])) {
+          string msg = "ERR weight value is not a float";
+          out_err(out, msg);
+          return RES_ERR;
+        }
+      }
+      rest += 1 + (size_t)nkeys;
+    } else if (arg_is(cmd[rest], "aggregate") && rest + 1 < cmd.size()) {
+      const string &agg = cmd[rest + 1];
+      if (arg_is(agg, "sum")) {
+        m.agg = ZAGG_SUM;
+      } else if (arg_is(agg, "min")) {
+        m.agg = ZAGG_MIN;
+      } else if (arg_is(agg, "max")) {
+        m.agg = ZAGG_MAX;
+      } else {
+        ok = false;
+      }
+      rest += 2;
+    } else {
+      ok = false;
+    }
+  }
+  if (!ok) {
+    string msg = "ERR syntax error";
+    out_err(out, msg);
+    return RES_ERR;
+  }
+  size_t total = 0;
+  for (size_t i = first; i < first + (size_t)nkeys; i++) {
+    Entry *ent = entry_lookup(cmd[i]);
+    if (ent && ent->type != T_ZSET) {
+      return out_wrongtype(out);
+    }
+    m.srcs.push_back(ent ? ent->zset : NULL);
+    total += ent ? hm_size(&ent->zset->db) : 0;
+  }
+
+  m.nparts = total >= k_zmerge_par_members ? k_zmerge_parts : 1;
+  zmerge_init(&m);
+  if (m.nparts > 1) {
+    thread_pool_run(&g_data.tp, &zmerge_part_run, &m, m.nparts);
+  } else {
+    zmerge_part(&m, 0);
+  }
+
+  // the sources were only read until here; dest may be one of them
+  Entry *dest = entry_pop(cmd[1]);
+  if (dest) {
+    entry_del(dest);
+  }
+  size_t n = zmerge_size(&m);
+  if (n) {
+    dest = entry_new(cmd[1], T_ZSET);
+    size_t before = entry_mem(dest);
+    zmerge_finish(&m, dest->zset);
+    g_data.used_memory += entry_mem(dest) - before;
+  }
+  out_int(out, (int64_t)n);
+  return RES_OK;
+}
+
+static uint32_t do_zunionstore(vector<string> &cmd, string &out) {
+  return zmerge_store(cmd, out, false);
+}
+
+static uint32_t do_zinterstore(vector<string> &cmd, string &out) {
+  return zmerge_store(cmd, out, true);
+}
+
+static HObjLimits hash_limits() {
+  HObjLimits limits;
+  limits.max_entries = g_config.hash_max_listpack_entries;
+  limits.max_value = g_config.hash_max_listpack_value;
+  return limits;
+}
+
+// hset key field value [field value ...]
+static uint32_t do_hset(vector<string> &cmd, string &out) {
+  if (cmd.size() % 2 != 0) {
+    string msg = "ERR wrong number of arguments for 'hset' command";
+    out_err(out, msg);
+    return RES_ERR;
+  }
+  Entry *ent = entry_lookup(cmd[1]);
+  if (ent && ent->type != T_HASH) {
+    return out_wrongtype(out);
+  }
+  if (!ent) {
+    ent = entry_new(cmd[1], T_HASH);
+  }
+  HObjLimits limits = hash_limits();
+  size_t before = entry_mem(ent);
+  int64_t added = 0;
+  for (size_t i = 2; i < cmd.size(); i += 2) {
+    added += hobj_set(ent->hash, cmd[i].data(), cmd[i].size(),
+                      cmd[i + 1].data(), cmd[i + 1].size(), limits);
+  }
+  g_data.used_memory += entry_mem(ent) - before;
+  out_int(out, added);
+  return RES_OK;
+}
+
+static uint32_t do_hget(vector<string> &cmd, string &out) {
+  Entry *ent = entry_lookup(cmd[1]);
+  if (!ent) {
+    return out_not_found(out);
+  }
+  if (ent->type != T_HASH) {
+    return out_wrongtype(out);
+  }
+  const char *val = NULL;
+  size_t len = 0;
+  if (!hobj_get(ent->hash, cmd[2].data(), cmd[2].size(), &val, &len)) {
+    out_nil(out);
+    return RES_NF;
+  }
+  out_str(out, val, len);
+  return RES_OK;
+}
+
+// a nil for each missing field, or for all of them if the key is missing
+static uint32_t do_hmget(vector<string> &cmd, string &out) {
+  Entry *ent = entry_lookup(cmd[1]);
+  if (ent && ent->type != T_HASH) {
+    return out_wrongtype(out);
+  }
+  out_arr(out, (uint32_t)(cmd.size() - 2));
+  for (size_t i = 2; i < cmd.size(); i++) {
+    const char *val = NULL;
+    size_t len = 0;
+    if (ent && hobj_get(ent->hash, cmd[i].data(), cmd[i].size(), &val, &len)) {
+      out_str(out, val, len);
+    } else {
+      out_nil(out);
+    }
+  }
+  return RES_OK;
+}
+
+static void pack_field(const char *field, size_t flen, const char *val,
+                       size_t vlen, void *arg) {
+  string &out = *(string *)arg;
+  out_str(out, field, flen);
+  out_str(out, val, vlen);
+}
+
+static uint32_t do_hgetall(vector<string> &cmd, string &out) {
+  Entry *ent = entry_lookup(cmd[1]);
+  if (ent && ent->type != T_HASH) {
+    return out_wrongtype(out);
+  }
+  if (!ent) {
+    out_map(out, 0);
+    return RES_OK;
+  }
+  out_map(out, (uint32_t)hobj_size(ent->hash));
+  hobj_scan(ent->hash, &pack_field, &out);
+  return RES_OK;
+}
+
+// the key is removed with its last field
+static uint32_t do_hdel(vector<string> &cmd, string &out) {
+  Entry *ent = entry_lookup(cmd[1]);
+  if (ent && ent->type != T_HASH) {
+    return out_wrongtype(out);
+  }
+  int64_t removed = 0;
+  if (ent) {
+    size_t before = entry_mem(ent);
+    for (size_t i = 2; i < cmd.size(); i++) {
+      removed += hobj_del(ent->hash, cmd[i].data(), cmd[i].size());
+    }
+    g_data.used_memory += entry_mem(ent) - before;
+    if (hobj_size(ent->hash) == 0) {
+      entry_del(entry_pop(cmd[1]));
+    }
+  }
+  out_int(out, removed);
+  return RES_OK;
+}
+
+static uint32_t do_hlen(vector<string> &cmd, string &out) {
+  Entry *ent = entry_lookup(cmd[1]);
+  if (ent && ent->type != T_HASH) {
+    return out_wrongtype(out);
+  }
+  out_int(out, ent ? (int64_t)hobj_size(ent->hash) : 0);
+  return RES_OK;
+}
+
+// lpush/rpush key value [value ...], returns the new length
+static uint32_t do_push(vector<string> &cmd, string &out, bool front) {
+  Entry *ent = entry_lookup(cmd[1]);
+  if (ent && ent->type != T_LIST) {
+    return out_wrongtype(out);
+  }
+  if (!ent) {
+    ent = entry_new(cmd[1], T_LIST);
+  }
+  size_t before = entry_mem(ent);
+  for (size_t i = 2; i < cmd.size(); i++) {
+    ql_push(ent->list, front, cmd[i].data(), cmd[i].size());
+  }
+  g_data.used_memory += entry_mem(ent) - before;
+  out_int(out, (int64_t)ql_size(ent->list));
+  return RES_OK;
+}
+
+static uint32_t do_lpush(vector<string> &cmd, string &out) {
+  return do_push(cmd, out, true);
+}
+
+static uint32_t do_rpush(vector<string> &cmd, string &out) {
+  return do_push(cmd, out, false);
+}
+
+// lpop/rpop key [count]: one element, or an array of up to `count`. The key
+// goes with the last element.
+static uint32_t do_pop(vector<string> &cmd, string &out, bool front) {
+  int64_t count = 1;
+  if (cmd.size() > 3) {
+    string msg = "ERR syntax error";
+    out_err(out, msg);
+    return RES_ERR;
+  }
+  if (cmd.size() == 3 && (!str2int(cmd[2], count) || count < 0)) {
+    string msg = "ERR value is out of range, must be positive";
+    out_err(out, msg);
+    return RES_ERR;
+  }
+  Entry *ent = entry_lookup(cmd[1]);
+  if (ent && ent->type != T_LIST) {
+    return out_wrongtype(out);
+  }
+  if (!ent) {
+    out_nil(out);
+    return RES_NF;
+  }
+  size_t before = entry_mem(ent);
+  string val;
+  if (cmd.size() == 2) {
+    ql_pop(ent->list, front, val);
+    out_str(out, val);
+  } else {
+    size_t n = min((size_t)count, ql_size(ent->list));
+    out_arr(out, (uint32_t)n);
+    for (size_t i = 0; i < n; i++) {
+      ql_pop(ent->list, front, val);
+      out_str(out, val);
+    }
+  }
+  g_data.used_memory += entry_mem(ent) - before;
+  if (ql_size(ent->list) == 0) {
+    entry_del(entry_pop(cmd[1]));
+  }
+  return RES_OK;
+}
+
+static uint32_t do_lpop(vector<string> &cmd, string &out) {
+  return do_pop(cmd, out, true);
+}
+
+static uint32_t do_rpop(vector<string> &cmd, string &out) {
+  return do_pop(cmd, out, false);
+}
+
+// negative indexes count from the back, -1 being the last element
+static int64_t list_index(int64_t idx, size_t size) {
+  return idx < 0 ? idx + (int64_t)size : idx;
+}
+
+static uint32_t do_lrange(vector<string> &cmd, string &out) {
+  int64_t start = 0;
+  int64_t stop = 0;
+  if (!str2int(cmd[2], start) || !str2int(cmd[3], stop)) {
+    string msg = "expect int64";
+    out_err(out, msg);
+    return RES_ERR;
+  }
+  Entry *ent = entry_lookup(cmd[1]);
+  if (ent && ent->type != T_LIST) {
+    return out_wrongtype(out);
+  }
+  size_t size = ent ? ql_size(ent->list) : 0;
+  start = max(list_index(start, size), (int64_t)0);
+  stop = min(list_index(stop, size), (int64_t)size - 1);
+  if (start > stop) {
+    out_arr(out, 0);
+    return RES_OK;
+  }
+  out_arr(out, (uint32_t)(stop - start + 1));
+  QIter it;
+  ql_seek(ent->list, (size_t)start, &it);
+  const char *data = NULL;
+  size_t len = 0;
+  for (int64_t i = start; i <= stop; i++) {
+    ql_next(ent->list, &it, &data, &len);
+    out_str(out, data, len);
+  }
+  return RES_OK;
+}
+
+static uint32_t do_llen(vector<string> &cmd, string &out) {
+  Entry *ent = entry_lookup(cmd[1]);
+  if (ent && ent->type != T_LIST) {
+    return out_wrongtype(out);
+  }
+  out_int(out, ent ? (int64_t)ql_size(ent->list) : 0);
+  return RES_OK;
+}
+
+static uint32_t do_lindex(vector<string> &cmd, string &out) {
+  int64_t idx = 0;
+  if (!str2int(cmd[2], idx)) {
+    string msg = "expect int64";
+    out_err(out, msg);
+    return RES_ERR;
+  }
+  Entry *ent = entry_lookup(cmd[1]);
+  if (!ent) {
+    return out_not_found(out);
+  }
+  if (ent->type != T_LIST) {
+    return out_wrongtype(out);
+  }
+  idx = list_index(idx, ql_size(ent->list));
+  QIter it;
+  const char *data = NULL;
+  size_t len = 0;
+  if (idx < 0 || !ql_seek(ent->list, (size_t)idx, &it)) {
+    out_nil(out);
+    return RES_NF;
+  }
+  ql_next(ent->list, &it, &data, &len);
+  out_str(out, data, len);
+  return RES_OK;
+}
+
+// sadd key member [member ...], returns how many were new
+static uint32_t do_sadd(vector<string> &cmd, string &out) {
+  Entry *ent = entry_lookup(cmd[1]);
+  if (ent && ent->type != T_SET) {
+    return out_wrongtype(out);
+  }
+  if (!ent) {
+    ent = entry_new(cmd[1], T_SET);
+  }
+  size_t before = entry_mem(ent);
+  size_t added = sobj_add(ent->set, &cmd[2], cmd.size() - 2,
+                          g_config.set_max_intset_entries);
+  g_data.used_memory += entry_mem(ent) - before;
+  out_int(out, (int64_t)added);
+  return RES_OK;
+}
+
+// the key is removed with its last member
+static uint32_t do_srem(vector<string> &cmd, string &out) {
+  Entry *ent = entry_lookup(cmd[1]);
+  if (ent && ent->type != T_SET) {
+    return out_wrongtype(out);
+  }
+  int64_t removed = 0;
+  if (ent) {
+    size_t before = entry_mem(ent);
+    for (size_t i = 2; i < cmd.size(); i++) {
+      removed += sobj_del(ent->set, cmd[i].data(), cmd[i].size());
+    }
+    g_data.used_memory += entry_mem(ent) - before;
+    if (sobj_size(ent->set) == 0) {
+      entry_del(entry_pop(cmd[1]));
+    }
+  }
+  out_int(out, removed);
+  return RES_OK;
+}
+
+static uint32_t do_sismember(vector<string> &cmd, string &out) {
+  Entry *ent = entry_lookup(cmd[1]);
+  if (ent && ent->type != T_SET) {
+    return out_wrongtype(out);
+  }
+  out_int(out, ent && sobj_has(ent->set, cmd[2].data(), cmd[2].size()));
+  return RES_OK;
+}
+
+static uint32_t do_scard(vector<string> &cmd, string &out) {
+  Entry *ent = entry_lookup(cmd[1]);
+  if (ent && ent->type != T_SET) {
+    return out_wrongtype(out);
+  }
+  out_int(out, ent ? (int64_t)sobj_size(ent->set) : 0);
+  return RES_OK;
+}
+
+// Looks up the sets named by cmd[first...]. A missing key is an empty set
+// and comes back as NULL. False after replying if a key has another type.
+static bool lookup_sets(vector<string> &cmd, size_t first, size_t last,
+                        vector<SObj *> &sets, string &out) {
+  for (size_t i = first; i < last; i++) {
+    Entry *ent = entry_lookup(cmd[i]);
+    if (ent && ent->type != T_SET) {
+      out_wrongtype(out);
+      return false;
+    }
+    sets.push_back(ent ? ent->set : NULL);
+  }
+  return true;
+}
+
+static bool all_intsets(const vector<SObj *> &sets) {
+  for (SObj *set : sets) {
+    if (set && set->map) {
+      return false;
+    }
+  }
+  return true;
+}
+
+static void out_ints(string &out, const int64_t *vals, size_t n) {
+  out_arr(out, (uint32_t)n);
+  for (size_t i = 0; i < n; i++) {
+    string s = to_string(vals[i]);
+    out_str(out, s);
+  }
+}
+
+// Intersects integer sets, smallest first so that each step is bounded
+// by the running result. The result is then cut to `limit`, 0 is no
+// limit: the kernels intersect whole sets, so it saves no work.
+static void sinter_ints(vector<SObj *> &sets, vector<int64_t> &res,
+                        size_t limit) {
+  sort(sets.begin(), sets.end(), [](SObj *a, SObj *b) {
+    return a->ints.size() < b->ints.size();
+  });
+  if (sets.size() == 1) {
+    res = sets[0]->ints;
+  } else {
+    vector<int64_t> &a = sets[0]->ints;
+    vector<int64_t> &b = sets[1]->ints;
+    res.resize(a.size());
+    res.resize(intset_intersect(a.data(), a.size(), b.data(), b.size(),
+                                res.data()));
+    vector<int64_t> tmp;
+    for (size_t i = 2; i < sets.size() && !res.empty(); i++) {
+      vector<int64_t> &c = sets[i]->ints;
+      tmp.resize(res.size());
+      tmp.resize(intset_intersect(res.data(), res.size(), c.data(),
+                                  c.size(), tmp.data()));
+      res.swap(tmp);
+    }
+  }
+  if (limit && res.size() > limit) {
+    res.resize(limit);
+  }
+}
+
+struct SetScan {
+  vector<SObj *> *others = NULL;
+  bool want_in = true; // keep members in all others, or in none of them
+  string *out = NULL;  // NULL to only count
+  size_t count = 0;
+  size_t limit = 0;
+};
+
+static void set_filter(const char *name, size_t len, void *arg) {
+  SetScan *scan = (SetScan *)arg;
+  if (scan->limit && scan->count >= scan->limit) {
+    return;
+  }
+  for (SObj *set : *scan->others) {
+    bool in = set && sobj_has(set, name, len);
+    if (in != scan->want_in) {
+      return;
+    }
+  }
+  if (scan->out) {
+    out_str(*scan->out, name, len);
+  }
+  scan->count++;
+}
+
+// members of sets[0] kept or dropped by their presence in the others
+static size_t set_filter_all(vector<SObj *> &sets, bool want_in, string *out,
+                             size_t limit) {
+  vector<SObj *> others(sets.begin() + 1, sets.end());
+  SetScan scan;
+  scan.others = &others;
+  scan.want_in = want_in;
+  scan.out = out;
+  scan.limit = limit;
+  size_t pos = out ? begin_arr(*out) : 0;
+  if (sets[0]) {
+    sobj_scan(sets[0], &set_filter, &scan);
+  }
+  if (out) {
+    end_arr(*out, pos, (uint32_t)scan.count);
+  }
+  return scan.count;
+}
+
+static bool has_missing(const vector<SObj *> &sets) {
+  return find(sets.begin(), sets.end(), (SObj *)NULL) != sets.end();
+}
+
+static uint32_t do_sinter(vector<string> &cmd, string &out) {
+  vector<SObj *> sets;
+  if (!lookup_sets(cmd, 1, cmd.size(), sets, out)) {
+    return RES_ERR;
+  }
+  if (has_missing(sets)) {
+    out_arr(out, 0);
+  } else if (all_intsets(sets)) {
+    vector<int64_t> res;
+    sinter_ints(sets, res, 0);
+    out_ints(out, res.data(), res.size());
+  } else {
+    sort(sets.begin(), sets.end(), [](SObj *a, SObj *b) {
+      return sobj_size(a) < sobj_size(b);
+    });
+    set_filter_all(sets, true, &out, 0);
+  }
+  return RES_OK;
+}
+
+// sintercard numkeys key [key ...] [limit n]: the size of the intersection
+static uint32_t do_sintercard(vector<string> &cmd, string &out) {
+  int64_t nkeys = 0;
+  int64_t limit = 0;
+  bool ok = str2int(cmd[1], nkeys) && nkeys > 0 &&
+            (size_t)nkeys + 2 <= cmd.size();
+  size_t rest = ok ? 2 + (size_t)nkeys : 0;
+  if (ok && rest < cmd.size()) {
+    ok = rest + 2 == cmd.size() && arg_is(cmd[rest], "limit") &&
+         str2int(cmd[rest + 1], limit) && limit >= 0;
+  }
+  if (!ok) {
+    string msg = "ERR syntax error";
+    out_err(out, msg);
+    return RES_ERR;
+  }
+  vector<SObj *> sets;
+  if (!lookup_sets(cmd, 2, rest, sets, out)) {
+    return RES_ERR;
+  }
+  size_t n = 0;
+  if (has_missing(sets)) {
+    n = 0;
+  } else if (all_intsets(sets)) {
+    vector<int64_t> res;
+    sinter_ints(sets, res, (size_t)limit);
+    n = res.size();
+  } else {
+    sort(sets.begin(), sets.end(), [](SObj *a, SObj *b) {
+      return sobj_size(a) < sobj_size(b);
+    });
+    n = set_filter_all(sets, true, NULL, (size_t)limit);
+  }
+  out_int(out, (int64_t)n);
+  return RES_OK;
+}
+
+static void add_member(const char *name, size_t len, void *arg) {
+  string member(name, len);
+  sobj_add((SObj *)arg, &member, 1, 0);
+}
+
+static void pack_member(const char *name, size_t len, void *arg) {
+  out_str(*(string *)arg, name, len);
+}
+
+static uint32_t do_sunion(vector<string> &cmd, string &out) {
+  vector<SObj *> sets;
+  if (!lookup_sets(cmd, 1, cmd.size(), sets, out)) {
+    return RES_ERR;
+  }
+  if (all_intsets(sets)) {
+    vector<int64_t> res, tmp;
+    for (SObj *set : sets) {
+      if (!set) {
+        continue;
+      }
+      tmp.clear();
+      set_union(res.begin(), res.end(), set->ints.begin(), set->ints.end(),
+                back_inserter(tmp));
+      res.swap(tmp);
+    }
+    out_ints(out, res.data(), res.size());
+    return RES_OK;
+  }
+  SObj all;
+  for (SObj *set : sets) {
+    if (set) {
+      sobj_scan(set, &add_member, &all);
+    }
+  }
+  out_arr(out, (uint32_t)sobj_size(&all));
+  sobj_scan(&all, &pack_member, &out);
+  sobj_dispose(&all);
+  return RES_OK;
+}
+
+static uint32_t do_sdiff(vector<string> &cmd, string &out) {
+  vector<SObj *> sets;
+  if (!lookup_sets(cmd, 1, cmd.size(), sets, out)) {
+    return RES_ERR;
+  }
+  if (sets[0] && all_intsets(sets)) {
+    vector<int64_t> res = sets[0]->ints;
+    vector<int64_t> tmp;
+    for (size_t i = 1; i < sets.size() && !res.empty(); i++) {
+      if (!sets[i]) {
+        continue;
+      }
+      tmp.clear();
+      set_difference(res.begin(), res.end(), sets[i]->ints.begin(),
+                     sets[i]->ints.end(), back_inserter(tmp));
+      res.swap(tmp);
+    }
+    out_ints(out, res.data(), res.size());
+    return RES_OK;
+  }
+  set_filter_all(sets, false, &out, 0);
+  return RES_OK;
+}
+
+static uint32_t do_smembers(vector<string> &cmd, string &out) {
+  Entry *ent = entry_lookup(cmd[1]);
+  if (ent && ent->type != T_SET) {
+    return out_wrongtype(out);
+  }
+  out_arr(out, ent ? (uint32_t)sobj_size(ent->set) : 0);
+  if (ent) {
+    sobj_scan(ent->set, &pack_member, &out);
+  }
+  return RES_OK;
+}
+
+// Bitmaps are string values addressed by bit, bit 0 being the most
+// significant bit of the first byte. Up to 2^32 bits, as in Redis.
+const uint64_t k_max_bit_offset = (1ull << 32) - 1;
+
+// A string key, NULL if missing, with its bytes in `val`. False after
+// replying for another type.
+static bool lookup_str(string &key, Entry *&ent, string &out) {
+  ent = entry_lookup(key);
+  if (ent && ent->type != T_STR) {
+    out_wrongtype(out);
+    return false;
+  }
+  if (ent) {
+    str_decode(ent);
+  }
+  return true;
+}
+
+static bool parse_bit_offset(const string &arg, uint64_t &off, string &out) {
+  int64_t val = 0;
+  if (!str2int(arg, val) || val < 0 || (uint64_t)val > k_max_bit_offset) {
+    string msg = "ERR bit offset is not an integer or out of range";
+    out_err(out, msg);
+    return false;
+  }
+  off = (uint64_t)val;
+  return true;
+}
+
+static bool parse_bit(const string &arg, int &bit, string &out) {
+  int64_t val = 0;
+  if (!str2int(arg, val) || (val != 0 && val != 1)) {
+    string msg = "ERR bit is not an integer or out of range";
+    out_err(out, msg);
+    return false;
+  }
+  bit = (int)val;
+  return true;
+}
+
+// Reads the optional `start end [BYTE]` at cmd[first...] as the byte range
+// [start, end) of a string of `len` bytes. Negative indexes count from the
+// end; the range may come out empty. BIT ranges are not supported.
+static bool parse_byte_range(vector<string> &cmd, size_t first, size_t len,
+                             size_t &start, size_t &end, string &out) {
+  int64_t lo = 0;
+  int64_t hi = -1;
+  bool ok = true;
+  if (cmd.size() > first) {
+    ok = str2int(cmd[first], lo);
+  }
+  if (ok && cmd.size() > first + 1) {
+    ok = str2int(cmd[first + 1], hi);
+  }
+  if (!ok) {
+    string msg = "ERR value is not an integer or out of range";
+    out_err(out, msg);
+    return false;
+  }
+  if (cmd.size() > first + 3 ||
+      (cmd.size() == first + 3 && !arg_is(cmd[first + 2], "byte"))) {
+    string msg = "ERR syntax error";
+    out_err(out, msg);
+    return false;
+  }
+  int64_t n = (int64_t)len;
+  lo = lo < 0 ? max(lo + n, (int64_t)0) : lo;
+  hi = hi < 0 ? hi + n : min(hi, n - 1);
+  start = end = 0;
+  if (lo <= hi) {
+    start = (size_t)lo;
+    end = (size_t)hi + 1;
+  }
+  return true;
+}
+
+// setbit key offset 0|1, returns the previous bit. The string is extended
+// with zeros up to the offset.
+static uint32_t do_setbit(vector<string> &cmd, string &out) {
+  uint64_t off = 0;
+  int bit = 0;
+  Entry *ent = NULL;
+  if (!parse_bit_offset(cmd[2], off, out) || !parse_bit(cmd[3], bit, out) ||
+      !lookup_str(cmd[1], ent, out)) {
+    return RES_ERR;
+  }
+  if (!ent) {
+    ent = entry_new(cmd[1], T_STR);
+  }
+  size_t before = entry_mem(ent);
+  entry_unshare(ent, true);
+  size_t idx = (size_t)(off >> 3);
+  if (ent->val.size() <= idx) {
+    ent->val.resize(idx + 1);
+  }
+  uint8_t mask = (uint8_t)(0x80 >> (off & 7));
+  uint8_t &byte = (uint8_t &)ent->val[idx];
+  int old = (byte & mask) != 0;
+  byte = bit ? byte | mask : byte & ~mask;
+  g_data.used_memory += entry_mem(ent) - before;
+  out_int(out, old);
+  return RES_OK;
+}
+
+// getbit key offset, 0 past the end of the string or for a missing key
+static uint32_t do_getbit(vector<string> &cmd, string &out) {
+  uint64_t off = 0;
+  Entry *ent = NULL;
+  if (!parse_bit_offset(cmd[2], off, out) || !lookup_str(cmd[1], ent, out)) {
+    return RES_ERR;
+  }
+  size_t idx = (size_t)(off >> 3);
+  int bit = 0;
+  if (ent && idx < ent->val.size()) {
+    bit = (uint8_t)ent->val[idx] >> (7 - (off & 7)) & 1;
+  }
+  out_int(out, bit);
+  return RES_OK;
+}
+
+// bitcount key [start end [BYTE]]
+static uint32_t do_bitcount(vector<string> &cmd, string &out) {
+  if (cmd.size() == 3) {
+    string msg = "ERR syntax error";
+    out_err(out, msg);
+    return RES_ERR;
+  }
+  Entry *ent = NULL;
+  size_t start = 0, end = 0;
+  if (!lookup_str(cmd[1], ent, out) ||
+      !parse_byte_range(cmd, 2, ent ? ent->val.size() : 0, start, end, out)) {
+    return RES_ERR;
+  }
+  uint64_t n = 0;
+  if (ent) {
+    n = bitcount((const uint8_t *)ent->val.data() + start, end - start);
+  }
+  out_int(out, (int64_t)n);
+  return RES_OK;
+}
+
+// bitpos key 0|1 [start [end [BYTE]]]: the first bit with that value, or
+// -1. Without an end, a string of ones has its first 0 just past its end.
+static uint32_t do_bitpos(vector<string> &cmd, string &out) {
+  int bit = 0;
+  Entry *ent = NULL;
+  size_t start = 0, end = 0;
+  if (!parse_bit(cmd[2], bit, out) || !lookup_str(cmd[1], ent, out) ||
+      !parse_byte_range(cmd, 3, ent ? ent->val.size() : 0, start, end, out)) {
+    return RES_ERR;
+  }
+  if (!ent) {
+    out_int(out, bit ? -1 : 0);
+    return RES_OK;
+  }
+  int64_t pos =
+      bitpos((const uint8_t *)ent->val.data() + start, end - start, bit);
+  if (pos >= 0) {
+    pos += (int64_t)start * 8;
+  } else if (bit == 0 && cmd.size() <= 4 && start < end) {
+    pos = (int64_t)end * 8;
+  }
+  out_int(out, pos);
+  return RES_OK;
+}
+
+// a BITOP reading at least this many bytes runs on the thread pool
+const size_t k_bitop_bg_bytes = 1 << 20;
+// sources up to this size are copied into the job instead of being shared
+const size_t k_bitop_copy_max = 4096;
+
+struct BitopJob {
+  BgJob job;
+  int op = 0;
+  string dest;
+  size_t len = 0;
+  vector<const uint8_t *> srcs;
+  vector<size_t> lens;
+  string copies; // see k_bitop_copy_max
+  string result;
+};
+
+// replaces `dest` with a string, or deletes it if `val` is empty
+static void str_store(string &dest, string &val) {
+  Entry *ent = entry_pop(dest);
+  if (ent) {
+    entry_del(ent);
+  }
+  if (val.empty()) {
+    return;
+  }
+  ent = entry_new(dest, T_STR);
+  size_t before = entry_mem(ent);
+  ent->val.swap(val);
+  g_data.used_memory += entry_mem(ent) - before;
+}
+
+static void bitop_job_run(BgJob *job) {
+  BitopJob *b = container_of(job, BitopJob, job);
+  b->result.resize(b->len);
+  bitop(b->op, (uint8_t *)&b->result[0], b->len, b->srcs.data(),
+        b->lens.data(), b->srcs.size());
+}
+
+static void bitop_job_done(BgJob *job) {
+  BitopJob *b = container_of(job, BitopJob, job);
+  str_store(b->dest, b->result);
+  tracking_invalidate(b->dest, NULL);
+  Connection *con = bg_conn(job);
+  if (con) {
+    string out;
+    g_data.proto = con->proto;
+    out_int(out, (int64_t)b->len);
+    g_data.proto = PROTO_NATIVE;
+    conn_unblock(con, out);
+  }
+  delete b;
+}
+
+// Hands the sources to a job. Large strings are read in place, marked as
+// shared so that writers and deletes leave their buffers alone.
+static void bitop_submit(int op, string &dest, vector<Entry *> &ents,
+                         size_t len) {
+  BitopJob *b = new BitopJob();
+  b->job.run = &bitop_job_run;
+  b->job.done = &bitop_job_done;
+  b->op = op;
+  b->dest = dest;
+  b->len = len;
+  for (Entry *ent : ents) {
+    if (ent && ent->val.size() <= k_bitop_copy_max) {
+      b->copies += ent->val;
+    }
+  }
+  size_t copied = 0;
+  for (Entry *ent : ents) {
+    size_t n = ent ? ent->val.size() : 0;
+    const uint8_t *p = NULL;
+    if (n > k_bitop_copy_max) {
+      p = (const uint8_t *)ent->val.data();
+      ent->shared_epoch = g_data.bg_epoch;
+    } else if (n) {
+      p = (const uint8_t *)b->copies.data() + copied;
+      copied += n;
+    }
+    b->srcs.push_back(p);
+    b->lens.push_back(n);
+  }
+  bg_submit(&b->job);
+}
+
+// bitop and|or|xor|not dest key [key ...], returns the length of the
+// result. A missing key is an empty string and shorter ones are padded
+// with zeros; an empty result deletes dest.
+//
+// A large one runs on the thread pool while its connection waits. It
+// reads the sources as they were when the command started, and writes
+// dest when done.
+static uint32_t do_bitop(vector<string> &cmd, string &out) {
+  const char *names[] = {"and", "or", "xor", "not"};
+  int op = 0;
+  while (op < 4 && !arg_is(cmd[1], names[op])) {
+    op++;
+  }
+  if (op == 4) {
+    string msg = "ERR syntax error";
+    out_err(out, msg);
+    return RES_ERR;
+  }
+  if (op == BITOP_NOT && cmd.size() != 4) {
+    string msg = "ERR BITOP NOT must be called with a single source key.";
+    out_err(out, msg);
+    return RES_ERR;
+  }
+  vector<Entry *> ents;
+  size_t len = 0, total = 0;
+  for (size_t i = 3; i < cmd.size(); i++) {
+    Entry *ent = NULL;
+    if (!lookup_str(cmd[i], ent, out)) {
+      return RES_ERR;
+    }
+    ents.push_back(ent);
+    size_t n = ent ? ent->val.size() : 0;
+    len = max(len, n);
+    total += n;
+  }
+  if (bg_available() && total >= k_bitop_bg_bytes) {
+    bitop_submit(op, cmd[2], ents, len);
+    return RES_OK;
+  }
+  vector<const uint8_t *> srcs;
+  vector<size_t> lens;
+  for (Entry *ent : ents) {
+    srcs.push_back(ent ? (const uint8_t *)ent->val.data() : NULL);
+    lens.push_back(ent ? ent->val.size() : 0);
+  }
+  string res(len, '\0');
+  bitop(op, (uint8_t *)&res[0], len, srcs.data(), lens.data(), srcs.size());
+  str_store(cmd[2], res);
+  out_int(out, (int64_t)len);
+  return RES_OK;
+}
+
+// HyperLogLogs are strings in the Redis layout, see hll.h
+static uint32_t out_invalid_hll(string &out) {
+  string msg = "WRONGTYPE Key is not a valid HyperLogLog string value.";
+  out_err(out, msg);
+  return RES_ERR;
+}
+
+static uint32_t out_corrupt_hll(string &out) {
+  string msg = "INVALIDOBJ Corrupted HLL object detected";
+  out_err(out, msg);
+  return RES_ERR;
+}
+
+// A HyperLogLog key, NULL if missing. False after replying if the key holds
+// something else.
+static bool lookup_hll(string &key, Entry *&ent, string &out) {
+  if (!lookup_str(key, ent, out)) {
+    return false;
+  }
+  if (ent && !hll_valid(ent->val)) {
+    out_invalid_hll(out);
+    return false;
+  }
+  return true;
+}
+
+// pfadd key [element ...]: 1 if the estimate may have changed, which
+// includes creating the key
+static uint32_t do_pfadd(vector<string> &cmd, string &out) {
+  Entry *ent = NULL;
+  if (!lookup_hll(cmd[1], ent, out)) {
+    return RES_ERR;
+  }
+  bool changed = !ent;
+  if (!ent) {
+    ent = entry_new(cmd[1], T_STR);
+  }
+  size_t before = entry_mem(ent);
+  entry_unshare(ent, true);
+  if (changed) {
+    hll_init(ent->val);
+  }
+  int res = 0;
+  for (size_t i = 2; i < cmd.size() && res >= 0; i++) {
+    res = hll_add(ent->val, cmd[i].data(), cmd[i].size(),
+                  g_config.hll_sparse_max_bytes);
+    changed = changed || res > 0;
+  }
+  g_data.used_memory += entry_mem(ent) - before;
+  if (res < 0) {
+    return out_corrupt_hll(out);
+  }
+  out_int(out, changed ? 1 : 0);
+  return RES_OK;
+}
+
+// pfcount key [key ...]: the estimate for one key, from its cache when no
+// pfadd changed it since; for several keys, that of their union
+static uint32_t do_pfcount(vector<string> &cmd, string &out) {
+  uint64_t n = 0;
+  if (cmd.size() == 2) {
+    Entry *ent = NULL;
+    if (!lookup_hll(cmd[1], ent, out)) {
+      return RES_ERR;
+    }
+    if (ent) {
+      entry_unshare(ent, true);
+      if (!hll_count(ent->val, &n)) {
+        return out_corrupt_hll(out);
+      }
+    }
+    out_int(out, (int64_t)n);
+    return RES_OK;
+  }
+  uint8_t regs[k_hll_registers] = {};
+  uint8_t tmp[k_hll_registers];
+  for (size_t i = 1; i < cmd.size(); i++) {
+    Entry *ent = NULL;
+    if (!lookup_hll(cmd[i], ent, out)) {
+      return RES_ERR;
+    }
+    if (!ent) {
+      continue;
+    }
+    if (!hll_registers(ent->val, tmp)) {
+      return out_corrupt_hll(out);
+    }
+    hll_max(regs, tmp);
+  }
+  out_int(out, (int64_t)hll_estimate(regs));
+  return RES_OK;
+}
+
+// pfmerge dest [key ...]: dest becomes the union of itself and the keys,
+// in the dense encoding
+static uint32_t do_pfmerge(vector<string> &cmd, string &out) {
+  uint8_t regs[k_hll_registers] = {};
+  uint8_t tmp[k_hll_registers];
+  Entry *dest = NULL;
+  for (size_t i = 1; i < cmd.size(); i++) {
+    Entry *ent = NULL;
+    if (!lookup_hll(cmd[i], ent, out)) {
+      return RES_ERR;
+    }
+    dest = i == 1 ? ent : dest;
+    if (!ent) {
+      continue;
+    }
+    if (!hll_registers(ent->val, tmp)) {
+      return out_corrupt_hll(out);
+    }
+    hll_max(regs, tmp);
+  }
+  if (!dest) {
+    dest = entry_new(cmd[1], T_STR);
+  }
+  size_t before = entry_mem(dest);
+  entry_unshare(dest, false);
+  hll_init(dest->val);
+  hll_store_dense(dest->val, regs);
+  g_data.used_memory += entry_mem(dest) - before;
+  out_ok(out);
+  return RES_OK;
+}
+
+// Matches one element of a glob pattern, at pat[p], against `c` and moves
+// `p` past the element.
+static bool glob_one(const string &pat, size_t &p, unsigned char c) {
+  char t = pat[p++];
+  if (t == '?') {
+    return true;
+  }
+  if (t == '\\' && p < pat.size()) {
+    return (unsigned char)pat[p++] == c;
+  }
+  if (t != '[') {
+    return (unsigned char)t == c;
+  }
+  bool negate = p < pat.size() && pat[p] == '^';
+  p += negate ? 1 : 0;
+  bool hit = false;
+  while (p < pat.size() && pat[p] != ']') {
+    unsigned char lo = pat[p];
+    if (lo == '\\' && p + 1 < pat.size()) {
+      hit = hit || (unsigned char)pat[p + 1] == c;
+      p += 2;
+    } else if (p + 2 < pat.size() && pat[p + 1] == '-' && pat[p + 2] != ']') {
+      unsigned char hi = pat[p + 2];
+      hit = hit || (lo <= hi ? c >= lo && c <= hi : c >= hi && c <= lo);
+      p += 3;
+    } else {
+      hit = hit || lo == c;
+      p++;
+    }
+  }
+  p += p < pat.size() ? 1 : 0; // the `]`
+  return hit != negate;
+}
+
+// Redis glob patterns: `*`, `?`, `[abc]`, `[^a-z]`, and `\` escapes. A
+// mismatch after a `*` retries with the `*` taking one more byte.
+static bool glob_match(const string &pat, const string &str) {
+  size_t p = 0, s = 0;
+  size_t star = string::npos, mark = 0;
+  while (s < str.size()) {
+    if (p < pat.size() && pat[p] == '*') {
+      star = ++p;
+      mark = s;
+      continue;
+    }
+    size_t next = p;
+    if (p < pat.size() && glob_one(pat, next, str[s])) {
+      p = next;
+      s++;
+      continue;
+    }
+    if (star == string::npos) {
+      return false;
+    }
+    p = star;
+    s = ++mark;
+  }
+  while (p < pat.size() && pat[p] == '*') {
+    p++;
+  }
+  return p == pat.size();
+}
+
+// the bytes that every match of a glob pattern starts with
+static string glob_prefix(const string &pat) {
+  string prefix;
+  for (size_t i = 0; i < pat.size(); i++) {
+    char c = pat[i];
+    if (c == '*' || c == '?' || c == '[' ||
+        (c == '\\' && i + 1 == pat.size())) {
+      break;
+    }
+    if (c == '\\') {
+      c = pat[++i];
+    }
+    prefix.push_back(c);
+  }
+  return prefix;
+}
+
+struct KeyScan {
+  const string *pattern = NULL;
+  string prefix;
+  size_t count = 10;
+  size_t examined = 0;
+  vector<Entry *> hits;
+  Entry *last = NULL;
+  // stopped with keys left
+  bool more = false;
+};
+
+static void keyscan_add(KeyScan *ks, Entry *ent) {
+  ks->examined++;
+  ks->last = ent;
+  if (!ks->pattern || glob_match(*ks->pattern, ent->key)) {
+    ks->hits.push_back(ent);
+  }
+}
+
+static void keyscan_node(HNode *node, void *arg) {
+  keyscan_add((KeyScan *)arg, container_of(node, Entry, node));
+}
+
+// keys in order, from the start until one lacks the prefix
+static bool keyscan_ordered(void *val, void *arg) {
+  KeyScan *ks = (KeyScan *)arg;
+  Entry *ent = (Entry *)val;
+  if (ent->key.compare(0, ks->prefix.size(), ks->prefix) != 0) {
+    return false;
+  }
+  if (ks->examined == ks->count) {
+    ks->more = true;
+    return false;
+  }
+  keyscan_add(ks, ent);
+  return true;
+}
+
+// SCAN cursor [MATCH pattern] [COUNT count]
+//
+// Without the key index, the cursor walks the hash table buckets, as in
+// Redis. With it, keys come in order and only those starting with the
+// literal prefix of the pattern are examined; the cursor is then `>`
+// followed by the last key examined.
+static uint32_t do_scan(vector<string> &cmd, string &out) {
+  KeyScan ks;
+  for (size_t i = 2; i < cmd.size(); i += 2) {
+    int64_t n = 0;
+    if (i + 1 < cmd.size() && arg_is(cmd[i], "match")) {
+      ks.pattern = &cmd[i + 1];
+    } else if (i + 1 < cmd.size() && arg_is(cmd[i], "count") &&
+               str2int(cmd[i + 1], n) && n > 0) {
+      ks.count = (size_t)n;
+    } else {
+      string msg = "ERR syntax error";
+      out_err(out, msg);
+      return RES_ERR;
+    }
+  }
+  const string &cursor = cmd[1];
+  string next = "0";
+  if (g_data.keyidx_on) {
+    if (ks.pattern) {
+      ks.prefix = glob_prefix(*ks.pattern);
+    }
+    string resume;
+    const string *start = &ks.prefix;
+    bool inclusive = true;
+    if (cursor != "0") {
+      if (cursor.empty() || cursor[0] != '>') {
+        string msg = "ERR invalid cursor";
+        out_err(out, msg);
+        return RES_ERR;
+      }
+      // after the last key, unless that is before the prefix
+      resume = cursor.substr(1);
+      if (resume >= ks.prefix) {
+        start = &resume;
+        inclusive = false;
+      }
+    }
+    art_walk(&g_data.keyidx, (const uint8_t *)start->data(), start->size(),
+             inclusive, &keyscan_ordered, &ks);
+    if (ks.more) {
+      next = ">" + ks.last->key;
+    }
+  } else {
+    char *endp = NULL;
+    errno = 0;
+    uint64_t v = strtoull(cursor.c_str(), &endp, 10);
+    if (cursor.empty() || *endp || errno || cursor[0] == '-') {
+      string msg = "ERR invalid cursor";
+      out_err(out, msg);
+      return RES_ERR;
+    }
+    // empty buckets count too, so that a sparse table returns in time
+    size_t steps = 0;
+    do {
+      v = hm_scan(&g_data.db, v, &keyscan_node, &ks);
+    } while (v && ks.examined < ks.count && ++steps < ks.count * 10);
+    next = to_string(v);
+  }
+  out_arr(out, 2);
+  out_str(out, next);
+  out_arr(out, (uint32_t)ks.hits.size());
+  for (Entry *ent : ks.hits) {
+    out_str(out, ent->key);
+  }
+  return RES_OK;
+}
+
+// a bound of KEYRANGE: `-`, `+`, `[key` inclusive, or `(key` exclusive
+struct LexBound {
+  string key;
+  bool inclusive = true;
+  int inf = 0; // -1 for `-`, 1 for `+`
+};
+
+static bool parse_lex_bound(const string &s, LexBound &b) {
+  if (s == "-" || s == "+") {
+    b.inf = s == "-" ? -1 : 1;
+    return true;
+  }
+  if (s.empty() || (s[0] != '[' && s[0] != '(')) {
+    return false;
+  }
+  b.inclusive = s[0] == '[';
+  b.key = s.substr(1);
+  return true;
+}
+
+struct KeyRange {
+  const LexBound *max = NULL;
+  int64_t offset = 0;
+  int64_t count = -1; // negative for all
+  vector<Entry *> keys;
+};
+
+static bool keyrange_visit(void *val, void *arg) {
+  KeyRange *kr = (KeyRange *)arg;
+  Entry *ent = (Entry *)val;
+  const LexBound &max = *kr->max;
+  if (max.inf < 0 || (max.inf == 0 && (max.inclusive ? ent->key > max.key
+                                                      : ent->key >= max.key))) {
+    return false;
+  }
+  if (kr->offset > 0) {
+    kr->offset--;
+    return true;
+  }
+  kr->keys.push_back(ent);
+  return kr->count < 0 || (int64_t)kr->keys.size() < kr->count;
+}
+
+// KEYRANGE min max [LIMIT offset count], the keys between two bounds in
+// order, with the syntax of ZRANGEBYLEX. Needs the key index.
+static uint32_t do_keyrange(vector<string> &cmd, string &out) {
+  LexBound min, max;
+  if (!parse_lex_bound(cmd[1], min) || !parse_lex_bound(cmd[2], max)) {
+    string msg = "ERR min or max not valid string range item";
+    out_err(out, msg);
+    return RES_ERR;
+  }
+  KeyRange kr;
+  kr.max = &max;
+  if (cmd.size() != 3 &&
+      (cmd.size() != 6 || !arg_is(cmd[3], "limit") ||
+       !str2int(cmd[4], kr.offset) || !str2int(cmd[5], kr.count))) {
+    string msg = "ERR syntax error";
+    out_err(out, msg);
+    return RES_ERR;
+  }
+  if (!g_data.keyidx_on) {
+    string msg = "ERR keyrange needs key-index yes";
+    out_err(out, msg);
+    return RES_ERR;
+  }
+  if (min.inf <= 0 && kr.offset >= 0 && kr.count != 0) {
+    art_walk(&g_data.keyidx, (const uint8_t *)min.key.data(), min.key.size(),
+             min.inclusive, &keyrange_visit, &kr);
+  }
+  out_arr(out, (uint32_t)kr.keys.size());
+  for (Entry *ent : kr.keys) {
+    out_str(out, ent->key);
+  }
+  return RES_OK;
+}
+
+// Pub/sub. Subscription changes are confirmed with one message per
+// channel, queued on the connection like published messages.
+static void pubsub_reply(Connection *con, const char *kind,
+                         const string *name) {
+  string out;
+  out_push(out, 3);
+  out_str(out, kind, strlen(kind));
+  if (name) {
+    out_str(out, *name);
+  } else {
+    out_nil(out);
+  }
+  out_int(out, (int64_t)(con->channels.size() + con->patterns.size()));
+  conn_push_str(con, out);
+}
+
+static bool pubsub_conn(Connection *&con, string &out) {
+  con = g_data.cur_conn;
+  if (!con) {
+    string msg = "ERR pub/sub needs a client connection";
+    out_err(out, msg);
+  }
+  return con != NULL;
+}
+
+static uint32_t pubsub_subscribe(vector<string> &cmd, string &out,
+                                 bool pattern) {
+  Connection *con = NULL;
+  if (!pubsub_conn(con, out)) {
+    return RES_ERR;
+  }
+  unordered_set<string> &mine = pattern ? con->patterns : con->channels;
+  auto &subs = pattern ? g_data.patterns : g_data.channels;
+  for (size_t i = 1; i < cmd.size(); i++) {
+    if (mine.insert(cmd[i]).second) {
+      subs[cmd[i]].push_back(con);
+    }
+    pubsub_reply(con, pattern ? "psubscribe" : "subscribe", &cmd[i]);
+  }
+  return RES_OK;
+}
+
+// without names, from everything the connection subscribed to
+static uint32_t pubsub_unsubscribe(vector<string> &cmd, string &out,
+                                   bool pattern) {
+  Connection *con = NULL;
+  if (!pubsub_conn(con, out)) {
+    return RES_ERR;
+  }
+  const char *kind = pattern ? "punsubscribe" : "unsubscribe";
+  unordered_set<string> &mine = pattern ? con->patterns : con->channels;
+  auto &subs = pattern ? g_data.patterns : g_data.channels;
+  vector<string> names(cmd.begin() + 1, cmd.end());
+  if (names.empty()) {
+    names.assign(mine.begin(), mine.end());
+  }
+  if (names.empty()) {
+    pubsub_reply(con, kind, NULL);
+  }
+  for (const string &name : names) {
+    if (mine.erase(name)) {
+      pubsub_remove(subs, name, con);
+    }
+    pubsub_reply(con, kind, &name);
+  }
+  return RES_OK;
+}
+
+static uint32_t do_subscribe(vector<string> &cmd, string &out) {
+  return pubsub_subscribe(cmd, out, false);
+}
+
+static uint32_t do_psubscribe(vector<string> &cmd, string &out) {
+  return pubsub_subscribe(cmd, out, true);
+}
+
+static uint32_t do_unsubscribe(vector<string> &cmd, string &out) {
+  return pubsub_unsubscribe(cmd, out, false);
+}
+
+static uint32_t do_punsubscribe(vector<string> &cmd, string &out) {
+  return pubsub_unsubscribe(cmd, out, true);
+}
+
+// Queues a message on each subscriber. The message is encoded once per
+// protocol among them, and the subscribers share that buffer. Returns the
+// number of subscribers it was queued on.
+static size_t pubsub_fanout(vector<Connection *> &subs, const string *pattern,
+                            const string &channel, const string &msg) {
+  PubBuf *bufs[3] = {};
+  uint32_t saved = g_data.proto;
+  size_t n = 0;
+  for (Connection *con : subs) {
+    uint32_t idx = con->proto == PROTO_NATIVE  ? 0
+                   : con->proto == PROTO_RESP2 ? 1
+                                               : 2;
+    if (!bufs[idx]) {
+      g_data.proto = con->proto;
+      string out;
+      out_push(out, pattern ? 4 : 3);
+      if (pattern) {
+        out_str(out, "pmessage", 8);
+        out_str(out, *pattern);
+      } else {
+        out_str(out, "message", 7);
+      }
+      out_str(out, channel);
+      out_str(out, msg);
+      bufs[idx] = pubbuf_new(con->proto, out);
+      bufs[idx]->refs++; // until all subscribers have it
+    }
+    n += con->state != END ? 1 : 0;
+    conn_push(con, bufs[idx]);
+  }
+  g_data.proto = saved;
+  for (PubBuf *buf : bufs) {
+    if (buf) {
+      pubbuf_release(buf);
+    }
+  }
+  return n;
+}
+
+// publish channel message: the number of subscribers it reached, including
+// pattern subscriptions
+static uint32_t do_publish(vector<string> &cmd, string &out) {
+  size_t n = 0;
+  auto it = g_data.channels.find(cmd[1]);
+  if (it != g_data.channels.end()) {
+    n += pubsub_fanout(it->second, NULL, cmd[1], cmd[2]);
+  }
+  for (auto &sub : g_data.patterns) {
+    if (glob_match(sub.first, cmd[1])) {
+      n += pubsub_fanout(sub.second, &sub.first, cmd[1], cmd[2]);
+    }
+  }
+  g_data.pubsub_messages++;
+  out_int(out, (int64_t)n);
+  return RES_OK;
+}
+
+// pubsub channels [pattern] | numsub [channel ...] | numpat
+static uint32_t do_pubsub(vector<string> &cmd, string &out) {
+  if (arg_is(cmd[1], "channels") && cmd.size() <= 3) {
+    size_t pos = begin_arr(out);
+    uint32_t n = 0;
+    for (auto &sub : g_data.channels) {
+      if (cmd.size() == 2 || glob_match(cmd[2], sub.first)) {
+        out_str(out, sub.first);
+        n++;
+      }
+    }
+    end_arr(out, pos, n);
+  } else if (arg_is(cmd[1], "numsub")) {
+    out_map(out, (uint32_t)(cmd.size() - 2));
+    for (size_t i = 2; i < cmd.size(); i++) {
+      auto it = g_data.channels.find(cmd[i]);
+      out_str(out, cmd[i]);
+      out_int(out, it == g_data.channels.end() ? 0 : it->second.size());
+    }
+  } else if (arg_is(cmd[1], "numpat") && cmd.size() == 2) {
+    out_int(out, (int64_t)g_data.patterns.size());
+  } else {
+    string msg = "ERR syntax error";
+    out_err(out, msg);
+    return RES_ERR;
+  }
+  return RES_OK;
+}
+
+// Client-side caching. A connection with tracking on is told when a key it
+// read may have changed: written, expired, evicted, or moved to another
+// node. The key is then forgotten until it is read again. In broadcast
+// mode nothing is recorded per key; every change to a key under one of
+// the connection's prefixes is announced instead.
+struct TrackedKey {
+  HNode node;
+  string key;
+  unordered_set<uint64_t> clients; // ids of the connections that read it
+  Dlist order;                     // on g_data.tracking_order
+};
+
+static const char k_invalidate_channel[] = "__redis__:invalidate";
+
+static bool tracked_eq(HNode *lhs, HNode *rhs) {
+  TrackedKey *le = container_of(lhs, TrackedKey, node);
+  TrackedKey *re = container_of(rhs, TrackedKey, node);
   return le->key == re->key;
 }
 
-static uint32_t do_expire(std::vector<std::string> &cmd, std::string &out) {
-  int64_t ttl_ms = 0;
-  if (!str2int(cmd[2], ttl_ms)) {
-    string msg = "expect int64";
+static TrackedKey *tracked_find(string &key, bool pop) {
+  TrackedKey probe;
+  probe.key.swap(key);
+  probe.node.hcode = str_hash((uint8_t *)probe.key.data(), probe.key.size());
+  HNode *node = pop ? hm_pop(&g_data.tracking, &probe.node, &tracked_eq)
+                    : hm_find(&g_data.tracking, &probe.node, &tracked_eq);
+  probe.key.swap(key);
+  return node ? container_of(node, TrackedKey, node) : NULL;
+}
+
+// Tells a connection that `key` changed: a RESP3 push, or a message on the
+// invalidation channel, which a connection of another protocol must be
+// subscribed to.
+static void tracking_send(Connection *con, const string &key) {
+  if (con->tracking_redirect) {
+    size_t fd = (size_t)con->tracking_redirect_fd;
+    uint64_t id = con->tracking_redirect;
+    con = fd < g_data.connections.size() ? g_data.connections[fd] : NULL;
+    if (!con || con->id != id) {
+      return; // the target went away
+    }
+  }
+  bool resp3 = con->proto == PROTO_RESP3;
+  if (con->state == END ||
+      (!resp3 && !con->channels.count(k_invalidate_channel))) {
+    return;
+  }
+  uint32_t saved = g_data.proto;
+  g_data.proto = con->proto;
+  string out;
+  if (resp3) {
+    out_push(out, 2);
+    out_str(out, "invalidate", 10);
+  } else {
+    out_push(out, 3);
+    out_str(out, "message", 7);
+    out_str(out, k_invalidate_channel, sizeof(k_invalidate_channel) - 1);
+  }
+  out_arr(out, 1);
+  out_str(out, key);
+  g_data.proto = saved;
+  conn_push_str(con, out);
+  g_data.tracking_invalidations++;
+}
+
+// sends the invalidations of a key taken off the table, and frees it
+static void tracked_notify(TrackedKey *tk, Connection *by) {
+  for (uint64_t id : tk->clients) {
+    auto it = g_data.tracking_conns.find(id);
+    if (it == g_data.tracking_conns.end()) {
+      continue; // closed, or turned tracking off
+    }
+    Connection *con = it->second;
+    if (!con->tracking_bcast && !(con == by && con->tracking_noloop)) {
+      tracking_send(con, tk->key);
+    }
+  }
+  g_data.tracking_items -= tk->clients.size();
+  dlist_detach(&tk->order);
+  delete tk;
+}
+
+// `key` changed, by a command of `by` or by the server itself
+static void tracking_invalidate(string &key, Connection *by) {
+  for (auto &sub : g_data.tracking_prefixes) {
+    if (key.compare(0, sub.first.size(), sub.first) != 0) {
+      continue;
+    }
+    for (Connection *con : sub.second) {
+      if (!(con == by && con->tracking_noloop)) {
+        tracking_send(con, key);
+      }
+    }
+  }
+  if (!hm_size(&g_data.tracking)) {
+    return;
+  }
+  TrackedKey *tk = tracked_find(key, true);
+  if (tk) {
+    tracked_notify(tk, by);
+  }
+}
+
+// invalidates the oldest keys while the table is over its limit
+static void tracking_trim() {
+  uint32_t max_keys = g_config.tracking_table_max_keys;
+  while (max_keys && hm_size(&g_data.tracking) > max_keys) {
+    TrackedKey *tk =
+        container_of(g_data.tracking_order.next, TrackedKey, order);
+    HNode *node = hm_pop(&g_data.tracking, &tk->node, &hnode_same);
+    assert(node == &tk->node);
+    tracked_notify(tk, NULL);
+    g_data.tracking_evicted_keys++;
+  }
+}
+
+// records that a connection read `key`
+static void tracking_add(Connection *con, string &key) {
+  TrackedKey *tk = tracked_find(key, false);
+  if (tk) {
+    dlist_detach(&tk->order);
+  } else {
+    tk = new TrackedKey();
+    tk->key = key;
+    tk->node.hcode = str_hash((uint8_t *)key.data(), key.size());
+    hm_insert(&g_data.tracking, &tk->node);
+  }
+  // the most recently read last, so the table drops the others first
+  dlist_insert_before(&g_data.tracking_order, &tk->order);
+  g_data.tracking_items += tk->clients.insert(con->id).second ? 1 : 0;
+  tracking_trim();
+}
+
+// client id | client tracking on [redirect id] [bcast [prefix p ...]]
+// [noloop] | client tracking off
+static uint32_t do_client(vector<string> &cmd, string &out) {
+  Connection *con = g_data.cur_conn;
+  string msg;
+  if (!con) {
+    msg = "ERR client needs a client connection";
+  } else if (arg_is(cmd[1], "id") && cmd.size() == 2) {
+    out_int(out, (int64_t)con->id);
+    return RES_OK;
+  } else if (!arg_is(cmd[1], "tracking") || cmd.size() < 3) {
+    msg = "ERR syntax error";
+  } else if (arg_is(cmd[2], "off") && cmd.size() == 3) {
+    tracking_stop(con);
+    out_ok(out);
+    return RES_OK;
+  } else if (!arg_is(cmd[2], "on")) {
+    msg = "ERR syntax error";
+  }
+  int64_t redirect = 0;
+  bool bcast = false, noloop = false;
+  vector<string> prefixes;
+  for (size_t i = 3; msg.empty() && i < cmd.size(); i++) {
+    if (arg_is(cmd[i], "redirect") && i + 1 < cmd.size() &&
+        str2int(cmd[i + 1], redirect) && redirect > 0) {
+      i++;
+    } else if (arg_is(cmd[i], "prefix") && i + 1 < cmd.size()) {
+      prefixes.push_back(cmd[++i]);
+    } else if (arg_is(cmd[i], "bcast")) {
+      bcast = true;
+    } else if (arg_is(cmd[i], "noloop")) {
+      noloop = true;
+    } else {
+      msg = "ERR syntax error";
+    }
+  }
+  Connection *target = NULL;
+  for (size_t fd = 0; redirect && fd < g_data.connections.size(); fd++) {
+    Connection *c = g_data.connections[fd];
+    if (c && c->id == (uint64_t)redirect && c->state != END) {
+      target = c;
+    }
+  }
+  if (!msg.empty()) {
+    // already refused
+  } else if (!prefixes.empty() && !bcast) {
+    msg = "ERR prefix needs bcast";
+  } else if (redirect && !target) {
+    msg = "ERR no connection with the redirect id";
+  } else if (!redirect && con->proto != PROTO_RESP3) {
+    // pushed messages would be taken for replies
+    msg = "ERR tracking needs RESP3 or a redirect";
+  }
+  if (!msg.empty()) {
+    out_err(out, msg);
+    return RES_ERR;
+  }
+  tracking_stop(con);
+  con->tracking = true;
+  con->tracking_bcast = bcast;
+  con->tracking_noloop = noloop;
+  if (target) {
+    con->tracking_redirect = target->id;
+    con->tracking_redirect_fd = target->fd;
+  }
+  if (bcast && prefixes.empty()) {
+    prefixes.emplace_back(); // every key
+  }
+  for (const string &prefix : prefixes) {
+    auto &conns = g_data.tracking_prefixes[prefix];
+    if (find(conns.begin(), conns.end(), con) == conns.end()) {
+      conns.push_back(con);
+      con->tracking_prefixes.push_back(prefix);
+    }
+  }
+  g_data.tracking_conns[con->id] = con;
+  out_ok(out);
+  return RES_OK;
+}
+
+static uint32_t do_config(vector<string> &cmd, string &out) {
+  if (cmd.size() == 3 && arg_is(cmd[1], "get")) {
+    string val;
+    if (!config_get(cmd[2], val)) {
+      // unknown options match nothing, as tools probing for them expect
+      out_arr(out, 0);
+      return RES_NF;
+    }
+    out_arr(out, 2);
+    out_str(out, cmd[2]);
+    out_str(out, val);
+    return RES_OK;
+  } else if (cmd.size() == 4 && arg_is(cmd[1], "set")) {
+    if (!config_set(cmd[2], cmd[3])) {
+      string msg = "Invalid option or value";
+      out_err(out, msg);
+      return RES_ERR;
+    }
+    keyidx_sync();
+    tracking_trim();
+    out_ok(out);
+    return RES_OK;
+  }
+  string msg = "Usage: config get name | config set name value";
+  out_err(out, msg);
+  return RES_ERR;
+}
+
+// SLOWLOG GET [n] | SLOWLOG LEN | SLOWLOG RESET
+static uint32_t do_slowlog(vector<string> &cmd, string &out) {
+  if (arg_is(cmd[1], "len") && cmd.size() == 2) {
+    out_int(out, (int64_t)g_monitor.slowlog.size());
+    return RES_OK;
+  } else if (arg_is(cmd[1], "reset") && cmd.size() == 2) {
+    g_monitor.slowlog.clear();
+    out_ok(out);
+    return RES_OK;
+  } else if (arg_is(cmd[1], "get") && cmd.size() <= 3) {
+    int64_t limit = 10;
+    if (cmd.size() == 3 && (!str2int(cmd[2], limit) || limit < 0)) {
+      string msg = "expect int64";
+      out_err(out, msg);
+      return RES_ERR;
+    }
+    uint32_t n = (uint32_t)min((size_t)limit, g_monitor.slowlog.size());
+    out_arr(out, n);
+    for (uint32_t i = 0; i < n; i++) {
+      SlowlogEntry &ent = g_monitor.slowlog[i];
+      uint32_t nfields = 5;
+      out_arr(out, nfields);
+      out_int(out, (int64_t)ent.id);
+      out_int(out, (int64_t)ent.time_sec);
+      out_int(out, (int64_t)ent.duration_us);
+      uint32_t nargs = (uint32_t)ent.args.size();
+      out_arr(out, nargs);
+      for (string &arg : ent.args) {
+        out_str(out, arg);
+      }
+      out_str(out, ent.client);
+    }
+    return RES_OK;
+  }
+  string msg = "Usage: slowlog get [n] | slowlog len | slowlog reset";
+  out_err(out, msg);
+  return RES_ERR;
+}
+
+// LATENCY LATEST | LATENCY HISTORY event | LATENCY RESET [event]
+static uint32_t do_latency(vector<string> &cmd, string &out) {
+  if (arg_is(cmd[1], "latest") && cmd.size() == 2) {
+    uint32_t n = 0;
+    for (LatencyEvent &ev : g_monitor.events) {
+      n += ev.count ? 1 : 0;
+    }
+    out_arr(out, n);
+    for (int i = 0; i < LAT_MAX; i++) {
+      LatencyEvent &ev = g_monitor.events[i];
+      if (!ev.count) {
+        continue;
+      }
+      LatencySample &last =
+          ev.samples[(ev.idx + k_latency_samples - 1) % k_latency_samples];
+      uint32_t nfields = 4;
+      out_arr(out, nfields);
+      string name = k_latency_event_names[i];
+      out_str(out, name);
+      out_int(out, last.time_sec);
+      out_int(out, last.latency_us);
+      out_int(out, ev.max_us);
+    }
+    return RES_OK;
+  } else if (arg_is(cmd[1], "history") && cmd.size() == 3) {
+    int event = latency_event_from_name(cmd[2]);
+    if (event < 0) {
+      string msg = "Unknown event";
+      out_err(out, msg);
+      return RES_ERR;
+    }
+    LatencyEvent &ev = g_monitor.events[event];
+    uint32_t n = (uint32_t)ev.count;
+    out_arr(out, n);
+    size_t start = (ev.idx + k_latency_samples - ev.count) % k_latency_samples;
+    for (size_t i = 0; i < ev.count; i++) {
+      LatencySample &sample = ev.samples[(start + i) % k_latency_samples];
+      uint32_t nfields = 2;
+      out_arr(out, nfields);
+      out_int(out, sample.time_sec);
+      out_int(out, sample.latency_us);
+    }
+    return RES_OK;
+  } else if (arg_is(cmd[1], "reset") && cmd.size() <= 3) {
+    int64_t nreset = 0;
+    for (int i = 0; i < LAT_MAX; i++) {
+      if (cmd.size() == 3 && cmd[2] != k_latency_event_names[i]) {
+        continue;
+      }
+      nreset += g_monitor.events[i].count ? 1 : 0;
+      g_monitor.events[i] = LatencyEvent{};
+    }
+    out_int(out, nreset);
+    return RES_OK;
+  }
+  string msg = "Usage: latency latest | latency history event | "
+               "latency reset [event]";
+  out_err(out, msg);
+  return RES_ERR;
+}
+
+static uint32_t do_ping(vector<string> &cmd, string &out) {
+  Connection *con = g_data.cur_conn;
+  if (con && conn_subscribed(con) && g_data.proto != PROTO_RESP3) {
+    // a reply that reads like the messages around it
+    out_arr(out, 2);
+    out_str(out, "pong", 4);
+    out_str(out, cmd.size() == 2 ? cmd[1] : string());
+    return RES_OK;
+  }
+  if (cmd.size() == 2) {
+    out_str(out, cmd[1]);
+  } else if (g_data.proto == PROTO_NATIVE) {
+    out_str(out, "PONG", 4);
+  } else {
+    out.append("+PONG\r\n");
+  }
+  return RES_OK;
+}
+
+static uint32_t do_echo(vector<string> &cmd, string &out) {
+  out_str(out, cmd[1]);
+  return RES_OK;
+}
+
+// HELLO [2|3]: switches a RESP connection between RESP2 and RESP3
+static uint32_t do_hello(vector<string> &cmd, string &out) {
+  Connection *con = g_data.cur_conn;
+  if (!con || con->proto == PROTO_NATIVE) {
+    string msg = "HELLO is only supported over RESP";
+    out_err(out, msg);
+    return RES_ERR;
+  }
+  if (cmd.size() == 2) {
+    if (cmd[1] == "2") {
+      con->proto = PROTO_RESP2;
+    } else if (cmd[1] == "3") {
+      con->proto = PROTO_RESP3;
+    } else {
+      string msg = "NOPROTO unsupported protocol version";
+      out_err(out, msg);
+      return RES_ERR;
+    }
+  }
+  // the reply already uses the new protocol
+  g_data.proto = con->proto;
+  out_map(out, 3);
+  out_str(out, "server", 6);
+  out_str(out, "redsredis", 9);
+  out_str(out, "proto", 5);
+  out_int(out, con->proto);
+  out_str(out, "id", 2);
+  out_int(out, (int64_t)con->id);
+  return RES_OK;
+}
+
+// COMMAND: no command docs; replies empty so that RESP tools can start
+static uint32_t do_command(vector<string> &cmd, string &out) {
+  (void)cmd;
+  out_arr(out, 0);
+  return RES_OK;
+}
+
+// Transactions. MULTI queues the connection's commands until EXEC runs
+// them back to back; WATCH makes EXEC fail if a watched key was written in
+// the meantime.
+
+static bool txn_conn(Connection *&con, string &out) {
+  con = g_data.cur_conn;
+  if (!con) {
+    string msg = "ERR transactions need a client connection";
+    out_err(out, msg);
+  }
+  return con != NULL;
+}
+
+static uint32_t do_multi(vector<string> &cmd, string &out) {
+  (void)cmd;
+  Connection *con = NULL;
+  if (!txn_conn(con, out)) {
+    return RES_ERR;
+  }
+  if (con->in_multi) {
+    string msg = "ERR MULTI calls can not be nested";
+    out_err(out, msg);
+    return RES_ERR;
+  }
+  con->in_multi = true;
+  out_ok(out);
+  return RES_OK;
+}
+
+static uint32_t do_discard(vector<string> &cmd, string &out) {
+  (void)cmd;
+  Connection *con = NULL;
+  if (!txn_conn(con, out)) {
+    return RES_ERR;
+  }
+  if (!con->in_multi) {
+    string msg = "ERR DISCARD without MULTI";
+    out_err(out, msg);
+    return RES_ERR;
+  }
+  conn_multi_reset(con);
+  con->watched.clear();
+  out_ok(out);
+  return RES_OK;
+}
+
+// WATCH key [key ...]: remembers the version of each key, 0 if missing
+static uint32_t do_watch(vector<string> &cmd, string &out) {
+  Connection *con = NULL;
+  if (!txn_conn(con, out)) {
+    return RES_ERR;
+  }
+  for (size_t i = 1; i < cmd.size(); i++) {
+    Entry *ent = entry_find(cmd[i]);
+    con->watched.emplace_back(cmd[i], ent ? ent->version : 0);
+  }
+  out_ok(out);
+  return RES_OK;
+}
+
+static uint32_t do_unwatch(vector<string> &cmd, string &out) {
+  (void)cmd;
+  Connection *con = NULL;
+  if (!txn_conn(con, out)) {
+    return RES_ERR;
+  }
+  con->watched.clear();
+  out_ok(out);
+  return RES_OK;
+}
+
+// A key created and deleted again after WATCH reads as unchanged, like a
+// key that was never touched.
+static bool watched_changed(Connection *con) {
+  for (pair<string, uint64_t> &w : con->watched) {
+    Entry *ent = entry_find(w.first);
+    if ((ent ? ent->version : 0) != w.second) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// Cluster mode. Each node serves the keys of the hash slots assigned to it
+// and redirects the others with MOVED. A range of slots moves to another
+// node while both keep serving: the source streams its keys there with
+// RESTORE and answers ASK for keys it no longer has, which the client then
+// sends to the target after ASKING.
+
+static void info_add(string &out, const char *fmt, ...);
+
+enum {
+  // a worker connects to the target and has it import the slots
+  MIG_CONNECTING = 0,
+  // batches of keys go out, one at a time
+  MIG_STREAMING = 1,
+  // no key is left, the target is told it owns the slots
+  MIG_FINISHING = 2,
+  // a batch failed after keys had moved, it connects again at `retry_us`
+  MIG_WAITING = 3,
+};
+
+struct MigrateBatch;
+
+struct SlotMigration {
+  uint32_t lo = 0;
+  uint32_t hi = 0;
+  string range; // "lo-hi"
+  uint16_t target = k_no_node;
+  RcPool pool;
+  bool open = false; // `pool` is connected
+  int state = MIG_CONNECTING;
+  // the target was told it owns the slots, and may have applied it
+  bool assigned = false;
+  uint64_t retry_us = 0;
+  uint64_t cursor = 0;
+  size_t keys = 0;
+  uint64_t start_us = 0;
+  // the requests on their way to the target, answered by `deadline_us`
+  MigrateBatch *batch = NULL;
+  uint64_t deadline_us = 0;
+  // Keys whose copy on the target may be out of date: sent and not yet
+  // confirmed, written here meanwhile, or deleted here with the delete
+  // not yet confirmed. This node keeps serving them instead of answering
+  // ASK. The next batch deletes those it no longer has on the target.
+  unordered_set<string> held;
+};
+
+// keys sent per RESTORE batch, and buckets looked at per step for them
+const size_t k_migrate_batch = 100;
+const size_t k_migrate_scan = 1024;
+const uint32_t k_migrate_timeout_ms = 5000;
+// wait before connecting again after a failed batch
+const uint32_t k_migrate_retry_ms = 1000;
+
+static void cluster_init() {
+  if (!g_config.cluster_enabled) {
+    return;
+  }
+  SlotMap &map = g_data.cluster;
+  slotmap_parse(&map, g_config.cluster_config);
+  string self = "127.0.0.1:" + to_string(g_config.port);
+  if (g_config.cluster_config.empty()) {
+    // a cluster of one, others join by migrating slots to them
+    slotmap_assign(&map, 0, k_cluster_slots - 1, slotmap_node(&map, self));
+  }
+  g_data.cluster_self = slotmap_node(&map, self);
+  g_data.slot_keys.assign(k_cluster_slots, 0);
+  g_data.migrating.assign(k_cluster_slots, k_no_node);
+  g_data.importing.assign(k_cluster_slots, k_no_node);
+  g_data.cluster_on = true;
+  log_info("cluster mode, %zu slots served by %s",
+           slotmap_count(&map, g_data.cluster_self), self.c_str());
+}
+
+static uint32_t out_cluster_off(string &out) {
+  string msg = "ERR This instance has cluster support disabled";
+  out_err(out, msg);
+  return RES_ERR;
+}
+
+static bool parse_slot_arg(const string &arg, uint32_t &lo, uint32_t &hi,
+                           string &out) {
+  if (!parse_slot_range(arg, &lo, &hi)) {
+    string msg = "ERR Invalid or out of range slot";
+    out_err(out, msg);
+    return false;
+  }
+  return true;
+}
+
+// Collects a value as the RESTORE requests that rebuild it on another
+// node, each within what a node reads as one request.
+struct KeyDump {
+  const Entry *ent = NULL;
+  string ttl;
+  vector<vector<string>> reqs;
+  size_t bytes = 0;
+  bool ok = true;
+};
+
+static const char *k_type_names[] = {"string", "zset", "hash", "list", "set"};
+const size_t k_restore_max = 4 + MAX_BUF;
+
+static void dump_begin(KeyDump *d) {
+  // a compressed string goes as it is stored
+  bool lz = d->ent->enc == ENC_LZ;
+  d->reqs.push_back({"restore", d->ent->key, d->ttl,
+                     lz ? "lzstring" : k_type_names[d->ent->type],
+                     d->reqs.empty() ? "replace" : "append"});
+  d->bytes = 4;
+  for (const string &arg : d->reqs.back()) {
+    d->bytes += 4 + arg.size();
+  }
+}
+
+// adds one element, or a pair when `b` is set
+static void dump_add(KeyDump *d, const char *a, size_t alen, const char *b,
+                     size_t blen) {
+  size_t need = 4 + alen + (b ? 4 + blen : 0);
+  if (d->bytes + need > k_restore_max && d->reqs.back().size() > 5) {
+    dump_begin(d);
+  }
+  if (d->bytes + need > k_restore_max) {
+    d->ok = false;
+    return;
+  }
+  d->reqs.back().emplace_back(a, alen);
+  if (b) {
+    d->reqs.back().emplace_back(b, blen);
+  }
+  d->bytes += need;
+}
+
+static void dump_member(const char *name, size_t len, void *arg) {
+  dump_add((KeyDump *)arg, name, len, NULL, 0);
+}
+
+static void dump_field(const char *field, size_t flen, const char *val,
+                       size_t vlen, void *arg) {
+  dump_add((KeyDump *)arg, field, flen, val, vlen);
+}
+
+static bool entry_dump(Entry *ent, vector<vector<string>> &reqs) {
+  KeyDump d;
+  d.ent = ent;
+  d.ttl = "0";
+  if (ent->heap_idx != (size_t)-1) {
+    uint64_t expire_at = g_data.heap[ent->heap_idx].val;
+    uint64_t now_us = get_monotonic_usec();
+    d.ttl = to_string(expire_at > now_us + 1000 ? (expire_at - now_us) / 1000
+                                                : 1);
+  }
+  dump_begin(&d);
+  switch (ent->type) {
+  case T_STR: {
+    size_t chunk = k_restore_max - d.bytes - 4;
+    for (size_t i = 0; i < ent->val.size(); i += chunk) {
+      size_t len = min(chunk, ent->val.size() - i);
+      dump_add(&d, ent->val.data() + i, len, NULL, 0);
+      if (i + len < ent->val.size()) {
+        dump_begin(&d);
+      }
+    }
+    break;
+  }
+  case T_ZSET: {
+    ZNode *znode = zset_query(ent->zset, -INFINITY, "", 0);
+    char score[32];
+    for (; znode && d.ok; znode = znode_offset(znode, 1)) {
+      int n = snprintf(score, sizeof(score), "%.17g", znode->score);
+      dump_add(&d, znode->name, znode->len, score, (size_t)n);
+    }
+    break;
+  }
+  case T_HASH:
+    hobj_scan(ent->hash, &dump_field, &d);
+    break;
+  case T_LIST: {
+    QIter it;
+    const char *data = NULL;
+    size_t len = 0;
+    ql_seek(ent->list, 0, &it);
+    while (d.ok && ql_next(ent->list, &it, &data, &len)) {
+      dump_add(&d, data, len, NULL, 0);
+    }
+    break;
+  }
+  case T_SET:
+    sobj_scan(ent->set, &dump_member, &d);
+    break;
+  }
+  if (d.ok) {
+    for (vector<string> &req : d.reqs) {
+      reqs.push_back(std::move(req));
+    }
+  }
+  return d.ok;
+}
+
+// restore key ttl-ms type replace|append [elem ...]: rebuilds a value sent
+// by a migrating node, in as many requests as it takes. `replace` drops
+// whatever the key held; a zset takes member/score pairs, a hash
+// field/value pairs, a string one chunk to append. An `lzstring` is a
+// string sent compressed, see str_assign.
+static uint32_t do_restore(vector<string> &cmd, string &out) {
+  int64_t ttl_ms = 0;
+  bool lz = arg_is(cmd[3], "lzstring");
+  uint32_t type = lz ? T_STR : 0;
+  while (type < 5 && !lz && !arg_is(cmd[3], k_type_names[type])) {
+    type++;
+  }
+  bool replace = arg_is(cmd[4], "replace");
+  size_t n = cmd.size() - 5;
+  bool pairs = type == T_ZSET || type == T_HASH;
+  bool ok = str2int(cmd[2], ttl_ms) && ttl_ms >= 0 && type < 5 &&
+            (replace || arg_is(cmd[4], "append")) &&
+            (!pairs || n % 2 == 0) && (type != T_STR || n <= 1);
+  for (size_t i = 5; ok && type == T_ZSET && i < cmd.size(); i += 2) {
+    char *end = NULL;
+    double score = strtod(cmd[i + 1].c_str(), &end);
+    ok = end == cmd[i + 1].c_str() + cmd[i + 1].size() && !std::isnan(score);
+  }
+  if (!ok) {
+    string msg = "ERR syntax error";
+    out_err(out, msg);
+    return RES_ERR;
+  }
+
+  Entry *ent = entry_lookup(cmd[1]);
+  if (ent && replace) {
+    entry_del(entry_pop(cmd[1]));
+    ent = NULL;
+  }
+  if (ent && (ent->type != type || (ent->enc == ENC_LZ) != lz)) {
+    return out_wrongtype(out);
+  }
+  if (!ent) {
+    ent = entry_new(cmd[1], type);
+  }
+  size_t before = entry_mem(ent);
+  lz_account(ent, false);
+  ent->enc = lz ? ENC_LZ : ENC_RAW;
+  HObjLimits limits = hash_limits();
+  for (size_t i = 5; i < cmd.size(); i += pairs ? 2 : 1) {
+    switch (type) {
+    case T_STR:
+      entry_unshare(ent, true);
+      ent->val.append(cmd[i]);
+      break;
+    case T_ZSET:
+      zset_add(ent->zset, cmd[i].data(), cmd[i].size(),
+               strtod(cmd[i + 1].c_str(), NULL));
+      break;
+    case T_HASH:
+      hobj_set(ent->hash, cmd[i].data(), cmd[i].size(), cmd[i + 1].data(),
+               cmd[i + 1].size(), limits);
+      break;
+    case T_LIST:
+      ql_push(ent->list, false, cmd[i].data(), cmd[i].size());
+      break;
+    case T_SET:
+      sobj_add(ent->set, &cmd[i], 1, g_config.set_max_intset_entries);
+      break;
+    }
+  }
+  lz_account(ent, true);
+  g_data.used_memory += entry_mem(ent) - before;
+  if (ttl_ms > 0) {
+    entry_set_ttl(ent, ttl_ms);
+  }
+  out_ok(out);
+  return RES_OK;
+}
+
+// Sends a command to a node and waits for its reply. Only for workers,
+// the event loop never waits on another node.
+static bool cluster_send(RcPool *pool, const vector<string> &args,
+                         string *err) {
+  future<RcResult> f = rc_call(pool, args);
+  if (f.wait_for(std::chrono::milliseconds(k_migrate_timeout_ms)) !=
+      std::future_status::ready) {
+    // the pool is closed after this, which drops the pending reply
+    *err = "timed out";
+    return false;
+  }
+  RcResult res = f.get();
+  RcReply r = res.reply();
+  if (r.type == SER_ERR) {
+    *err = string(r.str, r.len);
+    return false;
+  }
+  return true;
+}
+
+static int cluster_connect(RcPool *pool, const string &addr) {
+  string host;
+  uint16_t port = 0;
+  parse_node_addr(addr, &host, &port);
+  RcOptions opt;
+  opt.host = host.c_str();
+  opt.port = port;
+  return rc_pool_open(pool, opt);
+}
+
+static void slots_set(vector<uint16_t> &v, uint32_t lo, uint32_t hi,
+                      uint16_t node) {
+  for (uint32_t s = lo; s <= hi; s++) {
+    v[s] = node;
+  }
+}
+
+// Requests sent to the target together. Their replies arrive on the
+// pool's I/O thread, and the last one hands the batch to the event loop
+// like a finished background job, see migrate_batch_done.
+struct MigrateBatch {
+  BgJob job;
+  // the keys restored, with their versions when they were sent, and the
+  // keys deleted
+  vector<pair<string, uint64_t>> keys;
+  vector<string> dels;
+  std::atomic<size_t> pending{0};
+  pthread_mutex_t mu = PTHREAD_MUTEX_INITIALIZER;
+  bool failed = false; // and the first error, under mu
+  string err;
+};
+
+static void migrate_reply(const RcReply *reply, void *arg) {
+  MigrateBatch *b = (MigrateBatch *)arg;
+  if (reply->type == SER_ERR) {
+    pthread_mutex_lock(&b->mu);
+    if (!b->failed) {
+      b->failed = true;
+      b->err.assign(reply->str, reply->len);
+    }
+    pthread_mutex_unlock(&b->mu);
+  }
+  if (--b->pending == 0) {
+    bg_finish(&b->job);
+  }
+}
+
+static void migrate_batch_done(BgJob *job);
+
+static void migrate_send(SlotMigration *m, MigrateBatch *b,
+                         const vector<vector<string>> &reqs) {
+  b->job.done = &migrate_batch_done;
+  b->pending = reqs.size() + b->dels.size();
+  m->batch = b;
+  m->deadline_us = get_monotonic_usec() + k_migrate_timeout_ms * 1000;
+  g_data.migration_due_us = m->deadline_us;
+  g_data.bg_jobs++;
+  // ahead of the restores, which may bring the key back
+  for (const string &key : b->dels) {
+    rc_send_after(&m->pool, {"asking"}, {"del", key}, &migrate_reply, b);
+  }
+  for (const vector<string> &req : reqs) {
+    rc_send(&m->pool, req, &migrate_reply, b);
+  }
+}
+
+// Tells the nodes about a finished or failed migration from a worker, then
+// frees it. The target's pool is closed there, which also fails what is
+// still pending on it; the target is told on a new connection, the failure
+// may have been the loss of that one.
+struct SetslotJob {
+  BgJob job;
+  SlotMigration *m = NULL;
+  vector<string> args;
+  vector<string> nodes; // addresses of the nodes to tell
+};
+
+static void setslot_job_run(BgJob *job) {
+  SetslotJob *j = container_of(job, SetslotJob, job);
+  SlotMigration *m = j->m;
+  string ignored;
+  if (m->open) {
+    rc_pool_close(&m->pool);
+  }
+  // a node missed here learns it from the redirects of this one
+  for (const string &addr : j->nodes) {
+    RcPool pool;
+    if (cluster_connect(&pool, addr) < 0) {
+      continue;
+    }
+    cluster_send(&pool, j->args, &ignored);
+    rc_pool_close(&pool);
+  }
+}
+
+static void setslot_job_done(BgJob *job) {
+  SetslotJob *j = container_of(job, SetslotJob, job);
+  delete j->m;
+  delete j;
+}
+
+static void migration_end(SlotMigration *m, bool done, const string &err) {
+  const string &target = g_data.cluster.nodes[m->target];
+  slots_set(g_data.migrating, m->lo, m->hi, k_no_node);
+  g_data.migration = NULL;
+  SetslotJob *j = new SetslotJob();
+  j->job.run = &setslot_job_run;
+  j->job.done = &setslot_job_done;
+  j->m = m;
+  if (!done) {
+    j->args = {"cluster", "setslot", m->range, "stable"};
+    j->nodes.push_back(target);
+    log_warn("migration of slots %s to %s failed: %s", m->range.c_str(),
+             target.c_str(), err.c_str());
+  } else {
+    // the target already knows, see cluster_cron
+    slotmap_assign(&g_data.cluster, m->lo, m->hi, m->target);
+    j->args = {"cluster", "setslot", m->range, "node", target};
+    for (uint16_t node = 0; node < g_data.cluster.nodes.size(); node++) {
+      if (node != m->target && node != g_data.cluster_self) {
+        j->nodes.push_back(g_data.cluster.nodes[node]);
+      }
+    }
+    log_info("migrated slots %s to %s: %zu keys in %.1f s", m->range.c_str(),
+             target.c_str(), m->keys,
+             (double)(get_monotonic_usec() - m->start_us) / 1e6);
+  }
+  bg_queue(&j->job);
+}
+
+// Before a key has moved, a failure stops the migration. After that the
+// moved keys are only on the target, and a failed SETSLOT NODE may have
+// been applied there, so the slots stay migrating: the source connects
+// again and goes on where it was.
+static void migration_fail(SlotMigration *m, const string &err) {
+  if (m->keys == 0 && !m->assigned) {
+    migration_end(m, false, err);
+    return;
+  }
+  log_warn("migration of slots %s to %s: %s, retrying in %u ms",
+           m->range.c_str(), g_data.cluster.nodes[m->target].c_str(),
+           err.c_str(), k_migrate_retry_ms);
+  m->state = MIG_WAITING;
+  m->retry_us = get_monotonic_usec() + k_migrate_retry_ms * 1000;
+  g_data.migration_due_us = m->retry_us;
+}
+
+// A key is sent again if it was written while on its way, and deleted on
+// the target if it was deleted here. It stays held until the target's copy
+// is known to match, see SlotMigration::held.
+static void migrate_batch_done(BgJob *job) {
+  MigrateBatch *b = container_of(job, MigrateBatch, job);
+  SlotMigration *m = g_data.migration;
+  if (!m || m->batch != b) {
+    delete b; // the migration failed meanwhile
+    return;
+  }
+  m->batch = NULL;
+  g_data.migration_due_us = 0;
+  if (b->failed) {
+    string err = b->err; // its keys stay held
+    delete b;
+    migration_fail(m, err);
+    return;
+  }
+  if (m->state == MIG_FINISHING) {
+    delete b;
+    migration_end(m, true, "");
+    return;
+  }
+  for (string &key : b->dels) {
+    if (!entry_find(key)) {
+      m->held.erase(key);
+    }
+  }
+  for (pair<string, uint64_t> &k : b->keys) {
+    Entry *ent = entry_find(k.first);
+    if (ent && ent->version == k.second) {
+      m->held.erase(k.first);
+      tracking_invalidate(k.first, NULL);
+      entry_del(entry_pop(k.first));
+      m->keys++;
+    }
+  }
+  delete b;
+}
+
+// whether this node serves a key of a migrating slot that it does not have
+static bool migration_holds(const string &key) {
+  SlotMigration *m = g_data.migration;
+  return m && m->held.count(key);
+}
+
+struct MigrateScan {
+  SlotMigration *m = NULL;
+  vector<Entry *> ents;
+};
+
+static void migrate_scan_node(HNode *node, void *arg) {
+  MigrateScan *ms = (MigrateScan *)arg;
+  Entry *ent = container_of(node, Entry, node);
+  uint32_t slot = key_slot(ent->key.data(), ent->key.size());
+  if (slot >= ms->m->lo && slot <= ms->m->hi) {
+    ms->ents.push_back(ent);
+  }
+}
+
+// Sends the next batch of keys of the migrating slots, and the assignment
+// of the slots once none are left. One batch is on its way at a time; the
+// loop goes on meanwhile and its reply comes through the background job
+// queue. A batch not answered in time fails the migration.
+static void migrate_reconnect(SlotMigration *m);
+
+static void cluster_cron() {
+  SlotMigration *m = g_data.migration;
+  if (!m || m->state == MIG_CONNECTING) {
+    return;
+  }
+  if (m->state == MIG_WAITING) {
+    if (get_monotonic_usec() >= m->retry_us) {
+      migrate_reconnect(m);
+    }
+    return;
+  }
+  if (m->batch) {
+    if (get_monotonic_usec() >= m->deadline_us) {
+      // freed when the pool is closed, which fails its requests
+      m->batch = NULL;
+      migration_fail(m, "timed out");
+    }
+    return;
+  }
+  size_t left = 0;
+  for (uint32_t s = m->lo; s <= m->hi; s++) {
+    left += g_data.slot_keys[s];
+  }
+  if (left == 0 && m->held.empty()) {
+    m->state = MIG_FINISHING;
+    m->assigned = true;
+    const string &target = g_data.cluster.nodes[m->target];
+    migrate_send(m, new MigrateBatch(),
+                 {{"cluster", "setslot", m->range, "node", target}});
+    return;
+  }
+
+  MigrateScan ms;
+  ms.m = m;
+  for (size_t i = 0;
+       left && i < k_migrate_scan && ms.ents.size() < k_migrate_batch; i++) {
+    m->cursor = hm_scan(&g_data.db, m->cursor, &migrate_scan_node, &ms);
+    if (m->cursor == 0) {
+      break;
+    }
+  }
+  MigrateBatch *b = new MigrateBatch();
+  for (string key : m->held) {
+    if (!entry_find(key)) {
+      b->dels.push_back(key);
+    }
+  }
+  vector<vector<string>> reqs;
+  unordered_set<string> seen; // a resizing table may yield a key twice
+  for (Entry *ent : ms.ents) {
+    if (!seen.insert(ent->key).second) {
+      continue;
+    }
+    if (!entry_dump(ent, reqs)) {
+      delete b;
+      migration_fail(m, "an element of " + ent->key +
+                            " does not fit in a request");
+      return;
+    }
+    b->keys.emplace_back(ent->key, ent->version);
+    m->held.insert(ent->key);
+  }
+  if (reqs.empty() && b->dels.empty()) {
+    delete b; // nothing in this part of the table, go on next iteration
+    return;
+  }
+  migrate_send(m, b, reqs);
+}
+
+// Connects to the target and has it import the slots, on a worker while
+// the connection that sent CLUSTER MIGRATE waits. After a failure it
+// connects again with no connection waiting, see migration_fail.
+struct MigrateStartJob {
+  BgJob job;
+  SlotMigration *m = NULL;
+  bool resume = false;
+  string addr;
+  vector<string> args; // empty once the slots were assigned to the target
+  string err;
+};
+
+static void migrate_start_run(BgJob *job) {
+  MigrateStartJob *j = container_of(job, MigrateStartJob, job);
+  string err;
+  if (j->m->open) {
+    rc_pool_close(&j->m->pool);
+    j->m->open = false;
+  }
+  if (cluster_connect(&j->m->pool, j->addr) < 0) {
+    j->err = "ERR Can't connect to " + j->addr;
+    return;
+  }
+  j->m->open = true;
+  if (!j->args.empty() && !cluster_send(&j->m->pool, j->args, &err)) {
+    j->err = "ERR Target refused the slots: " + err;
+  }
+}
+
+static void migrate_start_done(BgJob *job) {
+  MigrateStartJob *j = container_of(job, MigrateStartJob, job);
+  SlotMigration *m = j->m;
+  if (j->resume) {
+    if (!j->err.empty()) {
+      migration_fail(m, j->err.substr(4)); // without "ERR "
+    } else {
+      m->state = MIG_STREAMING;
+      g_data.migration_due_us = 0;
+      log_info("resumed migration of slots %s to %s", m->range.c_str(),
+               j->addr.c_str());
+    }
+    delete j;
+    return;
+  }
+  string out;
+  Connection *con = bg_conn(job);
+  g_data.proto = con ? con->proto : PROTO_NATIVE;
+  if (!j->err.empty()) {
+    if (m->open) {
+      rc_pool_close(&m->pool);
+    }
+    delete m;
+    g_data.migration = NULL;
+    out_err(out, j->err);
+  } else {
+    slots_set(g_data.migrating, m->lo, m->hi, m->target);
+    m->state = MIG_STREAMING;
+    g_data.migration_due_us = 0;
+    log_info("migrating slots %s to %s", m->range.c_str(), j->addr.c_str());
+    out_ok(out);
+  }
+  g_data.proto = PROTO_NATIVE;
+  if (con) {
+    conn_unblock(con, out);
+  }
+  delete j;
+}
+
+static MigrateStartJob *migrate_start_job(SlotMigration *m) {
+  SlotMap &map = g_data.cluster;
+  MigrateStartJob *j = new MigrateStartJob();
+  j->job.run = &migrate_start_run;
+  j->job.done = &migrate_start_done;
+  j->m = m;
+  j->addr = map.nodes[m->target];
+  if (!m->assigned) {
+    j->args = {"cluster", "setslot", m->range, "importing",
+               map.nodes[g_data.cluster_self]};
+  }
+  m->state = MIG_CONNECTING;
+  g_data.migration_due_us = (uint64_t)-1;
+  return j;
+}
+
+static void migrate_reconnect(SlotMigration *m) {
+  MigrateStartJob *j = migrate_start_job(m);
+  j->resume = true;
+  bg_queue(&j->job);
+}
+
+// cluster migrate <slots> <addr>: starts moving a range of slots served
+// here to another node, see cluster_cron
+static uint32_t cluster_migrate(vector<string> &cmd, string &out) {
+  uint32_t lo = 0, hi = 0;
+  if (!parse_slot_arg(cmd[2], lo, hi, out)) {
+    return RES_ERR;
+  }
+  string host, msg;
+  uint16_t port = 0;
+  SlotMap &map = g_data.cluster;
+  for (uint32_t s = lo; s <= hi && msg.empty(); s++) {
+    if (map.owner[s] != g_data.cluster_self) {
+      msg = "ERR I'm not the owner of hash slot " + to_string(s);
+    }
+  }
+  if (msg.empty() && !parse_node_addr(cmd[3], &host, &port)) {
+    msg = "ERR Invalid node address";
+  } else if (msg.empty() && cmd[3] == map.nodes[g_data.cluster_self]) {
+    msg = "ERR Can't migrate slots to myself";
+  } else if (msg.empty() && g_data.migration) {
+    msg = "ERR A slot migration is already in progress";
+  } else if (msg.empty() && !bg_available()) {
+    msg = "ERR Can't start a slot migration here";
+  }
+  if (!msg.empty()) {
+    out_err(out, msg);
+    return RES_ERR;
+  }
+
+  SlotMigration *m = new SlotMigration();
+  m->lo = lo;
+  m->hi = hi;
+  m->range = to_string(lo) + "-" + to_string(hi);
+  m->target = slotmap_node(&map, cmd[3]);
+  m->start_us = get_monotonic_usec();
+  g_data.migration = m;
+  bg_submit(&migrate_start_job(m)->job);
+  return RES_OK;
+}
+
+// cluster setslot <slots> node <addr> | importing <addr> | stable
+static uint32_t cluster_setslot(vector<string> &cmd, string &out) {
+  uint32_t lo = 0, hi = 0;
+  if (!parse_slot_arg(cmd[2], lo, hi, out)) {
+    return RES_ERR;
+  }
+  string host;
+  uint16_t port = 0;
+  bool with_node = cmd.size() == 5 && (arg_is(cmd[3], "node") ||
+                                       arg_is(cmd[3], "importing"));
+  if (!(cmd.size() == 4 && arg_is(cmd[3], "stable")) &&
+      !(with_node && parse_node_addr(cmd[4], &host, &port))) {
+    string msg = "ERR syntax error";
+    out_err(out, msg);
+    return RES_ERR;
+  }
+  if (arg_is(cmd[3], "stable")) {
+    slots_set(g_data.importing, lo, hi, k_no_node);
+  } else if (arg_is(cmd[3], "importing")) {
+    slots_set(g_data.importing, lo, hi, slotmap_node(&g_data.cluster, cmd[4]));
+  } else {
+    slotmap_assign(&g_data.cluster, lo, hi,
+                   slotmap_node(&g_data.cluster, cmd[4]));
+    slots_set(g_data.importing, lo, hi, k_no_node);
+  }
+  out_ok(out);
+  return RES_OK;
+}
+
+static uint32_t do_cluster(vector<string> &cmd, string &out) {
+  if (!g_data.cluster_on) {
+    return out_cluster_off(out);
+  }
+  SlotMap &map = g_data.cluster;
+  uint32_t lo = 0, hi = 0;
+  if (arg_is(cmd[1], "keyslot") && cmd.size() == 3) {
+    out_int(out, key_slot(cmd[2].data(), cmd[2].size()));
+  } else if (arg_is(cmd[1], "countkeysinslot") && cmd.size() == 3) {
+    if (!parse_slot_arg(cmd[2], lo, hi, out) || lo != hi) {
+      return RES_ERR;
+    }
+    out_int(out, g_data.slot_keys[lo]);
+  } else if (arg_is(cmd[1], "myid") && cmd.size() == 2) {
+    out_str(out, map.nodes[g_data.cluster_self]);
+  } else if (arg_is(cmd[1], "slots") && cmd.size() == 2) {
+    // [first, last, address] for each run of slots
+    vector<SlotRange> ranges = slotmap_ranges(&map);
+    out_arr(out, (uint32_t)ranges.size());
+    for (SlotRange &r : ranges) {
+      out_arr(out, 3);
+      out_int(out, r.lo);
+      out_int(out, r.hi);
+      out_str(out, map.nodes[r.node]);
+    }
+  } else if (arg_is(cmd[1], "info") && cmd.size() == 2) {
+    size_t assigned = 0, migrating = 0, importing = 0;
+    for (uint32_t s = 0; s < k_cluster_slots; s++) {
+      assigned += map.owner[s] != k_no_node;
+      migrating += g_data.migrating[s] != k_no_node;
+      importing += g_data.importing[s] != k_no_node;
+    }
+    string s;
+    info_add(s, "cluster_state:%s\r\n",
+             assigned == k_cluster_slots ? "ok" : "fail");
+    info_add(s, "cluster_slots_assigned:%zu\r\n", assigned);
+    info_add(s, "cluster_slots_served:%zu\r\n",
+             slotmap_count(&map, g_data.cluster_self));
+    info_add(s, "cluster_slots_migrating:%zu\r\n", migrating);
+    info_add(s, "cluster_slots_importing:%zu\r\n", importing);
+    info_add(s, "cluster_known_nodes:%zu\r\n", map.nodes.size());
+    out_str(out, s);
+  } else if (arg_is(cmd[1], "setslot") && cmd.size() >= 4) {
+    return cluster_setslot(cmd, out);
+  } else if (arg_is(cmd[1], "migrate") && cmd.size() == 4) {
+    return cluster_migrate(cmd, out);
+  } else {
+    string msg = "ERR unknown subcommand or wrong number of arguments";
     out_err(out, msg);
     return RES_ERR;
   }
+  return RES_OK;
+}
 
-  Entry key;
-  key.key.swap(cmd[1]);
-  key.node.hcode = str_hash((uint8_t *)key.key.data(), key.key.size());
-
-  HNode *node = hm_find(&g_data.db, &key.node, &entry_eq);
-  if (node) {
-    Entry *ent = container_of(node, Entry, node);
-    entry_set_ttl(ent, ttl_ms);
+// ASKING: lets the next command use a slot this node is importing
+static uint32_t do_asking(vector<string> &cmd, string &out) {
+  (void)cmd;
+  if (!g_data.cluster_on) {
+    return out_cluster_off(out);
+  }
+  if (g_data.cur_conn) {
+    g_data.cur_conn->asking = true;
   }
-  out_int(out, node ? 1 : 0);
+  out_ok(out);
   return RES_OK;
 }
 
-static void do_ttl(std::vector<std::string> &cmd, std::string &out) {
-  Entry key;
-  key.key.swap(cmd[1]);
-  key.node.hcode = str_hash((uint8_t *)key.key.data(), key.key.size());
+enum {
+  CMD_WRITE = 1 << 0,
+  // may grow memory, refused when over `maxmemory` and nothing can be evicted
+  CMD_DENYOOM = 1 << 1,
+  // allowed on a connection with subscriptions
+  CMD_PUBSUB = 1 << 2,
+  // runs at once inside MULTI instead of being queued
+  CMD_TXN = 1 << 3,
+  // refused inside MULTI: its reply would not be part of EXEC's
+  CMD_NOMULTI = 1 << 4,
+  // takes no key, so any node of a cluster runs it for its own data
+  CMD_NOKEY = 1 << 5,
+  // every argument from `write_key` on is a key
+  CMD_VARKEYS = 1 << 6,
+  // may use a slot being imported without ASKING first
+  CMD_ASKING = 1 << 7,
+  // the last argument is a timeout, not a key
+  CMD_TIMEOUT = 1 << 8,
+};
 
-  HNode *node = hm_find(&g_data.db, &key.node, &entry_eq);
-  if (!node) {
-    return out_int(out, -2);
-  }
+struct Command {
+  const char *name;
+  // exact number of words including the name, or -N for at least N
+  int32_t arity;
+  uint32_t flags;
+  uint32_t (*proc)(vector<string> &cmd, string &out);
+  // position of the first key, the one a CMD_WRITE command modifies
+  uint32_t write_key = 1;
+  // position of a key count the keys follow, as in ZUNIONSTORE, or 0
+  uint32_t numkeys = 0;
 
-  Entry *ent = container_of(node, Entry, node);
-  if (ent->heap_idx == (size_t)-1) {
-    return out_int(out, -1);
+  uint64_t calls = 0;
+  // latency in clock_ticks()
+  Histogram hist;
+};
+
+static uint32_t do_info(vector<string> &cmd, string &out);
+static uint32_t do_exec(vector<string> &cmd, string &out);
+
+static Command g_commands[] = {
+    {"pttl", 2, 0, &do_ttl},
+    {"pexpire", 3, CMD_WRITE, &do_expire},
+    {"zquery", 6, 0, &do_zquery},
+    {"zscore", 3, 0, &do_zscore},
+    {"zadd", 4, CMD_WRITE | CMD_DENYOOM, &do_zadd},
+    {"zunionstore", -4, CMD_WRITE | CMD_DENYOOM, &do_zunionstore, 1, 2},
+    {"zinterstore", -4, CMD_WRITE | CMD_DENYOOM, &do_zinterstore, 1, 2},
+    {"zpopmin", -2, CMD_WRITE, &do_zpopmin},
+    {"zpopmax", -2, CMD_WRITE, &do_zpopmax},
+    {"bzpopmin", -3, CMD_WRITE | CMD_VARKEYS | CMD_TIMEOUT, &do_bzpopmin},
+    {"bzpopmax", -3, CMD_WRITE | CMD_VARKEYS | CMD_TIMEOUT, &do_bzpopmax},
+    {"keys", -1, CMD_NOKEY, &do_keys},
+    {"scan", -2, CMD_NOKEY, &do_scan},
+    {"keyrange", -3, CMD_NOKEY, &do_keyrange},
+    {"set", 3, CMD_WRITE | CMD_DENYOOM, &do_set},
+    {"get", 2, 0, &do_get},
+    {"hset", -4, CMD_WRITE | CMD_DENYOOM, &do_hset},
+    {"hget", 3, 0, &do_hget},
+    {"hmget", -3, 0, &do_hmget},
+    {"hgetall", 2, 0, &do_hgetall},
+    {"hdel", -3, CMD_WRITE, &do_hdel},
+    {"hlen", 2, 0, &do_hlen},
+    {"lpush", -3, CMD_WRITE | CMD_DENYOOM, &do_lpush},
+    {"rpush", -3, CMD_WRITE | CMD_DENYOOM, &do_rpush},
+    {"lpop", -2, CMD_WRITE, &do_lpop},
+    {"rpop", -2, CMD_WRITE, &do_rpop},
+    {"lrange", 4, 0, &do_lrange},
+    {"llen", 2, 0, &do_llen},
+    {"lindex", 3, 0, &do_lindex},
+    {"sadd", -3, CMD_WRITE | CMD_DENYOOM, &do_sadd},
+    {"srem", -3, CMD_WRITE, &do_srem},
+    {"sismember", 3, 0, &do_sismember},
+    {"scard", 2, 0, &do_scard},
+    {"smembers", 2, 0, &do_smembers},
+    {"sinter", -2, CMD_VARKEYS, &do_sinter},
+    {"sintercard", -3, 0, &do_sintercard, 1, 1},
+    {"sunion", -2, CMD_VARKEYS, &do_sunion},
+    {"sdiff", -2, CMD_VARKEYS, &do_sdiff},
+    {"setbit", 4, CMD_WRITE | CMD_DENYOOM, &do_setbit},
+    {"getbit", 3, 0, &do_getbit},
+    {"bitcount", -2, 0, &do_bitcount},
+    {"bitpos", -3, 0, &do_bitpos},
+    {"bitop", -4, CMD_WRITE | CMD_DENYOOM | CMD_VARKEYS, &do_bitop, 2},
+    {"pfadd", -2, CMD_WRITE | CMD_DENYOOM, &do_pfadd},
+    {"pfcount", -2, CMD_VARKEYS, &do_pfcount},
+    {"pfmerge", -2, CMD_WRITE | CMD_DENYOOM | CMD_VARKEYS, &do_pfmerge},
+    {"publish", 3, CMD_NOKEY, &do_publish},
+    {"subscribe", -2, CMD_PUBSUB | CMD_NOMULTI | CMD_NOKEY, &do_subscribe},
+    {"psubscribe", -2, CMD_PUBSUB | CMD_NOMULTI | CMD_NOKEY, &do_psubscribe},
+    {"unsubscribe", -1, CMD_PUBSUB | CMD_NOMULTI | CMD_NOKEY, &do_unsubscribe},
+    {"punsubscribe", -1, CMD_PUBSUB | CMD_NOMULTI | CMD_NOKEY, &do_punsubscribe},
+    {"pubsub", -2, CMD_NOKEY, &do_pubsub},
+    {"del", 2, CMD_WRITE, &do_del},
+    {"multi", 1, CMD_TXN | CMD_NOKEY, &do_multi},
+    {"exec", 1, CMD_TXN | CMD_NOKEY, &do_exec},
+    {"discard", 1, CMD_TXN | CMD_NOKEY, &do_discard},
+    {"watch", -2, CMD_NOMULTI | CMD_VARKEYS, &do_watch},
+    {"unwatch", 1, CMD_NOKEY, &do_unwatch},
+    {"config", -3, CMD_NOKEY, &do_config},
+    {"info", -1, CMD_NOKEY, &do_info},
+    {"slowlog", -2, CMD_NOKEY, &do_slowlog},
+    {"latency", -2, CMD_NOKEY, &do_latency},
+    {"ping", -1, CMD_PUBSUB | CMD_NOKEY, &do_ping},
+    {"echo", 2, CMD_NOKEY, &do_echo},
+    {"hello", -1, CMD_NOMULTI | CMD_NOKEY, &do_hello},
+    {"command", -1, CMD_NOKEY, &do_command},
+    {"cluster", -2, CMD_NOKEY, &do_cluster},
+    {"asking", 1, CMD_NOKEY, &do_asking},
+    {"client", -2, CMD_NOKEY, &do_client},
+    {"restore", -5, CMD_WRITE | CMD_DENYOOM | CMD_ASKING, &do_restore},
+};
+
+static Command *cmd_lookup(vector<string> &cmd) {
+  if (cmd.empty()) {
+    return NULL;
+  }
+  for (Command &c : g_commands) {
+    if (!arg_is(cmd[0], c.name)) {
+      continue;
+    }
+    bool arity_ok = c.arity >= 0 ? cmd.size() == (size_t)c.arity
+                                 : cmd.size() >= (size_t)-c.arity;
+    return arity_ok ? &c : NULL;
   }
+  return NULL;
+}
 
-  uint64_t expire_at = g_data.heap[ent->heap_idx].val;
-  uint64_t now_us = get_monotonic_usec();
-  return out_int(out, expire_at > now_us ? (expire_at - now_us) / 1000 : 0);
+// the positions of the keys a command uses
+static void cmd_keys(Command *c, vector<string> &cmd, vector<size_t> &keys) {
+  if (c->flags & CMD_NOKEY) {
+    return;
+  }
+  if (c->numkeys) {
+    int64_t n = 0;
+    if (c->flags & CMD_WRITE) {
+      keys.push_back(c->write_key);
+    }
+    // a bad count is left for the command to report
+    if (str2int(cmd[c->numkeys], n) && n > 0) {
+      for (size_t i = c->numkeys + 1;
+           i < cmd.size() && i <= c->numkeys + (size_t)n; i++) {
+        keys.push_back(i);
+      }
+    }
+    return;
+  }
+  size_t last = (c->flags & CMD_VARKEYS) ? cmd.size() : c->write_key + 1;
+  if (c->flags & CMD_TIMEOUT) {
+    last--;
+  }
+  for (size_t i = c->write_key; i < last && i < cmd.size(); i++) {
+    keys.push_back(i);
+  }
 }
 
-static uint32_t do_get(vector<string> &cmd, string &out) {
-  Entry key;
-  key.key.swap(cmd[1]);
-  key.node.hcode = str_hash((uint8_t *)key.key.data(), key.key.size());
-  HNode *node = hm_find(&g_data.db, &key.node, &entry_cmp);
+// Cluster mode: whether this node runs the command, else the redirect for
+// it. The keys of a command must share a slot. A slot migrating away is
+// served for the keys still here; one being imported only after ASKING.
+static bool cluster_check(Command *c, vector<string> &cmd, string &out) {
+  vector<size_t> keys;
+  cmd_keys(c, cmd, keys);
+  if (keys.empty()) {
+    return true;
+  }
+  uint32_t slot = key_slot(cmd[keys[0]].data(), cmd[keys[0]].size());
+  for (size_t i : keys) {
+    if (key_slot(cmd[i].data(), cmd[i].size()) != slot) {
+      string msg = "CROSSSLOT Keys in request don't hash to the same slot";
+      out_err(out, msg);
+      return false;
+    }
+  }
+  SlotMap &map = g_data.cluster;
+  uint16_t owner = map.owner[slot];
+  Connection *con = g_data.cur_conn;
+  string msg;
+  if (owner == g_data.cluster_self) {
+    uint16_t target = g_data.migrating[slot];
+    size_t present = 0;
+    for (size_t i = 0; target != k_no_node && i < keys.size(); i++) {
+      present += entry_find(cmd[keys[i]]) != NULL ||
+                 migration_holds(cmd[keys[i]]);
+    }
+    if (target == k_no_node || present == keys.size()) {
+      return true;
+    }
+    if (present == 0) {
+      msg = "ASK " + to_string(slot) + " " + map.nodes[target];
+    } else {
+      msg = "TRYAGAIN Multiple keys request during rehashing of slot";
+    }
+  } else if (g_data.importing[slot] != k_no_node &&
+             ((con && con->asking) || (c->flags & CMD_ASKING))) {
+    return true;
+  } else if (owner == k_no_node) {
+    msg = "CLUSTERDOWN Hash slot not served";
+  } else {
+    msg = "MOVED " + to_string(slot) + " " + map.nodes[owner];
+  }
+  out_err(out, msg);
+  return false;
+}
 
-  if (!node) {
-    string msg = "Not found";
-    out_err(out, msg);
-    return RES_NF;
+// runs a command that passed the checks of try_cmd
+static uint32_t cmd_call(Command *c, vector<string> &cmd, string &out) {
+  if ((c->flags & CMD_DENYOOM) && perform_evictions() == EVICT_FAIL) {
+    string reply = "OOM command not allowed when used memory > 'maxmemory'";
+    out_err(out, reply);
+    return RES_ERR;
+  }
+  uint64_t t0 = clock_ticks();
+  uint32_t res = c->proc(cmd, out);
+  uint64_t ticks = clock_ticks() - t0;
+  hist_record(&c->hist, ticks);
+  c->calls++;
+  g_data.total_commands++;
+  if ((c->flags & CMD_WRITE) && res != RES_ERR) {
+    // also when nothing changed, which only costs a watcher a retry
+    Entry *ent = entry_find(cmd[c->write_key]);
+    if (ent) {
+      ent->version = ++g_data.key_version;
+      HMap *map = entry_map(ent);
+      if (map && hm_rehash_pending(map)) {
+        g_data.rehash_keys.insert(cmd[c->write_key]);
+      }
+    }
+    tracking_invalidate(cmd[c->write_key], g_data.cur_conn);
+    if (g_data.bzpop_waiters.count(cmd[c->write_key])) {
+      g_data.bzpop_ready.push_back(cmd[c->write_key]);
+    }
+  }
+  if (!g_data.bzpop_ready.empty() && !g_data.in_exec) {
+    bzpop_serve();
+  }
+  Connection *con = g_data.cur_conn;
+  if (con && con->tracking && !con->tracking_bcast &&
+      !(c->flags & (CMD_WRITE | CMD_NOKEY)) && res != RES_ERR) {
+    vector<size_t> keys;
+    cmd_keys(c, cmd, keys);
+    for (size_t pos : keys) {
+      tracking_add(con, cmd[pos]);
+    }
   }
 
-  string &val = (container_of(node, Entry, node))->val;
-  assert(val.size() <= MAX_BUF);
-  out_str(out, val);
-  return RES_OK;
+  uint64_t us = ticks_to_usec(ticks);
+  slowlog_push(cmd, us, g_data.cur_conn ? g_data.cur_conn->fd : -1);
+  latency_add(LAT_COMMAND, us);
+  return res;
 }
 
-static uint32_t do_del(vector<string> &cmd, string &out) {
-  // (void)writeBuf;
-  // (void)write_size;
-  Entry key;
-  key.key.swap(cmd[1]);
-  key.node.hcode = str_hash((uint8_t *)key.key.data(), key.key.size());
-
-  out.push_back(SER_INT);
-  HNode *node = hm_pop(&g_data.db, &key.node, &entry_cmp);
-  uint64_t val = 0;
-  if (node) {
-    delete container_of(node, Entry, node);
-    val = 1;
+// queues a command of a MULTI block, checked now so that EXEC fails early
+static uint32_t multi_queue(Connection *con, Command *c, vector<string> &cmd,
+                            string &out) {
+  if (c->flags & CMD_NOMULTI) {
+    con->multi_failed = true;
+    string reply = "ERR Command not allowed inside a transaction";
+    out_err(out, reply);
+    return RES_ERR;
+  }
+  size_t bytes = sizeof(vector<string>) + cmd.size() * sizeof(string);
+  for (const string &arg : cmd) {
+    bytes += str_mem(arg);
+  }
+  con->multi_cmds.push_back(cmd);
+  con->multi_bytes += bytes;
+  g_data.used_memory += bytes;
+  if (conn_input_bytes(con) > g_config.client_query_buffer_limit) {
+    log_verbose("query buffer limit reached on connection %d", con->fd);
+    g_data.input_limit_disconnects++;
+    con->state = END;
+    return RES_ERR;
+  }
+  if (g_data.proto == PROTO_NATIVE) {
+    out_str(out, "QUEUED", 6);
+  } else {
+    out.append("+QUEUED\r\n");
   }
-  out.append((char *)&val, 8);
   return RES_OK;
 }
 
-static uint32_t do_set(vector<string> &cmd, string &out) {
-  Entry key;
-  key.key.swap(cmd[1]);
-  key.node.hcode = str_hash((uint8_t *)key.key.data(), key.key.size());
-  HNode *node = hm_find(&g_data.db, &key.node, &entry_cmp);
-  out.push_back(SER_NIL);
-  if (node) {
-    (container_of(node, Entry, node))->val.swap(cmd[2]);
-  } else {
-    Entry *e = new Entry(key);
-    e->val.swap(cmd[2]);
-    hm_insert(&g_data.db, &e->node);
+static uint32_t try_cmd(vector<string> &cmd, string &out) {
+  Command *c = cmd_lookup(cmd);
+  Connection *con = g_data.cur_conn;
+  if (!c) {
+    if (con && con->in_multi) {
+      con->multi_failed = true;
+    }
+    string reply = "Error Invalid Command";
+    out_err(out, reply);
+    return RES_ERR;
+  }
+  if (con && conn_subscribed(con) && !(c->flags & CMD_PUBSUB) &&
+      g_data.proto != PROTO_RESP3) {
+    // the replies would be mistaken for messages
+    string reply = "ERR Can't execute '" + cmd[0] +
+                   "': only (P)SUBSCRIBE / (P)UNSUBSCRIBE / PING are allowed "
+                   "in this context";
+    out_err(out, reply);
+    return RES_ERR;
+  }
+  bool served = !g_data.cluster_on || cluster_check(c, cmd, out);
+  if (con && c->proc != &do_asking) {
+    // ASKING holds for one command
+    con->asking = false;
+  }
+  if (!served) {
+    if (con && con->in_multi) {
+      con->multi_failed = true;
+    }
+    return RES_ERR;
+  }
+  if (con && con->in_multi && !(c->flags & CMD_TXN)) {
+    return multi_queue(con, c, cmd, out);
+  }
+  return cmd_call(c, cmd, out);
+}
+
+// EXEC: runs the queued commands with nothing in between and replies with
+// an array of their replies, sent as one write. Null if a watched key
+// changed, and nothing runs.
+static uint32_t do_exec(vector<string> &cmd, string &out) {
+  (void)cmd;
+  Connection *con = NULL;
+  if (!txn_conn(con, out)) {
+    return RES_ERR;
+  }
+  if (!con->in_multi) {
+    string msg = "ERR EXEC without MULTI";
+    out_err(out, msg);
+    return RES_ERR;
+  }
+  bool failed = con->multi_failed;
+  bool changed = watched_changed(con);
+  vector<vector<string>> cmds;
+  cmds.swap(con->multi_cmds);
+  conn_multi_reset(con);
+  con->watched.clear();
+  if (failed) {
+    string msg =
+        "EXECABORT Transaction discarded because of previous errors.";
+    out_err(out, msg);
+    return RES_ERR;
+  }
+  if (changed) {
+    if (g_data.proto == PROTO_RESP2) {
+      out.append("*-1\r\n");
+    } else {
+      out_nil(out);
+    }
+    return RES_OK;
   }
 
+  out_arr(out, (uint32_t)cmds.size());
+  string reply;
+  g_data.in_exec = true;
+  for (vector<string> &args : cmds) {
+    reply.clear();
+    cmd_call(cmd_lookup(args), args, reply);
+    if (reply.size() > MAX_BUF) {
+      // as if it had run on its own
+      reply.clear();
+      string msg = "reply exceeds " + to_string(MAX_BUF) + " bytes";
+      out_err(reply, msg);
+    }
+    out.append(reply);
+  }
+  g_data.in_exec = false;
+  if (out.size() > MAX_BUF) {
+    // too large for writeBuf, queued whole instead
+    conn_push_str(con, out);
+    out.clear();
+  }
   return RES_OK;
 }
-// TYPE - SIZE - DATA
-static void pack_str(HNode *node, void *container) {
-  string &out = *(string *)container;
-  out_str(out, (container_of(node, Entry, node))->val);
+
+static void info_add(string &out, const char *fmt, ...) {
+  char buf[256];
+  va_list ap;
+  va_start(ap, fmt);
+  int n = vsnprintf(buf, sizeof(buf), fmt, ap);
+  va_end(ap);
+  if (n > 0) {
+    out.append(buf, min((size_t)n, sizeof(buf) - 1));
+  }
 }
-static uint32_t do_keys(vector<string> &cmd, string &out) {
-  uint32_t size = (uint32_t)hm_size(&g_data.db);
-  out_arr(out, size);
-  h_scan(&g_data.db.ht1, pack_str, &out);
-  h_scan(&g_data.db.ht2, pack_str, &out);
-  return 0;
+
+// averaged over the sample ring filled by stats_cron
+static uint64_t instantaneous_ops() {
+  size_t newest = (g_data.ops_sample_idx + 15) % 16;
+  // until the ring wraps the first sample is at index 0
+  size_t oldest = g_data.ops_sample_us[g_data.ops_sample_idx]
+                      ? g_data.ops_sample_idx
+                      : 0;
+  uint64_t dt = g_data.ops_sample_us[newest] - g_data.ops_sample_us[oldest];
+  if (dt == 0) {
+    return 0;
+  }
+  uint64_t dc =
+      g_data.ops_sample_cmds[newest] - g_data.ops_sample_cmds[oldest];
+  return dc * 1000000 / dt;
 }
 
-static uint32_t do_zscore(vector<string> &cmd, string &out) {
-  string zsetName = cmd[1];
-  string member = cmd[2];
-  Entry key;
-  key.key = zsetName;
-  key.node.hcode = str_hash((uint8_t *)key.key.data(), key.key.size());
-  key.type = 1;
-  HNode *node = hm_find(&g_data.db, &key.node, &entry_cmp);
-  if (!node) {
-    string reply = "Not found";
-    out_err(out, reply);
-    return RES_NF;
+static void stats_cron() {
+  const uint64_t k_ops_sample_us = 100 * 1000;
+  size_t last = (g_data.ops_sample_idx + 15) % 16;
+  if (g_data.now_us - g_data.ops_sample_us[last] < k_ops_sample_us) {
+    return;
   }
+  // the longer the baseline, the more precise the tick rate
+  g_data.ticks_per_us =
+      1000.0 * clock_ticks_per_ns(g_data.start_ticks, g_data.start_us * 1000,
+                                  clock_ticks(), get_monotonic_usec() * 1000);
+  g_data.ops_sample_us[g_data.ops_sample_idx] = g_data.now_us;
+  g_data.ops_sample_cmds[g_data.ops_sample_idx] = g_data.total_commands;
+  g_data.ops_sample_idx = (g_data.ops_sample_idx + 1) % 16;
+}
 
-  ZSet *set = (container_of(node, Entry, node))->zset;
-  ZNode *znode = zset_lookup(set, member.data(), member.length());
-  int score = znode->score;
-  out_int(out, score);
-  return RES_OK;
+static bool info_section(vector<string> &cmd, const char *name) {
+  return cmd.size() < 2 || arg_is(cmd[1], name) || arg_is(cmd[1], "all");
 }
 
-static uint32_t do_zadd(vector<string> &cmd, string &out) {
-  string zsetName = cmd[1];
-  double score = atof(cmd[2].c_str());
-  Entry key;
-  key.key = zsetName;
-  key.node.hcode = str_hash((uint8_t *)key.key.data(), key.key.size());
-  key.type = 1;
-  HNode *node = hm_find(&g_data.db, &key.node, &entry_cmp);
-  if (!node) {
-    Entry *e = new Entry(key);
-    e->zset = new ZSet();
-    zset_add(e->zset, cmd[3].data(), cmd[3].length(), score);
-    hm_insert(&g_data.db, &e->node);
-  } else {
-    ZSet *set = (container_of(node, Entry, node))->zset;
-    zset_add(set, cmd[3].data(), cmd[3].length(), score);
+// INFO [section]: a text report of `key:value` lines grouped in sections
+static uint32_t do_info(vector<string> &cmd, string &out) {
+  string s;
+  double tpu = g_data.ticks_per_us;
+  if (info_section(cmd, "server")) {
+    info_add(s, "# Server\r\n");
+    info_add(s, "io_backend:%s\r\n", g_data.io_uring ? "io_uring" : "poll");
+    info_add(s, "uptime_in_seconds:%lu\r\n",
+             (unsigned long)((g_data.now_us - g_data.start_us) / 1000000));
+    info_add(s, "eventloop_iterations:%lu\r\n",
+             (unsigned long)g_data.loop_hist.total);
+    info_add(s, "eventloop_usec_p50:%.1f\r\n",
+             hist_percentile(&g_data.loop_hist, 0.5) / tpu);
+    info_add(s, "eventloop_usec_p99:%.1f\r\n",
+             hist_percentile(&g_data.loop_hist, 0.99) / tpu);
+    info_add(s, "eventloop_usec_max:%.1f\r\n", g_data.loop_hist.max / tpu);
+  }
+  if (info_section(cmd, "clients")) {
+    info_add(s, "# Clients\r\n");
+    info_add(s, "connected_clients:%zu\r\n", g_data.nconnections);
+    size_t in_bytes = 0, out_bytes = 0, in_max = 0, out_max = 0, paused = 0;
+    for (Connection *con : g_data.connections) {
+      if (!con) {
+        continue;
+      }
+      in_bytes += conn_input_bytes(con);
+      out_bytes += conn_output_bytes(con);
+      in_max = max(in_max, conn_input_bytes(con));
+      out_max = max(out_max, conn_output_bytes(con));
+      // not read until the output is sent
+      paused += con->state == RES;
+    }
+    info_add(s, "client_input_buffer_bytes:%zu\r\n", in_bytes);
+    info_add(s, "client_output_buffer_bytes:%zu\r\n", out_bytes);
+    info_add(s, "client_max_input_buffer:%zu\r\n", in_max);
+    info_add(s, "client_max_output_buffer:%zu\r\n", out_max);
+    info_add(s, "clients_paused_reading:%zu\r\n", paused);
+    info_add(s, "clients_over_soft_limit:%zu\r\n", g_data.soft_limited);
+    info_add(s, "tracking_clients:%zu\r\n", g_data.tracking_conns.size());
+    info_add(s, "blocked_clients:%zu\r\n", g_data.blocked_clients);
+  }
+  if (info_section(cmd, "memory")) {
+    info_add(s, "# Memory\r\n");
+    info_add(s, "used_memory:%zu\r\n", mem_used());
+    info_add(s, "maxmemory:%lu\r\n", (unsigned long)g_config.maxmemory);
+    info_add(s, "maxmemory_policy:%s\r\n",
+             k_evict_policy_names[g_config.maxmemory_policy]);
+    info_add(s, "pubsub_buffer_bytes:%zu\r\n", g_data.pubsub_buf_bytes);
+    info_add(s, "compressed_values:%zu\r\n", g_data.lz_values);
+    info_add(s, "compressed_value_bytes:%zu\r\n", g_data.lz_bytes);
+    info_add(s, "compressed_value_raw_bytes:%zu\r\n", g_data.lz_raw_bytes);
+  }
+  if (info_section(cmd, "stats")) {
+    info_add(s, "# Stats\r\n");
+    info_add(s, "total_connections_received:%lu\r\n",
+             (unsigned long)g_data.total_connections);
+    info_add(s, "total_commands_processed:%lu\r\n",
+             (unsigned long)g_data.total_commands);
+    info_add(s, "instantaneous_ops_per_sec:%lu\r\n",
+             (unsigned long)instantaneous_ops());
+    info_add(s, "total_net_input_bytes:%lu\r\n",
+             (unsigned long)g_data.net_input_bytes);
+    info_add(s, "total_net_output_bytes:%lu\r\n",
+             (unsigned long)g_data.net_output_bytes);
+    info_add(s, "expired_keys:%lu\r\n", (unsigned long)g_data.expired_keys);
+    info_add(s, "evicted_keys:%lu\r\n", (unsigned long)g_data.evicted_keys);
+    info_add(s, "pubsub_channels:%zu\r\n", g_data.channels.size());
+    info_add(s, "pubsub_patterns:%zu\r\n", g_data.patterns.size());
+    info_add(s, "pubsub_messages:%lu\r\n",
+             (unsigned long)g_data.pubsub_messages);
+    info_add(s, "tracking_total_keys:%zu\r\n", hm_size(&g_data.tracking));
+    info_add(s, "tracking_total_items:%zu\r\n", g_data.tracking_items);
+    info_add(s, "tracking_total_prefixes:%zu\r\n",
+             g_data.tracking_prefixes.size());
+    info_add(s, "tracking_invalidations:%lu\r\n",
+             (unsigned long)g_data.tracking_invalidations);
+    info_add(s, "tracking_evicted_keys:%lu\r\n",
+             (unsigned long)g_data.tracking_evicted_keys);
+    info_add(s, "output_limit_disconnections:%lu\r\n",
+             (unsigned long)g_data.output_limit_disconnects);
+    info_add(s, "input_limit_disconnections:%lu\r\n",
+             (unsigned long)g_data.input_limit_disconnects);
+  }
+  if (info_section(cmd, "commandstats")) {
+    info_add(s, "# Commandstats\r\n");
+    for (Command &c : g_commands) {
+      if (!c.calls) {
+        continue;
+      }
+      double usec = c.hist.sum / tpu;
+      info_add(s, "cmdstat_%s:calls=%lu,usec=%.0f,usec_per_call=%.2f\r\n",
+               c.name, (unsigned long)c.calls, usec, usec / c.calls);
+    }
   }
-  out.push_back(SER_NIL);
+  if (info_section(cmd, "latencystats")) {
+    info_add(s, "# Latencystats\r\n");
+    for (Command &c : g_commands) {
+      if (!c.calls) {
+        continue;
+      }
+      info_add(s,
+               "latency_percentiles_usec_%s:p50=%.3f,p99=%.3f,p99.9=%.3f,"
+               "max=%.3f\r\n",
+               c.name, hist_percentile(&c.hist, 0.5) / tpu,
+               hist_percentile(&c.hist, 0.99) / tpu,
+               hist_percentile(&c.hist, 0.999) / tpu, c.hist.max / tpu);
+    }
+  }
+  if (info_section(cmd, "keyspace")) {
+    info_add(s, "# Keyspace\r\n");
+    info_add(s, "keys:%zu\r\n", hm_size(&g_data.db));
+    info_add(s, "expires:%zu\r\n", g_data.heap.size());
+    info_add(s, "ht_buckets:%zu\r\n",
+             g_data.db.ht1.tab ? g_data.db.ht1.mask + 1 : 0);
+    info_add(s, "rehashing:%d\r\n", g_data.db.ht2.tab ? 1 : 0);
+    info_add(s, "rehashing_remaining:%zu\r\n", g_data.db.ht2.size);
+    info_add(s, "rehashing_values:%zu\r\n", g_data.rehash_keys.size());
+    info_add(s, "key_index:%d\r\n", g_data.keyidx_on ? 1 : 0);
+    info_add(s, "key_index_bytes:%zu\r\n", g_data.keyidx.mem);
+  }
+  if (info_section(cmd, "cluster")) {
+    info_add(s, "# Cluster\r\n");
+    info_add(s, "cluster_enabled:%d\r\n", g_data.cluster_on ? 1 : 0);
+    SlotMigration *m = g_data.migration;
+    info_add(s, "cluster_migrating:%d\r\n", m ? 1 : 0);
+    info_add(s, "cluster_migrated_keys:%zu\r\n", m ? m->keys : 0);
+  }
+  if (s.size() > MAX_BUF - 16) {
+    s.resize(MAX_BUF - 16);
+  }
+  out_str(out, s);
   return RES_OK;
 }
 
-static void *begin_arr(string &out) {
-  out.push_back(SER_ARR);
-  uint32_t placeHolder = 0;
-  out.append((char *)&placeHolder, 4);
-  return &out;
+// Parses one request of the native framing: nstr, then nstr (len, bytes)
+// pairs. Returns the number of bytes consumed, 0 if the request is still
+// incomplete, or -1 if it can never fit in the read buffer.
+static int64_t parse_req(const uint8_t *data, size_t size,
+                         vector<string> &cmd) {
+  if (size < 4) {
+    return 0;
+  }
+  uint32_t nstr = 0;
+  memcpy(&nstr, data, 4);
+  if (nstr > MAX_BUF / 4) {
+    return -1;
+  }
+  size_t cur = 4;
+  // assign() reuses the capacity left by earlier requests
+  cmd.resize(nstr);
+  for (uint32_t i = 0; i < nstr; i++) {
+    if (cur + 4 > size) {
+      return 0;
+    }
+    uint32_t len = 0;
+    memcpy(&len, &data[cur], 4);
+    cur += 4;
+    if (len > MAX_BUF) {
+      return -1;
+    }
+    if (cur + len > size) {
+      return 0;
+    }
+    cmd[i].assign((const char *)&data[cur], len);
+    cur += len;
+  }
+  return (int64_t)cur;
 }
 
-static void end_arr(string &out, void *arr, uint32_t len) {
-  char len_arr[4];
-  len_arr[0] = (len >> 24) & 0xff;
-  len_arr[1] = (len >> 16) & 0xff;
-  len_arr[2] = (len >> 8) & 0xff;
-  len_arr[3] = len & 0xff;
-  for (int i = 1; i < 5; i++) {
-    out[i] = len_arr[i - 1];
+// Reads a `<type>N\r\n` header at data[pos] and moves pos past it. Returns 1
+// when done, 0 if the line is still incomplete, -1 if it is malformed.
+static int resp_read_int(const uint8_t *data, size_t size, size_t &pos,
+                         char type, int64_t &val) {
+  if (pos >= size) {
+    return 0;
+  }
+  if (data[pos] != type) {
+    return -1;
+  }
+  const uint8_t *cr = (const uint8_t *)memchr(&data[pos], '\r', size - pos);
+  if (!cr) {
+    return size - pos > 24 ? -1 : 0;
+  }
+  if (cr + 1 == data + size) {
+    return 0;
+  }
+  if (cr[1] != '\n') {
+    return -1;
+  }
+  const uint8_t *p = &data[pos + 1];
+  bool neg = p < cr && *p == '-';
+  p += neg ? 1 : 0;
+  if (p == cr || cr - p > 18) {
+    return -1;
+  }
+  int64_t v = 0;
+  for (; p < cr; p++) {
+    if (*p < '0' || *p > '9') {
+      return -1;
+    }
+    v = v * 10 + (*p - '0');
   }
+  val = neg ? -v : v;
+  pos = cr + 2 - data;
+  return 1;
+}
 
-  out.append((char *)&arr, len);
+// An inline command: words separated by spaces on one line, as typed into
+// telnet. No quoting.
+static int64_t parse_inline(const uint8_t *data, size_t size,
+                            vector<string> &cmd) {
+  const uint8_t *nl = (const uint8_t *)memchr(data, '\n', size);
+  if (!nl) {
+    return 0;
+  }
+  size_t end = nl - data;
+  size_t argc = 0;
+  size_t i = 0;
+  while (i < end) {
+    while (i < end && (data[i] == ' ' || data[i] == '\t' || data[i] == '\r')) {
+      i++;
+    }
+    size_t start = i;
+    while (i < end && data[i] != ' ' && data[i] != '\t' && data[i] != '\r') {
+      i++;
+    }
+    if (i > start) {
+      if (cmd.size() <= argc) {
+        cmd.emplace_back();
+      }
+      cmd[argc++].assign((const char *)&data[start], i - start);
+    }
+  }
+  cmd.resize(argc);
+  return (int64_t)end + 1;
 }
 
-static uint32_t do_zquery(vector<string> &cmd, string &out) {
-  string zsetName = cmd[1];
-  double score = atof(cmd[2].c_str());
-  string name = cmd[3];
-  uint64_t offset = stoi(cmd[4]);
-  uint32_t limit = stoi(cmd[5]);
-  Entry key;
-  key.key = zsetName;
-  key.node.hcode = str_hash((uint8_t *)key.key.data(), key.key.size());
-  key.type = 1;
-  HNode *node = hm_find(&g_data.db, &key.node, &entry_cmp);
-  if (!node) {
-    string reply = "Not found";
-    out_err(out, reply);
-    return RES_NF;
+// Parses one RESP request, a multibulk `*N\r\n` followed by N `$len\r\n`
+// bulk strings, or an inline command. Resumes from the progress saved in
+// `st`; arguments are located in place and only copied out into `cmd` once
+// the whole request is there. Same return values as parse_req.
+static int64_t parse_resp(const uint8_t *data, size_t size, RespParser &st,
+                          vector<string> &cmd) {
+  if (st.argc < 0) {
+    if (size == 0) {
+      return 0;
+    }
+    if (data[0] != '*') {
+      return parse_inline(data, size, cmd);
+    }
+    int64_t argc = 0;
+    int rv = resp_read_int(data, size, st.pos, '*', argc);
+    if (rv <= 0) {
+      return rv;
+    }
+    if (argc > (int64_t)(MAX_BUF / 4)) {
+      return -1;
+    }
+    st.argc = max(argc, (int64_t)0);
+    st.args.clear();
   }
-  ZSet *s = (container_of(node, Entry, node))->zset;
-  ZNode *znode = zset_query(s, score, name.data(), name.length());
-  znode = znode_offset(znode, offset);
-  void *arr = begin_arr(out);
-  uint32_t n = 0;
-  while (znode && n < limit) {
-    out_str(out, znode->name, znode->len);
-    cout << znode->name << endl;
-    cout << znode->score << endl;
-    out_int(out, znode->score);
-    znode = znode_offset(znode, 1);
-    n++;
+  while ((int64_t)st.args.size() < st.argc) {
+    if (st.bulklen < 0) {
+      int64_t len = 0;
+      int rv = resp_read_int(data, size, st.pos, '$', len);
+      if (rv <= 0) {
+        return rv;
+      }
+      if (len < 0 || len > (int64_t)MAX_BUF) {
+        return -1;
+      }
+      st.bulklen = len;
+    }
+    size_t end = st.pos + (size_t)st.bulklen;
+    if (end + 2 > size) {
+      return 0;
+    }
+    if (data[end] != '\r' || data[end + 1] != '\n') {
+      return -1;
+    }
+    st.args.emplace_back((uint32_t)st.pos, (uint32_t)st.bulklen);
+    st.pos = end + 2;
+    st.bulklen = -1;
   }
-  end_arr(out, arr, n);
-  return RES_OK;
+  cmd.resize(st.args.size());
+  for (size_t i = 0; i < st.args.size(); i++) {
+    cmd[i].assign((const char *)&data[st.args[i].first], st.args[i].second);
+  }
+  int64_t consumed = (int64_t)st.pos;
+  st.argc = -1;
+  st.pos = 0;
+  return consumed;
 }
 
-static uint32_t try_cmd(vector<string> &cmd, string &out) {
-  if (cmd.size() == 2 && cmd[0] == "pttl") {
-    do_ttl(cmd, out);
-    return RES_OK;
-  } else if (cmd.size() == 3 && cmd[0] == "pexpire") {
-    return do_expire(cmd, out);
-  } else if (cmd.size() == 6 && cmd[0] == "zquery") {
-    return do_zquery(cmd, out);
-  } else if (cmd.size() == 3 && cmd[0] == "zscore") {
-    return do_zscore(cmd, out);
-  } else if (cmd.size() == 4 && cmd[0] == "zadd") {
-    return do_zadd(cmd, out);
-  } else if (cmd.size() > 0 && cmd[0] == "keys") {
-    return do_keys(cmd, out);
-  } else if (cmd.size() == 3 && cmd[0] == "set") {
-    return do_set(cmd, out);
-  } else if (cmd.size() == 2 && cmd[0] == "get") {
-    return do_get(cmd, out);
-  } else if (cmd.size() == 2 && cmd[0] == "del") {
-    return do_del(cmd, out);
-  }
-  string reply = "Error Invalid Command";
-  out_err(out, reply);
-  return RES_ERR;
+// The first byte of a connection tells the protocols apart: RESP requests
+// start with `*` or, inline, with a letter, while a native request starts
+// with the low byte of its argument count. Native requests of 42 or 65 to
+// 122 arguments would be mistaken for RESP.
+static uint32_t detect_proto(uint8_t first) {
+  return first == '*' || isalpha(first) ? PROTO_RESP2 : PROTO_NATIVE;
 }
 
 static bool try_req(Connection *con) {
-  // Try evaluating this request
-  // cout << "Trying request" << endl;
-  // First 4 bytes is for nstr then next is for len of the first string
-  // cout << con->read_size << endl;
-  if (con->read_size < 4) {
-    // Wait for it
+  if (con->blocked) {
     return false;
   }
-  uint32_t nstr = 0;
-  memcpy(&nstr, &con->readBuf[0], 4);
-
-  int cur = 4;
-  int lengths[nstr];
-  memset(lengths, 0, sizeof(lengths));
-  vector<string> cmd;
-  for (int i = 0; i < nstr; i++) {
-    // Have you read enough data ?
-    // cout << cur << endl;
-    if (cur + 4 > con->read_size)
-      return false;
-    memcpy(&lengths[i], &con->readBuf[cur], 4);
-    cur += 4;
-    // Have you read enough data ?
-    // cout << cur << endl;
-    if (cur > con->read_size)
+  if (con->proto == PROTO_UNKNOWN) {
+    if (con->read_size == 0) {
       return false;
-    char str[lengths[i] + 1];
-    memcpy(str, &con->readBuf[cur], lengths[i]);
-    str[lengths[i]] = '\0';
-    cmd.push_back(string(str, lengths[i]));
-    cur += lengths[i];
+    }
+    con->proto = detect_proto(con->readBuf[0]);
   }
-  string out;
-  // SIZE_OF_BUF _ TYPE _ LENGTH _ DATA
-  uint32_t res = try_cmd(cmd, out);
-  assert((uint32_t)out.size() <= MAX_BUF);
-  uint32_t wlen = (uint32_t)out.size();
-  memcpy(&con->writeBuf[0], &wlen, 4);
-  memcpy(&con->writeBuf[4], out.data(), out.size());
-  con->write_size = wlen + 4;
-
+  vector<string> &cmd = con->argv;
+  int64_t consumed =
+      con->proto == PROTO_NATIVE
+          ? parse_req(con->readBuf, con->read_size, cmd)
+          : parse_resp(con->readBuf, con->read_size, con->resp, cmd);
+  if (consumed == 0 && con->read_size == sizeof(con->readBuf)) {
+    consumed = -1; // incomplete, but the buffer is already full
+  }
+  if (consumed < 0) {
+    log_verbose("bad request on connection %d", con->fd);
+    con->state = END;
+    return false;
+  }
+  if (consumed == 0) {
+    // Wait for it
+    return false;
+  }
+  size_t cur = (size_t)consumed;
   size_t rem = con->read_size - cur;
   if (rem) {
     memmove(&con->readBuf, &con->readBuf[cur], rem);
   }
   con->read_size = rem;
+  if (cmd.empty() && con->proto != PROTO_NATIVE) {
+    // an empty RESP request gets no reply
+    return true;
+  }
 
-  con->state = RES;
-  HandleRes(con);
-  return (con->state == REQ);
+  string out;
+  g_data.cur_conn = con;
+  g_data.proto = con->proto;
+  try_cmd(cmd, out);
+  if (!con->blocked && con->state != END) {
+    // while still current, so that a reply queued behind messages is left
+    // for the caller to send
+    conn_set_reply(con, out);
+  }
+  g_data.cur_conn = NULL;
+  g_data.proto = PROTO_NATIVE;
+  if (con->blocked || con->state != RES) {
+    // the reply comes through conn_unblock, or the connection is closing
+    return false;
+  }
+  // the replies of the requests buffered with it go out together, see
+  // conn_run_requests
+  return con->outq_bytes < k_out_batch;
+}
+
+// Runs the requests buffered on the connection. Their replies queue behind
+// the first and, with poll, leave in one writev once no complete request
+// is left or the batch is full. The io_uring loop sends them itself.
+static void conn_run_requests(Connection *con) {
+  while (true) {
+    while (try_req(con)) {
+    }
+    if (g_data.io_uring || con->state != RES) {
+      return;
+    }
+    HandleRes(con);
+    if (con->state != REQ) {
+      return; // the rest goes out once the socket is writable
+    }
+  }
 }
 
 static bool fill_buff(Connection *con) {
@@ -553,22 +5221,25 @@ static bool fill_buff(Connection *con) {
     return false;
   }
   if (rv < 0) {
-    cout << "read() error" << endl;
+    log_warn("read: %s", strerror(errno));
     con->state = END;
+    return false;
   }
   if (rv == 0) {
-    if (con->read_size > 0)
-      cout << "UNEXPECTED ";
-    cout << " EOF" << endl;
+    if (con->read_size > 0) {
+      log_verbose("unexpected EOF on connection %d", con->fd);
+    } else {
+      log_verbose("EOF on connection %d", con->fd);
+    }
     con->state = END;
     return false;
   }
   con->read_size += rv;
+  g_data.net_input_bytes += rv;
   assert(con->read_size <= sizeof(con->readBuf));
   // Try requesting now
   // cout << "ReadSize : " << con->read_size << endl;
-  while (try_req(con)) {
-  }
+  conn_run_requests(con);
   return (con->state == REQ);
 }
 
@@ -578,17 +5249,65 @@ static void HandleReq(Connection *con) {
   }
 }
 
-static void HandleConnection(Connection *con) {
-  // Update the timer in the connection
+// moves the connection to the back of the idle list
+static void conn_touch(Connection *con) {
   con->idle_start = get_monotonic_usec();
   dlist_detach(&con->idle_list);
   dlist_insert_before(&g_data.idle_list, &con->idle_list);
+}
+
+static void HandleConnection(Connection *con) {
+  // Update the timer in the connection
+  conn_touch(con);
 
   if (con->state == REQ) {
     HandleReq(con);
   } else if (con->state == RES) {
     HandleRes(con);
+    // requests that arrived with the earlier ones
+    if (con->state == REQ) {
+      conn_run_requests(con);
+    }
   } else {
     assert(0);
   }
 }
+
+// Handles poll events on a connection. A command of a connection handled
+// earlier in the same round can already have marked this one END, such as
+// a subscriber a PUBLISH pushed over its output limit; it is only closed.
+static void conn_poll_event(Connection *con) {
+  if (con->state == END) {
+    // closed below
+  } else if (con->blocked) {
+    // an error or hangup, nothing is read while blocked
+    con->state = END;
+  } else {
+    HandleConnection(con);
+  }
+  if (con->state == END) {
+    conn_done(con);
+  }
+}
+
+// Sends the replies of commands that completed in the background and the
+// queued pub/sub messages, then runs the requests the connections buffered
+// meanwhile.
+static void poll_resume() {
+  while (!g_data.pending_out.empty()) {
+    vector<Connection *> batch;
+    batch.swap(g_data.pending_out);
+    for (Connection *con : batch) {
+      con->pending_out = false;
+      if (con->state == RES) {
+        HandleRes(con);
+      }
+      if (con->state == REQ) {
+        conn_run_requests(con);
+      }
+      if (con->state == END) {
+        conn_done(con);
+      }
+    }
+  }
+}
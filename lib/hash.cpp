@@ -24,7 +24,8 @@ static void h_insert(HTab *htab, HNode *node) {
   ++htab->size;
 }
 
-static HNode **h_find(HTab *htab, HNode *key, bool (*eq)(HNode *, HNode *)) {
+static HNode **h_find(const HTab *htab, HNode *key,
+                      bool (*eq)(HNode *, HNode *)) {
   if (!htab->tab)
     return NULL;
   size_t pos = key->hcode & htab->mask;
@@ -57,20 +58,39 @@ void h_scan(HTab *htab, void (*pack)(HNode *, void *), void *container) {
   }
 };
 
-const size_t k_max_load_factor = 0;
+const size_t k_max_load_factor = 8;
 
-static void hm_start_resizing(HMap *hmap) {
+// the smallest table that holds `n` nodes at half the maximum load
+static size_t h_capacity(size_t n) {
+  size_t cap = 4;
+  while (cap * (k_max_load_factor / 2) < n) {
+    cap *= 2;
+  }
+  return cap;
+}
+
+static void hm_start_resizing(HMap *hmap, size_t cap) {
   assert(hmap->ht2.tab == NULL);
   hmap->ht2 = hmap->ht1;
-  h_init(&hmap->ht1, (hmap->ht1.mask + 1) * 2);
+  h_init(&hmap->ht1, cap);
   hmap->resizing_pos = 0;
 }
 
-const size_t k_resize_step = 128;
+// A table under 1/16 of the maximum load shrinks, which leaves room for
+// the size to grow 4 times or shrink again as much before the next resize.
+static bool hm_sparse(const HMap *hmap) {
+  size_t cap = hmap->ht1.mask + 1;
+  return !hmap->ht2.tab && cap > 4 && hmap->ht1.size * 2 < cap;
+}
 
-static void hm_help_resizing(HMap *hmap) {
+const size_t k_resize_step = 16;
+
+// Moves nodes from the old table for up to `max_work` steps, a step being
+// a node moved or an empty bucket skipped. Returns the steps taken.
+static size_t hm_help_resizing(HMap *hmap, size_t max_work) {
   size_t nwork = 0;
-  while (nwork < k_resize_step && hmap->ht2.size > 0) {
+  while (nwork < max_work && hmap->ht2.size > 0) {
+    nwork++;
     HNode **from = &hmap->ht2.tab[hmap->resizing_pos];
     if (!*from) {
       hmap->resizing_pos++;
@@ -84,6 +104,22 @@ static void hm_help_resizing(HMap *hmap) {
     free(hmap->ht2.tab);
     hmap->ht2 = HTab{};
   }
+  return nwork;
+}
+
+static void hm_help_resizing(HMap *hmap) {
+  hm_help_resizing(hmap, k_resize_step);
+}
+
+bool hm_rehash_pending(const HMap *hmap) {
+  return hmap->ht2.tab || hm_sparse(hmap);
+}
+
+size_t hm_rehash(HMap *hmap, size_t max_work) {
+  if (hm_sparse(hmap)) {
+    hm_start_resizing(hmap, h_capacity(hmap->ht1.size));
+  }
+  return hm_help_resizing(hmap, max_work);
 }
 
 size_t hm_size(HMap *hmap) { return hmap->ht1.size + hmap->ht2.size; }
@@ -92,15 +128,16 @@ HNode *hm_pop(HMap *hmap, HNode *key, bool (*eq)(HNode *, HNode *)) {
   // Transfer some nodes
   hm_help_resizing(hmap);
 
+  HNode *node = NULL;
   if (HNode **from = h_find(&hmap->ht1, key, eq)) {
-    return h_detach(&hmap->ht1, from);
+    node = h_detach(&hmap->ht1, from);
+  } else if (HNode **from = h_find(&hmap->ht2, key, eq)) {
+    node = h_detach(&hmap->ht2, from);
   }
-
-  if (HNode **from = h_find(&hmap->ht2, key, eq)) {
-    return h_detach(&hmap->ht2, from);
+  if (node && hm_sparse(hmap)) {
+    hm_start_resizing(hmap, h_capacity(hmap->ht1.size));
   }
-
-  return NULL;
+  return node;
 }
 
 void hm_insert(HMap *hmap, HNode *node) {
@@ -111,12 +148,18 @@ void hm_insert(HMap *hmap, HNode *node) {
   if (!hmap->ht2.tab) {
     size_t load_factor = hmap->ht1.size / (hmap->ht1.mask + 1);
     if (load_factor >= k_max_load_factor) {
-      hm_start_resizing(hmap);
+      hm_start_resizing(hmap, (hmap->ht1.mask + 1) * 2);
     }
   }
   hm_help_resizing(hmap);
 }
 
+void hm_reserve(HMap *hmap, size_t n) {
+  assert(hm_size(hmap) == 0);
+  hm_destroy(hmap);
+  h_init(&hmap->ht1, h_capacity(n));
+}
+
 HNode *hm_find(HMap *hmap, HNode *key, bool (*eq)(HNode *, HNode *)) {
   hm_help_resizing(hmap);
   HNode **from = h_find(&hmap->ht1, key, eq);
@@ -125,8 +168,80 @@ HNode *hm_find(HMap *hmap, HNode *key, bool (*eq)(HNode *, HNode *)) {
   return from ? *from : NULL;
 }
 
+HNode *hm_lookup(const HMap *hmap, HNode *key, bool (*eq)(HNode *, HNode *)) {
+  HNode **from = h_find(&hmap->ht1, key, eq);
+  from = from ? from : h_find(&hmap->ht2, key, eq);
+  return from ? *from : NULL;
+}
+
 void hm_destroy(HMap *hmap) {
   free(hmap->ht1.tab);
   free(hmap->ht2.tab);
   *hmap = HMap{};
 }
+
+// Collects up to `n` nodes from consecutive buckets starting at a random
+// position. The result is not uniform, which is fine for sampled eviction.
+size_t hm_sample(HMap *hmap, uint64_t seed, HNode **out, size_t n) {
+  size_t count = 0;
+  HTab *tabs[2] = {&hmap->ht1, &hmap->ht2};
+  for (HTab *htab : tabs) {
+    if (!htab->tab || htab->size == 0)
+      continue;
+    // bound the walk over empty buckets in sparse tables
+    size_t max_steps = n * 10;
+    for (size_t i = 0; i <= htab->mask && i < max_steps && count < n; i++) {
+      HNode *node = htab->tab[(seed + i) & htab->mask];
+      for (; node && count < n; node = node->next) {
+        out[count++] = node;
+      }
+    }
+  }
+  return count;
+}
+
+static uint64_t rev64(uint64_t v) {
+  v = (v >> 1 & 0x5555555555555555ull) | (v & 0x5555555555555555ull) << 1;
+  v = (v >> 2 & 0x3333333333333333ull) | (v & 0x3333333333333333ull) << 2;
+  v = (v >> 4 & 0x0F0F0F0F0F0F0F0Full) | (v & 0x0F0F0F0F0F0F0F0Full) << 4;
+  return __builtin_bswap64(v);
+}
+
+static void h_scan_bucket(const HTab *htab, uint64_t cursor,
+                          void (*fn)(HNode *, void *), void *arg) {
+  for (HNode *node = htab->tab[cursor & htab->mask]; node; node = node->next) {
+    fn(node, arg);
+  }
+}
+
+// The cursor counts up from its high bits, as in Redis. The buckets a
+// bucket splits into when the table doubles come right after it, so the
+// buckets visited before a resize cover the same nodes after it.
+static uint64_t cursor_next(uint64_t cursor, size_t mask) {
+  cursor |= ~(uint64_t)mask;
+  return rev64(rev64(cursor) + 1);
+}
+
+uint64_t hm_scan(HMap *hmap, uint64_t cursor, void (*fn)(HNode *, void *),
+                 void *arg) {
+  const HTab *small = &hmap->ht1, *large = &hmap->ht2;
+  if (!large->tab) {
+    if (!small->tab) {
+      return 0;
+    }
+    h_scan_bucket(small, cursor, fn, arg);
+    return cursor_next(cursor, small->mask);
+  }
+  if (small->mask > large->mask) {
+    const HTab *t = small;
+    small = large;
+    large = t;
+  }
+  // a bucket of the smaller table, then the ones it maps to in the larger
+  h_scan_bucket(small, cursor, fn, arg);
+  do {
+    h_scan_bucket(large, cursor, fn, arg);
+    cursor = cursor_next(cursor, large->mask);
+  } while (cursor & (small->mask ^ large->mask));
+  return cursor;
+}
@@ -29,11 +29,29 @@ struct HMap {
 
 
 HNode *hm_find(HMap *hmap, HNode *key, bool (*eq)(HNode *, HNode *));
+// hm_find without helping a resize along, for readers on other threads
+HNode *hm_lookup(const HMap *hmap, HNode *key, bool (*eq)(HNode *, HNode *));
 void hm_insert(HMap *hmap, HNode *node);
+// sizes an empty map so that inserting `n` nodes does not resize it
+void hm_reserve(HMap *hmap, size_t n);
+// shrinks the map once it is mostly empty, see hm_rehash
 HNode *hm_pop(HMap *hmap, HNode *key, bool (*eq)(HNode *, HNode *));
 size_t hm_size(HMap *hmap);
+// Requests move a resizing map along by a few nodes each. For the event
+// loop to finish the job when idle: the map is resizing, or sparse enough
+// to shrink.
+bool hm_rehash_pending(const HMap *hmap);
+// starts shrinking a sparse map, then takes up to `max_work` steps of the
+// resize, a node moved or an empty bucket skipped each; returns the steps
+size_t hm_rehash(HMap *hmap, size_t max_work);
 void h_scan(HTab *htab, void (*pack)(HNode *, void *container), void *container);
 void hm_destroy(HMap *hmap);
+size_t hm_sample(HMap *hmap, uint64_t seed, HNode **out, size_t n);
+// Calls `fn` for the nodes of the buckets at `cursor` and returns the next
+// cursor, 0 after the last bucket. Start with 0. A node present for the
+// whole scan is visited at least once, even if the map resizes meanwhile.
+uint64_t hm_scan(HMap *hmap, uint64_t cursor, void (*fn)(HNode *, void *),
+                 void *arg);
 
 #define container_of(ptr, T, member) \
     (T *)( (char *)ptr - offsetof(T, member) )
@@ -0,0 +1,44 @@
+#include "histogram.h"
+
+// the largest value that maps to bucket `i`
+static uint64_t hist_bucket_max(size_t i) {
+  if (i < (1u << k_hist_sub_bits)) {
+    return i;
+  }
+  uint32_t shift = (uint32_t)(i >> k_hist_sub_bits) - 1;
+  uint64_t sub = i & ((1u << k_hist_sub_bits) - 1);
+  uint64_t lo = ((1ull << k_hist_sub_bits) + sub) << shift;
+  return lo + (1ull << shift) - 1;
+}
+
+uint64_t hist_percentile(const Histogram *h, double q) {
+  if (h->total == 0) {
+    return 0;
+  }
+  uint64_t rank = (uint64_t)(q * (double)h->total);
+  if (rank >= h->total) {
+    rank = h->total - 1;
+  }
+  uint64_t seen = 0;
+  for (size_t i = 0; i < k_hist_buckets; i++) {
+    seen += h->counts[i];
+    if (seen > rank) {
+      uint64_t v = hist_bucket_max(i);
+      return v < h->max ? v : h->max;
+    }
+  }
+  return h->max;
+}
+
+void hist_merge(Histogram *dst, const Histogram *src) {
+  for (size_t i = 0; i < k_hist_buckets; i++) {
+    dst->counts[i] += src->counts[i];
+  }
+  dst->total += src->total;
+  dst->sum += src->sum;
+  if (src->max > dst->max) {
+    dst->max = src->max;
+  }
+}
+
+void hist_reset(Histogram *h) { *h = Histogram{}; }
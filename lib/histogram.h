@@ -0,0 +1,79 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+// Log-linear histogram in the spirit of HdrHistogram: values are grouped by
+// power of two, and each power is split into 2^k_hist_sub_bits linear
+// sub-buckets, so a reported value is within ~6% of the recorded one.
+// Recording is a couple of shifts and an increment.
+const uint32_t k_hist_sub_bits = 4;
+const uint32_t k_hist_max_bits = 48; // larger values are clamped
+const size_t k_hist_buckets = (k_hist_max_bits - k_hist_sub_bits + 1)
+                              << k_hist_sub_bits;
+
+struct Histogram {
+  uint64_t counts[k_hist_buckets] = {};
+  uint64_t total = 0;
+  uint64_t sum = 0;
+  uint64_t max = 0;
+};
+
+inline size_t hist_index(uint64_t v) {
+  if (v < (1u << k_hist_sub_bits)) {
+    return (size_t)v;
+  }
+  uint32_t msb = 63 - __builtin_clzll(v);
+  if (msb >= k_hist_max_bits) {
+    return k_hist_buckets - 1;
+  }
+  uint32_t shift = msb - k_hist_sub_bits;
+  size_t sub = (v >> shift) & ((1u << k_hist_sub_bits) - 1);
+  return ((size_t)(shift + 1) << k_hist_sub_bits) + sub;
+}
+
+inline void hist_record(Histogram *h, uint64_t v) {
+  h->counts[hist_index(v)]++;
+  h->total++;
+  h->sum += v;
+  if (v > h->max) {
+    h->max = v;
+  }
+}
+
+// the value below which a fraction `q` (0..1) of the samples fall
+uint64_t hist_percentile(const Histogram *h, double q);
+void hist_merge(Histogram *dst, const Histogram *src);
+void hist_reset(Histogram *h);
+
+// A cheap monotonic tick counter for timing hot paths: the TSC where
+// available, otherwise the monotonic clock in ns. Convert ticks with a
+// ratio measured against the monotonic clock, see clock_ticks_per_ns.
+inline uint64_t clock_ticks() {
+#if defined(__x86_64__) || defined(__i386__)
+  return __rdtsc();
+#else
+  timespec tv = {0, 0};
+  clock_gettime(CLOCK_MONOTONIC, &tv);
+  return uint64_t(tv.tv_sec) * 1000000000 + tv.tv_nsec;
+#endif
+}
+
+inline uint64_t clock_nsec() {
+  timespec tv = {0, 0};
+  clock_gettime(CLOCK_MONOTONIC, &tv);
+  return uint64_t(tv.tv_sec) * 1000000000 + tv.tv_nsec;
+}
+
+// ticks per ns, measured between two (ticks, ns) points taken apart
+inline double clock_ticks_per_ns(uint64_t t0, uint64_t ns0, uint64_t t1,
+                                 uint64_t ns1) {
+  if (ns1 <= ns0 || t1 <= t0) {
+    return 1.0;
+  }
+  return (double)(t1 - t0) / (double)(ns1 - ns0);
+}
@@ -0,0 +1,468 @@
+#include "hll.h"
+#include <immintrin.h>
+#include <math.h>
+#include <string.h>
+
+enum { HLL_DENSE = 0, HLL_SPARSE = 1 };
+
+// Sparse opcodes, as in Redis:
+//   ZERO   00xxxxxx            xxxxxx + 1 zero registers, up to 64
+//   XZERO  01xxxxxx yyyyyyyy   xxxxxxyyyyyyyy + 1 zero registers
+//   VAL    1vvvvvxx            xx + 1 registers of value vvvvv + 1
+const uint32_t k_sparse_val_max = 32;
+const uint32_t k_sparse_val_len = 4;
+const uint32_t k_sparse_zero_len = 64;
+
+struct SparseOp {
+  uint32_t val = 0;
+  uint32_t len = 0;  // registers
+  size_t size = 0;   // bytes
+};
+
+static bool sparse_op(const uint8_t *p, const uint8_t *end, SparseOp *op) {
+  if ((*p & 0xC0) == 0x00) {
+    op->val = 0;
+    op->len = (*p & 0x3F) + 1;
+    op->size = 1;
+  } else if ((*p & 0xC0) == 0x40) {
+    if (p + 1 >= end) {
+      return false;
+    }
+    op->val = 0;
+    op->len = ((uint32_t)(*p & 0x3F) << 8 | p[1]) + 1;
+    op->size = 2;
+  } else {
+    op->val = (*p >> 2 & 0x1F) + 1;
+    op->len = (*p & 0x03) + 1;
+    op->size = 1;
+  }
+  return true;
+}
+
+// appends `len` registers of `val`, in as many opcodes as it takes
+static void sparse_put(string &out, uint32_t val, uint32_t len) {
+  while (len) {
+    if (val == 0 && len <= k_sparse_zero_len) {
+      out += (char)(len - 1);
+      len = 0;
+    } else if (val == 0) {
+      uint32_t n = len < k_hll_registers ? len : k_hll_registers;
+      out += (char)(0x40 | (n - 1) >> 8);
+      out += (char)((n - 1) & 0xFF);
+      len -= n;
+    } else {
+      uint32_t n = len < k_sparse_val_len ? len : k_sparse_val_len;
+      out += (char)(0x80 | (val - 1) << 2 | (n - 1));
+      len -= n;
+    }
+  }
+}
+
+static uint8_t *hll_regs_ptr(string &s) { return (uint8_t *)&s[k_hll_header]; }
+
+// The cached cardinality is little-endian in bytes 8 to 15. The top bit
+// marks it invalid.
+static void cache_invalidate(string &s) { s[15] = (char)(s[15] | 0x80); }
+
+static bool cache_get(const string &s, uint64_t *out) {
+  if ((uint8_t)s[15] & 0x80) {
+    return false;
+  }
+  uint64_t v = 0;
+  for (int i = 7; i >= 0; i--) {
+    v = v << 8 | (uint8_t)s[8 + i];
+  }
+  *out = v;
+  return true;
+}
+
+static void cache_set(string &s, uint64_t v) {
+  for (int i = 0; i < 8; i++) {
+    s[8 + i] = (char)(v >> (8 * i));
+  }
+}
+
+void hll_init(string &s) {
+  s.assign("HYLL", 4);
+  s.append(12, '\0');
+  s[4] = HLL_SPARSE;
+  sparse_put(s, 0, k_hll_registers);
+}
+
+bool hll_valid(const string &s) {
+  if (s.size() < k_hll_header || memcmp(s.data(), "HYLL", 4) != 0) {
+    return false;
+  }
+  if (s[4] == HLL_DENSE) {
+    return s.size() == k_hll_dense_size;
+  }
+  return s[4] == HLL_SPARSE;
+}
+
+bool hll_is_dense(const string &s) { return s[4] == HLL_DENSE; }
+
+// Redis' MurmurHash64A, so that elements land in the same registers
+static uint64_t murmur64a(const char *key, size_t len, uint64_t seed) {
+  const uint64_t m = 0xc6a4a7935bd1e995ull;
+  const int r = 47;
+  uint64_t h = seed ^ (len * m);
+  const uint8_t *data = (const uint8_t *)key;
+  const uint8_t *end = data + (len - (len & 7));
+  for (; data != end; data += 8) {
+    uint64_t k = 0;
+    memcpy(&k, data, 8);
+    k *= m;
+    k ^= k >> r;
+    k *= m;
+    h ^= k;
+    h *= m;
+  }
+  switch (len & 7) {
+  case 7:
+    h ^= (uint64_t)data[6] << 48; // fallthrough
+  case 6:
+    h ^= (uint64_t)data[5] << 40; // fallthrough
+  case 5:
+    h ^= (uint64_t)data[4] << 32; // fallthrough
+  case 4:
+    h ^= (uint64_t)data[3] << 24; // fallthrough
+  case 3:
+    h ^= (uint64_t)data[2] << 16; // fallthrough
+  case 2:
+    h ^= (uint64_t)data[1] << 8; // fallthrough
+  case 1:
+    h ^= (uint64_t)data[0];
+    h *= m;
+  }
+  h ^= h >> r;
+  h *= m;
+  h ^= h >> r;
+  return h;
+}
+
+// The low bits of the hash pick the register, the run of zeros above them
+// plus one is the value. A sentinel bit bounds it at 64 - p + 1.
+static uint32_t hll_pattern(const char *elem, size_t len, uint32_t *idx) {
+  uint64_t h = murmur64a(elem, len, 0xadc83b19ull);
+  *idx = (uint32_t)(h & (k_hll_registers - 1));
+  h >>= k_hll_p;
+  h |= 1ull << (64 - k_hll_p);
+  return (uint32_t)__builtin_ctzll(h) + 1;
+}
+
+// register i is bits [6i, 6i + 6) of the array, least significant first
+static uint32_t dense_get(const uint8_t *d, uint32_t i) {
+  size_t b = i * 6 / 8;
+  uint32_t fb = i * 6 & 7;
+  uint32_t v = d[b] >> fb;
+  if (fb > 2) {
+    v |= (uint32_t)d[b + 1] << (8 - fb);
+  }
+  return v & 63;
+}
+
+static void dense_set(uint8_t *d, uint32_t i, uint32_t val) {
+  size_t b = i * 6 / 8;
+  uint32_t fb = i * 6 & 7;
+  d[b] = (uint8_t)((d[b] & ~(63u << fb)) | val << fb);
+  if (fb > 2) {
+    d[b + 1] = (uint8_t)((d[b + 1] & ~(63u >> (8 - fb))) | val >> (8 - fb));
+  }
+}
+
+static int dense_add(string &s, uint32_t idx, uint32_t count) {
+  uint8_t *d = hll_regs_ptr(s);
+  if (dense_get(d, idx) >= count) {
+    return 0;
+  }
+  dense_set(d, idx, count);
+  cache_invalidate(s);
+  return 1;
+}
+
+static bool sparse_to_dense(string &s) {
+  uint8_t regs[k_hll_registers];
+  if (!hll_registers(s, regs)) {
+    return false;
+  }
+  hll_store_dense(s, regs);
+  return true;
+}
+
+// Splits the run holding the register into the part before it, the new
+// value, and the part after it.
+static int sparse_add(string &s, uint32_t idx, uint32_t count,
+                      size_t sparse_max) {
+  const uint8_t *data = (const uint8_t *)s.data();
+  const uint8_t *p = data + k_hll_header;
+  const uint8_t *end = data + s.size();
+  uint32_t first = 0; // register index where the opcode at `p` starts
+  SparseOp op;
+  for (; p < end; p += op.size) {
+    if (!sparse_op(p, end, &op)) {
+      return -1;
+    }
+    if (idx < first + op.len) {
+      break;
+    }
+    first += op.len;
+  }
+  if (p >= end) {
+    return -1;
+  }
+  if (op.val >= count) {
+    return 0;
+  }
+  string seq;
+  if (count <= k_sparse_val_max) {
+    sparse_put(seq, op.val, idx - first);
+    sparse_put(seq, count, 1);
+    sparse_put(seq, op.val, first + op.len - idx - 1);
+  }
+  size_t size = s.size() - op.size + seq.size() - k_hll_header;
+  if (seq.empty() || size > sparse_max) {
+    if (!sparse_to_dense(s)) {
+      return -1;
+    }
+    return dense_add(s, idx, count);
+  }
+  s.replace(p - data, op.size, seq);
+  cache_invalidate(s);
+  return 1;
+}
+
+int hll_add(string &s, const char *elem, size_t len, size_t sparse_max) {
+  uint32_t idx = 0;
+  uint32_t count = hll_pattern(elem, len, &idx);
+  if (hll_is_dense(s)) {
+    return dense_add(s, idx, count);
+  }
+  return sparse_add(s, idx, count, sparse_max);
+}
+
+bool hll_count(string &s, uint64_t *out) {
+  if (cache_get(s, out)) {
+    return true;
+  }
+  uint8_t regs[k_hll_registers];
+  if (!hll_registers(s, regs)) {
+    return false;
+  }
+  *out = hll_estimate(regs);
+  cache_set(s, *out);
+  return true;
+}
+
+// 4 registers in each 3 bytes
+void hll_unpack_scalar(const uint8_t *dense, uint8_t *regs) {
+  for (uint32_t g = 0; g < k_hll_registers / 4; g++) {
+    const uint8_t *p = dense + 3 * g;
+    uint32_t x = p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16;
+    regs[4 * g] = x & 63;
+    regs[4 * g + 1] = x >> 6 & 63;
+    regs[4 * g + 2] = x >> 12 & 63;
+    regs[4 * g + 3] = x >> 18 & 63;
+  }
+}
+
+// Each 128-bit lane takes 12 bytes, spreads every 3 into a 32-bit word,
+// and shifts the 4 registers of the word into its 4 bytes.
+__attribute__((target("avx2"))) static void
+hll_unpack_avx2_kernel(const uint8_t *dense, uint8_t *regs) {
+  const __m256i spread = _mm256_setr_epi8(
+      0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1, 0, 1, 2, -1, 3, 4,
+      5, -1, 6, 7, 8, -1, 9, 10, 11, -1);
+  const __m256i m0 = _mm256_set1_epi32(0x3F);
+  const __m256i m1 = _mm256_set1_epi32(0x3F00);
+  const __m256i m2 = _mm256_set1_epi32(0x3F0000);
+  const __m256i m3 = _mm256_set1_epi32(0x3F000000);
+  const size_t dense_bytes = k_hll_registers * 6 / 8;
+  size_t in = 0, out = 0;
+  // the upper lane reads 16 bytes at in + 12
+  for (; in + 28 <= dense_bytes; in += 24, out += 32) {
+    __m256i v = _mm256_inserti128_si256(
+        _mm256_castsi128_si256(_mm_loadu_si128((const __m128i *)(dense + in))),
+        _mm_loadu_si128((const __m128i *)(dense + in + 12)), 1);
+    __m256i x = _mm256_shuffle_epi8(v, spread);
+    __m256i r = _mm256_and_si256(x, m0);
+    r = _mm256_or_si256(r, _mm256_and_si256(_mm256_slli_epi32(x, 2), m1));
+    r = _mm256_or_si256(r, _mm256_and_si256(_mm256_slli_epi32(x, 4), m2));
+    r = _mm256_or_si256(r, _mm256_and_si256(_mm256_slli_epi32(x, 6), m3));
+    _mm256_storeu_si256((__m256i *)(regs + out), r);
+  }
+  for (; out < k_hll_registers; in += 3, out += 4) {
+    uint32_t x = dense[in] | (uint32_t)dense[in + 1] << 8 |
+                 (uint32_t)dense[in + 2] << 16;
+    regs[out] = x & 63;
+    regs[out + 1] = x >> 6 & 63;
+    regs[out + 2] = x >> 12 & 63;
+    regs[out + 3] = x >> 18 & 63;
+  }
+}
+
+void hll_unpack_avx2(const uint8_t *dense, uint8_t *regs) {
+  if (!cpu_has_avx2()) {
+    return hll_unpack_scalar(dense, regs);
+  }
+  hll_unpack_avx2_kernel(dense, regs);
+}
+
+bool hll_registers(const string &s, uint8_t *regs) {
+  const uint8_t *data = (const uint8_t *)s.data();
+  if (hll_is_dense(s)) {
+    hll_unpack_avx2(data + k_hll_header, regs);
+    return true;
+  }
+  const uint8_t *p = data + k_hll_header;
+  const uint8_t *end = data + s.size();
+  uint32_t i = 0;
+  SparseOp op;
+  for (; p < end; p += op.size) {
+    if (!sparse_op(p, end, &op) || op.len > k_hll_registers - i) {
+      return false;
+    }
+    memset(regs + i, (int)op.val, op.len);
+    i += op.len;
+  }
+  return i == k_hll_registers;
+}
+
+void hll_store_dense(string &s, const uint8_t *regs) {
+  s.resize(k_hll_dense_size);
+  s[4] = HLL_DENSE;
+  uint8_t *d = hll_regs_ptr(s);
+  for (uint32_t g = 0; g < k_hll_registers / 4; g++) {
+    const uint8_t *r = regs + 4 * g;
+    uint32_t x = r[0] | (uint32_t)r[1] << 6 | (uint32_t)r[2] << 12 |
+                 (uint32_t)r[3] << 18;
+    d[3 * g] = (uint8_t)x;
+    d[3 * g + 1] = (uint8_t)(x >> 8);
+    d[3 * g + 2] = (uint8_t)(x >> 16);
+  }
+  cache_invalidate(s);
+}
+
+void hll_max_scalar(uint8_t *dst, const uint8_t *src) {
+  for (uint32_t i = 0; i < k_hll_registers; i++) {
+    dst[i] = src[i] > dst[i] ? src[i] : dst[i];
+  }
+}
+
+__attribute__((target("avx2"))) static void
+hll_max_avx2_kernel(uint8_t *dst, const uint8_t *src) {
+  for (uint32_t i = 0; i < k_hll_registers; i += 32) {
+    __m256i a = _mm256_loadu_si256((const __m256i *)(dst + i));
+    __m256i b = _mm256_loadu_si256((const __m256i *)(src + i));
+    _mm256_storeu_si256((__m256i *)(dst + i), _mm256_max_epu8(a, b));
+  }
+}
+
+void hll_max_avx2(uint8_t *dst, const uint8_t *src) {
+  if (!cpu_has_avx2()) {
+    return hll_max_scalar(dst, src);
+  }
+  hll_max_avx2_kernel(dst, src);
+}
+
+void hll_max(uint8_t *dst, const uint8_t *src) { hll_max_avx2(dst, src); }
+
+// Ertl's estimator, "New cardinality estimation algorithms for
+// HyperLogLog sketches", as used by Redis. sigma and tau correct for the
+// registers still zero and those at the maximum.
+static double hll_sigma(double x) {
+  if (x == 1.0) {
+    return INFINITY;
+  }
+  double y = 1.0;
+  double z = x;
+  double prev = 0;
+  do {
+    x *= x;
+    prev = z;
+    z += x * y;
+    y += y;
+  } while (prev != z);
+  return z;
+}
+
+static double hll_tau(double x) {
+  if (x == 0.0 || x == 1.0) {
+    return 0.0;
+  }
+  double y = 1.0;
+  double z = 1 - x;
+  double prev = 0;
+  do {
+    x = sqrt(x);
+    prev = z;
+    y *= 0.5;
+    z -= (1 - x) * (1 - x) * y;
+  } while (prev != z);
+  return z / 3;
+}
+
+const uint32_t k_hll_q = 64 - k_hll_p; // the largest value is q + 1
+
+// `harmonic` is the sum of 2^-r over the registers from 1 to q
+static uint64_t hll_finish(double harmonic, uint32_t zeros, uint32_t maxed) {
+  const double m = k_hll_registers;
+  double z = m * hll_tau((m - maxed) / m) * ldexp(1.0, -(int)k_hll_q);
+  z += harmonic + m * hll_sigma(zeros / m);
+  const double alpha_inf = 0.5 / log(2.0);
+  return (uint64_t)llround(alpha_inf * m * m / z);
+}
+
+uint64_t hll_estimate_scalar(const uint8_t *regs) {
+  uint32_t histo[64] = {};
+  for (uint32_t i = 0; i < k_hll_registers; i++) {
+    histo[regs[i]]++;
+  }
+  double harmonic = 0;
+  for (uint32_t j = k_hll_q; j >= 1; j--) {
+    harmonic = (harmonic + histo[j]) * 0.5;
+  }
+  return hll_finish(harmonic, histo[0], histo[k_hll_q + 1]);
+}
+
+// 2^-r is built directly as the bits of a double, exponent 1023 - r. The
+// zero and maximal registers are counted with byte compares, and their
+// terms taken out of the sum afterwards.
+__attribute__((target("avx2"))) static uint64_t
+hll_estimate_avx2_kernel(const uint8_t *regs) {
+  const __m256i bias = _mm256_set1_epi64x(1023);
+  const __m256i zero = _mm256_setzero_si256();
+  const __m256i top = _mm256_set1_epi8((char)(k_hll_q + 1));
+  __m256d acc[4] = {_mm256_setzero_pd(), _mm256_setzero_pd(),
+                    _mm256_setzero_pd(), _mm256_setzero_pd()};
+  uint32_t zeros = 0, maxed = 0;
+  for (uint32_t i = 0; i < k_hll_registers; i += 32) {
+    __m256i v = _mm256_loadu_si256((const __m256i *)(regs + i));
+    zeros += __builtin_popcount(
+        (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, zero)));
+    maxed += __builtin_popcount(
+        (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, top)));
+    for (int k = 0; k < 8; k++) {
+      uint32_t four = 0;
+      memcpy(&four, regs + i + 4 * k, 4);
+      __m256i r = _mm256_cvtepu8_epi64(_mm_cvtsi32_si128((int)four));
+      __m256i bits = _mm256_slli_epi64(_mm256_sub_epi64(bias, r), 52);
+      acc[k & 3] = _mm256_add_pd(acc[k & 3], _mm256_castsi256_pd(bits));
+    }
+  }
+  __m256d sum = _mm256_add_pd(_mm256_add_pd(acc[0], acc[1]),
+                              _mm256_add_pd(acc[2], acc[3]));
+  double lanes[4];
+  _mm256_storeu_pd(lanes, sum);
+  double harmonic = lanes[0] + lanes[1] + lanes[2] + lanes[3];
+  harmonic -= zeros + maxed * ldexp(1.0, -(int)(k_hll_q + 1));
+  return hll_finish(harmonic, zeros, maxed);
+}
+
+uint64_t hll_estimate_avx2(const uint8_t *regs) {
+  if (!cpu_has_avx2()) {
+    return hll_estimate_scalar(regs);
+  }
+  return hll_estimate_avx2_kernel(regs);
+}
+
+uint64_t hll_estimate(const uint8_t *regs) { return hll_estimate_avx2(regs); }
@@ -0,0 +1,53 @@
+#pragma once
+
+#include "cpu.h"
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+using namespace std;
+
+// HyperLogLog counters stored in string values, in the layout Redis uses:
+// a 16-byte header ("HYLL", the encoding, 3 unused bytes, and the cached
+// cardinality), then 2^14 registers of 6 bits.
+//
+// A new counter is sparse: runs of equal registers, a couple of bytes for
+// a counter that saw a few elements. It becomes dense, the registers
+// packed 4 per 3 bytes (12 KB), once the runs need more than the limit
+// passed to hll_add, or a register exceeds what a run can hold.
+
+const uint32_t k_hll_p = 14;
+const uint32_t k_hll_registers = 1 << k_hll_p;
+const size_t k_hll_header = 16;
+const size_t k_hll_dense_size = k_hll_header + k_hll_registers * 6 / 8;
+
+// a new, empty sparse counter
+void hll_init(string &s);
+// checks the header, and the size of a dense counter
+bool hll_valid(const string &s);
+bool hll_is_dense(const string &s);
+
+// Adds an element. Returns 1 if a register changed, which invalidates the
+// cached cardinality, 0 if not, and -1 for a corrupt sparse encoding.
+int hll_add(string &s, const char *elem, size_t len, size_t sparse_max);
+// the estimate, from the cache when it is valid; updates the cache
+bool hll_count(string &s, uint64_t *out);
+
+// Unpacks the registers, one per byte, into regs[k_hll_registers]. False
+// for a corrupt sparse encoding.
+bool hll_registers(const string &s, uint8_t *regs);
+// replaces the counter with the dense encoding of `regs`
+void hll_store_dense(string &s, const uint8_t *regs);
+
+// dst[i] = max(dst[i], src[i]) over all registers
+void hll_max(uint8_t *dst, const uint8_t *src);
+// the estimate for unpacked registers
+uint64_t hll_estimate(const uint8_t *regs);
+
+// kernels behind the functions above, for tests and benchmarks; the _avx2
+// variants fall back to the scalar ones without AVX2
+void hll_unpack_scalar(const uint8_t *dense, uint8_t *regs);
+void hll_unpack_avx2(const uint8_t *dense, uint8_t *regs);
+void hll_max_scalar(uint8_t *dst, const uint8_t *src);
+void hll_max_avx2(uint8_t *dst, const uint8_t *src);
+uint64_t hll_estimate_scalar(const uint8_t *regs);
+uint64_t hll_estimate_avx2(const uint8_t *regs);
@@ -0,0 +1,280 @@
+#include "hobj.h"
+#include "structures.hpp"
+#include <string.h>
+
+// Packed layout: varint(flen) field varint(vlen) value, repeated.
+
+static size_t varint_put(uint8_t *p, uint32_t v) {
+  size_t n = 0;
+  while (v >= 0x80) {
+    p[n++] = (uint8_t)(v | 0x80);
+    v >>= 7;
+  }
+  p[n++] = (uint8_t)v;
+  return n;
+}
+
+static const uint8_t *varint_get(const uint8_t *p, uint32_t *v) {
+  uint32_t out = 0;
+  for (int shift = 0;; shift += 7) {
+    uint8_t b = *p++;
+    out |= (uint32_t)(b & 0x7F) << shift;
+    if (!(b & 0x80)) {
+      break;
+    }
+  }
+  *v = out;
+  return p;
+}
+
+static void packed_append(string &out, const char *data, size_t len) {
+  uint8_t hdr[5];
+  out.append((char *)hdr, varint_put(hdr, (uint32_t)len));
+  out.append(data, len);
+}
+
+// Replaces [pos, pos + len) with `data`. The buffer is reallocated to the
+// exact size, like a listpack, instead of growing by doubling.
+static void packed_splice(HObj *h, size_t pos, size_t len, const string &data) {
+  string next;
+  next.reserve(h->packed.size() - len + data.size());
+  next.append(h->packed, 0, pos);
+  next.append(data);
+  next.append(h->packed, pos + len, string::npos);
+  h->packed.swap(next);
+}
+
+// A pair in the packed buffer, as offsets so they survive reallocation.
+struct PackedPos {
+  size_t field = 0; // start of the field's length
+  size_t val = 0;   // start of the value's length
+  size_t end = 0;   // one past the value
+  const char *vdata = NULL;
+  uint32_t vlen = 0;
+};
+
+static bool packed_find(HObj *h, const char *field, size_t flen,
+                        PackedPos *pos) {
+  const uint8_t *base = (const uint8_t *)h->packed.data();
+  const uint8_t *p = base;
+  const uint8_t *end = base + h->packed.size();
+  while (p < end) {
+    const uint8_t *start = p;
+    uint32_t len = 0;
+    p = varint_get(p, &len);
+    bool match = len == flen && memcmp(p, field, flen) == 0;
+    p += len;
+    const uint8_t *vstart = p;
+    p = varint_get(p, &len);
+    if (match) {
+      pos->field = start - base;
+      pos->val = vstart - base;
+      pos->end = (p + len) - base;
+      pos->vdata = (const char *)p;
+      pos->vlen = len;
+      return true;
+    }
+    p += len;
+  }
+  return false;
+}
+
+static size_t str_heap(const string &s) {
+  return s.capacity() > 15 ? s.capacity() + 1 : 0;
+}
+
+static size_t hfield_mem(HField *hf) {
+  return sizeof(HField) + str_heap(hf->field) + str_heap(hf->val);
+}
+
+struct HFieldKey {
+  HNode node;
+  const char *field = NULL;
+  size_t len = 0;
+};
+
+static bool hfield_eq(HNode *node, HNode *key) {
+  HField *hf = container_of(node, HField, node);
+  HFieldKey *hkey = container_of(key, HFieldKey, node);
+  return hf->field.size() == hkey->len &&
+         memcmp(hf->field.data(), hkey->field, hkey->len) == 0;
+}
+
+static HField *map_find(HObj *h, const char *field, size_t flen) {
+  HFieldKey key;
+  key.node.hcode = str_hash((const uint8_t *)field, flen);
+  key.field = field;
+  key.len = flen;
+  HNode *node = hm_find(h->map, &key.node, &hfield_eq);
+  return node ? container_of(node, HField, node) : NULL;
+}
+
+static void map_insert(HObj *h, const char *field, size_t flen,
+                       const char *val, size_t vlen) {
+  HField *hf = new HField();
+  hf->field.assign(field, flen);
+  hf->val.assign(val, vlen);
+  hf->node.hcode = str_hash((const uint8_t *)field, flen);
+  hm_insert(h->map, &hf->node);
+  h->mem += hfield_mem(hf);
+}
+
+// moves the packed pairs into an HMap
+static void hobj_convert(HObj *h) {
+  h->map = new HMap();
+  const uint8_t *p = (const uint8_t *)h->packed.data();
+  const uint8_t *end = p + h->packed.size();
+  while (p < end) {
+    uint32_t flen = 0, vlen = 0;
+    p = varint_get(p, &flen);
+    const char *field = (const char *)p;
+    p = varint_get(p + flen, &vlen);
+    map_insert(h, field, flen, (const char *)p, vlen);
+    p += vlen;
+  }
+  string().swap(h->packed);
+}
+
+bool hobj_set(HObj *h, const char *field, size_t flen, const char *val,
+              size_t vlen, const HObjLimits &limits) {
+  if (!h->map) {
+    PackedPos pos;
+    bool found = packed_find(h, field, flen, &pos);
+    bool fits = vlen <= limits.max_value && flen <= limits.max_value &&
+                (found || h->count < limits.max_entries);
+    if (fits && found) {
+      // only the value is spliced in, the other pairs stay where they are
+      string enc;
+      packed_append(enc, val, vlen);
+      packed_splice(h, pos.val, pos.end - pos.val, enc);
+      return false;
+    }
+    if (fits) {
+      string enc;
+      packed_append(enc, field, flen);
+      packed_append(enc, val, vlen);
+      packed_splice(h, h->packed.size(), 0, enc);
+      h->count++;
+      return true;
+    }
+    hobj_convert(h);
+  }
+
+  HField *hf = map_find(h, field, flen);
+  if (hf) {
+    h->mem -= hfield_mem(hf);
+    hf->val.assign(val, vlen);
+    h->mem += hfield_mem(hf);
+    return false;
+  }
+  map_insert(h, field, flen, val, vlen);
+  h->count++;
+  return true;
+}
+
+bool hobj_get(HObj *h, const char *field, size_t flen, const char **val,
+              size_t *vlen) {
+  if (h->map) {
+    HField *hf = map_find(h, field, flen);
+    if (!hf) {
+      return false;
+    }
+    *val = hf->val.data();
+    *vlen = hf->val.size();
+    return true;
+  }
+  PackedPos pos;
+  if (!packed_find(h, field, flen, &pos)) {
+    return false;
+  }
+  *val = pos.vdata;
+  *vlen = pos.vlen;
+  return true;
+}
+
+bool hobj_del(HObj *h, const char *field, size_t flen) {
+  if (h->map) {
+    HFieldKey key;
+    key.node.hcode = str_hash((const uint8_t *)field, flen);
+    key.field = field;
+    key.len = flen;
+    HNode *node = hm_pop(h->map, &key.node, &hfield_eq);
+    if (!node) {
+      return false;
+    }
+    HField *hf = container_of(node, HField, node);
+    h->mem -= hfield_mem(hf);
+    delete hf;
+    h->count--;
+    return true;
+  }
+  PackedPos pos;
+  if (!packed_find(h, field, flen, &pos)) {
+    return false;
+  }
+  packed_splice(h, pos.field, pos.end - pos.field, string());
+  h->count--;
+  return true;
+}
+
+size_t hobj_size(HObj *h) { return h->count; }
+
+static void htab_each(HTab *htab, void (*fn)(HField *, void *), void *arg) {
+  for (size_t i = 0; htab->tab && i <= htab->mask; i++) {
+    HNode *node = htab->tab[i];
+    while (node) {
+      // fn may free the node
+      HNode *next = node->next;
+      fn(container_of(node, HField, node), arg);
+      node = next;
+    }
+  }
+}
+
+struct ScanCtx {
+  void (*fn)(const char *, size_t, const char *, size_t, void *);
+  void *arg;
+};
+
+static void scan_field(HField *hf, void *arg) {
+  ScanCtx *ctx = (ScanCtx *)arg;
+  ctx->fn(hf->field.data(), hf->field.size(), hf->val.data(), hf->val.size(),
+          ctx->arg);
+}
+
+void hobj_scan(HObj *h,
+               void (*fn)(const char *field, size_t flen, const char *val,
+                          size_t vlen, void *arg),
+               void *arg) {
+  if (h->map) {
+    ScanCtx ctx = {fn, arg};
+    htab_each(&h->map->ht1, &scan_field, &ctx);
+    htab_each(&h->map->ht2, &scan_field, &ctx);
+    return;
+  }
+  const uint8_t *p = (const uint8_t *)h->packed.data();
+  const uint8_t *end = p + h->packed.size();
+  while (p < end) {
+    uint32_t flen = 0, vlen = 0;
+    p = varint_get(p, &flen);
+    const char *field = (const char *)p;
+    p = varint_get(p + flen, &vlen);
+    fn(field, flen, (const char *)p, vlen, arg);
+    p += vlen;
+  }
+}
+
+static void free_field(HField *hf, void *) { delete hf; }
+
+void hobj_dispose(HObj *h) {
+  if (h->map) {
+    htab_each(&h->map->ht1, &free_field, NULL);
+    htab_each(&h->map->ht2, &free_field, NULL);
+    hm_destroy(h->map);
+    delete h->map;
+    h->map = NULL;
+  }
+  string().swap(h->packed);
+  h->count = 0;
+  h->mem = 0;
+}
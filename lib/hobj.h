@@ -0,0 +1,47 @@
+#pragma once
+
+#include "hash.h"
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+using namespace std;
+
+// The value of a hash key: a map of fields to values.
+//
+// A small hash is one packed buffer of field, value, field, value...
+// where each string is prefixed by its length as a varint, and lookups
+// scan it linearly. A hash that outgrows the limits passed to hobj_set is
+// converted to an HMap with one node per field, and stays one.
+struct HObj {
+  string packed;
+  uint32_t count = 0;
+  HMap *map = NULL; // NULL while packed
+  // bytes held by the map's nodes, for maxmemory accounting
+  size_t mem = 0;
+};
+
+struct HField {
+  HNode node;
+  string field;
+  string val;
+};
+
+// Limits of the packed encoding, from `hash-max-listpack-*`.
+struct HObjLimits {
+  uint32_t max_entries = 128;
+  uint32_t max_value = 64;
+};
+
+// Sets a field. Returns true if the field is new.
+bool hobj_set(HObj *h, const char *field, size_t flen, const char *val,
+              size_t vlen, const HObjLimits &limits);
+// Points `val` at the value, valid until the hash is modified.
+bool hobj_get(HObj *h, const char *field, size_t flen, const char **val,
+              size_t *vlen);
+bool hobj_del(HObj *h, const char *field, size_t flen);
+size_t hobj_size(HObj *h);
+void hobj_scan(HObj *h,
+               void (*fn)(const char *field, size_t flen, const char *val,
+                          size_t vlen, void *arg),
+               void *arg);
+void hobj_dispose(HObj *h);
@@ -0,0 +1,200 @@
+#include "log.h"
+#include <atomic>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+int g_log_level = LOG_INFO;
+
+const size_t k_log_ring_size = 4096; // power of 2
+const size_t k_log_msg_max = 232;
+
+// A slot of the bounded MPMC ring (Vyukov's scheme): `seq` equals the
+// enqueue position when the slot is free and position + 1 once filled.
+struct LogSlot {
+  std::atomic<size_t> seq;
+  uint64_t realtime_us;
+  uint8_t level;
+  uint16_t len;
+  char msg[k_log_msg_max];
+};
+
+static LogSlot g_ring[k_log_ring_size];
+static std::atomic<size_t> g_head(0);
+static size_t g_tail = 0; // only touched by the writer thread
+static std::atomic<size_t> g_drained(0);
+static std::atomic<uint64_t> g_dropped(0);
+static FILE *g_out = NULL;
+// a file opened by log_reopen, taken over by the writer
+static std::atomic<FILE *> g_next_out(NULL);
+static std::atomic<bool> g_started(false);
+
+static const char *k_level_names[] = {"debug", "verbose", "info", "warn",
+                                      "error"};
+static const char k_level_marks[] = {'.', '-', '*', '#', '!'};
+
+const char *log_level_name(int level) {
+  return (level >= LOG_DEBUG && level <= LOG_ERROR) ? k_level_names[level]
+                                                    : "?";
+}
+
+int log_level_from_name(const char *name) {
+  for (int i = LOG_DEBUG; i <= LOG_ERROR; i++) {
+    if (strcmp(name, k_level_names[i]) == 0) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+void log_set_level(int level) { g_log_level = level; }
+
+uint64_t log_dropped() { return g_dropped.load(std::memory_order_relaxed); }
+
+void log_write(int level, const char *fmt, ...) {
+  size_t pos = g_head.load(std::memory_order_relaxed);
+  LogSlot *slot = NULL;
+  while (true) {
+    slot = &g_ring[pos & (k_log_ring_size - 1)];
+    size_t seq = slot->seq.load(std::memory_order_acquire);
+    intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+    if (diff == 0) {
+      if (g_head.compare_exchange_weak(pos, pos + 1,
+                                       std::memory_order_relaxed)) {
+        break;
+      }
+    } else if (diff < 0) {
+      // full; the writer is behind
+      g_dropped.fetch_add(1, std::memory_order_relaxed);
+      return;
+    } else {
+      pos = g_head.load(std::memory_order_relaxed);
+    }
+  }
+
+  timespec tv = {0, 0};
+  clock_gettime(CLOCK_REALTIME, &tv);
+  slot->realtime_us = uint64_t(tv.tv_sec) * 1000000 + tv.tv_nsec / 1000;
+  slot->level = (uint8_t)level;
+  va_list ap;
+  va_start(ap, fmt);
+  int n = vsnprintf(slot->msg, k_log_msg_max, fmt, ap);
+  va_end(ap);
+  if (n < 0) {
+    n = 0;
+  } else if (n >= (int)k_log_msg_max) {
+    n = k_log_msg_max - 1; // truncated
+  }
+  slot->len = (uint16_t)n;
+  slot->seq.store(pos + 1, std::memory_order_release);
+}
+
+// formats one slot as `DD Mon HH:MM:SS.mmm * message`
+static size_t log_format(LogSlot *slot, char *buf, size_t cap) {
+  time_t secs = (time_t)(slot->realtime_us / 1000000);
+  struct tm tm;
+  localtime_r(&secs, &tm);
+  size_t n = strftime(buf, cap, "%d %b %H:%M:%S", &tm);
+  n += snprintf(buf + n, cap - n, ".%03u %c ",
+                (unsigned)(slot->realtime_us / 1000 % 1000),
+                k_level_marks[slot->level]);
+  size_t len = slot->len < cap - n - 1 ? slot->len : cap - n - 1;
+  memcpy(buf + n, slot->msg, len);
+  n += len;
+  buf[n++] = '\n';
+  return n;
+}
+
+static void *log_writer(void *) {
+  char batch[64 * 1024];
+  uint64_t reported_drops = 0;
+  uint32_t idle_rounds = 0;
+  while (true) {
+    FILE *next = g_next_out.exchange(NULL);
+    if (next) {
+      if (g_out != stdout) {
+        fclose(g_out);
+      }
+      g_out = next;
+    }
+    size_t used = 0;
+    while (used + k_log_msg_max + 64 <= sizeof(batch)) {
+      LogSlot *slot = &g_ring[g_tail & (k_log_ring_size - 1)];
+      if (slot->seq.load(std::memory_order_acquire) != g_tail + 1) {
+        break;
+      }
+      used += log_format(slot, batch + used, sizeof(batch) - used);
+      slot->seq.store(g_tail + k_log_ring_size, std::memory_order_release);
+      g_tail++;
+    }
+    uint64_t drops = log_dropped();
+    if (drops != reported_drops) {
+      used += snprintf(batch + used, sizeof(batch) - used,
+                       "(%lu log messages dropped)\n",
+                       (unsigned long)(drops - reported_drops));
+      reported_drops = drops;
+    }
+    if (used) {
+      fwrite(batch, 1, used, g_out);
+      fflush(g_out);
+      g_drained.store(g_tail, std::memory_order_release);
+      idle_rounds = 0;
+      continue;
+    }
+    g_drained.store(g_tail, std::memory_order_release);
+    // back off while idle, from 100us to 10ms
+    idle_rounds = idle_rounds < 100 ? idle_rounds + 1 : 100;
+    timespec ts = {0, (long)idle_rounds * 100000};
+    nanosleep(&ts, NULL);
+  }
+  return NULL;
+}
+
+bool log_init(const char *path) {
+  for (size_t i = 0; i < k_log_ring_size; i++) {
+    g_ring[i].seq.store(i, std::memory_order_relaxed);
+  }
+  g_out = stdout;
+  if (path && *path) {
+    g_out = fopen(path, "a");
+    if (!g_out) {
+      perror("fopen");
+      return false;
+    }
+  }
+  pthread_t thread;
+  if (pthread_create(&thread, NULL, &log_writer, NULL) != 0) {
+    return false;
+  }
+  g_started = true;
+  return true;
+}
+
+bool log_reopen(const char *path) {
+  if (!g_started) {
+    return true; // log_init opens it
+  }
+  FILE *f = stdout;
+  if (path && *path) {
+    f = fopen(path, "a");
+    if (!f) {
+      return false;
+    }
+  }
+  // replaces a file the writer has not taken yet
+  FILE *old = g_next_out.exchange(f);
+  if (old && old != stdout) {
+    fclose(old);
+  }
+  return true;
+}
+
+void log_flush() {
+  size_t target = g_head.load(std::memory_order_acquire);
+  while (g_drained.load(std::memory_order_acquire) < target) {
+    timespec ts = {0, 100000};
+    nanosleep(&ts, NULL);
+  }
+}
@@ -0,0 +1,48 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+enum {
+  LOG_DEBUG = 0,
+  LOG_VERBOSE = 1,
+  LOG_INFO = 2,
+  LOG_WARN = 3,
+  LOG_ERROR = 4,
+};
+
+// Levels below this are compiled out entirely, arguments included.
+#ifndef LOG_COMPILE_LEVEL
+#define LOG_COMPILE_LEVEL LOG_DEBUG
+#endif
+
+// runtime threshold, see log_set_level
+extern int g_log_level;
+
+// Starts the writer thread. `path` NULL or empty logs to stdout.
+bool log_init(const char *path);
+// Switches to another file, or stdout, after the messages already queued.
+// False if the file can't be opened, the current one is kept then.
+bool log_reopen(const char *path);
+void log_set_level(int level);
+int log_level_from_name(const char *name);
+const char *log_level_name(int level);
+// Formats into a ring slot and returns; never blocks on I/O. Messages are
+// dropped (and counted) when the ring is full.
+void log_write(int level, const char *fmt, ...)
+    __attribute__((format(printf, 2, 3)));
+// waits until the writer has drained everything queued so far
+void log_flush();
+uint64_t log_dropped();
+
+#define LOG_AT(level, ...)                                                     \
+  do {                                                                         \
+    if ((level) >= LOG_COMPILE_LEVEL && (level) >= g_log_level)                \
+      log_write((level), __VA_ARGS__);                                         \
+  } while (0)
+
+#define log_debug(...) LOG_AT(LOG_DEBUG, __VA_ARGS__)
+#define log_verbose(...) LOG_AT(LOG_VERBOSE, __VA_ARGS__)
+#define log_info(...) LOG_AT(LOG_INFO, __VA_ARGS__)
+#define log_warn(...) LOG_AT(LOG_WARN, __VA_ARGS__)
+#define log_error(...) LOG_AT(LOG_ERROR, __VA_ARGS__)
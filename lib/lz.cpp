@@ -0,0 +1,149 @@
+#include "lz.h"
+#include <string.h>
+
+const uint32_t k_lz_hash_bits = 12;
+const size_t k_lz_max_lit = 32;
+const size_t k_lz_max_off = 1 << 13;
+// 7 in the control byte, 255 in the next, plus the 2 always implied
+const size_t k_lz_max_ref = 7 + 255 + 2;
+
+static uint32_t lz_hash(const uint8_t *p) {
+  uint32_t v = (uint32_t)p[0] << 16 | (uint32_t)p[1] << 8 | p[2];
+  return (v * 2654435761u) >> (32 - k_lz_hash_bits);
+}
+
+// writes in[from, to) as literal runs; false if `out` is full
+static bool lz_literals(const uint8_t *in, size_t from, size_t to,
+                        uint8_t *&op, const uint8_t *oend) {
+  while (from < to) {
+    size_t run = to - from < k_lz_max_lit ? to - from : k_lz_max_lit;
+    if ((size_t)(oend - op) < 1 + run) {
+      return false;
+    }
+    *op++ = (uint8_t)(run - 1);
+    memcpy(op, in + from, run);
+    op += run;
+    from += run;
+  }
+  return true;
+}
+
+bool lz_compress(const uint8_t *in, size_t len, string &out, size_t max_out) {
+  if (max_out <= k_lz_header || len > UINT32_MAX) {
+    return false;
+  }
+  out.resize(max_out);
+  uint8_t *op = (uint8_t *)&out[0];
+  const uint8_t *oend = op + max_out;
+  uint32_t raw = (uint32_t)len;
+  memcpy(op, &raw, 4);
+  op += k_lz_header;
+
+  // position + 1 of the last occurrence of each hash, 0 for none
+  uint32_t table[1 << k_lz_hash_bits] = {};
+  size_t ip = 0, lit = 0;
+  while (ip + 2 < len) {
+    uint32_t h = lz_hash(in + ip);
+    size_t ref = table[h];
+    table[h] = (uint32_t)ip + 1;
+    if (!ref || ip - (ref - 1) > k_lz_max_off ||
+        memcmp(in + ref - 1, in + ip, 3) != 0) {
+      ip++;
+      continue;
+    }
+    ref--;
+    size_t max_len = len - ip < k_lz_max_ref ? len - ip : k_lz_max_ref;
+    size_t mlen = 3;
+    while (mlen < max_len && in[ref + mlen] == in[ip + mlen]) {
+      mlen++;
+    }
+    if (!lz_literals(in, lit, ip, op, oend) || oend - op < 3) {
+      return false;
+    }
+    size_t off = ip - ref - 1;
+    size_t l = mlen - 2;
+    if (l < 7) {
+      *op++ = (uint8_t)(l << 5 | off >> 8);
+    } else {
+      *op++ = (uint8_t)(7 << 5 | off >> 8);
+      *op++ = (uint8_t)(l - 7);
+    }
+    *op++ = (uint8_t)off;
+    // later matches may start inside this one
+    for (size_t i = ip + 1; i < ip + mlen && i + 2 < len; i++) {
+      table[lz_hash(in + i)] = (uint32_t)i + 1;
+    }
+    ip += mlen;
+    lit = ip;
+  }
+  if (!lz_literals(in, lit, len, op, oend)) {
+    return false;
+  }
+  out.resize(op - (const uint8_t *)out.data());
+  return true;
+}
+
+size_t lz_raw_size(const uint8_t *in, size_t len) {
+  uint32_t raw = 0;
+  if (len >= k_lz_header) {
+    memcpy(&raw, in, 4);
+  }
+  return raw;
+}
+
+bool lz_decompress(const uint8_t *in, size_t len, string &out) {
+  if (len < k_lz_header) {
+    return false;
+  }
+  // a 3-byte back reference gives the most output, 264 bytes
+  size_t raw = lz_raw_size(in, len);
+  if (raw > (len - k_lz_header) / 3 * k_lz_max_ref + 2) {
+    return false;
+  }
+  size_t base = out.size();
+  out.resize(base + raw);
+  uint8_t *start = (uint8_t *)&out[0] + base;
+  uint8_t *op = start;
+  const uint8_t *oend = (const uint8_t *)out.data() + out.size();
+  const uint8_t *ip = in + k_lz_header;
+  const uint8_t *iend = in + len;
+  bool ok = true;
+  while (ok && ip < iend) {
+    size_t c = *ip++;
+    if (c < k_lz_max_lit) {
+      size_t run = c + 1;
+      ok = (size_t)(iend - ip) >= run && (size_t)(oend - op) >= run;
+      if (ok) {
+        memcpy(op, ip, run);
+        op += run;
+        ip += run;
+      }
+      continue;
+    }
+    size_t l = c >> 5;
+    if (l == 7) {
+      ok = ip < iend;
+      l += ok ? *ip++ : 0;
+    }
+    ok = ok && ip < iend;
+    if (!ok) {
+      break;
+    }
+    size_t off = (c & 31) << 8 | *ip++;
+    l += 2;
+    ok = (size_t)(op - start) > off && (size_t)(oend - op) >= l;
+    if (ok) {
+      // may overlap the bytes it writes, for runs
+      const uint8_t *ref = op - off - 1;
+      for (size_t i = 0; i < l; i++) {
+        op[i] = ref[i];
+      }
+      op += l;
+    }
+  }
+  if (!ok || op != oend) {
+    out.resize(base);
+    return false;
+  }
+  return true;
+}
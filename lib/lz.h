@@ -0,0 +1,27 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+using namespace std;
+
+// A small LZ77 codec in the LZF format: literal runs of up to 32 bytes and
+// back references of 3 to 264 bytes within the last 8 KB. It finds matches
+// through one hash probe per position, so it runs at memory speed, and
+// decompressing is a loop of copies.
+//
+// A block is self-contained: a 4-byte little-endian raw size, then the
+// compressed data. A stream, such as a snapshot or replication feed, is a
+// sequence of blocks that can be decoded one at a time.
+
+const size_t k_lz_header = 4;
+
+// Replaces `out` with the block for `in`. False, leaving `out` unspecified,
+// if it would take more than `max_out` bytes; pass the input size less the
+// saving that makes compression worth it.
+bool lz_compress(const uint8_t *in, size_t len, string &out, size_t max_out);
+// the raw size recorded in a block, 0 if it has no header
+size_t lz_raw_size(const uint8_t *in, size_t len);
+// Appends the data of a block to `out`. False for a corrupt block, which
+// leaves `out` as it was.
+bool lz_decompress(const uint8_t *in, size_t len, string &out);
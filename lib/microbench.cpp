@@ -0,0 +1,914 @@
+// Microbenchmarks for the core data structures and the request parser.
+//
+// Results are printed as one JSON object per line. With --baseline, each
+// result is compared against a stored run and the process fails if any
+// benchmark got slower than the tolerance allows; CTest runs it that way.
+//
+//   microbench [--filter name] [--out file] [--baseline file]
+//              [--tolerance 0.5]
+#include "functions.hpp"
+#include "art.h"
+#include "avl.h"
+#include "bitops.h"
+#include "hash.h"
+#include "heap.h"
+#include "histogram.h"
+#include "hll.h"
+#include "hobj.h"
+#include "lz.h"
+#include "qlist.h"
+#include "rng.h"
+#include "sobj.h"
+#include "rclient.h"
+#include <map>
+
+const size_t k_bench_n = 200000;
+const int k_bench_rounds = 5;
+
+struct BenchResult {
+  string name;
+  double ns_per_op = 0;
+  uint64_t ops = 0;
+  // worst single operation, only reported where it is meaningful
+  double max_ns = 0;
+};
+
+// keeps the optimizer from dropping otherwise unused results
+static volatile uint64_t g_sink = 0;
+
+struct BNode {
+  HNode hnode;
+  AVLNode avlnode;
+  uint64_t key = 0;
+};
+
+static bool bnode_eq(HNode *lhs, HNode *rhs) {
+  return (container_of(lhs, BNode, hnode))->key ==
+         (container_of(rhs, BNode, hnode))->key;
+}
+
+static uint64_t int_hash(uint64_t v) {
+  return str_hash((const uint8_t *)&v, sizeof(v));
+}
+
+static vector<BNode> make_nodes(size_t n) {
+  vector<BNode> nodes(n);
+  for (size_t i = 0; i < n; i++) {
+    nodes[i].key = i;
+    nodes[i].hnode.hcode = int_hash(i);
+  }
+  return nodes;
+}
+
+// Each benchmark runs one round and returns the ns it took for `ops`
+// operations; the harness keeps the fastest of several rounds.
+typedef uint64_t (*BenchFn)(uint64_t &ops, double &max_ns);
+
+static uint64_t bench_hm_insert(uint64_t &ops, double &max_ns) {
+  vector<BNode> nodes = make_nodes(k_bench_n);
+  HMap map;
+  uint64_t worst = 0;
+  uint64_t start = clock_nsec();
+  for (BNode &n : nodes) {
+    uint64_t t0 = clock_nsec();
+    hm_insert(&map, &n.hnode);
+    worst = max(worst, clock_nsec() - t0);
+  }
+  uint64_t ns = clock_nsec() - start;
+  hm_destroy(&map);
+  ops = k_bench_n;
+  max_ns = (double)worst;
+  return ns;
+}
+
+static uint64_t bench_hm_find(uint64_t &ops, double &) {
+  vector<BNode> nodes = make_nodes(k_bench_n);
+  HMap map;
+  for (BNode &n : nodes) {
+    hm_insert(&map, &n.hnode);
+  }
+  BNode key;
+  uint64_t start = clock_nsec();
+  for (size_t i = 0; i < k_bench_n; i++) {
+    key.key = rnd() % k_bench_n;
+    key.hnode.hcode = int_hash(key.key);
+    g_sink += (uintptr_t)hm_find(&map, &key.hnode, &bnode_eq);
+  }
+  uint64_t ns = clock_nsec() - start;
+  hm_destroy(&map);
+  ops = k_bench_n;
+  return ns;
+}
+
+// lookups right after the insert that triggers a table resize
+static uint64_t bench_hm_find_resizing(uint64_t &ops, double &max_ns) {
+  vector<BNode> nodes = make_nodes(k_bench_n);
+  HMap map;
+  size_t i = 0;
+  uint64_t ns = 0;
+  uint64_t worst = 0;
+  ops = 0;
+  while (i < k_bench_n) {
+    size_t buckets = map.ht1.mask + 1;
+    hm_insert(&map, &nodes[i++].hnode);
+    if (map.ht1.mask + 1 == buckets || buckets < 1024) {
+      continue;
+    }
+    // a resize just started; measure lookups while it is in progress
+    BNode key;
+    for (size_t j = 0; j < 1024; j++) {
+      key.key = rnd() % i;
+      key.hnode.hcode = int_hash(key.key);
+      uint64_t t0 = clock_nsec();
+      g_sink += (uintptr_t)hm_find(&map, &key.hnode, &bnode_eq);
+      uint64_t dt = clock_nsec() - t0;
+      ns += dt;
+      worst = max(worst, dt);
+      ops++;
+    }
+  }
+  hm_destroy(&map);
+  max_ns = (double)worst;
+  return ns;
+}
+
+static uint64_t bench_hm_pop(uint64_t &ops, double &) {
+  vector<BNode> nodes = make_nodes(k_bench_n);
+  HMap map;
+  for (BNode &n : nodes) {
+    hm_insert(&map, &n.hnode);
+  }
+  uint64_t start = clock_nsec();
+  for (BNode &n : nodes) {
+    g_sink += (uintptr_t)hm_pop(&map, &n.hnode, &bnode_eq);
+  }
+  uint64_t ns = clock_nsec() - start;
+  hm_destroy(&map);
+  ops = k_bench_n;
+  return ns;
+}
+
+static AVLNode *avl_add(AVLNode *root, BNode *node) {
+  avl_init(&node->avlnode);
+  AVLNode *cur = NULL;
+  AVLNode **from = &root;
+  while (*from) {
+    cur = *from;
+    BNode *parent = container_of(cur, BNode, avlnode);
+    from = node->key < parent->key ? &cur->left : &cur->right;
+  }
+  *from = &node->avlnode;
+  node->avlnode.parent = cur;
+  return avl_fix(&node->avlnode);
+}
+
+static vector<BNode> make_shuffled_nodes(size_t n) {
+  vector<BNode> nodes = make_nodes(n);
+  for (size_t i = n - 1; i > 0; i--) {
+    swap(nodes[i].key, nodes[rnd() % (i + 1)].key);
+  }
+  return nodes;
+}
+
+static uint64_t bench_avl_fix(uint64_t &ops, double &) {
+  vector<BNode> nodes = make_shuffled_nodes(k_bench_n);
+  AVLNode *root = NULL;
+  uint64_t start = clock_nsec();
+  for (BNode &n : nodes) {
+    root = avl_add(root, &n);
+  }
+  ops = k_bench_n;
+  return clock_nsec() - start;
+}
+
+static uint64_t bench_avl_del(uint64_t &ops, double &) {
+  vector<BNode> nodes = make_shuffled_nodes(k_bench_n);
+  AVLNode *root = NULL;
+  for (BNode &n : nodes) {
+    root = avl_add(root, &n);
+  }
+  uint64_t start = clock_nsec();
+  for (BNode &n : nodes) {
+    root = avl_del(&n.avlnode);
+  }
+  ops = k_bench_n;
+  g_sink += (uintptr_t)root;
+  return clock_nsec() - start;
+}
+
+static uint64_t bench_avl_offset(uint64_t &ops, double &) {
+  vector<BNode> nodes = make_shuffled_nodes(k_bench_n);
+  AVLNode *root = NULL;
+  for (BNode &n : nodes) {
+    root = avl_add(root, &n);
+  }
+  uint64_t start = clock_nsec();
+  for (size_t i = 0; i < k_bench_n; i++) {
+    AVLNode *from = &nodes[rnd() % k_bench_n].avlnode;
+    int64_t offset = (int64_t)(rnd() % 2001) - 1000;
+    g_sink += (uintptr_t)avl_offset(from, offset);
+  }
+  ops = k_bench_n;
+  return clock_nsec() - start;
+}
+
+// push random deadlines, then pop them all as process_timers does
+static uint64_t bench_heap_update(uint64_t &ops, double &) {
+  vector<HeapItem> heap;
+  vector<size_t> refs(k_bench_n);
+  heap.reserve(k_bench_n);
+  uint64_t start = clock_nsec();
+  for (size_t i = 0; i < k_bench_n; i++) {
+    HeapItem item;
+    item.val = rnd();
+    item.ref = &refs[i];
+    heap.push_back(item);
+    heap_update(heap.data(), heap.size() - 1, heap.size());
+  }
+  while (!heap.empty()) {
+    g_sink += heap[0].val;
+    heap[0] = heap.back();
+    heap.pop_back();
+    if (!heap.empty()) {
+      heap_update(heap.data(), 0, heap.size());
+    }
+  }
+  ops = 2 * k_bench_n;
+  return clock_nsec() - start;
+}
+
+static vector<string> make_members(size_t n) {
+  vector<string> names(n);
+  for (size_t i = 0; i < n; i++) {
+    names[i] = "member:" + to_string(i);
+  }
+  return names;
+}
+
+static uint64_t bench_zset_add(uint64_t &ops, double &) {
+  vector<string> names = make_members(k_bench_n);
+  ZSet zset;
+  uint64_t start = clock_nsec();
+  for (string &name : names) {
+    zset_add(&zset, name.data(), name.size(), (double)(rnd() % 100000));
+  }
+  uint64_t ns = clock_nsec() - start;
+  zset_dispose(&zset);
+  ops = k_bench_n;
+  return ns;
+}
+
+// zquery-style read: seek to a score, then walk 10 members
+static uint64_t bench_zset_query(uint64_t &ops, double &) {
+  vector<string> names = make_members(k_bench_n);
+  ZSet zset;
+  for (string &name : names) {
+    zset_add(&zset, name.data(), name.size(), (double)(rnd() % 100000));
+  }
+  uint64_t start = clock_nsec();
+  for (size_t i = 0; i < k_bench_n; i++) {
+    ZNode *node = zset_query(&zset, (double)(rnd() % 100000), "", 0);
+    for (int j = 0; node && j < 10; j++) {
+      g_sink += node->len;
+      node = znode_offset(node, 1);
+    }
+  }
+  uint64_t ns = clock_nsec() - start;
+  zset_dispose(&zset);
+  ops = k_bench_n;
+  return ns;
+}
+
+struct BKey {
+  string key;
+};
+
+static const uint8_t *bkey_of(void *val, size_t *len) {
+  BKey *k = (BKey *)val;
+  *len = k->key.size();
+  return (const uint8_t *)k->key.data();
+}
+
+// random keys shaped like those of `Client bench`
+static vector<BKey> make_bkeys(size_t n) {
+  vector<BKey> keys(n);
+  char buf[32];
+  for (BKey &k : keys) {
+    snprintf(buf, sizeof(buf), "key:%012lu",
+             (unsigned long)(rnd() % 1000000000000ull));
+    k.key = buf;
+  }
+  return keys;
+}
+
+static uint64_t bench_art_insert(uint64_t &ops, double &) {
+  vector<BKey> keys = make_bkeys(k_bench_n);
+  Art t;
+  t.key_of = &bkey_of;
+  uint64_t start = clock_nsec();
+  for (BKey &k : keys) {
+    art_insert(&t, (const uint8_t *)k.key.data(), k.key.size(), &k);
+  }
+  uint64_t ns = clock_nsec() - start;
+  art_destroy(&t);
+  ops = k_bench_n;
+  return ns;
+}
+
+static bool bench_art_visit(void *val, void *arg) {
+  size_t *left = (size_t *)arg;
+  g_sink += ((BKey *)val)->key.size();
+  return --*left > 0;
+}
+
+// 100 keys in order from a random start, per key
+static uint64_t bench_art_walk(uint64_t &ops, double &) {
+  vector<BKey> keys = make_bkeys(k_bench_n);
+  Art t;
+  t.key_of = &bkey_of;
+  for (BKey &k : keys) {
+    art_insert(&t, (const uint8_t *)k.key.data(), k.key.size(), &k);
+  }
+  const size_t k_walks = 2000;
+  uint64_t start = clock_nsec();
+  for (size_t i = 0; i < k_walks; i++) {
+    BKey &k = keys[rnd() % k_bench_n];
+    size_t left = 100;
+    art_walk(&t, (const uint8_t *)k.key.data(), k.key.size(), true,
+             &bench_art_visit, &left);
+  }
+  uint64_t ns = clock_nsec() - start;
+  art_destroy(&t);
+  ops = k_walks * 100;
+  return ns;
+}
+
+// one partition of ZUNIONSTORE/ZINTERSTORE over 8 sets of 25k members
+// drawn from 100k names, per source member
+static uint64_t bench_zmerge(uint64_t &ops, bool inter) {
+  const size_t k_sets = 8, k_members = 25000;
+  vector<string> names = make_members(100000);
+  vector<ZSet> sets(k_sets);
+  ZMerge m;
+  for (ZSet &zset : sets) {
+    for (size_t i = 0; i < k_members; i++) {
+      string &name = names[rnd() % names.size()];
+      zset_add(&zset, name.data(), name.size(), (double)(rnd() % 1000));
+    }
+    m.srcs.push_back(&zset);
+    m.weights.push_back(1);
+  }
+  m.inter = inter;
+  uint64_t start = clock_nsec();
+  zmerge_init(&m);
+  zmerge_part(&m, 0);
+  ZSet dest;
+  g_sink += zmerge_finish(&m, &dest);
+  uint64_t ns = clock_nsec() - start;
+  zset_dispose(&dest);
+  for (ZSet &zset : sets) {
+    zset_dispose(&zset);
+  }
+  ops = k_sets * k_members;
+  return ns;
+}
+
+static uint64_t bench_zmerge_union(uint64_t &ops, double &) {
+  return bench_zmerge(ops, false);
+}
+
+static uint64_t bench_zmerge_inter(uint64_t &ops, double &) {
+  return bench_zmerge(ops, true);
+}
+
+// field updates on packed hashes of 16 fields
+static uint64_t bench_hobj_set(uint64_t &ops, double &) {
+  const size_t k_hashes = 1024;
+  vector<HObj> hashes(k_hashes);
+  vector<string> fields = make_members(16);
+  HObjLimits limits;
+  for (HObj &h : hashes) {
+    for (string &f : fields) {
+      hobj_set(&h, f.data(), f.size(), "0123456789", 10, limits);
+    }
+  }
+  uint64_t start = clock_nsec();
+  for (size_t i = 0; i < k_bench_n; i++) {
+    uint64_t r = rnd();
+    string &f = fields[r % 16];
+    g_sink += hobj_set(&hashes[(r >> 8) % k_hashes], f.data(), f.size(),
+                       "abcdefghij", 10, limits);
+  }
+  uint64_t ns = clock_nsec() - start;
+  for (HObj &h : hashes) {
+    hobj_dispose(&h);
+  }
+  ops = k_bench_n;
+  return ns;
+}
+
+static uint64_t bench_hobj_get(uint64_t &ops, double &) {
+  const size_t k_hashes = 1024;
+  vector<HObj> hashes(k_hashes);
+  vector<string> fields = make_members(16);
+  HObjLimits limits;
+  for (HObj &h : hashes) {
+    for (string &f : fields) {
+      hobj_set(&h, f.data(), f.size(), "0123456789", 10, limits);
+    }
+  }
+  uint64_t start = clock_nsec();
+  for (size_t i = 0; i < k_bench_n; i++) {
+    uint64_t r = rnd();
+    string &f = fields[r % 16];
+    const char *val = NULL;
+    size_t len = 0;
+    hobj_get(&hashes[(r >> 8) % k_hashes], f.data(), f.size(), &val, &len);
+    g_sink += len;
+  }
+  uint64_t ns = clock_nsec() - start;
+  for (HObj &h : hashes) {
+    hobj_dispose(&h);
+  }
+  ops = k_bench_n;
+  return ns;
+}
+
+// a queue holding about 1000 elements: rpush at the back, lpop at the front
+static uint64_t bench_qlist_push_pop(uint64_t &ops, double &) {
+  QList ql;
+  ql_init(&ql);
+  const char *val = "job:000000123456";
+  for (int i = 0; i < 1000; i++) {
+    ql_push(&ql, false, val, 16);
+  }
+  string out;
+  uint64_t start = clock_nsec();
+  for (size_t i = 0; i < k_bench_n; i++) {
+    ql_push(&ql, false, val, 16);
+    ql_pop(&ql, true, out);
+    g_sink += out.size();
+  }
+  uint64_t ns = clock_nsec() - start;
+  ql_dispose(&ql);
+  ops = 2 * k_bench_n;
+  return ns;
+}
+
+// lrange-style read: seek to a random index of 100k, then read 10
+static uint64_t bench_qlist_range(uint64_t &ops, double &) {
+  QList ql;
+  ql_init(&ql);
+  for (size_t i = 0; i < 100000; i++) {
+    string val = "job:" + to_string(i);
+    ql_push(&ql, false, val.data(), val.size());
+  }
+  uint64_t start = clock_nsec();
+  for (size_t i = 0; i < k_bench_n; i++) {
+    QIter it;
+    ql_seek(&ql, rnd() % (100000 - 10), &it);
+    const char *data = NULL;
+    size_t len = 0;
+    for (int j = 0; j < 10; j++) {
+      ql_next(&ql, &it, &data, &len);
+      g_sink += len;
+    }
+  }
+  uint64_t ns = clock_nsec() - start;
+  ql_dispose(&ql);
+  ops = k_bench_n;
+  return ns;
+}
+
+// two sorted sets of 100k integers, half of them shared; ns per input value
+static uint64_t bench_intersect(uint64_t &ops, size_t nb,
+                                size_t (*fn)(const int64_t *, size_t,
+                                             const int64_t *, size_t,
+                                             int64_t *)) {
+  const size_t k_na = 100000;
+  const int k_reps = 40;
+  vector<int64_t> a, b;
+  for (size_t i = 0; a.size() < k_na || b.size() < nb; i++) {
+    uint64_t r = rnd();
+    if (a.size() < k_na && (r & 1)) {
+      a.push_back((int64_t)i);
+    }
+    if (b.size() < nb && (r & 2)) {
+      b.push_back((int64_t)i);
+    }
+  }
+  vector<int64_t> out(min(a.size(), b.size()));
+  uint64_t start = clock_nsec();
+  for (int i = 0; i < k_reps; i++) {
+    g_sink += fn(a.data(), a.size(), b.data(), b.size(), out.data());
+  }
+  ops = k_reps * (a.size() + b.size());
+  return clock_nsec() - start;
+}
+
+static uint64_t bench_intersect_scalar(uint64_t &ops, double &) {
+  return bench_intersect(ops, 100000, &intersect_scalar);
+}
+
+static uint64_t bench_intersect_avx2(uint64_t &ops, double &) {
+  return bench_intersect(ops, 100000, &intersect_avx2);
+}
+
+// 1k against 100k
+static uint64_t bench_intersect_skewed(uint64_t &ops, double &) {
+  return bench_intersect(ops, 1000, &intset_intersect);
+}
+
+// 256 KB of random bytes, which fits in L2; ns per 64-byte line
+const size_t k_bits_bytes = 256 * 1024;
+const int k_bits_reps = 200;
+
+static string bench_bits() {
+  string s(k_bits_bytes, '\0');
+  for (size_t i = 0; i < s.size(); i += 8) {
+    uint64_t r = rnd();
+    memcpy(&s[i], &r, 8);
+  }
+  return s;
+}
+
+static uint64_t bench_bitcount(uint64_t &ops,
+                               uint64_t (*fn)(const uint8_t *, size_t)) {
+  string s = bench_bits();
+  uint64_t start = clock_nsec();
+  for (int i = 0; i < k_bits_reps; i++) {
+    g_sink += fn((const uint8_t *)s.data(), s.size());
+  }
+  ops = k_bits_reps * (k_bits_bytes / 64);
+  return clock_nsec() - start;
+}
+
+static uint64_t bench_bitcount_scalar(uint64_t &ops, double &) {
+  return bench_bitcount(ops, &bitcount_scalar);
+}
+
+static uint64_t bench_bitcount_popcnt(uint64_t &ops, double &) {
+  return bench_bitcount(ops, &bitcount_popcnt);
+}
+
+static uint64_t bench_bitcount_avx2(uint64_t &ops, double &) {
+  return bench_bitcount(ops, &bitcount_avx2);
+}
+
+// AND of 4 sources; ns per 64-byte line of output
+static uint64_t bench_bitop(uint64_t &ops,
+                            void (*fn)(int, uint8_t *, size_t,
+                                       const uint8_t *const *, const size_t *,
+                                       size_t)) {
+  string srcs[4] = {bench_bits(), bench_bits(), bench_bits(), bench_bits()};
+  const uint8_t *ptrs[4];
+  size_t lens[4];
+  for (int k = 0; k < 4; k++) {
+    ptrs[k] = (const uint8_t *)srcs[k].data();
+    lens[k] = srcs[k].size();
+  }
+  string dst(k_bits_bytes, '\0');
+  uint64_t start = clock_nsec();
+  for (int i = 0; i < k_bits_reps; i++) {
+    fn(BITOP_AND, (uint8_t *)&dst[0], dst.size(), ptrs, lens, 4);
+    g_sink += (uint8_t)dst[i];
+  }
+  ops = k_bits_reps * (k_bits_bytes / 64);
+  return clock_nsec() - start;
+}
+
+static uint64_t bench_bitop_scalar(uint64_t &ops, double &) {
+  return bench_bitop(ops, &bitop_scalar);
+}
+
+static uint64_t bench_bitop_avx2(uint64_t &ops, double &) {
+  return bench_bitop(ops, &bitop_avx2);
+}
+
+// PFCOUNT over several keys: each dense counter is unpacked and folded into
+// the union; ns per counter
+static uint64_t bench_hll_merge(uint64_t &ops,
+                                void (*unpack)(const uint8_t *, uint8_t *),
+                                void (*fold)(uint8_t *, const uint8_t *)) {
+  const int k_keys = 4, k_reps = 2000;
+  string hlls[k_keys];
+  for (string &s : hlls) {
+    hll_init(s);
+    for (int i = 0; i < 100000; i++) {
+      string elem = to_string(rnd());
+      hll_add(s, elem.data(), elem.size(), 0);
+    }
+  }
+  static uint8_t regs[k_hll_registers], tmp[k_hll_registers];
+  uint64_t start = clock_nsec();
+  for (int i = 0; i < k_reps; i++) {
+    memset(regs, 0, sizeof(regs));
+    for (string &s : hlls) {
+      unpack((const uint8_t *)s.data() + k_hll_header, tmp);
+      fold(regs, tmp);
+    }
+    g_sink += regs[i % k_hll_registers];
+  }
+  ops = (uint64_t)k_reps * k_keys;
+  return clock_nsec() - start;
+}
+
+static uint64_t bench_hll_merge_scalar(uint64_t &ops, double &) {
+  return bench_hll_merge(ops, &hll_unpack_scalar, &hll_max_scalar);
+}
+
+static uint64_t bench_hll_merge_avx2(uint64_t &ops, double &) {
+  return bench_hll_merge(ops, &hll_unpack_avx2, &hll_max_avx2);
+}
+
+// the harmonic mean over all registers; ns per estimate
+static uint64_t bench_hll_estimate(uint64_t &ops,
+                                   uint64_t (*fn)(const uint8_t *)) {
+  const int k_reps = 4000;
+  static uint8_t regs[k_hll_registers];
+  for (uint8_t &r : regs) {
+    r = (uint8_t)(1 + __builtin_ctzll(rnd() | 1ull << 40));
+  }
+  uint64_t start = clock_nsec();
+  for (int i = 0; i < k_reps; i++) {
+    regs[i % k_hll_registers] ^= 1;
+    g_sink += fn(regs);
+  }
+  ops = k_reps;
+  return clock_nsec() - start;
+}
+
+static uint64_t bench_hll_estimate_scalar(uint64_t &ops, double &) {
+  return bench_hll_estimate(ops, &hll_estimate_scalar);
+}
+
+static uint64_t bench_hll_estimate_avx2(uint64_t &ops, double &) {
+  return bench_hll_estimate(ops, &hll_estimate_avx2);
+}
+
+static uint64_t bench_parse_req(uint64_t &ops, double &) {
+  string req;
+  const char *args[] = {"set", "key:000000123456", "0123456789abcdef"};
+  uint32_t nstr = 3;
+  req.append((char *)&nstr, 4);
+  for (const char *arg : args) {
+    uint32_t len = (uint32_t)strlen(arg);
+    req.append((char *)&len, 4);
+    req.append(arg, len);
+  }
+  vector<string> cmd;
+  uint64_t start = clock_nsec();
+  for (size_t i = 0; i < k_bench_n; i++) {
+    g_sink += parse_req((const uint8_t *)req.data(), req.size(), cmd);
+  }
+  ops = k_bench_n;
+  return clock_nsec() - start;
+}
+
+static uint64_t bench_parse_resp(uint64_t &ops, double &) {
+  string req = "*3\r\n$3\r\nset\r\n$16\r\nkey:000000123456\r\n"
+               "$16\r\n0123456789abcdef\r\n";
+  RespParser st;
+  vector<string> cmd;
+  uint64_t start = clock_nsec();
+  for (size_t i = 0; i < k_bench_n; i++) {
+    g_sink += parse_resp((const uint8_t *)req.data(), req.size(), st, cmd);
+  }
+  ops = k_bench_n;
+  return clock_nsec() - start;
+}
+
+// a zquery reply of 10 pairs, walked the way a library caller would
+static uint64_t bench_rc_decode(uint64_t &ops, double &) {
+  string out;
+  size_t pos = begin_arr(out);
+  for (int i = 0; i < 10; i++) {
+    out_str(out, "member:" + to_string(i));
+    out_dbl(out, i * 1.5);
+  }
+  end_arr(out, pos, 20);
+  const uint8_t *p = (const uint8_t *)out.data();
+  uint64_t start = clock_nsec();
+  for (size_t i = 0; i < k_bench_n; i++) {
+    RcReply arr, elem;
+    rc_decode(p, p + out.size(), &arr);
+    RcArrayIter it = rc_array(arr);
+    while (rc_array_next(&it, &elem)) {
+      g_sink += elem.len + (uint64_t)elem.dbl;
+    }
+  }
+  ops = k_bench_n;
+  return clock_nsec() - start;
+}
+
+// a 2 KB array of small JSON records, which compresses about 4x
+static string bench_json() {
+  static const char *names[] = {"alice", "bob", "carol", "dave"};
+  string s = "[";
+  while (s.size() < 2048) {
+    s += "{\"id\":" + to_string(rnd() % 100000) + ",\"name\":\"" +
+         names[rnd() % 4] + "\",\"active\":" +
+         (rnd() % 2 ? "true" : "false") + ",\"tags\":[\"a\",\"b\"]},";
+  }
+  s.resize(2048);
+  return s;
+}
+
+static uint64_t bench_lz_compress(uint64_t &ops, double &) {
+  string raw = bench_json(), block;
+  const size_t n = k_bench_n / 20;
+  uint64_t start = clock_nsec();
+  for (size_t i = 0; i < n; i++) {
+    lz_compress((const uint8_t *)raw.data(), raw.size(), block, raw.size());
+    g_sink += block.size();
+  }
+  ops = n;
+  return clock_nsec() - start;
+}
+
+static uint64_t bench_lz_decompress(uint64_t &ops, double &) {
+  string raw = bench_json(), block, out;
+  lz_compress((const uint8_t *)raw.data(), raw.size(), block, raw.size());
+  const size_t n = k_bench_n / 20;
+  uint64_t start = clock_nsec();
+  for (size_t i = 0; i < n; i++) {
+    out.clear();
+    lz_decompress((const uint8_t *)block.data(), block.size(), out);
+    g_sink += out.size();
+  }
+  ops = n;
+  return clock_nsec() - start;
+}
+
+// do_get of a 2 KB JSON value, stored as it is or compressed
+static uint64_t bench_get(uint64_t &ops, uint32_t threshold) {
+  g_config.value_compression_threshold = threshold;
+  vector<string> set = {"set", "bench:json", bench_json()};
+  vector<string> get = {"get", "bench:json"};
+  string out;
+  do_set(set, out);
+  const size_t n = k_bench_n / 4;
+  uint64_t start = clock_nsec();
+  for (size_t i = 0; i < n; i++) {
+    out.clear();
+    do_get(get, out);
+    g_sink += out.size();
+  }
+  ops = n;
+  uint64_t ns = clock_nsec() - start;
+  g_config.value_compression_threshold = 0;
+  return ns;
+}
+
+static uint64_t bench_get_raw(uint64_t &ops, double &) {
+  return bench_get(ops, 0);
+}
+
+static uint64_t bench_get_lz(uint64_t &ops, double &) {
+  return bench_get(ops, 512);
+}
+
+struct Bench {
+  const char *name;
+  BenchFn fn;
+  bool report_max;
+};
+
+static Bench g_benches[] = {
+    {"hm_insert", &bench_hm_insert, true},
+    {"hm_find", &bench_hm_find, false},
+    {"hm_find_resizing", &bench_hm_find_resizing, true},
+    {"hm_pop", &bench_hm_pop, false},
+    {"avl_fix", &bench_avl_fix, false},
+    {"avl_del", &bench_avl_del, false},
+    {"avl_offset", &bench_avl_offset, false},
+    {"heap_update", &bench_heap_update, false},
+    {"zset_add", &bench_zset_add, false},
+    {"zset_query", &bench_zset_query, false},
+    {"art_insert", &bench_art_insert, false},
+    {"art_walk", &bench_art_walk, false},
+    {"zmerge_union", &bench_zmerge_union, false},
+    {"zmerge_inter", &bench_zmerge_inter, false},
+    {"hobj_set", &bench_hobj_set, false},
+    {"hobj_get", &bench_hobj_get, false},
+    {"qlist_push_pop", &bench_qlist_push_pop, false},
+    {"qlist_range", &bench_qlist_range, false},
+    {"intersect_scalar", &bench_intersect_scalar, false},
+    {"intersect_avx2", &bench_intersect_avx2, false},
+    {"intersect_skewed", &bench_intersect_skewed, false},
+    {"bitcount_scalar", &bench_bitcount_scalar, false},
+    {"bitcount_popcnt", &bench_bitcount_popcnt, false},
+    {"bitcount_avx2", &bench_bitcount_avx2, false},
+    {"bitop_scalar", &bench_bitop_scalar, false},
+    {"bitop_avx2", &bench_bitop_avx2, false},
+    {"hll_merge_scalar", &bench_hll_merge_scalar, false},
+    {"hll_merge_avx2", &bench_hll_merge_avx2, false},
+    {"hll_estimate_scalar", &bench_hll_estimate_scalar, false},
+    {"hll_estimate_avx2", &bench_hll_estimate_avx2, false},
+    {"parse_req", &bench_parse_req, false},
+    {"parse_resp", &bench_parse_resp, false},
+    {"rc_decode", &bench_rc_decode, false},
+    {"lz_compress", &bench_lz_compress, false},
+    {"lz_decompress", &bench_lz_decompress, false},
+    {"get_raw", &bench_get_raw, false},
+    {"get_lz", &bench_get_lz, false},
+};
+
+static string result_json(const BenchResult &r, bool report_max) {
+  char buf[256];
+  int n = snprintf(buf, sizeof(buf), "{\"name\":\"%s\",\"ns_per_op\":%.2f",
+                   r.name.c_str(), r.ns_per_op);
+  n += snprintf(buf + n, sizeof(buf) - n, ",\"ops\":%lu",
+                (unsigned long)r.ops);
+  if (report_max) {
+    n += snprintf(buf + n, sizeof(buf) - n, ",\"max_ns\":%.0f", r.max_ns);
+  }
+  snprintf(buf + n, sizeof(buf) - n, "}");
+  return buf;
+}
+
+static bool load_baseline(const char *path, map<string, double> &out) {
+  FILE *f = fopen(path, "r");
+  if (!f) {
+    perror(path);
+    return false;
+  }
+  char line[512];
+  while (fgets(line, sizeof(line), f)) {
+    char name[128];
+    double ns = 0;
+    if (sscanf(line, " {\"name\":\"%127[^\"]\",\"ns_per_op\":%lf", name,
+               &ns) == 2) {
+      out[name] = ns;
+    }
+  }
+  fclose(f);
+  return true;
+}
+
+int main(int argc, char *argv[]) {
+  const char *filter = NULL;
+  const char *out_path = NULL;
+  const char *baseline_path = NULL;
+  double tolerance = 0.5;
+  for (int i = 1; i + 1 < argc; i += 2) {
+    if (strcmp(argv[i], "--filter") == 0) {
+      filter = argv[i + 1];
+    } else if (strcmp(argv[i], "--out") == 0) {
+      out_path = argv[i + 1];
+    } else if (strcmp(argv[i], "--baseline") == 0) {
+      baseline_path = argv[i + 1];
+    } else if (strcmp(argv[i], "--tolerance") == 0) {
+      tolerance = atof(argv[i + 1]);
+    } else {
+      fprintf(stderr, "unknown option %s\n", argv[i]);
+      return 2;
+    }
+  }
+
+  map<string, double> baseline;
+  if (baseline_path && !load_baseline(baseline_path, baseline)) {
+    return 2;
+  }
+  FILE *out = out_path ? fopen(out_path, "w") : NULL;
+  if (out_path && !out) {
+    perror(out_path);
+    return 2;
+  }
+
+  int regressions = 0;
+  for (Bench &b : g_benches) {
+    if (filter && !strstr(b.name, filter)) {
+      continue;
+    }
+    BenchResult best;
+    best.name = b.name;
+    for (int round = 0; round < k_bench_rounds; round++) {
+      uint64_t ops = 0;
+      double max_ns = 0;
+      uint64_t ns = b.fn(ops, max_ns);
+      double per_op = ops ? (double)ns / ops : 0;
+      if (round == 0 || per_op < best.ns_per_op) {
+        best.ns_per_op = per_op;
+        best.ops = ops;
+      }
+      best.max_ns = round == 0 ? max_ns : min(best.max_ns, max_ns);
+    }
+
+    string json = result_json(best, b.report_max);
+    printf("%s\n", json.c_str());
+    if (out) {
+      fprintf(out, "%s\n", json.c_str());
+    }
+    auto it = baseline.find(b.name);
+    if (it != baseline.end() && best.ns_per_op > it->second * (1 + tolerance)) {
+      fprintf(stderr, "REGRESSION %s: %.2f ns/op vs baseline %.2f ns/op\n",
+              b.name, best.ns_per_op, it->second);
+      regressions++;
+    }
+  }
+  if (out) {
+    fclose(out);
+  }
+  return regressions ? 1 : 0;
+}
@@ -0,0 +1,148 @@
+#include "config.hpp"
+#include "structures.hpp"
+#include <arpa/inet.h>
+#include <deque>
+#include <string>
+#include <sys/socket.h>
+#include <vector>
+using namespace std;
+
+#pragma once
+
+// Slow log: commands whose execution took longer than
+// `slowlog-log-slower-than`, newest first.
+struct SlowlogEntry {
+  uint64_t id = 0;
+  uint64_t time_sec = 0; // unix time
+  uint64_t duration_us = 0;
+  vector<string> args;
+  string client;
+};
+
+const size_t k_slowlog_max_args = 32;
+const size_t k_slowlog_max_arg_len = 128;
+
+// Latency monitor: named internal events that may stall the event loop.
+enum {
+  LAT_COMMAND = 0,
+  LAT_EVENTLOOP = 1,
+  LAT_EXPIRE_CYCLE = 2,
+  LAT_REHASH = 3,
+  LAT_FREE = 4,
+  LAT_EVICTION = 5,
+  LAT_MAX = 6,
+};
+
+static const char *k_latency_event_names[LAT_MAX] = {
+    "command", "eventloop", "expire-cycle", "rehash", "free", "eviction",
+};
+
+const size_t k_latency_samples = 160;
+
+struct LatencySample {
+  uint32_t time_sec = 0;
+  uint32_t latency_us = 0;
+};
+
+struct LatencyEvent {
+  // ring of the latest spikes, at most one per second
+  LatencySample samples[k_latency_samples];
+  size_t idx = 0;
+  size_t count = 0;
+  uint32_t max_us = 0;
+};
+
+static struct {
+  deque<SlowlogEntry> slowlog;
+  uint64_t slowlog_next_id = 0;
+  LatencyEvent events[LAT_MAX];
+} g_monitor;
+
+static uint64_t unix_time_sec() { return (uint64_t)time(NULL); }
+
+static uint64_t ticks_to_usec(uint64_t ticks) {
+  return (uint64_t)(ticks / g_data.ticks_per_us);
+}
+
+static string peer_name(int fd) {
+  struct sockaddr_in addr = {};
+  socklen_t len = sizeof(addr);
+  if (getpeername(fd, (struct sockaddr *)&addr, &len) < 0 ||
+      addr.sin_family != AF_INET) {
+    return "fd=" + to_string(fd);
+  }
+  char ip[INET_ADDRSTRLEN] = {};
+  inet_ntop(AF_INET, &addr.sin_addr, ip, sizeof(ip));
+  return string(ip) + ":" + to_string(ntohs(addr.sin_port)) +
+         " fd=" + to_string(fd);
+}
+
+static void slowlog_push(vector<string> &cmd, uint64_t duration_us, int fd) {
+  if (g_config.slowlog_slower_than < 0 ||
+      duration_us < (uint64_t)g_config.slowlog_slower_than) {
+    return;
+  }
+  SlowlogEntry ent;
+  ent.id = g_monitor.slowlog_next_id++;
+  ent.time_sec = unix_time_sec();
+  ent.duration_us = duration_us;
+  size_t nargs = min(cmd.size(), k_slowlog_max_args);
+  for (size_t i = 0; i < nargs; i++) {
+    if (i == k_slowlog_max_args - 1 && cmd.size() > k_slowlog_max_args) {
+      ent.args.push_back("... (" + to_string(cmd.size() - i) +
+                         " more arguments)");
+      break;
+    }
+    if (cmd[i].size() > k_slowlog_max_arg_len) {
+      ent.args.push_back(cmd[i].substr(0, k_slowlog_max_arg_len) + "... (" +
+                         to_string(cmd[i].size() - k_slowlog_max_arg_len) +
+                         " more bytes)");
+    } else {
+      ent.args.push_back(cmd[i]);
+    }
+  }
+  ent.client = fd >= 0 ? peer_name(fd) : "";
+  g_monitor.slowlog.push_front(ent);
+  while (g_monitor.slowlog.size() > g_config.slowlog_max_len) {
+    g_monitor.slowlog.pop_back();
+  }
+}
+
+static void latency_add(int event, uint64_t latency_us) {
+  if (!g_config.latency_threshold_us ||
+      latency_us < g_config.latency_threshold_us) {
+    return;
+  }
+  LatencyEvent &ev = g_monitor.events[event];
+  uint32_t now = (uint32_t)unix_time_sec();
+  uint32_t us = latency_us > UINT32_MAX ? UINT32_MAX : (uint32_t)latency_us;
+  if (us > ev.max_us) {
+    ev.max_us = us;
+  }
+  // merge spikes within the same second, keeping the worst
+  if (ev.count) {
+    LatencySample &last =
+        ev.samples[(ev.idx + k_latency_samples - 1) % k_latency_samples];
+    if (last.time_sec == now) {
+      last.latency_us = max(last.latency_us, us);
+      return;
+    }
+  }
+  ev.samples[ev.idx].time_sec = now;
+  ev.samples[ev.idx].latency_us = us;
+  ev.idx = (ev.idx + 1) % k_latency_samples;
+  ev.count = min(ev.count + 1, k_latency_samples);
+}
+
+static void latency_add_ticks(int event, uint64_t ticks) {
+  latency_add(event, ticks_to_usec(ticks));
+}
+
+static int latency_event_from_name(const string &name) {
+  for (int i = 0; i < LAT_MAX; i++) {
+    if (name == k_latency_event_names[i]) {
+      return i;
+    }
+  }
+  return -1;
+}
@@ -0,0 +1,13 @@
+#pragma once
+
+// Value types of the native reply framing: a type byte, then
+// SER_STR/SER_ERR: u32 length and bytes, SER_INT: i64, SER_DBL: double,
+// SER_ARR: u32 count and that many values. All little endian.
+enum Type {
+  SER_NIL = 0,
+  SER_ERR = 1,
+  SER_STR = 2,
+  SER_INT = 3,
+  SER_ARR = 4,
+  SER_DBL = 5,
+};
@@ -0,0 +1,244 @@
+#include "qlist.h"
+#include "hash.h"
+#include <stdlib.h>
+#include <string.h>
+
+static size_t varint_len(uint32_t v) {
+  size_t n = 1;
+  while (v >= 0x80) {
+    v >>= 7;
+    n++;
+  }
+  return n;
+}
+
+static size_t varint_put(uint8_t *p, uint32_t v) {
+  size_t n = 0;
+  while (v >= 0x80) {
+    p[n++] = (uint8_t)(v | 0x80);
+    v >>= 7;
+  }
+  p[n++] = (uint8_t)v;
+  return n;
+}
+
+static uint32_t varint_get(const uint8_t *p, size_t *n) {
+  uint32_t out = 0;
+  size_t i = 0;
+  for (int shift = 0;; shift += 7) {
+    uint8_t b = p[i++];
+    out |= (uint32_t)(b & 0x7F) << shift;
+    if (!(b & 0x80)) {
+      break;
+    }
+  }
+  *n = i;
+  return out;
+}
+
+// reads the byte-reversed length that ends just before `end`
+static uint32_t rvarint_get(const uint8_t *end, size_t *n) {
+  uint32_t out = 0;
+  size_t i = 0;
+  for (int shift = 0;; shift += 7) {
+    uint8_t b = *(end - 1 - i++);
+    out |= (uint32_t)(b & 0x7F) << shift;
+    if (!(b & 0x80)) {
+      break;
+    }
+  }
+  *n = i;
+  return out;
+}
+
+static size_t enc_len(size_t len) { return len + 2 * varint_len((uint32_t)len); }
+
+static void enc_put(uint8_t *p, const char *data, size_t len) {
+  size_t n = varint_put(p, (uint32_t)len);
+  memcpy(p + n, data, len);
+  uint8_t tmp[5];
+  varint_put(tmp, (uint32_t)len);
+  for (size_t i = 0; i < n; i++) {
+    p[n + len + i] = tmp[n - 1 - i];
+  }
+}
+
+static uint32_t chunk_cap(size_t need) {
+  if (need > k_qnode_bytes) {
+    return (uint32_t)need;
+  }
+  uint32_t cap = 64;
+  while (cap < need) {
+    cap *= 2;
+  }
+  return cap;
+}
+
+static QNode *qnode_new(QList *ql, size_t need) {
+  QNode *node = new QNode();
+  node->cap = chunk_cap(need);
+  node->data = (uint8_t *)malloc(node->cap);
+  ql->nchunks++;
+  ql->mem += sizeof(QNode) + node->cap;
+  return node;
+}
+
+static void qnode_free(QList *ql, QNode *node) {
+  dlist_detach(&node->link);
+  ql->nchunks--;
+  ql->mem -= sizeof(QNode) + node->cap;
+  free(node->data);
+  delete node;
+}
+
+// Makes room for `need` bytes at one end of the node. False if the chunk
+// is full and the element goes into a new one.
+static bool qnode_reserve(QList *ql, QNode *node, bool front, size_t need) {
+  if (front ? node->head >= need : node->cap - node->tail >= need) {
+    return true;
+  }
+  uint32_t used = node->tail - node->head;
+  if (used + need > k_qnode_bytes) {
+    return false;
+  }
+  if (used + need > node->cap) {
+    // grow, with all of the new room at the end being pushed to
+    uint32_t cap = chunk_cap(used + need);
+    uint8_t *data = (uint8_t *)malloc(cap);
+    uint32_t head = front ? cap - used : 0;
+    memcpy(data + head, node->data + node->head, used);
+    free(node->data);
+    ql->mem += cap - node->cap;
+    node->data = data;
+    node->cap = cap;
+    node->head = head;
+    node->tail = head + used;
+    return true;
+  }
+  // The room is at the other end. Split it between both ends, so that
+  // alternating pushes don't move the elements back and forth.
+  uint32_t spare = node->cap - used - (uint32_t)need;
+  uint32_t head = spare / 2 + (front ? (uint32_t)need : 0);
+  memmove(node->data + head, node->data + node->head, used);
+  node->head = head;
+  node->tail = head + used;
+  return true;
+}
+
+void ql_init(QList *ql) { dlist_init(&ql->chunks); }
+
+void ql_push(QList *ql, bool front, const char *data, size_t len) {
+  size_t need = enc_len(len);
+  Dlist *end = front ? ql->chunks.next : ql->chunks.prev;
+  QNode *node = end != &ql->chunks ? container_of(end, QNode, link) : NULL;
+  if (!node || !qnode_reserve(ql, node, front, need)) {
+    node = qnode_new(ql, need);
+    node->head = node->tail = front ? node->cap : 0;
+    dlist_insert_before(front ? ql->chunks.next : &ql->chunks, &node->link);
+  }
+  if (front) {
+    node->head -= (uint32_t)need;
+    enc_put(node->data + node->head, data, len);
+  } else {
+    enc_put(node->data + node->tail, data, len);
+    node->tail += (uint32_t)need;
+  }
+  node->count++;
+  ql->count++;
+}
+
+bool ql_pop(QList *ql, bool front, string &out) {
+  if (ql->count == 0) {
+    return false;
+  }
+  Dlist *end = front ? ql->chunks.next : ql->chunks.prev;
+  QNode *node = container_of(end, QNode, link);
+  size_t n = 0;
+  if (front) {
+    uint32_t len = varint_get(node->data + node->head, &n);
+    out.assign((char *)node->data + node->head + n, len);
+    node->head += (uint32_t)(len + 2 * n);
+  } else {
+    uint32_t len = rvarint_get(node->data + node->tail, &n);
+    node->tail -= (uint32_t)(len + 2 * n);
+    out.assign((char *)node->data + node->tail + n, len);
+  }
+  node->count--;
+  ql->count--;
+  if (node->count == 0) {
+    qnode_free(ql, node);
+  }
+  return true;
+}
+
+size_t ql_size(QList *ql) { return ql->count; }
+
+bool ql_seek(QList *ql, size_t index, QIter *it) {
+  if (index >= ql->count) {
+    return false;
+  }
+  // find the chunk, then the element in it, each from the closer end
+  QNode *node = NULL;
+  size_t first = 0; // index of the chunk's first element
+  if (index < ql->count / 2) {
+    for (Dlist *d = ql->chunks.next;; d = d->next) {
+      node = container_of(d, QNode, link);
+      if (index < first + node->count) {
+        break;
+      }
+      first += node->count;
+    }
+  } else {
+    first = ql->count;
+    for (Dlist *d = ql->chunks.prev;; d = d->prev) {
+      node = container_of(d, QNode, link);
+      first -= node->count;
+      if (index >= first) {
+        break;
+      }
+    }
+  }
+
+  size_t i = index - first;
+  uint32_t off = 0;
+  size_t n = 0;
+  if (i < node->count / 2) {
+    off = node->head;
+    for (; i > 0; i--) {
+      off += (uint32_t)(varint_get(node->data + off, &n) + 2 * n);
+    }
+  } else {
+    off = node->tail;
+    for (i = node->count - i; i > 0; i--) {
+      off -= (uint32_t)(rvarint_get(node->data + off, &n) + 2 * n);
+    }
+  }
+  it->node = node;
+  it->off = off;
+  return true;
+}
+
+bool ql_next(QList *ql, QIter *it, const char **data, size_t *len) {
+  QNode *node = it->node;
+  if (!node) {
+    return false;
+  }
+  size_t n = 0;
+  uint32_t elen = varint_get(node->data + it->off, &n);
+  *data = (const char *)node->data + it->off + n;
+  *len = elen;
+  it->off += (uint32_t)(elen + 2 * n);
+  if (it->off >= node->tail) {
+    Dlist *next = node->link.next;
+    it->node = next != &ql->chunks ? container_of(next, QNode, link) : NULL;
+    it->off = it->node ? it->node->head : 0;
+  }
+  return true;
+}
+
+void ql_dispose(QList *ql) {
+  while (!dlist_empty(&ql->chunks)) {
+    qnode_free(ql, container_of(ql->chunks.next, QNode, link));
+  }
+  ql->count = 0;
+}
@@ -0,0 +1,53 @@
+#pragma once
+
+#include "dlist.h"
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+using namespace std;
+
+// A list as a doubly linked list of packed chunks, like a Redis quicklist.
+//
+// Each element in a chunk is encoded as varint(len) data rvarint(len),
+// where the trailing length is stored byte-reversed so that the chunk can
+// be walked from either end. The bytes in use are [head, tail) of the
+// chunk's buffer, with free room kept at both ends, so pushes and pops at
+// either end of the list are O(1) amortized.
+
+// chunks fill up to this many bytes; a larger element gets a chunk alone
+const uint32_t k_qnode_bytes = 8192;
+
+struct QNode {
+  Dlist link;
+  uint32_t count = 0;
+  uint32_t head = 0;
+  uint32_t tail = 0;
+  uint32_t cap = 0;
+  uint8_t *data = NULL;
+};
+
+struct QList {
+  Dlist chunks; // of QNode::link, front to back
+  size_t count = 0;
+  size_t nchunks = 0;
+  // bytes held by the chunks, for maxmemory accounting
+  size_t mem = 0;
+};
+
+// a position in the list, invalidated by any change to it
+struct QIter {
+  QNode *node = NULL;
+  uint32_t off = 0; // offset of the element in node->data
+};
+
+void ql_init(QList *ql);
+void ql_push(QList *ql, bool front, const char *data, size_t len);
+// copies the element out before freeing its room
+bool ql_pop(QList *ql, bool front, string &out);
+size_t ql_size(QList *ql);
+// Points `it` at the element at `index`, counted from 0 at the front, and
+// walks from whichever end is closer. False if out of range.
+bool ql_seek(QList *ql, size_t index, QIter *it);
+// Reads the element at `it` and advances it. False past the back.
+bool ql_next(QList *ql, QIter *it, const char **data, size_t *len);
+void ql_dispose(QList *ql);
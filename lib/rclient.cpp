@@ -0,0 +1,762 @@
+#include "rclient.h"
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+using namespace std;
+
+// deeper nesting is treated as malformed
+const uint32_t k_rc_max_depth = 32;
+
+static int64_t rc_decode_depth(const uint8_t *p, const uint8_t *end,
+                               RcReply *out, uint32_t depth) {
+  if (p >= end || depth > k_rc_max_depth) {
+    return -1;
+  }
+  size_t avail = end - p;
+  RcReply r;
+  r.type = p[0];
+  r.raw = p;
+  size_t used = 1;
+  switch (r.type) {
+  case SER_NIL:
+    break;
+  case SER_STR:
+  case SER_ERR:
+    if (avail < 5) {
+      return -1;
+    }
+    memcpy(&r.len, &p[1], 4);
+    if (avail - 5 < r.len) {
+      return -1;
+    }
+    r.str = (const char *)&p[5];
+    used = 5 + r.len;
+    break;
+  case SER_INT:
+  case SER_DBL:
+    if (avail < 9) {
+      return -1;
+    }
+    if (r.type == SER_INT) {
+      memcpy(&r.integer, &p[1], 8);
+    } else {
+      memcpy(&r.dbl, &p[1], 8);
+    }
+    used = 9;
+    break;
+  case SER_ARR: {
+    if (avail < 5) {
+      return -1;
+    }
+    memcpy(&r.len, &p[1], 4);
+    r.elems = &p[5];
+    used = 5;
+    // skip over the elements to find where the array ends
+    RcReply elem;
+    for (uint32_t i = 0; i < r.len; i++) {
+      int64_t n = rc_decode_depth(&p[used], end, &elem, depth + 1);
+      if (n < 0) {
+        return -1;
+      }
+      used += (size_t)n;
+    }
+    break;
+  }
+  default:
+    return -1;
+  }
+  r.raw_len = used;
+  *out = r;
+  return (int64_t)used;
+}
+
+int64_t rc_decode(const uint8_t *p, const uint8_t *end, RcReply *out) {
+  return rc_decode_depth(p, end, out, 0);
+}
+
+RcArrayIter rc_array(const RcReply &arr) {
+  RcArrayIter it;
+  if (arr.type == SER_ARR) {
+    it.p = arr.elems;
+    it.end = arr.raw + arr.raw_len;
+    it.left = arr.len;
+  }
+  return it;
+}
+
+bool rc_array_next(RcArrayIter *it, RcReply *elem) {
+  if (it->left == 0) {
+    return false;
+  }
+  int64_t n = rc_decode(it->p, it->end, elem);
+  if (n < 0) {
+    it->left = 0;
+    return false;
+  }
+  it->p += n;
+  it->left--;
+  return true;
+}
+
+static void rc_append_u32(string &out, uint32_t v) {
+  out.append((const char *)&v, 4);
+}
+
+void rc_encode(string &out, const vector<string> &args) {
+  rc_append_u32(out, (uint32_t)args.size());
+  for (const string &a : args) {
+    rc_append_u32(out, (uint32_t)a.size());
+    out.append(a);
+  }
+}
+
+RcReply RcResult::reply() const {
+  RcReply r;
+  const uint8_t *p = (const uint8_t *)raw.data();
+  if (rc_decode(p, p + raw.size(), &r) < 0) {
+    r = RcReply();
+  }
+  return r;
+}
+
+// an error reply made up on this side
+static string rc_error(const char *msg) {
+  string enc;
+  enc.push_back(SER_ERR);
+  rc_append_u32(enc, (uint32_t)strlen(msg));
+  enc.append(msg);
+  return enc;
+}
+
+static void rc_fail(const RcPending &p, const char *msg) {
+  string enc = rc_error(msg);
+  RcReply r;
+  rc_decode((const uint8_t *)enc.data(),
+            (const uint8_t *)enc.data() + enc.size(), &r);
+  p.cb(&r, p.arg);
+}
+
+static int rc_connect(const RcOptions &opt) {
+  int fd = socket(opt.unix_path ? AF_UNIX : AF_INET, SOCK_STREAM, 0);
+  if (fd < 0) {
+    return -errno;
+  }
+  int rv = 0;
+  if (opt.unix_path) {
+    struct sockaddr_un addr = {};
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, opt.unix_path, sizeof(addr.sun_path) - 1);
+    rv = connect(fd, (const sockaddr *)&addr, sizeof(addr));
+  } else {
+    struct sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(opt.port);
+    addr.sin_addr.s_addr = inet_addr(opt.host);
+    rv = connect(fd, (const sockaddr *)&addr, sizeof(addr));
+    int val = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &val, sizeof(val));
+  }
+  if (rv < 0) {
+    int err = -errno;
+    close(fd);
+    return err;
+  }
+  fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+  return fd;
+}
+
+// fails everything queued on a broken connection
+static void rc_conn_dead(RcConn *c) {
+  deque<RcPending> pending;
+  pthread_mutex_lock(&c->mu);
+  bool was_dead = c->dead;
+  c->dead = true;
+  pending.swap(c->pending);
+  c->outq.clear();
+  pthread_mutex_unlock(&c->mu);
+  if (c->fd >= 0) {
+    close(c->fd);
+    c->fd = -1;
+  }
+  c->wbuf.clear();
+  c->wsent = 0;
+  c->rsize = 0;
+  for (RcPending &p : pending) {
+    rc_fail(p, "connection lost");
+  }
+  if (c->on_push && !was_dead) {
+    RcPending p;
+    p.cb = c->on_push;
+    p.arg = c->push_arg;
+    rc_fail(p, "connection lost");
+  }
+}
+
+static bool rc_conn_write(RcConn *c) {
+  while (c->wsent < c->wbuf.size()) {
+    ssize_t rv = write(c->fd, c->wbuf.data() + c->wsent,
+                       c->wbuf.size() - c->wsent);
+    if (rv < 0 && errno == EINTR) {
+      continue;
+    }
+    if (rv < 0 && errno == EAGAIN) {
+      return true;
+    }
+    if (rv <= 0) {
+      return false;
+    }
+    c->wsent += (size_t)rv;
+  }
+  c->wbuf.clear();
+  c->wsent = 0;
+  return true;
+}
+
+// reads what is available and runs the callbacks of complete replies
+static bool rc_conn_read(RcConn *c) {
+  while (true) {
+    if (c->rbuf.size() - c->rsize < 4096) {
+      c->rbuf.resize(c->rbuf.size() * 2 + 4096);
+    }
+    ssize_t rv =
+        read(c->fd, c->rbuf.data() + c->rsize, c->rbuf.size() - c->rsize);
+    if (rv < 0 && errno == EINTR) {
+      continue;
+    }
+    if (rv < 0 && errno == EAGAIN) {
+      break;
+    }
+    if (rv <= 0) {
+      return false;
+    }
+    c->rsize += (size_t)rv;
+  }
+
+  // count the complete frames, then take their callbacks in one go
+  size_t nframes = 0;
+  size_t pos = 0;
+  while (c->rsize - pos >= 4) {
+    uint32_t len = 0;
+    memcpy(&len, &c->rbuf[pos], 4);
+    if (c->rsize - pos - 4 < len) {
+      break;
+    }
+    pos += 4 + (size_t)len;
+    nframes++;
+  }
+  if (nframes == 0) {
+    return true;
+  }
+  vector<RcPending> done;
+  done.reserve(nframes);
+  pthread_mutex_lock(&c->mu);
+  while (done.size() < nframes && !c->pending.empty()) {
+    done.push_back(c->pending.front());
+    c->pending.pop_front();
+  }
+  pthread_mutex_unlock(&c->mu);
+  if (done.size() < nframes && !c->on_push) {
+    return false; // a reply without a request
+  }
+  RcPending push;
+  push.cb = c->on_push;
+  push.arg = c->push_arg;
+  done.resize(nframes, push);
+
+  pos = 0;
+  for (RcPending &p : done) {
+    uint32_t len = 0;
+    memcpy(&len, &c->rbuf[pos], 4);
+    const uint8_t *frame = &c->rbuf[pos + 4];
+    RcReply r;
+    if (rc_decode(frame, frame + len, &r) < 0) {
+      rc_fail(p, "malformed reply");
+    } else {
+      p.cb(&r, p.arg);
+    }
+    pos += 4 + (size_t)len;
+  }
+  memmove(c->rbuf.data(), c->rbuf.data() + pos, c->rsize - pos);
+  c->rsize -= pos;
+  return true;
+}
+
+static void *rc_io_thread(void *arg) {
+  RcPool *pool = (RcPool *)arg;
+  vector<struct pollfd> pfds;
+  while (!pool->stop.load(memory_order_acquire)) {
+    // requests queued after this point wake the next poll
+    pool->wake_pending.store(false, memory_order_seq_cst);
+    for (RcConn *c : pool->conns) {
+      if (c->fd < 0) {
+        continue;
+      }
+      pthread_mutex_lock(&c->mu);
+      if (!c->outq.empty()) {
+        if (c->wbuf.empty()) {
+          c->wbuf.swap(c->outq);
+        } else {
+          c->wbuf.append(c->outq);
+          c->outq.clear();
+        }
+      }
+      pthread_mutex_unlock(&c->mu);
+      // most writes complete without waiting for POLLOUT
+      if (!c->wbuf.empty() && !rc_conn_write(c)) {
+        rc_conn_dead(c);
+      }
+    }
+
+    pfds.clear();
+    pfds.push_back({pool->wake_fd, POLLIN, 0});
+    for (RcConn *c : pool->conns) {
+      short events = POLLIN | (c->wbuf.empty() ? 0 : POLLOUT);
+      pfds.push_back({c->fd, events, 0}); // negative fds are ignored
+    }
+    if (poll(pfds.data(), pfds.size(), -1) < 0 && errno != EINTR) {
+      break;
+    }
+    if (pfds[0].revents & POLLIN) {
+      uint64_t n = 0;
+      ssize_t rv = read(pool->wake_fd, &n, sizeof(n));
+      (void)rv;
+    }
+    for (size_t i = 0; i < pool->conns.size(); i++) {
+      RcConn *c = pool->conns[i];
+      short ev = pfds[i + 1].revents;
+      if (c->fd < 0 || !ev) {
+        continue;
+      }
+      bool ok = true;
+      if (ev & POLLOUT) {
+        ok = rc_conn_write(c);
+      }
+      if (ok && (ev & (POLLIN | POLLERR | POLLHUP))) {
+        ok = rc_conn_read(c);
+      }
+      if (!ok) {
+        rc_conn_dead(c);
+      }
+    }
+  }
+  return NULL;
+}
+
+// undoes a failed rc_pool_open
+static void rc_pool_free(RcPool *pool) {
+  for (RcConn *c : pool->conns) {
+    close(c->fd);
+    pthread_mutex_destroy(&c->mu);
+    delete c;
+  }
+  pool->conns.clear();
+  close(pool->wake_fd);
+  pool->wake_fd = -1;
+}
+
+int rc_pool_open(RcPool *pool, const RcOptions &opt) {
+  pool->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (pool->wake_fd < 0) {
+    return -errno;
+  }
+  for (uint32_t i = 0; i < (opt.conns ? opt.conns : 1); i++) {
+    int fd = rc_connect(opt);
+    if (fd < 0) {
+      rc_pool_free(pool);
+      return fd;
+    }
+    RcConn *c = new RcConn();
+    c->fd = fd;
+    pthread_mutex_init(&c->mu, NULL);
+    pool->conns.push_back(c);
+  }
+  pool->stop.store(false);
+  int rv = pthread_create(&pool->thread, NULL, &rc_io_thread, pool);
+  if (rv) {
+    rc_pool_free(pool);
+    return -rv;
+  }
+  return 0;
+}
+
+static void rc_wake(RcPool *pool) {
+  if (!pool->wake_pending.exchange(true)) {
+    uint64_t one = 1;
+    ssize_t rv = write(pool->wake_fd, &one, sizeof(one));
+    (void)rv;
+  }
+}
+
+void rc_pool_close(RcPool *pool) {
+  pool->stop.store(true, memory_order_release);
+  uint64_t one = 1;
+  ssize_t rv = write(pool->wake_fd, &one, sizeof(one));
+  (void)rv;
+  pthread_join(pool->thread, NULL);
+  for (RcConn *c : pool->conns) {
+    rc_conn_dead(c);
+    pthread_mutex_destroy(&c->mu);
+    delete c;
+  }
+  pool->conns.clear();
+  close(pool->wake_fd);
+  pool->wake_fd = -1;
+}
+
+static void rc_ignore(const RcReply *reply, void *arg) {
+  (void)reply;
+  (void)arg;
+}
+
+// queues `first`, if any, and `args` on `c`; false if it is lost
+static bool rc_queue(RcConn *c, const vector<string> *first,
+                     const vector<string> &args, const RcPending &p) {
+  pthread_mutex_lock(&c->mu);
+  bool dead = c->dead;
+  if (!dead) {
+    if (first) {
+      RcPending ignored;
+      ignored.cb = &rc_ignore;
+      rc_encode(c->outq, *first);
+      c->pending.push_back(ignored);
+    }
+    rc_encode(c->outq, args);
+    c->pending.push_back(p);
+  }
+  pthread_mutex_unlock(&c->mu);
+  return !dead;
+}
+
+// queues `first`, if any, and `args` on the connection `c` of the pool
+static void rc_send_on(RcPool *pool, RcConn *c, const vector<string> *first,
+                       const vector<string> &args, RcCallback cb, void *arg) {
+  RcPending p;
+  p.cb = cb;
+  p.arg = arg;
+  if (!rc_queue(c, first, args, p)) {
+    rc_fail(p, "connection lost");
+    return;
+  }
+  rc_wake(pool);
+}
+
+// Queues `first`, if any, and `args` together on one connection, the next
+// one in turn that is not lost. Lost connections are not reopened, a pool
+// fails requests once all of them are gone.
+static void rc_send_pair(RcPool *pool, const vector<string> *first,
+                         const vector<string> &args, RcCallback cb,
+                         void *arg) {
+  RcPending p;
+  p.cb = cb;
+  p.arg = arg;
+  uint32_t n = pool->next.fetch_add(1, memory_order_relaxed);
+  size_t nconns = pool->conns.size();
+  for (size_t i = 0; i < nconns; i++) {
+    if (rc_queue(pool->conns[(n + i) % nconns], first, args, p)) {
+      rc_wake(pool);
+      return;
+    }
+  }
+  rc_fail(p, "connection lost");
+}
+
+void rc_send(RcPool *pool, const vector<string> &args, RcCallback cb,
+             void *arg) {
+  rc_send_pair(pool, NULL, args, cb, arg);
+}
+
+void rc_send_after(RcPool *pool, const vector<string> &first,
+                   const vector<string> &args, RcCallback cb, void *arg) {
+  rc_send_pair(pool, &first, args, cb, arg);
+}
+
+static void rc_call_done(const RcReply *reply, void *arg) {
+  promise<RcResult> *pr = (promise<RcResult> *)arg;
+  RcResult res;
+  res.raw.assign((const char *)reply->raw, reply->raw_len);
+  pr->set_value(std::move(res));
+  delete pr;
+}
+
+future<RcResult> rc_call(RcPool *pool, const vector<string> &args) {
+  promise<RcResult> *pr = new promise<RcResult>();
+  future<RcResult> f = pr->get_future();
+  rc_send(pool, args, &rc_call_done, pr);
+  return f;
+}
+
+future<RcResult> rc_call_after(RcPool *pool, const vector<string> &first,
+                               const vector<string> &args) {
+  promise<RcResult> *pr = new promise<RcResult>();
+  future<RcResult> f = pr->get_future();
+  rc_send_after(pool, first, args, &rc_call_done, pr);
+  return f;
+}
+
+// redirects followed for one request before giving up
+const uint32_t k_rc_max_redirects = 16;
+
+// the pool of a node, connected on first use; NULL if that fails
+static RcPool *rc_cluster_pool(RcCluster *cl, uint16_t node) {
+  pthread_mutex_lock(&cl->mu);
+  if (cl->pools.size() < cl->map.nodes.size()) {
+    cl->pools.resize(cl->map.nodes.size(), NULL);
+  }
+  RcPool *pool = cl->pools[node];
+  if (!pool) {
+    string host;
+    RcOptions opt = cl->opt;
+    if (parse_node_addr(cl->map.nodes[node], &host, &opt.port)) {
+      opt.host = host.c_str();
+      pool = new RcPool();
+      if (rc_pool_open(pool, opt) < 0) {
+        delete pool;
+        pool = NULL;
+      }
+    }
+    cl->pools[node] = pool;
+  }
+  pthread_mutex_unlock(&cl->mu);
+  return pool;
+}
+
+static uint16_t rc_cluster_node(RcCluster *cl, const string &addr) {
+  pthread_mutex_lock(&cl->mu);
+  uint16_t node = slotmap_node(&cl->map, addr);
+  pthread_mutex_unlock(&cl->mu);
+  return node;
+}
+
+// Replaces the slot map with the one a node has. Node indexes stay, so
+// that they keep matching `pools`.
+static bool rc_cluster_refresh(RcCluster *cl, uint16_t node) {
+  RcPool *pool = rc_cluster_pool(cl, node);
+  if (!pool) {
+    return false;
+  }
+  RcResult res = rc_call(pool, {"cluster", "slots"}).get();
+  RcReply r = res.reply();
+  if (r.type != SER_ARR) {
+    return false;
+  }
+  vector<SlotRange> ranges;
+  vector<string> addrs;
+  RcArrayIter it = rc_array(r);
+  RcReply range;
+  while (rc_array_next(&it, &range)) {
+    RcReply lo, hi, addr;
+    RcArrayIter ri = rc_array(range);
+    if (range.type != SER_ARR || !rc_array_next(&ri, &lo) ||
+        !rc_array_next(&ri, &hi) || !rc_array_next(&ri, &addr) ||
+        lo.type != SER_INT || hi.type != SER_INT || addr.type != SER_STR ||
+        lo.integer < 0 || hi.integer < lo.integer ||
+        hi.integer >= k_cluster_slots) {
+      return false;
+    }
+    SlotRange sr;
+    sr.lo = (uint32_t)lo.integer;
+    sr.hi = (uint32_t)hi.integer;
+    ranges.push_back(sr);
+    addrs.emplace_back(addr.str, addr.len);
+  }
+  pthread_mutex_lock(&cl->mu);
+  slotmap_assign(&cl->map, 0, k_cluster_slots - 1, k_no_node);
+  for (size_t i = 0; i < ranges.size(); i++) {
+    slotmap_assign(&cl->map, ranges[i].lo, ranges[i].hi,
+                   slotmap_node(&cl->map, addrs[i]));
+  }
+  pthread_mutex_unlock(&cl->mu);
+  return true;
+}
+
+int rc_cluster_open(RcCluster *cl, const RcOptions &opt) {
+  cl->opt = opt;
+  string seed = string(opt.host) + ":" + to_string(opt.port);
+  uint16_t node = rc_cluster_node(cl, seed);
+  if (!rc_cluster_pool(cl, node)) {
+    return -ECONNREFUSED;
+  }
+  return rc_cluster_refresh(cl, node) ? 0 : -EPROTO;
+}
+
+void rc_cluster_close(RcCluster *cl) {
+  for (RcPool *pool : cl->pools) {
+    if (pool) {
+      rc_pool_close(pool);
+      delete pool;
+    }
+  }
+  cl->pools.clear();
+}
+
+RcResult rc_cluster_call(RcCluster *cl, const string &key,
+                         const vector<string> &args) {
+  uint32_t slot = key_slot(key.data(), key.size());
+  uint16_t ask_node = k_no_node;
+  RcResult res;
+  for (uint32_t i = 0; i <= k_rc_max_redirects; i++) {
+    uint16_t node = ask_node;
+    if (node == k_no_node) {
+      pthread_mutex_lock(&cl->mu);
+      node = key.empty() ? 0 : cl->map.owner[slot];
+      pthread_mutex_unlock(&cl->mu);
+    }
+    RcPool *pool = node == k_no_node ? NULL : rc_cluster_pool(cl, node);
+    if (!pool) {
+      res.raw = rc_error(node == k_no_node ? "CLUSTERDOWN Hash slot not served"
+                                           : "connection failed");
+      return res;
+    }
+    res = ask_node != k_no_node ? rc_call_after(pool, {"asking"}, args).get()
+                                : rc_call(pool, args).get();
+    RcReply r = res.reply();
+    bool ask = false;
+    string addr;
+    if (r.type == SER_ERR && r.len >= 8 && memcmp(r.str, "TRYAGAIN", 8) == 0) {
+      // keys of the request are split by a migration that is still going
+      usleep(1000);
+      ask_node = k_no_node;
+      continue;
+    }
+    if (r.type != SER_ERR || !parse_redirect(r.str, r.len, &ask, &slot, &addr)) {
+      return res;
+    }
+    ask_node = k_no_node;
+    uint16_t target = rc_cluster_node(cl, addr);
+    if (ask) {
+      ask_node = target;
+    } else if (!rc_cluster_refresh(cl, target)) {
+      pthread_mutex_lock(&cl->mu);
+      slotmap_assign(&cl->map, slot, slot, target);
+      pthread_mutex_unlock(&cl->mu);
+    }
+  }
+  return res;
+}
+
+static future<RcResult> rc_call_on(RcPool *pool, RcConn *c,
+                                   const vector<string> &args) {
+  promise<RcResult> *pr = new promise<RcResult>();
+  future<RcResult> f = pr->get_future();
+  rc_send_on(pool, c, NULL, args, &rc_call_done, pr);
+  return f;
+}
+
+// an invalidation message, or the loss of the invalidation connection
+static void rc_cache_push(const RcReply *reply, void *arg) {
+  RcCache *cache = (RcCache *)arg;
+  RcReply kind, channel, keys, key;
+  RcArrayIter it = rc_array(*reply);
+  bool msg = rc_array_next(&it, &kind) && rc_array_next(&it, &channel) &&
+             rc_array_next(&it, &keys) && kind.type == SER_STR &&
+             kind.len == 7 && memcmp(kind.str, "message", 7) == 0;
+  pthread_mutex_lock(&cache->mu);
+  if (reply->type == SER_ERR) {
+    cache->broken = true;
+    cache->entries.clear();
+  }
+  RcArrayIter ki = rc_array(keys);
+  while (msg && rc_array_next(&ki, &key)) {
+    if (key.type == SER_STR) {
+      cache->entries.erase(string(key.str, key.len));
+      cache->invalidations++;
+    }
+  }
+  pthread_mutex_unlock(&cache->mu);
+}
+
+static bool rc_ok(RcResult res) { return res.reply().type != SER_ERR; }
+
+int rc_cache_open(RcCache *cache, const RcOptions &opt, size_t max_keys) {
+  cache->max_keys = max_keys;
+  RcOptions one = opt;
+  one.conns = 1;
+  int rv = rc_pool_open(&cache->inval, one);
+  if (rv < 0) {
+    return rv;
+  }
+  RcConn *ic = cache->inval.conns[0];
+  ic->on_push = &rc_cache_push;
+  ic->push_arg = cache;
+  RcResult id = rc_call(&cache->inval, {"client", "id"}).get();
+  RcReply r = id.reply();
+  if (r.type != SER_INT ||
+      !rc_ok(rc_call(&cache->inval, {"subscribe", "__redis__:invalidate"})
+                 .get())) {
+    rc_pool_close(&cache->inval);
+    return -EPROTO;
+  }
+  rv = rc_pool_open(&cache->pool, opt);
+  if (rv < 0) {
+    rc_pool_close(&cache->inval);
+    return rv;
+  }
+  vector<string> on = {"client", "tracking", "on", "redirect",
+                       to_string(r.integer)};
+  for (RcConn *c : cache->pool.conns) {
+    // the server forgets what a lost connection read
+    c->on_push = &rc_cache_push;
+    c->push_arg = cache;
+    if (!rc_ok(rc_call_on(&cache->pool, c, on).get())) {
+      rc_cache_close(cache);
+      return -EPROTO;
+    }
+  }
+  return 0;
+}
+
+void rc_cache_close(RcCache *cache) {
+  rc_pool_close(&cache->pool);
+  rc_pool_close(&cache->inval);
+  cache->entries.clear();
+}
+
+RcResult rc_cache_get(RcCache *cache, const string &key) {
+  pthread_mutex_lock(&cache->mu);
+  uint64_t fill = 0;
+  if (!cache->broken) {
+    auto it = cache->entries.find(key);
+    if (it != cache->entries.end() && !it->second.raw.empty()) {
+      RcResult res;
+      res.raw = it->second.raw;
+      cache->hits++;
+      pthread_mutex_unlock(&cache->mu);
+      return res;
+    }
+    if (it == cache->entries.end() &&
+        cache->entries.size() >= cache->max_keys && cache->max_keys) {
+      cache->entries.erase(cache->entries.begin());
+    }
+    // an invalidation while the reply is on its way drops this entry
+    fill = ++cache->next_fill;
+    cache->entries[key].fill = fill;
+  }
+  cache->misses++;
+  pthread_mutex_unlock(&cache->mu);
+
+  RcResult res = rc_call(&cache->pool, {"get", key}).get();
+  if (!fill) {
+    return res;
+  }
+  bool keep = res.reply().type == SER_STR;
+  pthread_mutex_lock(&cache->mu);
+  auto it = cache->entries.find(key);
+  if (it != cache->entries.end() && it->second.fill == fill) {
+    if (keep) {
+      it->second.raw = res.raw;
+    } else {
+      cache->entries.erase(it);
+    }
+  }
+  pthread_mutex_unlock(&cache->mu);
+  return res;
+}
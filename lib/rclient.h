@@ -0,0 +1,176 @@
+#pragma once
+
+#include "cluster.h"
+#include "protocol.h"
+#include <atomic>
+#include <deque>
+#include <future>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// Client library for the native protocol. A pool owns a few connections and
+// one I/O thread. Any thread may send; requests issued while the I/O thread
+// is busy are written together, so concurrent callers pipeline over the same
+// connection, and replies are matched to callbacks in request order.
+
+// A decoded value. Nothing is copied: strings and array elements point into
+// the buffer the value was decoded from.
+struct RcReply {
+  uint8_t type = SER_NIL;
+  int64_t integer = 0;         // SER_INT
+  double dbl = 0;              // SER_DBL
+  const char *str = NULL;      // SER_STR, SER_ERR
+  uint32_t len = 0;            // string length, or SER_ARR element count
+  const uint8_t *elems = NULL; // SER_ARR: the first encoded element
+  // the whole encoded value
+  const uint8_t *raw = NULL;
+  size_t raw_len = 0;
+};
+
+// Decodes the value at [p, end). Returns the bytes used, or -1 if it is
+// malformed or truncated.
+int64_t rc_decode(const uint8_t *p, const uint8_t *end, RcReply *out);
+
+// walks the elements of a SER_ARR value without allocating
+struct RcArrayIter {
+  const uint8_t *p = NULL;
+  const uint8_t *end = NULL;
+  uint32_t left = 0;
+};
+
+RcArrayIter rc_array(const RcReply &arr);
+bool rc_array_next(RcArrayIter *it, RcReply *elem);
+
+// appends a request in the native framing
+void rc_encode(std::string &out, const std::vector<std::string> &args);
+
+// Runs on the I/O thread, or on the sender's thread if the connection is
+// already gone. `reply` is valid only during the call; a lost connection is
+// reported as a SER_ERR reply.
+typedef void (*RcCallback)(const RcReply *reply, void *arg);
+
+// A reply that owns its bytes, for futures: one allocation, whatever the
+// shape of the value.
+struct RcResult {
+  std::string raw;
+  RcReply reply() const;
+};
+
+struct RcOptions {
+  // an IPv4 address
+  const char *host = "127.0.0.1";
+  uint16_t port = 1800;
+  // connects to this AF_UNIX path instead of 127.0.0.1:port
+  const char *unix_path = NULL;
+  uint32_t conns = 1;
+};
+
+struct RcPending {
+  RcCallback cb = NULL;
+  void *arg = NULL;
+};
+
+struct RcConn {
+  int fd = -1;
+  // Gets the frames that arrive with no request waiting, such as pub/sub
+  // messages, and a SER_ERR reply when the connection is lost. Set before
+  // the connection is used, the connection is then dropped on such frames.
+  RcCallback on_push = NULL;
+  void *push_arg = NULL;
+  // guards outq, pending and dead, shared with the sending threads
+  pthread_mutex_t mu;
+  std::string outq; // encoded requests not yet taken by the I/O thread
+  std::deque<RcPending> pending;
+  bool dead = false;
+
+  // owned by the I/O thread
+  std::string wbuf;
+  size_t wsent = 0;
+  std::vector<uint8_t> rbuf;
+  size_t rsize = 0;
+};
+
+struct RcPool {
+  std::vector<RcConn *> conns;
+  pthread_t thread;
+  int wake_fd = -1; // eventfd, written when requests are queued
+  std::atomic<bool> wake_pending{false};
+  std::atomic<bool> stop{false};
+  std::atomic<uint32_t> next{0}; // round-robin over conns
+};
+
+// Connects and starts the I/O thread. Returns 0 or a negative errno.
+int rc_pool_open(RcPool *pool, const RcOptions &opt);
+// Stops the I/O thread; requests still waiting get an error reply.
+void rc_pool_close(RcPool *pool);
+
+// thread-safe
+void rc_send(RcPool *pool, const std::vector<std::string> &args,
+             RcCallback cb, void *arg);
+std::future<RcResult> rc_call(RcPool *pool,
+                              const std::vector<std::string> &args);
+
+// sends `first` and `args` back to back on one connection, the reply to
+// `first` is dropped; for a command that needs ASKING before it
+void rc_send_after(RcPool *pool, const std::vector<std::string> &first,
+                   const std::vector<std::string> &args, RcCallback cb,
+                   void *arg);
+std::future<RcResult> rc_call_after(RcPool *pool,
+                                    const std::vector<std::string> &first,
+                                    const std::vector<std::string> &args);
+
+// Routes requests over the nodes of a cluster by the slot of their key,
+// with a pool for each node. The slot map comes from CLUSTER SLOTS and is
+// reloaded from the node a MOVED redirect points to; an ASK redirect is
+// followed for the one request. Thread-safe.
+struct RcCluster {
+  SlotMap map;
+  std::vector<RcPool *> pools; // by node of `map`, NULL until used
+  RcOptions opt;
+  pthread_mutex_t mu = PTHREAD_MUTEX_INITIALIZER;
+};
+
+// loads the slot map from the node at opt.host:opt.port
+int rc_cluster_open(RcCluster *cl, const RcOptions &opt);
+void rc_cluster_close(RcCluster *cl);
+// Runs a request on the node serving `key`, or any node if it is empty,
+// and waits for its reply.
+RcResult rc_cluster_call(RcCluster *cl, const std::string &key,
+                         const std::vector<std::string> &args);
+
+// A local cache of GET replies that the server keeps correct, see CLIENT
+// TRACKING. The connections of `pool` have tracking on, redirected to the
+// connection of `inval`, which is subscribed to the invalidation channel;
+// an invalidation drops the key here. A reply is kept only if no
+// invalidation of its key came while it was on its way. If the
+// invalidation connection, or any other, is lost, the cache is emptied and
+// every get goes to the server. Thread-safe.
+struct RcCacheEntry {
+  std::string raw; // the encoded reply, empty while it is being fetched
+  uint64_t fill = 0;
+};
+
+struct RcCache {
+  RcPool pool;  // for requests, also other than gets
+  RcPool inval; // one connection receiving invalidations
+  size_t max_keys = 0;
+  pthread_mutex_t mu = PTHREAD_MUTEX_INITIALIZER;
+  std::unordered_map<std::string, RcCacheEntry> entries;
+  uint64_t next_fill = 0;
+  bool broken = false;
+  uint64_t hits = 0;
+  uint64_t misses = 0;
+  uint64_t invalidations = 0;
+};
+
+// Connects and turns tracking on. Once `max_keys` values are cached, an
+// arbitrary one makes room for the next. Returns 0 or a negative errno.
+int rc_cache_open(RcCache *cache, const RcOptions &opt, size_t max_keys);
+void rc_cache_close(RcCache *cache);
+// the reply to GET key, from the cache if it is there; strings only are
+// cached
+RcResult rc_cache_get(RcCache *cache, const std::string &key);
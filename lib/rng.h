@@ -0,0 +1,20 @@
+#pragma once
+
+#include <stdint.h>
+
+const uint64_t k_rng_seed = 0x9E3779B97F4A7C15ull;
+
+// xorshift64*: advances `state`, which must not be 0, and returns the next
+// number. Fast, and good enough for sampling, benchmarks and tests.
+inline uint64_t rng_step(uint64_t &state) {
+  state ^= state >> 12;
+  state ^= state << 25;
+  state ^= state >> 27;
+  return state * 0x2545F4914F6CDD1Dull;
+}
+
+// the same sequence on every run, for tests and benchmarks
+inline uint64_t rnd() {
+  static uint64_t state = k_rng_seed;
+  return rng_step(state);
+}
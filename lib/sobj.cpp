@@ -0,0 +1,355 @@
+#include "sobj.h"
+#include "structures.hpp"
+#include <algorithm>
+#include <immintrin.h>
+#include <stdlib.h>
+#include <string.h>
+
+bool str2member_int(const char *s, size_t len, int64_t *out) {
+  // canonical only, so that formatting the value gives back the member
+  if (len == 0 || len > 20) {
+    return false;
+  }
+  const char *p = s;
+  const char *end = s + len;
+  bool neg = *p == '-';
+  if (neg && ++p == end) {
+    return false;
+  }
+  if (*p == '0' && (end - p > 1 || neg)) {
+    return false;
+  }
+  uint64_t v = 0;
+  for (; p < end; p++) {
+    if (*p < '0' || *p > '9') {
+      return false;
+    }
+    uint64_t d = (uint64_t)(*p - '0');
+    if (v > (UINT64_MAX - d) / 10) {
+      return false;
+    }
+    v = v * 10 + d;
+  }
+  if (neg ? v > (uint64_t)INT64_MAX + 1 : v > (uint64_t)INT64_MAX) {
+    return false;
+  }
+  *out = neg ? (int64_t)(0 - v) : (int64_t)v;
+  return true;
+}
+
+// formats into the end of `buf`, returns the first character
+static char *int2str(int64_t v, char buf[24]) {
+  char *p = buf + 24;
+  uint64_t u = v < 0 ? 0 - (uint64_t)v : (uint64_t)v;
+  do {
+    *--p = (char)('0' + u % 10);
+    u /= 10;
+  } while (u);
+  if (v < 0) {
+    *--p = '-';
+  }
+  return p;
+}
+
+static SNode *snode_new(const char *name, size_t len) {
+  SNode *node = (SNode *)malloc(sizeof(SNode) + len);
+  node->node.next = NULL;
+  node->node.hcode = str_hash((const uint8_t *)name, len);
+  node->len = len;
+  memcpy(node->name, name, len);
+  return node;
+}
+
+struct SKey {
+  HNode node;
+  const char *name = NULL;
+  size_t len = 0;
+};
+
+static bool snode_eq(HNode *node, HNode *key) {
+  SNode *sn = container_of(node, SNode, node);
+  SKey *skey = container_of(key, SKey, node);
+  return sn->len == skey->len && memcmp(sn->name, skey->name, sn->len) == 0;
+}
+
+static HNode *map_find(SObj *s, const char *name, size_t len, bool pop) {
+  SKey key;
+  key.node.hcode = str_hash((const uint8_t *)name, len);
+  key.name = name;
+  key.len = len;
+  return pop ? hm_pop(s->map, &key.node, &snode_eq)
+             : hm_find(s->map, &key.node, &snode_eq);
+}
+
+static bool map_add(SObj *s, const char *name, size_t len) {
+  if (map_find(s, name, len, false)) {
+    return false;
+  }
+  hm_insert(s->map, &snode_new(name, len)->node);
+  s->mem += sizeof(SNode) + len;
+  return true;
+}
+
+// moves the intset into an HMap
+static void sobj_convert(SObj *s) {
+  s->map = new HMap();
+  char buf[24];
+  for (int64_t v : s->ints) {
+    char *p = int2str(v, buf);
+    map_add(s, p, buf + 24 - p);
+  }
+  vector<int64_t>().swap(s->ints);
+}
+
+size_t sobj_add(SObj *s, const string *members, size_t n,
+                uint32_t max_intset) {
+  if (!s->map) {
+    vector<int64_t> vals(n);
+    bool all_ints = true;
+    for (size_t i = 0; i < n && all_ints; i++) {
+      all_ints = str2member_int(members[i].data(), members[i].size(), &vals[i]);
+    }
+    if (all_ints) {
+      sort(vals.begin(), vals.end());
+      vals.erase(unique(vals.begin(), vals.end()), vals.end());
+      if (vals.size() == 1) {
+        // the common single insert, without building a merged copy
+        auto it = lower_bound(s->ints.begin(), s->ints.end(), vals[0]);
+        if (it != s->ints.end() && *it == vals[0]) {
+          return 0;
+        }
+        if (s->ints.size() < max_intset) {
+          s->ints.insert(it, vals[0]);
+          return 1;
+        }
+      } else {
+        vector<int64_t> merged;
+        merged.reserve(s->ints.size() + vals.size());
+        set_union(s->ints.begin(), s->ints.end(), vals.begin(), vals.end(),
+                  back_inserter(merged));
+        size_t added = merged.size() - s->ints.size();
+        if (merged.size() <= max_intset) {
+          s->ints.swap(merged);
+          return added;
+        }
+      }
+    }
+    sobj_convert(s);
+  }
+  size_t added = 0;
+  for (size_t i = 0; i < n; i++) {
+    added += map_add(s, members[i].data(), members[i].size());
+  }
+  return added;
+}
+
+bool sobj_del(SObj *s, const char *name, size_t len) {
+  if (s->map) {
+    HNode *node = map_find(s, name, len, true);
+    if (!node) {
+      return false;
+    }
+    SNode *sn = container_of(node, SNode, node);
+    s->mem -= sizeof(SNode) + sn->len;
+    free(sn);
+    return true;
+  }
+  int64_t v = 0;
+  if (!str2member_int(name, len, &v)) {
+    return false;
+  }
+  auto it = lower_bound(s->ints.begin(), s->ints.end(), v);
+  if (it == s->ints.end() || *it != v) {
+    return false;
+  }
+  s->ints.erase(it);
+  return true;
+}
+
+bool sobj_has(SObj *s, const char *name, size_t len) {
+  if (s->map) {
+    return map_find(s, name, len, false) != NULL;
+  }
+  int64_t v = 0;
+  return str2member_int(name, len, &v) &&
+         binary_search(s->ints.begin(), s->ints.end(), v);
+}
+
+size_t sobj_size(SObj *s) { return s->map ? hm_size(s->map) : s->ints.size(); }
+
+static void htab_each(HTab *htab, void (*fn)(SNode *, void *), void *arg) {
+  for (size_t i = 0; htab->tab && i <= htab->mask; i++) {
+    HNode *node = htab->tab[i];
+    while (node) {
+      // fn may free the node
+      HNode *next = node->next;
+      fn(container_of(node, SNode, node), arg);
+      node = next;
+    }
+  }
+}
+
+struct ScanCtx {
+  void (*fn)(const char *, size_t, void *);
+  void *arg;
+};
+
+static void scan_node(SNode *sn, void *arg) {
+  ScanCtx *ctx = (ScanCtx *)arg;
+  ctx->fn(sn->name, sn->len, ctx->arg);
+}
+
+void sobj_scan(SObj *s, void (*fn)(const char *name, size_t len, void *arg),
+               void *arg) {
+  if (s->map) {
+    ScanCtx ctx = {fn, arg};
+    htab_each(&s->map->ht1, &scan_node, &ctx);
+    htab_each(&s->map->ht2, &scan_node, &ctx);
+    return;
+  }
+  char buf[24];
+  for (int64_t v : s->ints) {
+    char *p = int2str(v, buf);
+    fn(p, buf + 24 - p, arg);
+  }
+}
+
+static void free_node(SNode *sn, void *) { free(sn); }
+
+void sobj_dispose(SObj *s) {
+  if (s->map) {
+    htab_each(&s->map->ht1, &free_node, NULL);
+    htab_each(&s->map->ht2, &free_node, NULL);
+    hm_destroy(s->map);
+    delete s->map;
+    s->map = NULL;
+  }
+  vector<int64_t>().swap(s->ints);
+  s->mem = 0;
+}
+
+// Branch-free merge: the comparisons of random data mispredict half the
+// time, so each step writes unconditionally and advances by flags.
+size_t intersect_scalar(const int64_t *a, size_t na, const int64_t *b,
+                        size_t nb, int64_t *out) {
+  size_t i = 0, j = 0, k = 0;
+  while (i < na && j < nb) {
+    int64_t x = a[i];
+    int64_t y = b[j];
+    out[k] = x;
+    k += x == y;
+    i += x <= y;
+    j += y <= x;
+  }
+  return k;
+}
+
+// For each value of the small side, an exponential search forward in the
+// large side from where the previous one stopped: O(na log(nb / na)).
+size_t intersect_gallop(const int64_t *a, size_t na, const int64_t *b,
+                        size_t nb, int64_t *out) {
+  size_t j = 0, k = 0;
+  for (size_t i = 0; i < na && j < nb; i++) {
+    int64_t x = a[i];
+    size_t step = 1;
+    size_t hi = j;
+    while (hi < nb && b[hi] < x) {
+      j = hi + 1;
+      hi += step;
+      step *= 2;
+    }
+    // the first value >= x is in [j, min(hi, nb - 1)]
+    j = lower_bound(b + j, b + min(hi + 1, nb), x) - b;
+    if (j < nb && b[j] == x) {
+      out[k++] = x;
+      j++;
+    }
+  }
+  return k;
+}
+
+// For each 4-bit match mask, the 32-bit lane permutation that moves the
+// matched 64-bit lanes to the front.
+struct CompactLut {
+  int32_t idx[16][8];
+  CompactLut() {
+    for (int m = 0; m < 16; m++) {
+      int n = 0;
+      for (int lane = 0; lane < 4; lane++) {
+        if (m & (1 << lane)) {
+          idx[m][2 * n] = 2 * lane;
+          idx[m][2 * n + 1] = 2 * lane + 1;
+          n++;
+        }
+      }
+      for (; n < 4; n++) {
+        idx[m][2 * n] = idx[m][2 * n + 1] = 0;
+      }
+    }
+  }
+};
+
+static const CompactLut g_compact;
+
+// Compares blocks of 4 against 4: the block of b is rotated three times so
+// every pair meets in one lane. The matched lanes of `a` are compacted and
+// stored with a mask, so nothing past the matches is written, and the
+// block with the smaller maximum is consumed.
+__attribute__((target("avx2"))) static size_t
+intersect_avx2_kernel(const int64_t *a, size_t na, const int64_t *b,
+                      size_t nb, int64_t *out) {
+  size_t i = 0, j = 0, k = 0;
+  const __m256i lanes = _mm256_set_epi64x(3, 2, 1, 0);
+  while (i + 4 <= na && j + 4 <= nb) {
+    __m256i va = _mm256_loadu_si256((const __m256i *)(a + i));
+    __m256i vb = _mm256_loadu_si256((const __m256i *)(b + j));
+    __m256i m = _mm256_cmpeq_epi64(va, vb);
+    vb = _mm256_permute4x64_epi64(vb, 0x39);
+    m = _mm256_or_si256(m, _mm256_cmpeq_epi64(va, vb));
+    vb = _mm256_permute4x64_epi64(vb, 0x39);
+    m = _mm256_or_si256(m, _mm256_cmpeq_epi64(va, vb));
+    vb = _mm256_permute4x64_epi64(vb, 0x39);
+    m = _mm256_or_si256(m, _mm256_cmpeq_epi64(va, vb));
+    int mask = _mm256_movemask_pd(_mm256_castsi256_pd(m));
+    int64_t amax = a[i + 3];
+    int64_t bmax = b[j + 3];
+    if (mask) {
+      int n = __builtin_popcount(mask);
+      __m256i perm =
+          _mm256_loadu_si256((const __m256i *)g_compact.idx[mask]);
+      __m256i packed = _mm256_permutevar8x32_epi32(va, perm);
+      __m256i store = _mm256_cmpgt_epi64(_mm256_set1_epi64x(n), lanes);
+      _mm256_maskstore_epi64((long long *)(out + k), store, packed);
+      k += n;
+    }
+    i += amax <= bmax ? 4 : 0;
+    j += bmax <= amax ? 4 : 0;
+  }
+  return k + intersect_scalar(a + i, na - i, b + j, nb - j, out + k);
+}
+
+size_t intersect_avx2(const int64_t *a, size_t na, const int64_t *b,
+                      size_t nb, int64_t *out) {
+  if (!cpu_has_avx2()) {
+    return intersect_scalar(a, na, b, nb, out);
+  }
+  return intersect_avx2_kernel(a, na, b, nb, out);
+}
+
+// below this size ratio a linear merge beats galloping
+const size_t k_gallop_ratio = 32;
+
+size_t intset_intersect(const int64_t *a, size_t na, const int64_t *b,
+                        size_t nb, int64_t *out) {
+  if (na > nb) {
+    swap(a, b);
+    swap(na, nb);
+  }
+  if (na == 0) {
+    return 0;
+  }
+  if (nb / na >= k_gallop_ratio) {
+    return intersect_gallop(a, na, b, nb, out);
+  }
+  return intersect_avx2(a, na, b, nb, out);
+}
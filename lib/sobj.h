@@ -0,0 +1,57 @@
+#pragma once
+
+#include "cpu.h"
+#include "hash.h"
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+using namespace std;
+
+// The value of a set key.
+//
+// While every member is an integer in canonical form ("12", not "012") and
+// the set is below the limit passed to sobj_add, the members are kept as a
+// sorted array of int64, like a Redis intset. Otherwise each member is a
+// node in an HMap, and the set stays that way.
+struct SObj {
+  vector<int64_t> ints; // sorted, used while `map` is NULL
+  HMap *map = NULL;
+  // bytes held by the map's nodes, for maxmemory accounting
+  size_t mem = 0;
+};
+
+struct SNode {
+  HNode node;
+  size_t len = 0;
+  char name[0];
+};
+
+// parses a member that round-trips exactly through int64
+bool str2member_int(const char *s, size_t len, int64_t *out);
+
+// Adds `n` members, returns how many were new. A batch of integers is
+// sorted and merged into the intset in one pass.
+size_t sobj_add(SObj *s, const string *members, size_t n,
+                uint32_t max_intset);
+bool sobj_del(SObj *s, const char *name, size_t len);
+bool sobj_has(SObj *s, const char *name, size_t len);
+size_t sobj_size(SObj *s);
+void sobj_scan(SObj *s, void (*fn)(const char *name, size_t len, void *arg),
+               void *arg);
+void sobj_dispose(SObj *s);
+
+// Intersection of sorted, duplicate-free arrays into `out`, which must have
+// room for min(na, nb) values. Returns the number written.
+//
+// intset_intersect picks a kernel: galloping when one side is much smaller,
+// otherwise a merge that is vectorized with AVX2 where the CPU has it.
+size_t intset_intersect(const int64_t *a, size_t na, const int64_t *b,
+                        size_t nb, int64_t *out);
+size_t intersect_scalar(const int64_t *a, size_t na, const int64_t *b,
+                        size_t nb, int64_t *out);
+size_t intersect_gallop(const int64_t *a, size_t na, const int64_t *b,
+                        size_t nb, int64_t *out);
+// falls back to intersect_scalar without AVX2
+size_t intersect_avx2(const int64_t *a, size_t na, const int64_t *b,
+                      size_t nb, int64_t *out);
@@ -1,7 +1,13 @@
+#include "art.h"
+#include "cluster.h"
 #include "dlist.h"
 #include "thread.h"
 #include "hash.h"
 #include "heap.h"
+#include "histogram.h"
+#include "protocol.h"
+#include "rng.h"
+#include <algorithm>
 #include <arpa/inet.h>
 #include <ctime>
 #include <fcntl.h>
@@ -12,7 +18,12 @@
 #include <stdlib.h>
 #include <string.h>
 #include <sys/socket.h>
+#include <deque>
+#include <sys/uio.h>
 #include <unistd.h>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
 
 #pragma once
 const size_t MAX_BUF = 4096;
@@ -25,15 +36,34 @@ enum {
 
 enum RES_CODE { RES_OK = 0, RES_ERR = 1, RES_NF = 2 };
 
-enum Type {
-  SER_NIL = 0,
-  SER_ERR = 1,
-  SER_STR = 2,
-  SER_INT = 3,
-  SER_ARR = 4,
+// wire protocol of a connection, picked from its first byte
+enum {
+  PROTO_NATIVE = 0,
+  PROTO_RESP2 = 2,
+  PROTO_RESP3 = 3,
+  PROTO_UNKNOWN = 255,
+};
+
+// Progress through a partial RESP request, so that bytes already scanned are
+// not parsed again when more data arrives. Arguments are slices of readBuf.
+struct RespParser {
+  int64_t argc = -1;    // -1 until the `*N` header has been read
+  int64_t bulklen = -1; // -1 until the next `$N` header has been read
+  size_t pos = 0;       // first byte of readBuf not scanned yet
+  vector<pair<uint32_t, uint32_t>> args; // (offset, length)
 };
 
-enum { T_STR = 0, T_ZSET = 1 };
+enum { T_STR = 0, T_ZSET = 1, T_HASH = 2, T_LIST = 3, T_SET = 4 };
+// how a string value is stored, see str_assign
+enum { ENC_RAW = 0, ENC_LZ = 1 };
+
+// Output shared by several connections: a published message, encoded and
+// framed once per protocol for all its subscribers. The last connection to
+// send it frees it.
+struct PubBuf {
+  uint32_t refs = 0;
+  string data;
+};
 
 struct Connection {
   int fd = -1;
@@ -46,15 +76,197 @@ struct Connection {
 
   uint64_t idle_start = 0;
   Dlist idle_list;
+
+  uint32_t proto = PROTO_UNKNOWN;
+  RespParser resp;
+  // reused across requests to keep the argument strings' capacity
+  vector<string> argv;
+  // io_uring operations still referencing the connection and its buffers
+  uint32_t inflight = 0;
+  // tells a connection apart from a later one reusing its fd
+  uint64_t id = 0;
+  // waiting for the reply of a command that completes later, see
+  // conn_block; the requests after it stay buffered
+  bool blocked = false;
+
+  // Output behind writeBuf: pub/sub messages, and the replies that came
+  // while messages were still queued, see conn_push.
+  deque<PubBuf *> outq;
+  size_t outq_sent = 0;  // bytes of the front buffer already sent
+  size_t outq_bytes = 0; // not sent yet, checked against the output limits
+  // when the queue went over the soft limit, 0 while under it
+  uint64_t outq_soft_us = 0;
+  // on g_data.pending_out
+  bool pending_out = false;
+  // writev arguments, kept while an io_uring send is in flight
+  vector<struct iovec> iov;
+  struct msghdr msg = {};
+  // pub/sub subscriptions; while there are any, only the pub/sub commands
+  // are accepted outside RESP3
+  unordered_set<string> channels;
+  unordered_set<string> patterns;
+  // MULTI: commands queued until EXEC, and whether one of them was refused
+  bool in_multi = false;
+  bool multi_failed = false;
+  vector<vector<string>> multi_cmds;
+  size_t multi_bytes = 0; // counted in used_memory
+  // WATCH: keys with their versions when watched, see Entry::version
+  vector<pair<string, uint64_t>> watched;
+  // ASKING: the next command may use a slot this node is importing
+  bool asking = false;
+  // CLIENT TRACKING: told when keys it read change, or in broadcast mode
+  // any key under one of `tracking_prefixes`; the messages go to the
+  // connection with id `tracking_redirect` (and that fd) if set
+  bool tracking = false;
+  bool tracking_bcast = false;
+  bool tracking_noloop = false; // not about its own writes
+  uint64_t tracking_redirect = 0;
+  int tracking_redirect_fd = -1;
+  vector<string> tracking_prefixes;
+  // BZPOPMIN/BZPOPMAX: the keys it waits on, see bzpop_block, and its
+  // place in g_data.bzpop_heap unless it waits forever
+  vector<string> bzpop_keys;
+  bool bzpop_max = false;
+  size_t bzpop_heap_idx = -1;
 };
 
+struct SlotMigration;
+
+// Work done on the thread pool for a command, see bg_submit. `run` executes
+// on a worker and must not touch the key space; `done` runs on the event
+// loop afterwards, applies the result and frees the job.
+struct BgJob {
+  void (*run)(BgJob *job) = NULL;
+  void (*done)(BgJob *job) = NULL;
+  // the blocked connection waiting for the reply
+  int fd = -1;
+  uint64_t conn_id = 0;
+};
+
+// a key picked by sampling, kept across eviction rounds so the best
+// candidates seen so far are not forgotten
+struct EvictCandidate {
+  uint64_t score = 0; // higher is evicted first
+  string key;
+};
+
+const size_t k_evpool_size = 16;
+
 static struct {
   HMap db;
+  // the keys in order while `key-index` is on, see keyidx_sync
+  Art keyidx;
+  bool keyidx_on = false;
   // Connections in the database
   vector<Connection *> connections;
   Dlist idle_list;
   vector<HeapItem> heap;
   ThreadPool tp;
+  // cached clock, refreshed once per event loop iteration
+  uint64_t now_us = 0;
+  uint64_t rng_state = k_rng_seed;
+  // bytes held by entries and connections, see mem_used()
+  size_t used_memory = 0;
+  // sorted by ascending score
+  vector<EvictCandidate> evpool;
+  // eviction ran out of its time budget and must continue next iteration
+  bool evicting = false;
+  uint64_t evicted_keys = 0;
+
+  // statistics reported by `info`
+  uint64_t start_us = 0;
+  uint64_t start_ticks = 0;
+  // clock_ticks() per microsecond, refined by stats_cron
+  double ticks_per_us = 1.0;
+  // the connection whose request is being executed, NULL otherwise
+  Connection *cur_conn = NULL;
+  // protocol replies are encoded in, that of cur_conn while it is set
+  uint32_t proto = PROTO_NATIVE;
+  // replies are sent by the io_uring loop instead of written inline
+  bool io_uring = false;
+  // Background jobs. Workers queue finished jobs in bg_done and signal the
+  // eventfd, which the event loop watches.
+  int bg_fd = -1;
+  pthread_mutex_t bg_mu = PTHREAD_MUTEX_INITIALIZER;
+  vector<BgJob *> bg_done;
+  uint32_t bg_jobs = 0; // submitted and not done yet
+  // String buffers that running jobs may still read, freed once none runs.
+  // An entry whose buffer was handed to a job is marked with the epoch.
+  vector<string> bg_retired;
+  uint64_t bg_epoch = 1;
+  // connections with output that the event loop has not started sending:
+  // replies of blocked commands, and pub/sub messages
+  vector<Connection *> pending_out;
+  // pub/sub subscribers, by channel and by pattern
+  unordered_map<string, vector<Connection *>> channels;
+  unordered_map<string, vector<Connection *>> patterns;
+  // Client-side caching: the keys read by connections with tracking on,
+  // oldest first in tracking_order, those connections by id, and the
+  // connections in broadcast mode by prefix. See tracking_add.
+  HMap tracking;
+  Dlist tracking_order;
+  size_t tracking_items = 0; // connection ids over all tracked keys
+  unordered_map<uint64_t, Connection *> tracking_conns;
+  unordered_map<string, vector<Connection *>> tracking_prefixes;
+  uint64_t tracking_invalidations = 0;
+  uint64_t tracking_evicted_keys = 0;
+  // Connections blocked in BZPOPMIN/BZPOPMAX: in arrival order by key,
+  // and by deadline. A write to a key someone waits on queues it in
+  // bzpop_ready, to be served once the command is done, see bzpop_serve.
+  unordered_map<string, deque<Connection *>> bzpop_waiters;
+  vector<HeapItem> bzpop_heap;
+  vector<string> bzpop_ready;
+  size_t blocked_clients = 0;
+  // bytes held by PubBufs, counted once however many queues share them
+  size_t pubsub_buf_bytes = 0;
+  // compressed string values: their number, stored and raw sizes, and a
+  // buffer to compress into and decompress replies into
+  size_t lz_values = 0;
+  size_t lz_bytes = 0;
+  size_t lz_raw_bytes = 0;
+  string lz_buf;
+  uint64_t pubsub_messages = 0;
+  // connections closed for going over an output limit
+  uint64_t output_limit_disconnects = 0;
+  // and for going over the query buffer limit
+  uint64_t input_limit_disconnects = 0;
+  // keys whose value's hash table is resizing, finished by rehash_cron,
+  // and the command count when it last ran
+  unordered_set<string> rehash_keys;
+  uint64_t rehash_cmds = 0;
+  uint64_t rehash_us = 0;
+  // connections over their soft output limit, checked by clients_cron
+  size_t soft_limited = 0;
+  uint64_t clients_cron_us = 0;
+  // Cluster mode: the slot map with this node in it, the keys held per
+  // slot, and per slot the node it is moving to or coming from, see
+  // cluster_check. One range of slots moves out at a time.
+  bool cluster_on = false;
+  SlotMap cluster;
+  uint16_t cluster_self = k_no_node;
+  vector<uint32_t> slot_keys;
+  vector<uint16_t> migrating;
+  vector<uint16_t> importing;
+  SlotMigration *migration = NULL;
+  // when cluster_cron has work for the migration: 0 for a batch to send,
+  // else the reply deadline of the one on its way
+  uint64_t migration_due_us = 0;
+  // last version given to a modified key, see Entry::version
+  uint64_t key_version = 0;
+  // EXEC is running queued commands, which must finish before it returns
+  bool in_exec = false;
+  size_t nconnections = 0;
+  uint64_t total_connections = 0;
+  uint64_t total_commands = 0;
+  uint64_t net_input_bytes = 0;
+  uint64_t net_output_bytes = 0;
+  uint64_t expired_keys = 0;
+  // processing time of one event loop iteration, excluding the poll wait
+  Histogram loop_hist;
+  // ring of (time, commands) samples for the instantaneous ops/sec
+  uint64_t ops_sample_us[16] = {};
+  uint64_t ops_sample_cmds[16] = {};
+  size_t ops_sample_idx = 0;
 } g_data;
 
 static uint64_t str_hash(const uint8_t *data, size_t len) {
@@ -73,11 +285,155 @@ static uint64_t get_monotonic_usec() {
   return uint64_t(tv.tv_sec) * 1000000 + tv.tv_nsec / 1000;
 }
 
+static void pubbuf_release(PubBuf *buf) {
+  if (--buf->refs) {
+    return;
+  }
+  size_t bytes = sizeof(PubBuf) + buf->data.capacity();
+  g_data.pubsub_buf_bytes -= bytes;
+  g_data.used_memory -= bytes;
+  delete buf;
+}
+
+// drops the queued output, the connection is closing
+static void conn_drop_output(Connection *conn) {
+  for (PubBuf *buf : conn->outq) {
+    pubbuf_release(buf);
+  }
+  conn->outq.clear();
+  conn->outq_sent = 0;
+  conn->outq_bytes = 0;
+}
+
+static void pubsub_remove(unordered_map<string, vector<Connection *>> &subs,
+                          const string &name, Connection *conn) {
+  auto it = subs.find(name);
+  if (it == subs.end()) {
+    return;
+  }
+  vector<Connection *> &conns = it->second;
+  for (size_t i = 0; i < conns.size(); i++) {
+    if (conns[i] == conn) {
+      conns[i] = conns.back();
+      conns.pop_back();
+      break;
+    }
+  }
+  if (conns.empty()) {
+    subs.erase(it);
+  }
+}
+
+// the connection is back under its soft output limit
+static void conn_soft_clear(Connection *conn) {
+  if (conn->outq_soft_us) {
+    conn->outq_soft_us = 0;
+    g_data.soft_limited--;
+  }
+}
+
+static bool conn_subscribed(Connection *conn) {
+  return !conn->channels.empty() || !conn->patterns.empty();
+}
+
+// CLIENT TRACKING off. The keys the connection read keep its id until
+// they are invalidated, which then finds no connection for it.
+static void tracking_stop(Connection *conn) {
+  if (!conn->tracking) {
+    return;
+  }
+  for (const string &prefix : conn->tracking_prefixes) {
+    pubsub_remove(g_data.tracking_prefixes, prefix, conn);
+  }
+  conn->tracking_prefixes.clear();
+  g_data.tracking_conns.erase(conn->id);
+  conn->tracking = false;
+  conn->tracking_bcast = false;
+  conn->tracking_noloop = false;
+  conn->tracking_redirect = 0;
+  conn->tracking_redirect_fd = -1;
+}
+
+// The connection stops waiting in BZPOPMIN/BZPOPMAX, served or not.
+static void bzpop_unwait(Connection *conn) {
+  if (conn->bzpop_keys.empty()) {
+    return;
+  }
+  for (const string &key : conn->bzpop_keys) {
+    auto it = g_data.bzpop_waiters.find(key);
+    if (it == g_data.bzpop_waiters.end()) {
+      continue;
+    }
+    deque<Connection *> &waiters = it->second;
+    auto pos = find(waiters.begin(), waiters.end(), conn);
+    if (pos != waiters.end()) {
+      waiters.erase(pos);
+    }
+    if (waiters.empty()) {
+      g_data.bzpop_waiters.erase(it);
+    }
+  }
+  conn->bzpop_keys.clear();
+  size_t pos = conn->bzpop_heap_idx;
+  if (pos != (size_t)-1) {
+    g_data.bzpop_heap[pos] = g_data.bzpop_heap.back();
+    g_data.bzpop_heap.pop_back();
+    if (pos < g_data.bzpop_heap.size()) {
+      heap_update(g_data.bzpop_heap.data(), pos, g_data.bzpop_heap.size());
+    }
+    conn->bzpop_heap_idx = -1;
+  }
+  g_data.blocked_clients--;
+}
+
+// leaves MULTI, dropping the queued commands
+static void conn_multi_reset(Connection *conn) {
+  g_data.used_memory -= conn->multi_bytes;
+  conn->multi_bytes = 0;
+  conn->multi_cmds.clear();
+  conn->in_multi = false;
+  conn->multi_failed = false;
+}
+
 static void conn_done(Connection *conn) {
+  // output queued for the loop to send goes with the connection
+  if (conn->pending_out) {
+    vector<Connection *> &pending = g_data.pending_out;
+    auto it = find(pending.begin(), pending.end(), conn);
+    if (it != pending.end()) {
+      pending.erase(it); // not if the loop took it already
+    }
+    conn->pending_out = false;
+  }
+  for (const string &name : conn->channels) {
+    pubsub_remove(g_data.channels, name, conn);
+  }
+  for (const string &name : conn->patterns) {
+    pubsub_remove(g_data.patterns, name, conn);
+  }
+  conn->channels.clear();
+  conn->patterns.clear();
+  tracking_stop(conn);
+  bzpop_unwait(conn);
+  if (conn->inflight) {
+    // The kernel may still write into the buffers. Shutting the socket
+    // down completes the pending operations, and the io_uring loop calls
+    // back here once the last one is reaped.
+    conn->state = END;
+    shutdown(conn->fd, SHUT_RDWR);
+    dlist_detach(&conn->idle_list);
+    dlist_init(&conn->idle_list);
+    return;
+  }
+  conn_drop_output(conn);
+  conn_soft_clear(conn);
+  conn_multi_reset(conn);
   g_data.connections[conn->fd] = NULL;
   (void)close(conn->fd);
   dlist_detach(&conn->idle_list);
-  free(conn);
+  g_data.used_memory -= sizeof(Connection);
+  g_data.nconnections--;
+  delete conn;
 }
 
 static uint32_t next_timer_ms() {
@@ -96,6 +452,30 @@ static uint32_t next_timer_ms() {
     next_us = g_data.heap[0].val;
   }
 
+  // BZPOPMIN/BZPOPMAX timeouts
+  if (!g_data.bzpop_heap.empty() && g_data.bzpop_heap[0].val < next_us) {
+    next_us = g_data.bzpop_heap[0].val;
+  }
+
+  if (g_data.evicting) {
+    return 0; // keep freeing memory without waiting for events
+  }
+
+  if (!g_data.rehash_keys.empty() || hm_rehash_pending(&g_data.db)) {
+    return 0; // resize tables while there is nothing else to do
+  }
+
+  // the next batch of a slot migration, or the deadline of the one on its
+  // way, see cluster_cron
+  if (g_data.migration && g_data.migration_due_us < next_us) {
+    next_us = g_data.migration_due_us;
+  }
+
+  // soft output limits expire without events, see clients_cron
+  if (g_data.soft_limited && next_us > now_us + 100 * 1000) {
+    next_us = now_us + 100 * 1000;
+  }
+
   if (next_us == (uint64_t)-1) {
     return 10000; // no timer, the value doesn't matter
   }
@@ -0,0 +1,134 @@
+#include "art.h"
+#include "rng.h"
+#include <assert.h>
+#include <map>
+#include <string>
+#include <vector>
+using namespace std;
+
+struct Val {
+  string key;
+};
+
+static const uint8_t *val_key(void *val, size_t *len) {
+  Val *v = (Val *)val;
+  *len = v->key.size();
+  return (const uint8_t *)v->key.data();
+}
+
+struct Collect {
+  vector<string> keys;
+  size_t limit = 0;
+};
+
+static bool collect(void *val, void *arg) {
+  Collect *c = (Collect *)arg;
+  c->keys.push_back(((Val *)val)->key);
+  return c->keys.size() < c->limit;
+}
+
+// Keys over a small alphabet, so that they share prefixes, are prefixes of
+// each other, and share runs longer than a node stores.
+static string make_key() {
+  static const char *stems[] = {"", "user:", "user:1234567890:", "\xff\xfe"};
+  string key = stems[rnd() % 4];
+  size_t n = rnd() % 6;
+  for (size_t i = 0; i < n; i++) {
+    key.push_back("ab\x00\xff"[rnd() % 4]);
+  }
+  return key;
+}
+
+static void check_walk(Art *t, map<string, Val *> &ref, const string &start,
+                       bool inclusive, size_t limit) {
+  Collect c;
+  c.limit = limit;
+  art_walk(t, (const uint8_t *)start.data(), start.size(), inclusive,
+           &collect, &c);
+  auto it = inclusive ? ref.lower_bound(start) : ref.upper_bound(start);
+  for (const string &key : c.keys) {
+    assert(it != ref.end() && it->first == key);
+    ++it;
+  }
+  assert(c.keys.size() == limit || it == ref.end());
+}
+
+static void test_random(size_t nops) {
+  Art t;
+  t.key_of = &val_key;
+  map<string, Val *> ref;
+  for (size_t i = 0; i < nops; i++) {
+    string key = make_key();
+    uint64_t op = rnd() % 8;
+    if (op < 4) {
+      Val *v = new Val{key};
+      Val *old = (Val *)art_insert(&t, (const uint8_t *)key.data(),
+                                   key.size(), v);
+      assert(old == (ref.count(key) ? ref[key] : NULL));
+      delete old;
+      ref[key] = v;
+    } else if (op < 7) {
+      Val *v = (Val *)art_delete(&t, (const uint8_t *)key.data(), key.size());
+      auto it = ref.find(key);
+      assert(v == (it == ref.end() ? NULL : it->second));
+      if (it != ref.end()) {
+        ref.erase(it);
+      }
+      delete v;
+    } else {
+      check_walk(&t, ref, key, rnd() % 2, 1 + rnd() % 20);
+    }
+    Val *found = (Val *)art_find(&t, (const uint8_t *)key.data(), key.size());
+    assert(found == (ref.count(key) ? ref[key] : NULL));
+    assert(t.size == ref.size());
+    if (i % 64 == 0) {
+      assert(art_verify(&t));
+    }
+  }
+  assert(art_verify(&t));
+  check_walk(&t, ref, "", true, ref.size() + 1);
+  for (auto &kv : ref) {
+    delete kv.second;
+  }
+  art_destroy(&t);
+}
+
+// every node size, grown one child at a time and shrunk back
+static void test_fanout() {
+  Art t;
+  t.key_of = &val_key;
+  map<string, Val *> ref;
+  vector<int> order(256);
+  for (int i = 0; i < 256; i++) {
+    order[i] = i;
+  }
+  for (int i = 255; i > 0; i--) {
+    swap(order[i], order[rnd() % (i + 1)]);
+  }
+  for (int b : order) {
+    string key = "node:" + string(1, (char)b) + "tail";
+    Val *v = new Val{key};
+    art_insert(&t, (const uint8_t *)key.data(), key.size(), v);
+    ref[key] = v;
+    assert(art_verify(&t));
+    check_walk(&t, ref, "node:", false, 1000);
+  }
+  for (int b : order) {
+    string key = "node:" + string(1, (char)b) + "tail";
+    Val *v = (Val *)art_delete(&t, (const uint8_t *)key.data(), key.size());
+    assert(v && v->key == key);
+    ref.erase(key);
+    delete v;
+    assert(art_verify(&t));
+    check_walk(&t, ref, "node:", true, 1000);
+  }
+  assert(t.size == 0 && t.root == NULL && t.mem == 0);
+}
+
+int main() {
+  test_fanout();
+  for (int i = 0; i < 20; i++) {
+    test_random(5000);
+  }
+  return 0;
+}
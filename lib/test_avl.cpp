@@ -1,5 +1,7 @@
 #include "avl.cpp"
 #include <assert.h>
+#include <vector>
+using namespace std;
 
 #define container_of(ptr, type, member)                                        \
   ({                                                                           \
@@ -74,9 +76,62 @@ static void test_case(uint32_t sz) {
   dispose(c.root);
 }
 
+// checks the links, counts, depths and balance; returns the depth
+static uint32_t verify(AVLNode *node, AVLNode *parent) {
+  if (!node) {
+    return 0;
+  }
+  assert(node->parent == parent);
+  uint32_t l = verify(node->left, node);
+  uint32_t r = verify(node->right, node);
+  assert(l <= r + 1 && r <= l + 1);
+  assert(node->depth == 1 + (l > r ? l : r));
+  assert(node->cnt == 1 + avl_cnt(node->left) + avl_cnt(node->right));
+  return node->depth;
+}
+
+static void test_build(uint32_t sz) {
+  vector<Data> data(sz);
+  vector<AVLNode *> nodes(sz);
+  for (uint32_t i = 0; i < sz; ++i) {
+    data[i].val = i;
+    avl_init(&data[i].node);
+    nodes[i] = &data[i].node;
+  }
+  AVLNode *root = avl_build(nodes.data(), sz);
+  assert(sz ? root != NULL : root == NULL);
+  verify(root, NULL);
+  for (uint32_t i = 0; i < sz; ++i) {
+    assert(avl_offset(nodes[0], (int64_t)i) == nodes[i]);
+  }
+  // and it stays an AVL tree under later inserts
+  Container c;
+  c.root = root;
+  for (uint32_t i = 0; i < 50; ++i) {
+    add(c, sz + i);
+  }
+  verify(c.root, NULL);
+  AVLNode *min = c.root;
+  while (min->left) {
+    min = min->left;
+  }
+  vector<Data *> added;
+  for (uint32_t i = 0; i < 50; ++i) {
+    Data *d = container_of(avl_offset(min, sz + i), Data, node);
+    assert(d->val == sz + i);
+    added.push_back(d);
+  }
+  for (Data *d : added) {
+    delete d;
+  }
+}
+
 int main() {
   for (uint32_t i = 1; i < 500; ++i) {
     test_case(i);
   }
+  for (uint32_t i = 0; i < 300; ++i) {
+    test_build(i);
+  }
   return 0;
 }
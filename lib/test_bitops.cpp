@@ -0,0 +1,100 @@
+#include "bitops.h"
+#include "rng.h"
+#include <assert.h>
+#include <string>
+#include <vector>
+using namespace std;
+
+// random bytes, or runs of one value so that BITPOS has something to skip
+static string make_bits(size_t n) {
+  string s(n, '\0');
+  uint64_t r = rnd() % 3;
+  for (size_t i = 0; i < n; i++) {
+    s[i] = r == 0 ? (char)rnd() : r == 1 ? '\0' : '\xFF';
+  }
+  if (r && n && rnd() % 2) {
+    s[rnd() % n] = (char)rnd();
+  }
+  return s;
+}
+
+static int get_bit(const string &s, size_t i) {
+  return (uint8_t)s[i / 8] >> (7 - i % 8) & 1;
+}
+
+static void test_bitcount(const string &s) {
+  uint64_t want = 0;
+  for (size_t i = 0; i < s.size() * 8; i++) {
+    want += get_bit(s, i);
+  }
+  const uint8_t *p = (const uint8_t *)s.data();
+  assert(bitcount_scalar(p, s.size()) == want);
+  assert(bitcount_popcnt(p, s.size()) == want);
+  assert(bitcount_avx2(p, s.size()) == want);
+  assert(bitcount(p, s.size()) == want);
+}
+
+static void test_bitpos(const string &s) {
+  const uint8_t *p = (const uint8_t *)s.data();
+  for (int bit = 0; bit < 2; bit++) {
+    int64_t want = -1;
+    for (size_t i = 0; i < s.size() * 8 && want < 0; i++) {
+      if (get_bit(s, i) == bit) {
+        want = (int64_t)i;
+      }
+    }
+    assert(bitpos_scalar(p, s.size(), bit) == want);
+    assert(bitpos_avx2(p, s.size(), bit) == want);
+    assert(bitpos(p, s.size(), bit) == want);
+  }
+}
+
+static void test_bitop(int op, size_t nsrc, size_t max_len) {
+  vector<string> srcs(nsrc);
+  vector<const uint8_t *> ptrs;
+  vector<size_t> lens;
+  size_t n = 0;
+  for (string &s : srcs) {
+    s = make_bits(rnd() % (max_len + 1));
+    ptrs.push_back((const uint8_t *)s.data());
+    lens.push_back(s.size());
+    n = s.size() > n ? s.size() : n;
+  }
+  string want(n, '\0');
+  for (size_t i = 0; i < n; i++) {
+    uint8_t v = i < srcs[0].size() ? srcs[0][i] : 0;
+    for (size_t k = 1; k < nsrc; k++) {
+      uint8_t b = i < srcs[k].size() ? srcs[k][i] : 0;
+      v = op == BITOP_AND ? v & b : op == BITOP_OR ? v | b : v ^ b;
+    }
+    want[i] = op == BITOP_NOT ? ~v : v;
+  }
+  typedef void (*Kernel)(int, uint8_t *, size_t, const uint8_t *const *,
+                         const size_t *, size_t);
+  Kernel kernels[] = {&bitop_scalar, &bitop_avx2, &bitop};
+  for (Kernel fn : kernels) {
+    // one byte past the end checks for overruns
+    string got(n + 1, '\x5A');
+    fn(op, (uint8_t *)&got[0], n, ptrs.data(), lens.data(), nsrc);
+    assert(got.back() == '\x5A');
+    got.pop_back();
+    assert(got == want);
+  }
+}
+
+int main() {
+  size_t sizes[] = {0, 1, 7, 8, 31, 32, 33, 63, 64, 65, 255, 256, 1000, 4099};
+  for (size_t n : sizes) {
+    for (int i = 0; i < 20; i++) {
+      string s = make_bits(n);
+      test_bitcount(s);
+      test_bitpos(s);
+    }
+  }
+  for (int i = 0; i < 2000; i++) {
+    int op = (int)(rnd() % 4);
+    size_t nsrc = op == BITOP_NOT ? 1 : 1 + rnd() % 5;
+    test_bitop(op, nsrc, i % 2 ? 300 : 5000);
+  }
+  return 0;
+}
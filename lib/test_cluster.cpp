@@ -0,0 +1,74 @@
+#include "cluster.h"
+#include <assert.h>
+#include <string.h>
+
+static uint32_t slot_of(const char *key) { return key_slot(key, strlen(key)); }
+
+static void test_slots() {
+  // the check value of CRC16/XMODEM, and slots Redis gives these keys
+  assert(crc16("123456789", 9) == 0x31C3);
+  assert(slot_of("foo") == 12182);
+  assert(slot_of("bar") == 5061);
+  assert(slot_of("") == 0);
+  // hash tags
+  assert(slot_of("{user1000}.following") == slot_of("{user1000}.followers"));
+  assert(slot_of("{user1000}.following") == slot_of("user1000"));
+  assert(slot_of("foo{}{bar}") == crc16("foo{}{bar}", 10) % k_cluster_slots);
+  assert(slot_of("foo{{bar}}zap") == slot_of("{bar"));
+  assert(slot_of("foo{bar}{zap}") == slot_of("bar"));
+  assert(slot_of("{bar") == crc16("{bar", 4) % k_cluster_slots);
+}
+
+static void test_slotmap() {
+  SlotMap map;
+  assert(slotmap_ranges(&map).empty() && !slotmap_owner(&map, 0));
+  assert(slotmap_parse(&map, "127.0.0.1:7001 0-8191 127.0.0.1:7002 "
+                             "8192-16382 16383"));
+  vector<SlotRange> ranges = slotmap_ranges(&map);
+  assert(ranges.size() == 2);
+  assert(ranges[0].lo == 0 && ranges[0].hi == 8191);
+  assert(ranges[1].lo == 8192 && ranges[1].hi == 16383);
+  assert(*slotmap_owner(&map, 8191) == "127.0.0.1:7001");
+  assert(*slotmap_owner(&map, 16383) == "127.0.0.1:7002");
+  assert(slotmap_count(&map, 0) == 8192 && slotmap_count(&map, 1) == 8192);
+
+  // a node takes over part of a range
+  slotmap_assign(&map, 100, 199, slotmap_node(&map, "127.0.0.1:7003"));
+  ranges = slotmap_ranges(&map);
+  assert(ranges.size() == 4 && ranges[1].lo == 100 && ranges[1].hi == 199);
+  assert(ranges[2].lo == 200 && ranges[2].node == ranges[0].node);
+  assert(map.nodes.size() == 3);
+
+  // nothing changes on an error
+  const char *bad[] = {"0-10", "127.0.0.1:7001 16384", "127.0.0.1:7001 5-4",
+                       "127.0.0.1: 1", "127.0.0.1:7001 1-x"};
+  for (const char *spec : bad) {
+    SlotMap copy = map;
+    assert(!slotmap_parse(&copy, spec));
+    assert(copy.owner == map.owner && copy.nodes == map.nodes);
+  }
+}
+
+static void test_redirect() {
+  bool ask = true;
+  uint32_t slot = 0;
+  string addr;
+  const char *moved = "MOVED 3999 127.0.0.1:6381";
+  assert(parse_redirect(moved, strlen(moved), &ask, &slot, &addr));
+  assert(!ask && slot == 3999 && addr == "127.0.0.1:6381");
+  const char *asked = "ASK 16383 localhost:7002";
+  assert(parse_redirect(asked, strlen(asked), &ask, &slot, &addr));
+  assert(ask && slot == 16383 && addr == "localhost:7002");
+  const char *bad[] = {"MOVED 16384 127.0.0.1:1", "ERR 1 127.0.0.1:1",
+                       "MOVED 1", "ASK 1 127.0.0.1"};
+  for (const char *msg : bad) {
+    assert(!parse_redirect(msg, strlen(msg), &ask, &slot, &addr));
+  }
+}
+
+int main() {
+  test_slots();
+  test_slotmap();
+  test_redirect();
+  return 0;
+}
@@ -0,0 +1,141 @@
+#include "hash.h"
+#include "rng.h"
+#include <algorithm>
+#include <assert.h>
+#include <set>
+
+struct Item {
+  HNode node;
+  uint64_t val = 0;
+};
+
+static bool item_eq(HNode *a, HNode *b) {
+  Item *x = container_of(a, Item, node);
+  Item *y = container_of(b, Item, node);
+  return x->val == y->val;
+}
+
+static Item *item_new(uint64_t val) {
+  Item *item = new Item();
+  item->val = val;
+  item->node.hcode = val * 0x9E3779B97F4A7C15ull;
+  return item;
+}
+
+static Item *find(HMap *map, uint64_t val) {
+  Item key;
+  key.val = val;
+  key.node.hcode = val * 0x9E3779B97F4A7C15ull;
+  HNode *node = hm_find(map, &key.node, &item_eq);
+  return node ? container_of(node, Item, node) : NULL;
+}
+
+static Item *pop(HMap *map, uint64_t val) {
+  Item key;
+  key.val = val;
+  key.node.hcode = val * 0x9E3779B97F4A7C15ull;
+  HNode *node = hm_pop(map, &key.node, &item_eq);
+  return node ? container_of(node, Item, node) : NULL;
+}
+
+static size_t capacity(HMap *map) {
+  return map->ht1.mask + 1 + (map->ht2.tab ? map->ht2.mask + 1 : 0);
+}
+
+static void collect(HNode *node, void *arg) {
+  Item *item = container_of(node, Item, node);
+  ((std::set<uint64_t> *)arg)->insert(item->val);
+}
+
+// grows, then shrinks once most nodes are gone, a bounded step at a time
+static void test_grow_shrink(size_t n) {
+  HMap map;
+  for (size_t i = 0; i < n; i++) {
+    hm_insert(&map, &item_new(i)->node);
+  }
+  while (hm_rehash_pending(&map)) {
+    assert(hm_rehash(&map, 100) <= 100);
+  }
+  size_t grown = capacity(&map);
+  assert(grown * 8 > n && grown * 2 <= n);
+
+  // delete all but a few, the table shrinks behind the deletes
+  size_t keep = n / 64;
+  for (size_t i = keep; i < n; i++) {
+    delete pop(&map, i);
+    assert(hm_size(&map) == n - 1 - i + keep);
+  }
+  while (hm_rehash_pending(&map)) {
+    hm_rehash(&map, 100);
+  }
+  assert(capacity(&map) <= keep * 2 || capacity(&map) == 4);
+  assert(capacity(&map) < grown || grown == 4);
+  for (size_t i = 0; i < n; i++) {
+    assert((find(&map, i) != NULL) == (i < keep));
+  }
+  for (size_t i = 0; i < keep; i++) {
+    delete pop(&map, i);
+  }
+  while (hm_rehash_pending(&map)) {
+    hm_rehash(&map, 100);
+  }
+  assert(hm_size(&map) == 0 && capacity(&map) == 4);
+  hm_destroy(&map);
+}
+
+// a scan sees every node that stays, while the map shrinks and grows
+static void test_scan_resize() {
+  HMap map;
+  const size_t n = 20000;
+  for (size_t i = 0; i < n; i++) {
+    hm_insert(&map, &item_new(i)->node);
+  }
+  std::set<uint64_t> seen;
+  uint64_t cursor = 0;
+  size_t start_cap = capacity(&map);
+  size_t round = 0, min_cap = start_cap, max_cap = 0;
+  do {
+    cursor = hm_scan(&map, cursor, &collect, &seen);
+    // multiples of 16 stay, the others go and then new ones come
+    for (uint64_t k = round * 20; k < round * 20 + 20; k++) {
+      if (k < n) {
+        if (k % 16) {
+          delete pop(&map, k);
+        }
+      } else {
+        hm_insert(&map, &item_new(k)->node);
+      }
+    }
+    hm_rehash(&map, rnd() % 64);
+    if (round * 20 < n) {
+      min_cap = std::min(min_cap, capacity(&map));
+    } else {
+      max_cap = std::max(max_cap, capacity(&map));
+    }
+    round++;
+  } while (cursor);
+  assert(min_cap < start_cap && max_cap > 2 * min_cap);
+  for (uint64_t i = 0; i < n; i += 16) {
+    assert(seen.count(i));
+  }
+  std::set<uint64_t> all;
+  cursor = 0;
+  do {
+    cursor = hm_scan(&map, cursor, &collect, &all);
+  } while (cursor);
+  assert(all.size() == hm_size(&map));
+  for (uint64_t val : all) {
+    delete pop(&map, val);
+  }
+  assert(hm_size(&map) == 0);
+  hm_destroy(&map);
+}
+
+int main() {
+  size_t sizes[] = {10, 1000, 100000};
+  for (size_t n : sizes) {
+    test_grow_shrink(n);
+  }
+  test_scan_resize();
+  return 0;
+}
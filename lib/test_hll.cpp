@@ -0,0 +1,102 @@
+#include "hll.h"
+#include "rng.h"
+#include <assert.h>
+#include <math.h>
+#include <string.h>
+
+// registers as adding `n` random elements would leave them, roughly
+static void make_regs(uint8_t *regs, uint32_t max_val) {
+  for (uint32_t i = 0; i < k_hll_registers; i++) {
+    regs[i] = (uint8_t)(rnd() % (max_val + 1));
+  }
+}
+
+static void test_kernels() {
+  uint8_t a[k_hll_registers], b[k_hll_registers];
+  uint8_t x[k_hll_registers], y[k_hll_registers];
+  uint32_t max_vals[] = {0, 1, 5, 51};
+  for (uint32_t max_val : max_vals) {
+    make_regs(a, max_val);
+    make_regs(b, max_val);
+    // packing and both unpackers round-trip
+    string s;
+    hll_init(s);
+    hll_store_dense(s, a);
+    assert(hll_valid(s) && hll_is_dense(s) && s.size() == k_hll_dense_size);
+    const uint8_t *dense = (const uint8_t *)s.data() + k_hll_header;
+    hll_unpack_scalar(dense, x);
+    assert(memcmp(x, a, sizeof(a)) == 0);
+    hll_unpack_avx2(dense, y);
+    assert(memcmp(y, a, sizeof(a)) == 0);
+
+    memcpy(x, a, sizeof(a));
+    memcpy(y, a, sizeof(a));
+    hll_max_scalar(x, b);
+    hll_max_avx2(y, b);
+    for (uint32_t i = 0; i < k_hll_registers; i++) {
+      assert(x[i] == (a[i] > b[i] ? a[i] : b[i]));
+    }
+    assert(memcmp(x, y, sizeof(x)) == 0);
+
+    // the sums run in a different order
+    int64_t e1 = (int64_t)hll_estimate_scalar(a);
+    int64_t e2 = (int64_t)hll_estimate_avx2(a);
+    assert(llabs(e1 - e2) <= 1 + e1 / 1000000);
+  }
+  memset(a, 0, sizeof(a));
+  assert(hll_estimate_scalar(a) == 0 && hll_estimate_avx2(a) == 0);
+}
+
+static void test_add(uint32_t n) {
+  string sparse, dense;
+  hll_init(sparse);
+  hll_init(dense);
+  assert(hll_valid(sparse) && !hll_is_dense(sparse));
+  for (uint32_t i = 0; i < n; i++) {
+    string elem = "elem:" + to_string(i);
+    int a = hll_add(sparse, elem.data(), elem.size(), 1 << 20);
+    int b = hll_add(dense, elem.data(), elem.size(), 0);
+    assert(a >= 0 && a == b);
+    // the same element again changes nothing
+    assert(hll_add(dense, elem.data(), elem.size(), 0) == 0);
+  }
+  assert(n == 0 || hll_is_dense(dense));
+  uint8_t x[k_hll_registers], y[k_hll_registers];
+  assert(hll_registers(sparse, x) && hll_registers(dense, y));
+  assert(memcmp(x, y, sizeof(x)) == 0);
+
+  uint64_t c1 = 0, c2 = 0;
+  assert(hll_count(sparse, &c1) && hll_count(dense, &c2));
+  assert(c1 == c2);
+  // about 0.81% standard error, allow 4 of them
+  assert(fabs((double)c1 - n) <= 0.0325 * n + 1);
+  // served from the cache now
+  assert(hll_count(dense, &c2) && c2 == c1);
+}
+
+static void test_invalid() {
+  string s;
+  assert(!hll_valid(s));
+  s = "HYLX";
+  s.resize(k_hll_dense_size);
+  assert(!hll_valid(s));
+  hll_init(s);
+  s[4] = 0; // dense, but too short
+  assert(!hll_valid(s));
+  hll_init(s);
+  s.push_back('\x01'); // two more zero registers than there are
+  s[15] = (char)0x80;  // and no cached count
+  uint8_t regs[k_hll_registers];
+  uint64_t n = 0;
+  assert(hll_valid(s) && !hll_registers(s, regs) && !hll_count(s, &n));
+}
+
+int main() {
+  test_kernels();
+  uint32_t sizes[] = {0, 1, 10, 100, 1000, 5000, 20000, 100000};
+  for (uint32_t n : sizes) {
+    test_add(n);
+  }
+  test_invalid();
+  return 0;
+}
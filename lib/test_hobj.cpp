@@ -0,0 +1,157 @@
+#include "hobj.h"
+#include "rng.h"
+#include <assert.h>
+#include <map>
+
+static void collect(const char *field, size_t flen, const char *val,
+                    size_t vlen, void *arg) {
+  map<string, string> *out = (map<string, string> *)arg;
+  assert(out->count(string(field, flen)) == 0);
+  (*out)[string(field, flen)] = string(val, vlen);
+}
+
+// the pairs in scan order, which is buffer order while packed
+static void collect_order(const char *field, size_t flen, const char *val,
+                          size_t vlen, void *arg) {
+  string *out = (string *)arg;
+  out->append(field, flen);
+  out->push_back('=');
+  out->append(val, vlen);
+  out->push_back(' ');
+}
+
+static bool hset(HObj *h, const string &f, const string &v,
+                 const HObjLimits &lim) {
+  return hobj_set(h, f.data(), f.size(), v.data(), v.size(), lim);
+}
+
+static string hget(HObj *h, const string &f) {
+  const char *val = NULL;
+  size_t vlen = 0;
+  if (!hobj_get(h, f.data(), f.size(), &val, &vlen)) {
+    return "(nil)";
+  }
+  return string(val, vlen);
+}
+
+static bool hdel(HObj *h, const string &f) {
+  return hobj_del(h, f.data(), f.size());
+}
+
+static string order(HObj *h) {
+  string out;
+  hobj_scan(h, &collect_order, &out);
+  return out;
+}
+
+static void test_splice() {
+  HObjLimits lim;
+  lim.max_value = 300;
+  HObj h;
+  assert(hset(&h, "a", "1", lim));
+  assert(hset(&h, "b", "2", lim));
+  assert(hset(&h, "c", "3", lim));
+  assert(order(&h) == "a=1 b=2 c=3 ");
+  assert(h.packed.size() == 12);
+
+  // an overwrite keeps the pair in place, also when the value's length
+  // needs a longer varint
+  string big(200, 'x');
+  assert(!hset(&h, "b", big, lim));
+  assert(order(&h) == "a=1 b=" + big + " c=3 ");
+  assert(h.packed.size() == 12 - 1 + 1 + 200);
+  assert(!hset(&h, "b", "", lim));
+  assert(order(&h) == "a=1 b= c=3 ");
+  assert(hget(&h, "b") == "");
+
+  // deletes splice out the pair and leave its neighbours intact
+  assert(hdel(&h, "b"));
+  assert(!hdel(&h, "b"));
+  assert(order(&h) == "a=1 c=3 ");
+  assert(hdel(&h, "a"));
+  assert(order(&h) == "c=3 ");
+  assert(hdel(&h, "c"));
+  assert(h.packed.empty() && hobj_size(&h) == 0 && !h.map);
+  hobj_dispose(&h);
+}
+
+static void test_limits() {
+  HObjLimits lim;
+  lim.max_entries = 4;
+  lim.max_value = 8;
+
+  // the entry limit: full is still packed, overwriting stays packed
+  HObj h;
+  for (int i = 0; i < 4; i++) {
+    assert(hset(&h, "f" + to_string(i), "v", lim));
+  }
+  assert(!h.map && hobj_size(&h) == 4);
+  assert(!hset(&h, "f0", "w", lim));
+  assert(!h.map);
+  assert(hset(&h, "f4", "v", lim));
+  assert(h.map && h.packed.empty() && hobj_size(&h) == 5);
+  assert(hget(&h, "f0") == "w" && hget(&h, "f4") == "v");
+  // and it stays a map once smaller again
+  for (int i = 0; i < 5; i++) {
+    assert(hdel(&h, "f" + to_string(i)));
+  }
+  assert(h.map && hobj_size(&h) == 0 && h.mem == 0);
+  hobj_dispose(&h);
+
+  // the value limit, for values and for fields
+  HObj v;
+  assert(hset(&v, "a", string(8, 'x'), lim));
+  assert(!v.map);
+  assert(!hset(&v, "a", string(9, 'x'), lim));
+  assert(v.map && hget(&v, "a") == string(9, 'x'));
+  hobj_dispose(&v);
+
+  HObj f;
+  assert(hset(&f, string(8, 'k'), "1", lim));
+  assert(!f.map);
+  assert(hset(&f, string(9, 'k'), "2", lim));
+  assert(f.map && hobj_size(&f) == 2);
+  assert(hget(&f, string(8, 'k')) == "1" && hget(&f, string(9, 'k')) == "2");
+  assert(f.mem > 0);
+  hobj_dispose(&f);
+  assert(!f.map && f.count == 0 && f.mem == 0);
+}
+
+static void test_random(const HObjLimits &lim) {
+  HObj h;
+  map<string, string> ref;
+  for (int i = 0; i < 20000; i++) {
+    uint64_t r = rnd() % 100;
+    string f = "f" + to_string(rnd() % 300);
+    if (r < 50) {
+      string v(rnd() % 80, (char)('a' + rnd() % 26));
+      bool added = ref.count(f) == 0;
+      ref[f] = v;
+      assert(hset(&h, f, v, lim) == added);
+    } else if (r < 75) {
+      assert(hdel(&h, f) == (ref.erase(f) == 1));
+    } else {
+      auto it = ref.find(f);
+      assert(hget(&h, f) == (it == ref.end() ? "(nil)" : it->second));
+    }
+    assert(hobj_size(&h) == ref.size());
+  }
+  map<string, string> got;
+  hobj_scan(&h, &collect, &got);
+  assert(got == ref);
+  hobj_dispose(&h);
+}
+
+int main() {
+  test_splice();
+  test_limits();
+  HObjLimits packed; // never outgrows the packed encoding
+  packed.max_entries = 1000;
+  packed.max_value = 1000;
+  test_random(packed);
+  HObjLimits small;
+  small.max_entries = 16;
+  small.max_value = 40;
+  test_random(small);
+  return 0;
+}
@@ -0,0 +1,97 @@
+#include "lz.h"
+#include "rng.h"
+#include <assert.h>
+#include <string.h>
+
+// records like an API would return, repetitive the way JSON is
+static string make_json(size_t n) {
+  static const char *names[] = {"alice", "bob", "carol", "dave"};
+  string s = "[";
+  while (s.size() < n) {
+    s += "{\"id\":" + to_string(rnd() % 100000) + ",\"name\":\"" +
+         names[rnd() % 4] + "\",\"active\":" +
+         (rnd() % 2 ? "true" : "false") + ",\"tags\":[\"a\",\"b\"]},";
+  }
+  s.resize(n);
+  return s;
+}
+
+static string make_random(size_t n, uint32_t alphabet) {
+  string s(n, '\0');
+  for (char &c : s) {
+    c = (char)(rnd() % alphabet);
+  }
+  return s;
+}
+
+static void check_roundtrip(const string &raw) {
+  string block, back = "prefix";
+  // unbounded: the worst case adds a byte per 32 and the header
+  size_t bound = raw.size() + raw.size() / 32 + 1 + k_lz_header;
+  assert(lz_compress((const uint8_t *)raw.data(), raw.size(), block, bound));
+  assert(block.size() <= bound);
+  assert(lz_raw_size((const uint8_t *)block.data(), block.size()) ==
+         raw.size());
+  assert(lz_decompress((const uint8_t *)block.data(), block.size(), back));
+  assert(back == "prefix" + raw);
+}
+
+static void test_roundtrip() {
+  size_t sizes[] = {0, 1, 2, 3, 4, 31, 32, 33, 100, 1000, 4096, 70000};
+  for (size_t n : sizes) {
+    check_roundtrip(make_json(n));
+    check_roundtrip(make_random(n, 256));
+    check_roundtrip(make_random(n, 2));
+    check_roundtrip(string(n, 'x'));
+  }
+  // long matches, and offsets at the window's edge
+  string s = make_random(8192, 256);
+  s += s.substr(0, 5000) + string(1000, 'y') + s.substr(3000, 4000);
+  check_roundtrip(s);
+}
+
+static void test_ratio() {
+  string json = make_json(4000), block;
+  assert(lz_compress((const uint8_t *)json.data(), json.size(), block,
+                     json.size()));
+  assert(block.size() * 3 < json.size());
+  // incompressible data does not fit in its own size
+  string noise = make_random(4000, 256);
+  assert(!lz_compress((const uint8_t *)noise.data(), noise.size(), block,
+                      noise.size()));
+  assert(!lz_compress((const uint8_t *)json.data(), json.size(), block,
+                      k_lz_header));
+}
+
+static void test_corrupt() {
+  string raw = make_json(2000), block, out;
+  assert(lz_compress((const uint8_t *)raw.data(), raw.size(), block,
+                     raw.size()));
+  // cut short
+  for (size_t n = 0; n < block.size(); n += 7) {
+    assert(!lz_decompress((const uint8_t *)block.data(), n, out));
+    assert(out.empty());
+  }
+  // random damage never reads or writes out of bounds
+  for (int i = 0; i < 2000; i++) {
+    string bad = block;
+    for (int j = 0; j < 3; j++) {
+      bad[rnd() % bad.size()] = (char)rnd();
+    }
+    if (lz_decompress((const uint8_t *)bad.data(), bad.size(), out)) {
+      assert(out.size() == lz_raw_size((const uint8_t *)bad.data(),
+                                       bad.size()));
+    }
+    out.clear();
+  }
+  // a back reference before the start
+  const uint8_t ref[] = {3, 0, 0, 0, 0x20, 0x05};
+  assert(!lz_decompress(ref, sizeof(ref), out) && out.empty());
+}
+
+int main() {
+  test_roundtrip();
+  test_ratio();
+  test_corrupt();
+  return 0;
+}
@@ -0,0 +1,289 @@
+// Slot migration to a node that fails along the way, played by a thread
+// that speaks the native protocol and drops its connection on cue.
+#include "functions.hpp"
+#include <arpa/inet.h>
+#include <assert.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/socket.h>
+
+struct FakeNode {
+  int lfd = -1;
+  string addr;
+  pthread_t thread;
+  pthread_mutex_t mu = PTHREAD_MUTEX_INITIALIZER;
+  vector<vector<string>> log; // every request received, under mu
+  // RESTOREs answered before the connection is dropped once, -1 for never
+  int restores_ok = -1;
+  bool drop_assign = false; // drops it once on CLUSTER SETSLOT NODE
+  size_t restores = 0;
+};
+
+static bool read_full(int fd, void *buf, size_t n) {
+  char *p = (char *)buf;
+  while (n > 0) {
+    ssize_t rv = read(fd, p, n);
+    if (rv <= 0) {
+      return false;
+    }
+    p += rv;
+    n -= (size_t)rv;
+  }
+  return true;
+}
+
+static bool read_req(int fd, vector<string> &cmd) {
+  uint32_t n = 0;
+  if (!read_full(fd, &n, 4)) {
+    return false;
+  }
+  cmd.assign(n, string());
+  for (string &arg : cmd) {
+    uint32_t len = 0;
+    if (!read_full(fd, &len, 4)) {
+      return false;
+    }
+    arg.resize(len);
+    if (len && !read_full(fd, &arg[0], len)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// whether the node drops the connection instead of answering `cmd`
+static bool fake_drops(FakeNode *node, const vector<string> &cmd) {
+  if (cmd[0] == "restore" && node->restores_ok >= 0 &&
+      node->restores++ == (size_t)node->restores_ok) {
+    node->restores_ok = -1;
+    return true;
+  }
+  if (cmd.size() == 5 && cmd[3] == "node" && node->drop_assign) {
+    node->drop_assign = false;
+    return true;
+  }
+  return false;
+}
+
+static void *fake_main(void *arg) {
+  FakeNode *node = (FakeNode *)arg;
+  int fd;
+  while ((fd = accept(node->lfd, NULL, NULL)) >= 0) {
+    vector<string> cmd;
+    while (read_req(fd, cmd)) {
+      pthread_mutex_lock(&node->mu);
+      node->log.push_back(cmd);
+      bool drop = fake_drops(node, cmd);
+      pthread_mutex_unlock(&node->mu);
+      if (drop) {
+        break;
+      }
+      // every command succeeds with a nil reply
+      uint8_t frame[5] = {1, 0, 0, 0, SER_NIL};
+      if (write(fd, frame, sizeof(frame)) != sizeof(frame)) {
+        break;
+      }
+    }
+    close(fd);
+  }
+  return NULL;
+}
+
+static void fake_start(FakeNode *node) {
+  node->lfd = socket(AF_INET, SOCK_STREAM, 0);
+  assert(node->lfd >= 0);
+  struct sockaddr_in sa = {};
+  sa.sin_family = AF_INET;
+  sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  socklen_t len = sizeof(sa);
+  assert(bind(node->lfd, (struct sockaddr *)&sa, len) == 0);
+  assert(listen(node->lfd, 8) == 0);
+  assert(getsockname(node->lfd, (struct sockaddr *)&sa, &len) == 0);
+  node->addr = "127.0.0.1:" + to_string(ntohs(sa.sin_port));
+  pthread_create(&node->thread, NULL, &fake_main, node);
+}
+
+// the requests received so far whose arguments start with `prefix`
+static size_t fake_count(FakeNode *node, const vector<string> &prefix) {
+  size_t n = 0;
+  pthread_mutex_lock(&node->mu);
+  for (const vector<string> &cmd : node->log) {
+    n += cmd.size() >= prefix.size() &&
+         std::equal(prefix.begin(), prefix.end(), cmd.begin());
+  }
+  pthread_mutex_unlock(&node->mu);
+  return n;
+}
+
+static Connection *open_pair(int *client) {
+  int fds[2];
+  int rv = socketpair(AF_UNIX, SOCK_STREAM, 0, fds);
+  assert(rv == 0);
+  fd_set_nb(fds[0]);
+  *client = fds[1];
+  return conn_open(fds[0], g_data.connections);
+}
+
+static void send_cmd(int fd, const vector<string> &args) {
+  string req = "*" + to_string(args.size()) + "\r\n";
+  for (const string &arg : args) {
+    req += "$" + to_string(arg.size()) + "\r\n" + arg + "\r\n";
+  }
+  ssize_t rv = write(fd, req.data(), req.size());
+  assert(rv == (ssize_t)req.size());
+}
+
+static string recv_all(int fd) {
+  string out;
+  char buf[4096];
+  ssize_t rv;
+  while ((rv = recv(fd, buf, sizeof(buf), MSG_DONTWAIT)) > 0) {
+    out.append(buf, (size_t)rv);
+  }
+  return out;
+}
+
+static string call(Connection *con, int fd, const vector<string> &args) {
+  send_cmd(fd, args);
+  conn_poll_event(con);
+  return recv_all(fd);
+}
+
+// runs the parts of the event loop a migration needs until `until` holds,
+// for at most 10 s
+static void run_loop(bool (*until)()) {
+  uint64_t stop = get_monotonic_usec() + 10 * 1000 * 1000;
+  while (!until()) {
+    assert(get_monotonic_usec() < stop);
+    struct pollfd pfd = {g_data.bg_fd, POLLIN, 0};
+    if (poll(&pfd, 1, 10) > 0) {
+      bg_complete();
+    }
+    poll_resume();
+    cluster_cron();
+  }
+}
+
+static bool migration_waiting() {
+  return g_data.migration && g_data.migration->state == MIG_WAITING;
+}
+
+// and the nodes were told
+static bool migration_done() {
+  return g_data.migration == NULL && g_data.bg_jobs == 0;
+}
+
+static bool streaming() {
+  return g_data.migration && g_data.migration->state == MIG_STREAMING;
+}
+
+// Before a key has moved, a failure stops the migration and the target is
+// told to forget the slots.
+static void test_stop() {
+  FakeNode node;
+  node.restores_ok = 0;
+  fake_start(&node);
+
+  int fd = -1;
+  Connection *con = open_pair(&fd);
+  for (int i = 0; i < 10; i++) {
+    assert(call(con, fd, {"set", "s" + to_string(i), "v"}) == "+OK\r\n");
+  }
+  assert(call(con, fd, {"cluster", "migrate", "0-16383", node.addr}) == "");
+  run_loop(&migration_done);
+  assert(recv_all(fd) == "+OK\r\n");
+  assert(fake_count(&node, {"cluster", "setslot", "0-16383", "stable"}) == 1);
+  assert(g_data.migrating[0] == k_no_node);
+  assert(g_data.cluster.owner[0] == g_data.cluster_self);
+  for (int i = 0; i < 10; i++) {
+    string key = "s" + to_string(i);
+    assert(call(con, fd, {"get", key}) == "$1\r\nv\r\n");
+    assert(call(con, fd, {"del", key}) == ":1\r\n");
+  }
+
+  conn_done(con);
+  close(fd);
+  shutdown(node.lfd, SHUT_RDWR);
+  pthread_join(node.thread, NULL);
+  close(node.lfd);
+}
+
+// A connection lost after keys have moved leaves the slots migrating: the
+// moved keys are asked of the target, the others are still served here,
+// and the migration goes on once the target is back. Losing it again on
+// the assignment of the slots sends that again.
+static void test_resume() {
+  FakeNode node;
+  node.restores_ok = 150; // into the second batch
+  node.drop_assign = true;
+  fake_start(&node);
+
+  int fd = -1;
+  Connection *con = open_pair(&fd);
+  const size_t nkeys = 250;
+  for (size_t i = 0; i < nkeys; i++) {
+    assert(call(con, fd, {"set", "k" + to_string(i), "v"}) == "+OK\r\n");
+  }
+  assert(call(con, fd, {"cluster", "migrate", "0-16383", node.addr}) == "");
+  run_loop(&streaming);
+  assert(recv_all(fd) == "+OK\r\n");
+  run_loop(&migration_waiting);
+
+  // nothing tells the target to give up the slots
+  assert(fake_count(&node, {"cluster", "setslot", "0-16383", "stable"}) == 0);
+  uint16_t target = slotmap_node(&g_data.cluster, node.addr);
+  assert(g_data.migrating[0] == target && g_data.migrating[16383] == target);
+  size_t moved = 0;
+  string kept;
+  for (size_t i = 0; i < nkeys; i++) {
+    string key = "k" + to_string(i);
+    string reply = call(con, fd, {"get", key});
+    if (entry_find(key)) {
+      assert(reply == "$1\r\nv\r\n");
+      if (g_data.migration->held.count(key)) {
+        kept = key;
+      }
+    } else {
+      assert(reply.compare(0, 5, "-ASK ") == 0);
+      moved++;
+    }
+  }
+  assert(moved == g_data.migration->keys && moved >= k_migrate_batch);
+  // one sent with the failed batch, deleted here meanwhile
+  assert(!kept.empty());
+  assert(call(con, fd, {"del", kept}) == ":1\r\n");
+
+  run_loop(&migration_done);
+  assert(g_data.cluster.owner[0] == target);
+  assert(g_data.cluster.owner[16383] == target);
+  assert(g_data.migrating[0] == k_no_node);
+  assert(hm_size(&g_data.db) == 0);
+  assert(fake_count(&node, {"cluster", "setslot", "0-16383", "stable"}) == 0);
+  // imported again on reconnecting, but not once the slots were assigned
+  assert(fake_count(&node, {"cluster", "setslot", "0-16383", "importing"}) ==
+         2);
+  assert(fake_count(&node, {"cluster", "setslot", "0-16383", "node"}) == 2);
+  assert(fake_count(&node, {"del", kept}) == 1);
+  for (size_t i = 0; i < nkeys; i++) {
+    string key = "k" + to_string(i);
+    assert(key == kept || fake_count(&node, {"restore", key}) >= 1);
+  }
+
+  conn_done(con);
+  close(fd);
+  shutdown(node.lfd, SHUT_RDWR);
+  pthread_join(node.thread, NULL);
+  close(node.lfd);
+}
+
+int main() {
+  dlist_init(&g_data.idle_list);
+  dlist_init(&g_data.tracking_order);
+  g_config.cluster_enabled = true;
+  thread_pool_init(&g_data.tp, 2);
+  bg_init();
+  cluster_init();
+  test_stop();
+  test_resume();
+  return 0;
+}
@@ -0,0 +1,316 @@
+// Event-loop handling of connections, driven over socket pairs.
+#include "functions.hpp"
+#include <assert.h>
+#include <sys/socket.h>
+
+// a server-side connection and the client end of its socket
+static Connection *open_pair(int *client) {
+  int fds[2];
+  int rv = socketpair(AF_UNIX, SOCK_STREAM, 0, fds);
+  assert(rv == 0);
+  fd_set_nb(fds[0]);
+  *client = fds[1];
+  return conn_open(fds[0], g_data.connections);
+}
+
+static void send_cmd(int fd, const vector<string> &args) {
+  string req = "*" + to_string(args.size()) + "\r\n";
+  for (const string &arg : args) {
+    req += "$" + to_string(arg.size()) + "\r\n" + arg + "\r\n";
+  }
+  ssize_t rv = write(fd, req.data(), req.size());
+  assert(rv == (ssize_t)req.size());
+}
+
+static string recv_all(int fd) {
+  string out;
+  char buf[4096];
+  ssize_t rv;
+  while ((rv = recv(fd, buf, sizeof(buf), MSG_DONTWAIT)) > 0) {
+    out.append(buf, (size_t)rv);
+  }
+  return out;
+}
+
+// A PUBLISH pushes a subscriber over its output limit while the subscriber
+// has a request waiting in the same poll round, to be handled after the
+// publisher. The subscriber is closed without running it.
+static void test_closed_by_publish() {
+  int sub_fd = -1, pub_fd = -1;
+  Connection *sub = open_pair(&sub_fd);
+  Connection *pub = open_pair(&pub_fd);
+  int sub_srv = sub->fd;
+  send_cmd(sub_fd, {"subscribe", "ch"});
+  conn_poll_event(sub);
+  assert(recv_all(sub_fd).find("subscribe") != string::npos);
+  assert(config_set("client-output-buffer-limit", "pubsub 100 0 0"));
+
+  send_cmd(pub_fd, {"publish", "ch", string(500, 'x')});
+  send_cmd(sub_fd, {"ping"});
+  conn_poll_event(pub);
+  assert(sub->state == END);
+  assert(recv_all(pub_fd) == ":1\r\n");
+  conn_poll_event(sub);
+  assert(g_data.connections[sub_srv] == NULL);
+  assert(g_data.output_limit_disconnects == 1);
+  // the server closed its end, dropping the unread PING
+  char c;
+  ssize_t n = recv(sub_fd, &c, 1, 0);
+  assert(n == 0 || (n < 0 && errno == ECONNRESET));
+  close(sub_fd);
+
+  // the publisher goes on
+  send_cmd(pub_fd, {"publish", "ch", "y"});
+  conn_poll_event(pub);
+  assert(recv_all(pub_fd) == ":0\r\n");
+  conn_done(pub);
+  close(pub_fd);
+}
+
+// sends a request and handles it like a poll event
+static string call(Connection *con, int fd, const vector<string> &args) {
+  send_cmd(fd, args);
+  conn_poll_event(con);
+  return recv_all(fd);
+}
+
+// BZPOPMIN waiters are served in the order they blocked, each taking one
+// member, when a write on another connection adds members.
+static void test_bzpop_fifo() {
+  int a_fd = -1, b_fd = -1, w_fd = -1;
+  Connection *a = open_pair(&a_fd);
+  Connection *b = open_pair(&b_fd);
+  Connection *w = open_pair(&w_fd);
+  assert(call(a, a_fd, {"bzpopmin", "other", "q", "0"}) == "");
+  assert(call(b, b_fd, {"bzpopmin", "q", "0"}) == "");
+  assert(a->blocked && b->blocked && g_data.blocked_clients == 2);
+
+  assert(call(w, w_fd, {"zadd", "q", "3", "c"}) == "+OK\r\n");
+  assert(!a->blocked && b->blocked && g_data.blocked_clients == 1);
+  poll_resume();
+  assert(recv_all(a_fd) == "*3\r\n$1\r\nq\r\n$1\r\nc\r\n$1\r\n3\r\n");
+  assert(recv_all(b_fd) == "");
+
+  // members added by EXEC are handed out once it is done
+  assert(call(w, w_fd, {"multi"}) == "+OK\r\n");
+  assert(call(w, w_fd, {"zadd", "q", "2", "b"}) == "+QUEUED\r\n");
+  assert(call(w, w_fd, {"zadd", "q", "1", "a"}) == "+QUEUED\r\n");
+  assert(call(w, w_fd, {"exec"}) == "*2\r\n+OK\r\n+OK\r\n");
+  assert(!b->blocked && g_data.blocked_clients == 0);
+  poll_resume();
+  assert(recv_all(b_fd) == "*3\r\n$1\r\nq\r\n$1\r\na\r\n$1\r\n1\r\n");
+  assert(g_data.bzpop_waiters.empty());
+
+  // with members present it does not block
+  assert(call(a, a_fd, {"bzpopmax", "q", "0"}) ==
+         "*3\r\n$1\r\nq\r\n$1\r\nb\r\n$1\r\n2\r\n");
+  conn_done(a);
+  conn_done(b);
+  conn_done(w);
+  close(a_fd);
+  close(b_fd);
+  close(w_fd);
+}
+
+// A timed out wait gets a null array on RESP2 and a null on RESP3.
+static void test_bzpop_timeout() {
+  int a_fd = -1, b_fd = -1;
+  Connection *a = open_pair(&a_fd);
+  Connection *b = open_pair(&b_fd);
+  assert(call(b, b_fd, {"hello", "3"}).find("proto") != string::npos);
+  assert(call(a, a_fd, {"bzpopmin", "t", "0.01"}) == "");
+  assert(call(b, b_fd, {"bzpopmax", "t", "0.01"}) == "");
+  assert(g_data.bzpop_heap.size() == 2);
+  usleep(20 * 1000);
+  bzpop_expire();
+  poll_resume();
+  assert(g_data.bzpop_heap.empty() && g_data.blocked_clients == 0);
+  assert(recv_all(a_fd) == "*-1\r\n");
+  assert(recv_all(b_fd) == "_\r\n");
+  // the connections take requests again
+  assert(call(a, a_fd, {"ping"}) == "+PONG\r\n");
+  conn_done(a);
+  conn_done(b);
+  close(a_fd);
+  close(b_fd);
+}
+
+// Inside EXEC nothing blocks, an empty key gives nil right away.
+static void test_bzpop_exec() {
+  int fd = -1;
+  Connection *con = open_pair(&fd);
+  assert(call(con, fd, {"multi"}) == "+OK\r\n");
+  assert(call(con, fd, {"bzpopmin", "e", "0"}) == "+QUEUED\r\n");
+  assert(call(con, fd, {"exec"}) == "*1\r\n*-1\r\n");
+  assert(!con->blocked && g_data.blocked_clients == 0);
+  assert(g_data.bzpop_waiters.empty());
+  conn_done(con);
+  close(fd);
+}
+
+// A blocked client that hung up is closed on its poll event, before a
+// write could hand it a member.
+static void test_bzpop_hangup() {
+  int a_fd = -1, w_fd = -1;
+  Connection *a = open_pair(&a_fd);
+  Connection *w = open_pair(&w_fd);
+  int a_srv = a->fd;
+  assert(call(a, a_fd, {"bzpopmin", "h", "0"}) == "");
+  close(a_fd);
+  // what the loop does on POLLRDHUP
+  conn_poll_event(a);
+  assert(g_data.connections[a_srv] == NULL);
+  assert(g_data.blocked_clients == 0 && g_data.bzpop_waiters.empty());
+  assert(call(w, w_fd, {"zadd", "h", "1", "m"}) == "+OK\r\n");
+  assert(call(w, w_fd, {"zscore", "h", "m"}).find("1") != string::npos);
+  conn_done(w);
+  close(w_fd);
+}
+
+// a RESP3 invalidation push for one key
+static string invalidate_push(const string &key) {
+  return ">2\r\n$10\r\ninvalidate\r\n*1\r\n$" + to_string(key.size()) +
+         "\r\n" + key + "\r\n";
+}
+
+// a connection on RESP3 with tracking turned on with `opts`
+static Connection *open_tracking(int *fd, const vector<string> &opts) {
+  Connection *con = open_pair(fd);
+  assert(call(con, *fd, {"hello", "3"}).find("proto") != string::npos);
+  vector<string> cmd = {"client", "tracking", "on"};
+  cmd.insert(cmd.end(), opts.begin(), opts.end());
+  assert(call(con, *fd, cmd) == "+OK\r\n");
+  return con;
+}
+
+// A key read by a tracking connection is invalidated once by a write from
+// another connection, then forgotten until it is read again. A RESP2
+// connection gets the invalidations on the channel of its redirect target.
+static void test_tracking_invalidate() {
+  int r_fd = -1, w_fd = -1, s_fd = -1, t_fd = -1;
+  Connection *r = open_tracking(&r_fd, {});
+  Connection *w = open_pair(&w_fd);
+  assert(call(r, r_fd, {"get", "k"}) == "_\r\n");
+  assert(call(w, w_fd, {"set", "k", "1"}) == "+OK\r\n");
+  poll_resume();
+  assert(recv_all(r_fd) == invalidate_push("k"));
+  assert(call(w, w_fd, {"set", "k", "2"}) == "+OK\r\n");
+  poll_resume();
+  assert(recv_all(r_fd) == "");
+  assert(call(r, r_fd, {"get", "k"}) == "$1\r\n2\r\n");
+  assert(call(w, w_fd, {"del", "k"}) == ":1\r\n");
+  poll_resume();
+  assert(recv_all(r_fd) == invalidate_push("k"));
+
+  Connection *s = open_pair(&s_fd);
+  Connection *t = open_pair(&t_fd);
+  string id = call(s, s_fd, {"client", "id"});
+  id = id.substr(1, id.size() - 3); // ":<id>\r\n"
+  assert(call(s, s_fd, {"subscribe", "__redis__:invalidate"})
+             .find("subscribe") != string::npos);
+  assert(call(t, t_fd, {"client", "tracking", "on", "redirect", id}) ==
+         "+OK\r\n");
+  assert(call(t, t_fd, {"get", "k2"}) == "$-1\r\n");
+  assert(call(w, w_fd, {"set", "k2", "v"}) == "+OK\r\n");
+  poll_resume();
+  assert(recv_all(s_fd) ==
+         "*3\r\n$7\r\nmessage\r\n$20\r\n__redis__:invalidate\r\n"
+         "*1\r\n$2\r\nk2\r\n");
+  assert(recv_all(t_fd) == "");
+  for (Connection *con : {r, w, s, t}) {
+    conn_done(con);
+  }
+  for (int fd : {r_fd, w_fd, s_fd, t_fd}) {
+    close(fd);
+  }
+}
+
+// NOLOOP leaves out the connection's own writes.
+static void test_tracking_noloop() {
+  int n_fd = -1, l_fd = -1, w_fd = -1;
+  Connection *n = open_tracking(&n_fd, {"noloop"});
+  Connection *l = open_tracking(&l_fd, {});
+  Connection *w = open_pair(&w_fd);
+  assert(call(w, w_fd, {"set", "k", "2"}) == "+OK\r\n");
+  assert(call(n, n_fd, {"get", "k"}) == "$1\r\n2\r\n");
+  assert(call(l, l_fd, {"get", "k"}) == "$1\r\n2\r\n");
+  // without NOLOOP the push goes out with the reply to the write
+  assert(call(l, l_fd, {"set", "k", "3"}) == invalidate_push("k") + "+OK\r\n");
+  assert(recv_all(n_fd) == "");
+  poll_resume();
+  assert(recv_all(n_fd) == invalidate_push("k"));
+
+  assert(call(n, n_fd, {"get", "k"}) == "$1\r\n3\r\n");
+  assert(call(n, n_fd, {"set", "k", "4"}) == "+OK\r\n");
+  poll_resume();
+  assert(recv_all(n_fd) == "");
+  assert(call(n, n_fd, {"get", "k"}) == "$1\r\n4\r\n");
+  assert(call(w, w_fd, {"set", "k", "5"}) == "+OK\r\n");
+  poll_resume();
+  assert(recv_all(n_fd) == invalidate_push("k"));
+  for (Connection *con : {n, l, w}) {
+    conn_done(con);
+  }
+  for (int fd : {n_fd, l_fd, w_fd}) {
+    close(fd);
+  }
+}
+
+// BCAST announces every write to a key under one of the prefixes, read
+// or not, and records nothing per key.
+static void test_tracking_bcast() {
+  int b_fd = -1, w_fd = -1;
+  Connection *b = open_tracking(&b_fd, {"bcast", "prefix", "user:",
+                                        "prefix", "job:"});
+  Connection *w = open_pair(&w_fd);
+  size_t tracked = hm_size(&g_data.tracking);
+  assert(call(b, b_fd, {"get", "user:1"}) == "_\r\n");
+  assert(hm_size(&g_data.tracking) == tracked);
+  assert(call(w, w_fd, {"set", "user:1", "a"}) == "+OK\r\n");
+  assert(call(w, w_fd, {"set", "user:1", "b"}) == "+OK\r\n");
+  assert(call(w, w_fd, {"set", "job:7", "c"}) == "+OK\r\n");
+  assert(call(w, w_fd, {"set", "user", "d"}) == "+OK\r\n");
+  assert(call(w, w_fd, {"set", "other:1", "e"}) == "+OK\r\n");
+  poll_resume();
+  assert(recv_all(b_fd) == invalidate_push("user:1") +
+                               invalidate_push("user:1") +
+                               invalidate_push("job:7"));
+  conn_done(b);
+  conn_done(w);
+  close(b_fd);
+  close(w_fd);
+}
+
+// Over tracking-table-max-keys, the key read least recently is dropped
+// and invalidated for its readers.
+static void test_tracking_evict() {
+  int r_fd = -1;
+  Connection *r = open_tracking(&r_fd, {});
+  assert(hm_size(&g_data.tracking) == 0);
+  assert(config_set("tracking-table-max-keys", "2"));
+  uint64_t evicted = g_data.tracking_evicted_keys;
+  assert(call(r, r_fd, {"get", "e1"}) == "_\r\n");
+  assert(call(r, r_fd, {"get", "e2"}) == "_\r\n");
+  assert(call(r, r_fd, {"get", "e1"}) == "_\r\n"); // e2 is now the oldest
+  assert(call(r, r_fd, {"get", "e3"}) == invalidate_push("e2") + "_\r\n");
+  assert(hm_size(&g_data.tracking) == 2);
+  assert(g_data.tracking_evicted_keys == evicted + 1);
+  assert(config_set("tracking-table-max-keys", "1000000"));
+  conn_done(r);
+  close(r_fd);
+}
+
+int main() {
+  dlist_init(&g_data.idle_list);
+  dlist_init(&g_data.tracking_order);
+  test_closed_by_publish();
+  test_bzpop_fifo();
+  test_bzpop_timeout();
+  test_bzpop_exec();
+  test_bzpop_hangup();
+  test_tracking_invalidate();
+  test_tracking_noloop();
+  test_tracking_bcast();
+  test_tracking_evict();
+  return 0;
+}
@@ -0,0 +1,83 @@
+#include "qlist.cpp"
+#include "rng.h"
+#include <assert.h>
+#include <deque>
+
+// mostly short elements, some past a varint byte, a few larger than a chunk
+static string make_elem(uint64_t i) {
+  uint64_t r = rnd() % 100;
+  size_t len = r < 90 ? rnd() % 20 : r < 99 ? 100 + rnd() % 300
+                                            : k_qnode_bytes + rnd() % 100;
+  string s = to_string(i);
+  s.resize(len, (char)('a' + i % 26));
+  return s;
+}
+
+static void verify(QList *ql, const deque<string> &ref) {
+  assert(ql_size(ql) == ref.size());
+  size_t count = 0;
+  for (Dlist *d = ql->chunks.next; d != &ql->chunks; d = d->next) {
+    QNode *node = container_of(d, QNode, link);
+    assert(node->count > 0);
+    assert(node->head <= node->tail && node->tail <= node->cap);
+    count += node->count;
+  }
+  assert(count == ref.size());
+
+  QIter it;
+  if (ref.empty()) {
+    assert(!ql_seek(ql, 0, &it));
+    return;
+  }
+  // a full walk, and a few seeks from each end
+  assert(ql_seek(ql, 0, &it));
+  const char *data = NULL;
+  size_t len = 0;
+  for (const string &s : ref) {
+    assert(ql_next(ql, &it, &data, &len));
+    assert(string(data, len) == s);
+  }
+  assert(!ql_next(ql, &it, &data, &len));
+  for (int i = 0; i < 8; i++) {
+    size_t idx = rnd() % ref.size();
+    assert(ql_seek(ql, idx, &it));
+    assert(ql_next(ql, &it, &data, &len));
+    assert(string(data, len) == ref[idx]);
+  }
+  assert(!ql_seek(ql, ref.size(), &it));
+}
+
+static void test_ops(size_t nops, uint32_t push_pct) {
+  QList ql;
+  ql_init(&ql);
+  deque<string> ref;
+  for (size_t i = 0; i < nops; i++) {
+    bool front = rnd() & 1;
+    if (rnd() % 100 < push_pct) {
+      string s = make_elem(i);
+      ql_push(&ql, front, s.data(), s.size());
+      front ? ref.push_front(s) : ref.push_back(s);
+    } else {
+      string out;
+      bool ok = ql_pop(&ql, front, out);
+      assert(ok == !ref.empty());
+      if (ok) {
+        assert(out == (front ? ref.front() : ref.back()));
+        front ? ref.pop_front() : ref.pop_back();
+      }
+    }
+    if (i % 97 == 0) {
+      verify(&ql, ref);
+    }
+  }
+  verify(&ql, ref);
+  ql_dispose(&ql);
+  assert(ql.nchunks == 0 && ql.mem == 0);
+}
+
+int main() {
+  test_ops(20000, 70); // growing
+  test_ops(20000, 50); // steady
+  test_ops(20000, 30); // mostly empty
+  return 0;
+}
@@ -0,0 +1,96 @@
+#include "sobj.h"
+#include "rng.h"
+#include <algorithm>
+#include <assert.h>
+#include <set>
+
+static vector<int64_t> make_ints(size_t n, uint64_t range) {
+  set<int64_t> vals;
+  while (vals.size() < n) {
+    vals.insert((int64_t)(rnd() % range) - (int64_t)(range / 2));
+  }
+  return vector<int64_t>(vals.begin(), vals.end());
+}
+
+static void test_intersect(size_t na, size_t nb, uint64_t range) {
+  vector<int64_t> a = make_ints(na, range);
+  vector<int64_t> b = make_ints(nb, range);
+  vector<int64_t> want;
+  set_intersection(a.begin(), a.end(), b.begin(), b.end(),
+                   back_inserter(want));
+
+  typedef size_t (*Kernel)(const int64_t *, size_t, const int64_t *, size_t,
+                           int64_t *);
+  Kernel kernels[] = {&intersect_scalar, &intersect_gallop, &intersect_avx2,
+                      &intset_intersect};
+  for (Kernel fn : kernels) {
+    vector<int64_t> out(min(na, nb));
+    out.resize(fn(a.data(), na, b.data(), nb, out.data()));
+    assert(out == want);
+    out.assign(min(na, nb), 0);
+    out.resize(fn(b.data(), nb, a.data(), na, out.data()));
+    assert(out == want);
+  }
+}
+
+static void test_member_int() {
+  int64_t v = 0;
+  assert(str2member_int("0", 1, &v) && v == 0);
+  assert(str2member_int("-12", 3, &v) && v == -12);
+  assert(str2member_int("9223372036854775807", 19, &v) && v == INT64_MAX);
+  assert(str2member_int("-9223372036854775808", 20, &v) && v == INT64_MIN);
+  assert(!str2member_int("9223372036854775808", 19, &v));
+  assert(!str2member_int("007", 3, &v));
+  assert(!str2member_int("-0", 2, &v));
+  assert(!str2member_int("+1", 2, &v));
+  assert(!str2member_int("-", 1, &v));
+  assert(!str2member_int("1a", 2, &v));
+  assert(!str2member_int("", 0, &v));
+}
+
+static void collect(const char *name, size_t len, void *arg) {
+  ((set<string> *)arg)->insert(string(name, len));
+}
+
+static void test_sobj(uint32_t max_intset) {
+  SObj s;
+  set<string> ref;
+  for (int i = 0; i < 5000; i++) {
+    uint64_t r = rnd() % 100;
+    string m = to_string((int64_t)(rnd() % 2000) - 1000);
+    if (r == 0) {
+      m = "0" + m; // not canonical, a string member
+    }
+    if (r < 60) {
+      string batch[3] = {m, to_string(rnd() % 500), m};
+      size_t added = sobj_add(&s, batch, 3, max_intset);
+      size_t before = ref.size();
+      ref.insert(batch, batch + 3);
+      assert(added == ref.size() - before);
+    } else if (r < 80) {
+      assert(sobj_del(&s, m.data(), m.size()) == (ref.erase(m) == 1));
+    } else {
+      assert(sobj_has(&s, m.data(), m.size()) == (ref.count(m) == 1));
+    }
+    assert(sobj_size(&s) == ref.size());
+  }
+  set<string> got;
+  sobj_scan(&s, &collect, &got);
+  assert(got == ref);
+  sobj_dispose(&s);
+}
+
+int main() {
+  test_member_int();
+  size_t sizes[] = {0, 1, 3, 4, 5, 17, 100, 1000, 40000};
+  for (size_t na : sizes) {
+    for (size_t nb : sizes) {
+      test_intersect(na, nb, 4 * max(na, nb) + 8);
+    }
+  }
+  test_intersect(1000, 100000, 1000000); // skewed, gallops
+  test_intersect(50000, 50000, 60000);   // dense
+  test_sobj(1 << 20); // stays an intset until a string member arrives
+  test_sobj(64);      // converted by size
+  return 0;
+}
@@ -0,0 +1,47 @@
+#include "Zset.h"
+#include "rng.h"
+#include <assert.h>
+#include <set>
+
+static string name_of(ZNode *node) { return string(node->name, node->len); }
+
+// zset_min and zset_max against an ordered set of (score, name)
+static void test_min_max() {
+  ZSet zs;
+  assert(!zset_min(&zs) && !zset_max(&zs));
+  set<pair<double, string>> ref;
+  for (int i = 0; i < 20000; i++) {
+    uint64_t r = rnd() % 100;
+    string name = "m" + to_string(rnd() % 500);
+    ZNode *node = zset_lookup(&zs, name.data(), name.size());
+    if (r < 60) {
+      // few distinct scores, so that ties are ordered by name
+      double score = (double)(rnd() % 20) - 10;
+      if (node) {
+        ref.erase({node->score, name});
+      }
+      zset_add(&zs, name.data(), name.size(), score);
+      ref.insert({score, name});
+    } else if (node) {
+      ref.erase({node->score, name});
+      znode_del(zset_pop(&zs, &name[0], name.size()));
+    }
+    ZNode *lo = zset_min(&zs);
+    ZNode *hi = zset_max(&zs);
+    if (ref.empty()) {
+      assert(!lo && !hi);
+      continue;
+    }
+    assert(lo && lo->score == ref.begin()->first &&
+           name_of(lo) == ref.begin()->second);
+    assert(hi && hi->score == ref.rbegin()->first &&
+           name_of(hi) == ref.rbegin()->second);
+    assert(!znode_offset(lo, -1) && !znode_offset(hi, 1));
+  }
+  zset_dispose(&zs);
+}
+
+int main() {
+  test_min_max();
+  return 0;
+}
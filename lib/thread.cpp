@@ -1,4 +1,6 @@
 #include "thread.h"
+#include <algorithm>
+#include <atomic>
 #include <cassert>
 #include <cstddef>
 #include <deque>
@@ -34,6 +36,79 @@ void thread_pool_init(ThreadPool *tp, size_t num_threads) {
   }
 }
 
+// A thread_pool_run call. Freed by the last of its threads, which may be a
+// worker that started after all the work was done.
+struct PoolRun {
+  void (*f)(void *, size_t) = NULL;
+  void *arg = NULL;
+  size_t n = 0;
+  std::atomic<size_t> next{0};
+  // under mutex
+  size_t done = 0;
+  size_t refs = 0;
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+};
+
+static void pool_run_calls(PoolRun *run) {
+  size_t ndone = 0;
+  for (size_t i = run->next++; i < run->n; i = run->next++) {
+    run->f(run->arg, i);
+    ndone++;
+  }
+  pthread_mutex_lock(&run->mutex);
+  run->done += ndone;
+  if (run->done == run->n) {
+    pthread_cond_broadcast(&run->cond);
+  }
+  pthread_mutex_unlock(&run->mutex);
+}
+
+static void pool_run_release(PoolRun *run) {
+  pthread_mutex_lock(&run->mutex);
+  bool last = --run->refs == 0;
+  pthread_mutex_unlock(&run->mutex);
+  if (last) {
+    pthread_mutex_destroy(&run->mutex);
+    pthread_cond_destroy(&run->cond);
+    delete run;
+  }
+}
+
+static void pool_run_worker(void *arg) {
+  PoolRun *run = (PoolRun *)arg;
+  pool_run_calls(run);
+  pool_run_release(run);
+}
+
+void thread_pool_run(ThreadPool *tp, void (*f)(void *, size_t), void *arg,
+                     size_t n) {
+  size_t helpers = n > 1 ? std::min(n - 1, tp->threads.size()) : 0;
+  if (helpers == 0) {
+    for (size_t i = 0; i < n; i++) {
+      f(arg, i);
+    }
+    return;
+  }
+  PoolRun *run = new PoolRun();
+  run->f = f;
+  run->arg = arg;
+  run->n = n;
+  run->refs = helpers + 1;
+  pthread_mutex_init(&run->mutex, NULL);
+  pthread_cond_init(&run->cond, NULL);
+  for (size_t i = 0; i < helpers; i++) {
+    thread_pool_queue(tp, &pool_run_worker, run);
+  }
+  pool_run_calls(run);
+  pthread_mutex_lock(&run->mutex);
+  while (run->done < run->n) {
+    pthread_cond_wait(&run->cond, &run->mutex);
+  }
+  pthread_mutex_unlock(&run->mutex);
+  pool_run_release(run);
+}
+
 void thread_pool_queue(ThreadPool *tp, void (*f)(void *), void *arg) {
     Work w;
     w.f = f;
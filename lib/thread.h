@@ -16,3 +16,8 @@ struct ThreadPool {
 
 void thread_pool_init(ThreadPool *tp, size_t num_threads);
 void thread_pool_queue(ThreadPool *tp, void (*f)(void *), void *arg);
+// Calls f(arg, i) for every i < n on the calling thread and the pool's
+// threads, and returns once all calls returned. The caller takes the calls
+// that no worker started, so a busy pool costs parallelism, not waiting.
+void thread_pool_run(ThreadPool *tp, void (*f)(void *, size_t), void *arg,
+                     size_t n);
@@ -0,0 +1,194 @@
+#include "uring.h"
+#include <errno.h>
+#include <signal.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+static int sys_setup(unsigned entries, io_uring_params *p) {
+  return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_enter(int fd, unsigned to_submit, unsigned min_complete,
+                     unsigned flags, void *arg, size_t argsz) {
+  return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags,
+                      arg, argsz);
+}
+
+static int sys_register(int fd, unsigned opcode, void *arg, unsigned nr) {
+  return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr);
+}
+
+int uring_init(Uring *r, unsigned entries, uint32_t flags) {
+  io_uring_params p;
+  memset(&p, 0, sizeof(p));
+  p.flags = flags;
+  int fd = sys_setup(entries, &p);
+  if (fd < 0) {
+    return -errno;
+  }
+  // timeouts are passed to io_uring_enter, which needs 5.11+
+  if (!(p.features & IORING_FEAT_EXT_ARG) ||
+      !(p.features & IORING_FEAT_SINGLE_MMAP)) {
+    close(fd);
+    return -EOPNOTSUPP;
+  }
+  r->fd = fd;
+  r->features = p.features;
+
+  size_t sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  size_t cq_len = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+  r->ring_len = sq_len > cq_len ? sq_len : cq_len;
+  r->ring = mmap(NULL, r->ring_len, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+  if (r->ring == MAP_FAILED) {
+    int err = -errno;
+    close(fd);
+    r->fd = -1;
+    return err;
+  }
+  r->sqes_len = p.sq_entries * sizeof(io_uring_sqe);
+  r->sqes = (io_uring_sqe *)mmap(NULL, r->sqes_len, PROT_READ | PROT_WRITE,
+                                 MAP_SHARED | MAP_POPULATE, fd,
+                                 IORING_OFF_SQES);
+  if (r->sqes == MAP_FAILED) {
+    int err = -errno;
+    munmap(r->ring, r->ring_len);
+    close(fd);
+    r->fd = -1;
+    return err;
+  }
+
+  uint8_t *sq = (uint8_t *)r->ring;
+  r->sq_head = (unsigned *)(sq + p.sq_off.head);
+  r->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+  r->sq_mask = *(unsigned *)(sq + p.sq_off.ring_mask);
+  r->sq_entries = *(unsigned *)(sq + p.sq_off.ring_entries);
+  r->sq_array = (unsigned *)(sq + p.sq_off.array);
+  // sqes are used in ring order, so the indirection array is the identity
+  for (unsigned i = 0; i < r->sq_entries; i++) {
+    r->sq_array[i] = i;
+  }
+
+  uint8_t *cq = (uint8_t *)r->ring;
+  r->cq_head = (unsigned *)(cq + p.cq_off.head);
+  r->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+  r->cq_mask = *(unsigned *)(cq + p.cq_off.ring_mask);
+  r->cqes = (io_uring_cqe *)(cq + p.cq_off.cqes);
+  return 0;
+}
+
+void uring_exit(Uring *r) {
+  if (r->fd < 0) {
+    return;
+  }
+  munmap(r->sqes, r->sqes_len);
+  munmap(r->ring, r->ring_len);
+  close(r->fd);
+  r->fd = -1;
+}
+
+io_uring_sqe *uring_get_sqe(Uring *r) {
+  unsigned head = __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+  unsigned tail = *r->sq_tail + r->sq_pending;
+  if (tail - head >= r->sq_entries) {
+    return NULL;
+  }
+  io_uring_sqe *sqe = &r->sqes[tail & r->sq_mask];
+  memset(sqe, 0, sizeof(*sqe));
+  r->sq_pending++;
+  return sqe;
+}
+
+int uring_submit_and_wait(Uring *r, unsigned wait_nr, int64_t timeout_ms) {
+  if (r->sq_pending) {
+    __atomic_store_n(r->sq_tail, *r->sq_tail + r->sq_pending,
+                     __ATOMIC_RELEASE);
+    r->sq_pending = 0;
+  }
+  // includes sqes left over by an interrupted call
+  unsigned to_submit =
+      *r->sq_tail - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+  unsigned flags = wait_nr ? IORING_ENTER_GETEVENTS : 0;
+  io_uring_getevents_arg arg;
+  memset(&arg, 0, sizeof(arg));
+  struct __kernel_timespec ts = {};
+  if (wait_nr && timeout_ms >= 0) {
+    ts.tv_sec = timeout_ms / 1000;
+    ts.tv_nsec = (timeout_ms % 1000) * 1000000;
+    arg.sigmask_sz = _NSIG / 8;
+    arg.ts = (uint64_t)(uintptr_t)&ts;
+    flags |= IORING_ENTER_EXT_ARG;
+  }
+  bool ext = flags & IORING_ENTER_EXT_ARG;
+  int rv = sys_enter(r->fd, to_submit, wait_nr, flags, ext ? &arg : NULL,
+                     ext ? sizeof(arg) : 0);
+  if (rv < 0) {
+    // a timeout or signal with nothing to submit is not an error
+    return (errno == ETIME || errno == EINTR) ? 0 : -errno;
+  }
+  return rv;
+}
+
+io_uring_cqe *uring_peek_cqe(Uring *r) {
+  unsigned head = *r->cq_head;
+  unsigned tail = __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE);
+  if (head == tail) {
+    return NULL;
+  }
+  return &r->cqes[head & r->cq_mask];
+}
+
+void uring_cqe_seen(Uring *r) {
+  __atomic_store_n(r->cq_head, *r->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+int uring_buf_ring_init(Uring *r, UringBufRing *br, uint16_t bgid,
+                        uint16_t nbufs, uint32_t buf_size) {
+  br->ring_len = nbufs * sizeof(io_uring_buf);
+  void *ring = mmap(NULL, br->ring_len, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (ring == MAP_FAILED) {
+    return -errno;
+  }
+  br->ring = (io_uring_buf_ring *)ring;
+  br->bufs = new uint8_t[(size_t)nbufs * buf_size];
+  br->buf_size = buf_size;
+  br->nbufs = nbufs;
+  br->bgid = bgid;
+
+  io_uring_buf_reg reg;
+  memset(&reg, 0, sizeof(reg));
+  reg.ring_addr = (uint64_t)(uintptr_t)ring;
+  reg.ring_entries = nbufs;
+  reg.bgid = bgid;
+  if (sys_register(r->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+    int err = -errno;
+    munmap(ring, br->ring_len);
+    delete[] br->bufs;
+    br->ring = NULL;
+    br->bufs = NULL;
+    return err;
+  }
+  for (uint16_t bid = 0; bid < nbufs; bid++) {
+    uring_buf_recycle(br, bid);
+  }
+  return 0;
+}
+
+uint8_t *uring_buf(UringBufRing *br, uint16_t bid) {
+  return &br->bufs[(size_t)bid * br->buf_size];
+}
+
+void uring_buf_recycle(UringBufRing *br, uint16_t bid) {
+  // only this thread moves the tail, the kernel moves the head
+  uint16_t tail = br->ring->tail;
+  // not ring->bufs: in C++ the header's flexible array sits 8 bytes late
+  io_uring_buf *buf = (io_uring_buf *)br->ring + (tail & (br->nbufs - 1));
+  buf->addr = (uint64_t)(uintptr_t)uring_buf(br, bid);
+  buf->len = br->buf_size;
+  buf->bid = bid;
+  __atomic_store_n(&br->ring->tail, (uint16_t)(tail + 1), __ATOMIC_RELEASE);
+}
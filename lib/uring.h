@@ -0,0 +1,66 @@
+#pragma once
+
+#include <linux/io_uring.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// A minimal io_uring wrapper on the raw syscalls: the submission and
+// completion rings, and a provided buffer ring for multishot recv.
+
+struct Uring {
+  int fd = -1;
+  uint32_t features = 0;
+
+  // submission ring, shared with the kernel
+  unsigned *sq_head = NULL;
+  unsigned *sq_tail = NULL;
+  unsigned *sq_array = NULL;
+  unsigned sq_mask = 0;
+  unsigned sq_entries = 0;
+  io_uring_sqe *sqes = NULL;
+  // sqes handed out by uring_get_sqe but not yet passed to the kernel
+  unsigned sq_pending = 0;
+
+  // completion ring, shared with the kernel
+  unsigned *cq_head = NULL;
+  unsigned *cq_tail = NULL;
+  unsigned cq_mask = 0;
+  io_uring_cqe *cqes = NULL;
+
+  // both rings share one mapping (IORING_FEAT_SINGLE_MMAP)
+  void *ring = NULL;
+  size_t ring_len = 0;
+  size_t sqes_len = 0;
+};
+
+// buffers the kernel picks from for IOSQE_BUFFER_SELECT reads
+struct UringBufRing {
+  io_uring_buf_ring *ring = NULL;
+  uint8_t *bufs = NULL;
+  uint32_t buf_size = 0;
+  uint16_t nbufs = 0;
+  uint16_t bgid = 0;
+  size_t ring_len = 0;
+};
+
+// returns a negative errno on failure
+int uring_init(Uring *r, unsigned entries, uint32_t flags);
+void uring_exit(Uring *r);
+
+// a zeroed sqe, or NULL when the submission ring is full
+io_uring_sqe *uring_get_sqe(Uring *r);
+// Passes pending sqes to the kernel and waits for at least `wait_nr`
+// completions, or until `timeout_ms` passes (negative waits forever).
+// Returns the number submitted or a negative errno.
+int uring_submit_and_wait(Uring *r, unsigned wait_nr, int64_t timeout_ms);
+
+// the next completion or NULL; release it with uring_cqe_seen
+io_uring_cqe *uring_peek_cqe(Uring *r);
+void uring_cqe_seen(Uring *r);
+
+// nbufs must be a power of two
+int uring_buf_ring_init(Uring *r, UringBufRing *br, uint16_t bgid,
+                        uint16_t nbufs, uint32_t buf_size);
+uint8_t *uring_buf(UringBufRing *br, uint16_t bid);
+// gives a consumed buffer back to the kernel
+void uring_buf_recycle(UringBufRing *br, uint16_t bid);
@@ -1,6 +1,7 @@
 #include "lib/dlist.h"
 #include "lib/functions.hpp"
 #include "lib/structures.hpp"
+#include "lib/uring.h"
 #include "poll.h"
 #include <arpa/inet.h>
 #include <cassert>
@@ -8,49 +9,37 @@
 #include <fcntl.h>
 #include <iostream>
 #include <netinet/ip.h>
+#include <signal.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/poll.h>
 #include <sys/socket.h>
+#include <sys/un.h>
 #include <unistd.h>
 #include <vector>
 using namespace std;
 
+struct Listener {
+  int fd = -1;
+  bool tcp = true;
+};
 
-int main(int argc, char *argv[]) {
-  int fd = socket(AF_INET, SOCK_STREAM, 0);
-  dlist_init(&g_data.idle_list);
-  if (fd < 0) {
-    perror("socket");
-    return 1;
-  }
-  int val = 1;
-  setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &val, sizeof(val));
-  struct sockaddr_in addr;
-  addr.sin_family = AF_INET;
-  addr.sin_port = htons(1800);
-  addr.sin_addr.s_addr = inet_addr("127.0.0.1");
-  if (bind(fd, (const sockaddr *)&addr, sizeof(addr)) < 0) {
-    perror("bind");
-    return 1;
-  }
-
-  if (listen(fd, 10) < 0) {
-    perror("listen");
-    return 1;
-  }
-
-  fd_set_nb(fd);
-
+static void poll_loop(vector<Listener> &listeners) {
   vector<struct pollfd> fds;
 
   while (true) {
     // Poll all the value connections
     fds.clear();
-    struct pollfd listener = {fd, POLLIN, 0};
-    fds.push_back(listener);
+    for (Listener &l : listeners) {
+      struct pollfd listener = {l.fd, POLLIN, 0};
+      fds.push_back(listener);
+    }
+    // then the background job completions
+    struct pollfd bg = {g_data.bg_fd, POLLIN, 0};
+    fds.push_back(bg);
+    size_t first_conn = fds.size();
     for (Connection *c : g_data.connections) {
       if (!c)
         continue;
@@ -58,6 +47,11 @@ int main(int argc, char *argv[]) {
       // Make it a non blocking connection
       conn.fd = c->fd;
       conn.events = (c->state == REQ) ? POLLIN : POLLOUT;
+      if (c->blocked) {
+        // input waits in the socket until the reply is out; a client that
+        // hung up must not be handed a BZPOPMIN member
+        conn.events = POLLRDHUP;
+      }
       conn.events = conn.events | POLLERR;
       fds.push_back(conn);
     }
@@ -65,34 +59,458 @@ int main(int argc, char *argv[]) {
     int rv = poll(fds.data(), (nfds_t)fds.size(), timeout);
 
     if (rv < 0){
-      perror("poll");
+      log_warn("poll: %s", strerror(errno));
     }
+    g_data.now_us = get_monotonic_usec();
+    uint64_t loop_start = clock_ticks();
 
-    for (int  i = 1; i < fds.size(); i++){
+    for (size_t i = first_conn; i < fds.size(); i++){
       if (fds[i].revents){
-        Connection *con = g_data.connections[fds[i].fd];
-        cout << "Handling " << fds[i].fd << endl;
-        //DONE: Implement Connection Handling 
-        //Update the timer in the connection
-        HandleConnection(con);
-        if (con->state == END){
-          // If the connection is about to end 
-          // g_data.connections[con->fd] = nullptr;
-          // close(con->fd);
-          // free(con);
-          conn_done(con);
-        }
+        log_debug("handling %d", fds[i].fd);
+        conn_poll_event(g_data.connections[fds[i].fd]);
       }
     }
+    if (fds[first_conn - 1].revents) {
+      bg_complete();
+    }
+    bzpop_expire();
+    poll_resume();
     process_timers();
+    clients_cron();
+    rehash_cron();
+    cluster_cron();
+    if (g_data.evicting) {
+      perform_evictions();
+    }
     
-    if (fds[0].revents){
-      //DONE: Accept new connection (Accept, Make the struct, push to vector );
-      acceptConnection(fd , g_data.connections);
+    for (size_t i = 0; i < listeners.size(); i++) {
+      if (fds[i].revents) {
+        //DONE: Accept new connection (Accept, Make the struct, push to vector );
+        acceptConnection(listeners[i].fd, listeners[i].tcp, g_data.connections);
+      }
     }
     // cout << "Accepted all g_data.connections" << endl;
+    stats_cron();
+    uint64_t loop_ticks = clock_ticks() - loop_start;
+    hist_record(&g_data.loop_hist, loop_ticks);
+    latency_add_ticks(LAT_EVENTLOOP, loop_ticks);
+
+  }
+}
+
+// io_uring backend: a multishot accept on the listener and a multishot recv
+// per connection draw from one provided buffer ring; replies are queued as
+// sends and everything is submitted by the single io_uring_enter that also
+// waits for the next completions.
+
+enum { UOP_ACCEPT = 1, UOP_RECV = 2, UOP_SEND = 3, UOP_BG = 4 };
+
+const unsigned k_uring_entries = 4096;
+const uint16_t k_uring_nbufs = 1024;
+const uint16_t k_uring_bgid = 0;
+// bytes received beyond what the read buffer holds, per connection
+const size_t k_uring_spill_max = 1 << 20;
+
+static Uring g_ring;
+static UringBufRing g_ring_bufs;
+// indexed by fd, see k_uring_spill_max
+static vector<string> g_ring_spill;
+
+static uint64_t uring_data(uint32_t op, int fd) {
+  return (uint64_t)op << 32 | (uint32_t)fd;
+}
+
+static io_uring_sqe *uring_sqe() {
+  io_uring_sqe *sqe = uring_get_sqe(&g_ring);
+  if (!sqe) {
+    // the submission ring is full, hand it to the kernel early
+    uring_submit_and_wait(&g_ring, 0, 0);
+    sqe = uring_get_sqe(&g_ring);
+  }
+  assert(sqe);
+  return sqe;
+}
+
+static void uring_arm_accept(int fd) {
+  io_uring_sqe *sqe = uring_sqe();
+  sqe->opcode = IORING_OP_ACCEPT;
+  sqe->fd = fd;
+  sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+  sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+  sqe->user_data = uring_data(UOP_ACCEPT, fd);
+}
+
+static void uring_arm_recv(Connection *con) {
+  io_uring_sqe *sqe = uring_sqe();
+  sqe->opcode = IORING_OP_RECV;
+  sqe->fd = con->fd;
+  sqe->ioprio = IORING_RECV_MULTISHOT;
+  sqe->flags = IOSQE_BUFFER_SELECT;
+  sqe->buf_group = k_uring_bgid;
+  sqe->user_data = uring_data(UOP_RECV, con->fd);
+  con->inflight++;
+}
+
+// a multishot poll on the eventfd of background job completions
+static void uring_arm_bg() {
+  io_uring_sqe *sqe = uring_sqe();
+  sqe->opcode = IORING_OP_POLL_ADD;
+  sqe->fd = g_data.bg_fd;
+  sqe->poll32_events = POLLIN;
+  sqe->len = IORING_POLL_ADD_MULTI;
+  sqe->user_data = uring_data(UOP_BG, g_data.bg_fd);
+}
+
+// sends writeBuf, or with queued output, everything up to k_out_iov buffers
+static void uring_send(Connection *con) {
+  io_uring_sqe *sqe = uring_sqe();
+  sqe->fd = con->fd;
+  if (con->outq.empty()) {
+    sqe->opcode = IORING_OP_SEND;
+    sqe->addr = (uint64_t)(uintptr_t)&con->writeBuf[con->write_sent];
+    sqe->len = (uint32_t)(con->write_size - con->write_sent);
+  } else {
+    con->iov.resize(k_out_iov);
+    con->msg = {};
+    con->msg.msg_iov = con->iov.data();
+    con->msg.msg_iovlen = conn_output_iov(con, con->iov.data(), k_out_iov);
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->addr = (uint64_t)(uintptr_t)&con->msg;
+    sqe->len = 1;
+  }
+  sqe->msg_flags = MSG_NOSIGNAL;
+  sqe->user_data = uring_data(UOP_SEND, con->fd);
+  con->inflight++;
+}
+
+// Runs the buffered requests, their replies queued behind the first, and
+// sends them together. Connections are only marked END here; the loop
+// closes them once nothing is in flight.
+static void uring_conn_input(Connection *con) {
+  if (con->state != REQ) {
+    return; // a send is in flight, or the connection is closing
+  }
+  string &spill = g_ring_spill[con->fd];
+  while (con->state != END && !con->blocked &&
+         con->outq_bytes < k_out_batch) {
+    size_t room = sizeof(con->readBuf) - con->read_size;
+    size_t n = min(room, spill.size());
+    memcpy(&con->readBuf[con->read_size], spill.data(), n);
+    spill.erase(0, n);
+    con->read_size += n;
+    while (try_req(con)) {
+    }
+    if (spill.empty()) {
+      break;
+    }
+  }
+  if (con->state == RES) {
+    uring_send(con);
+  }
+}
+
+static void uring_on_recv(Connection *con, int32_t res, uint32_t flags,
+                          vector<Connection *> &rearm) {
+  if (flags & IORING_CQE_F_BUFFER) {
+    uint16_t bid = (uint16_t)(flags >> IORING_CQE_BUFFER_SHIFT);
+    if (res > 0 && con->state != END) {
+      g_data.net_input_bytes += res;
+      string &spill = g_ring_spill[con->fd];
+      const uint8_t *data = uring_buf(&g_ring_bufs, bid);
+      size_t n = 0;
+      if (con->state == REQ && spill.empty()) {
+        n = min((size_t)res, sizeof(con->readBuf) - con->read_size);
+        memcpy(&con->readBuf[con->read_size], data, n);
+        con->read_size += n;
+      }
+      spill.append((const char *)data + n, res - n);
+      if (spill.size() > k_uring_spill_max) {
+        log_verbose("input overflow on connection %d", con->fd);
+        con->state = END;
+      }
+    }
+    uring_buf_recycle(&g_ring_bufs, bid);
+  }
+  bool more = flags & IORING_CQE_F_MORE;
+  if (!more) {
+    con->inflight--;
+  }
+  if (con->state == END) {
+    return;
+  }
+  if (res == 0 || (res < 0 && res != -ENOBUFS)) {
+    if (res < 0) {
+      log_warn("recv: %s", strerror(-res));
+    } else {
+      log_verbose("EOF on connection %d", con->fd);
+    }
+    con->state = END;
+    return;
+  }
+  if (res == -ENOBUFS) {
+    // the buffer ring ran dry; retried once this batch returned them
+    rearm.push_back(con);
+  } else if (!more) {
+    uring_arm_recv(con);
+  }
+  if (res > 0) {
+    conn_touch(con);
+    uring_conn_input(con);
+  }
+}
+
+static void uring_on_send(Connection *con, int32_t res) {
+  con->inflight--;
+  if (con->state == END) {
+    return;
+  }
+  if (res < 0) {
+    log_warn("send: %s", strerror(-res));
+    con->state = END;
+    return;
+  }
+  g_data.net_output_bytes += res;
+  if (!conn_output_sent(con, (size_t)res)) {
+    uring_send(con);
+    return;
+  }
+  uring_conn_input(con);
+}
+
+// Returns false if io_uring is unavailable, before touching any connection.
+static bool uring_loop(vector<Listener> &listeners) {
+  int err = uring_init(&g_ring, k_uring_entries,
+                       IORING_SETUP_SUBMIT_ALL | IORING_SETUP_COOP_TASKRUN);
+  if (err == 0) {
+    err = uring_buf_ring_init(&g_ring, &g_ring_bufs, k_uring_bgid,
+                              k_uring_nbufs, MAX_BUF);
+    if (err) {
+      uring_exit(&g_ring);
+    }
+  }
+  if (err) {
+    log_warn("io_uring unavailable (%s), using poll", strerror(-err));
+    return false;
+  }
+  g_data.io_uring = true;
+  log_info("using io_uring");
+  for (Listener &l : listeners) {
+    uring_arm_accept(l.fd);
+  }
+  if (g_data.bg_fd >= 0) {
+    uring_arm_bg();
+  }
+
+  vector<Connection *> rearm;
+  // freed after the batch, so the pointers in `rearm` stay valid
+  vector<Connection *> closed;
+  while (true) {
+    int rv = uring_submit_and_wait(&g_ring, 1, next_timer_ms());
+    if (rv < 0) {
+      log_warn("io_uring_enter: %s", strerror(-rv));
+    }
+    g_data.now_us = get_monotonic_usec();
+    uint64_t loop_start = clock_ticks();
+
+    io_uring_cqe *cqe = NULL;
+    while ((cqe = uring_peek_cqe(&g_ring))) {
+      uint32_t op = (uint32_t)(cqe->user_data >> 32);
+      int cfd = (int)(uint32_t)cqe->user_data;
+      int32_t res = cqe->res;
+      uint32_t flags = cqe->flags;
+      uring_cqe_seen(&g_ring);
+
+      if (op == UOP_ACCEPT) {
+        if (res >= 0) {
+          if (g_ring_spill.size() <= (size_t)res) {
+            g_ring_spill.resize(res + 1);
+          }
+          if (cfd == listeners[0].fd) {
+            fd_set_nodelay(res);
+          }
+          uring_arm_recv(conn_open(res, g_data.connections));
+        } else {
+          log_warn("accept: %s", strerror(-res));
+        }
+        if (!(flags & IORING_CQE_F_MORE)) {
+          uring_arm_accept(cfd);
+        }
+        continue;
+      }
+      if (op == UOP_BG) {
+        bg_complete();
+        if (!(flags & IORING_CQE_F_MORE)) {
+          uring_arm_bg();
+        }
+        continue;
+      }
+      Connection *con = g_data.connections[cfd];
+      assert(con);
+      if (op == UOP_RECV) {
+        uring_on_recv(con, res, flags, rearm);
+      } else {
+        uring_on_send(con, res);
+      }
+      if (con->state == END) {
+        if (con->inflight == 0) {
+          closed.push_back(con);
+        } else {
+          // shuts the socket down, which completes what is in flight
+          conn_done(con);
+        }
+      }
+    }
+    for (Connection *con : rearm) {
+      if (con->state != END) {
+        uring_arm_recv(con);
+      } else if (!con->inflight) {
+        closed.push_back(con);
+      }
+    }
+    rearm.clear();
+    bzpop_expire();
+    // replies of commands that completed in the background, and pub/sub
+    // messages; a subscriber over its output limit is closed
+    vector<Connection *> pending;
+    pending.swap(g_data.pending_out);
+    for (Connection *con : pending) {
+      con->pending_out = false;
+      if (con->state != END) {
+        uring_send(con);
+      } else if (con->inflight) {
+        conn_done(con);
+      } else {
+        closed.push_back(con);
+      }
+    }
+    // a connection can end more than once in a batch
+    sort(closed.begin(), closed.end());
+    closed.erase(unique(closed.begin(), closed.end()), closed.end());
+    for (Connection *con : closed) {
+      g_ring_spill[con->fd].clear();
+      g_ring_spill[con->fd].shrink_to_fit();
+      conn_done(con);
+    }
+    closed.clear();
+
+    process_timers();
+    clients_cron();
+    rehash_cron();
+    cluster_cron();
+    if (g_data.evicting) {
+      perform_evictions();
+    }
+    stats_cron();
+    uint64_t loop_ticks = clock_ticks() - loop_start;
+    hist_record(&g_data.loop_hist, loop_ticks);
+    latency_add_ticks(LAT_EVENTLOOP, loop_ticks);
+  }
+  return true;
+}
+
+
+static int listen_tcp() {
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  if (fd < 0) {
+    perror("socket");
+    return -1;
+  }
+  int val = 1;
+  setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &val, sizeof(val));
+  struct sockaddr_in addr;
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons((uint16_t)g_config.port);
+  addr.sin_addr.s_addr = inet_addr("127.0.0.1");
+  if (bind(fd, (const sockaddr *)&addr, sizeof(addr)) < 0) {
+    perror("bind");
+    return -1;
+  }
+
+  if (listen(fd, (int)g_config.tcp_backlog) < 0) {
+    perror("listen");
+    return -1;
+  }
+
+  fd_set_nb(fd);
+  log_info("listening on 127.0.0.1:%u", g_config.port);
+  return fd;
+}
+
+// co-located clients skip the TCP stack
+static int listen_unix(const string &path) {
+  struct sockaddr_un addr = {};
+  if (path.size() >= sizeof(addr.sun_path)) {
+    fprintf(stderr, "unixsocket path too long: %s\n", path.c_str());
+    return -1;
+  }
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0) {
+    perror("socket");
+    return -1;
+  }
+  addr.sun_family = AF_UNIX;
+  memcpy(addr.sun_path, path.data(), path.size());
+  // a socket file left by a previous run
+  unlink(path.c_str());
+  if (bind(fd, (const sockaddr *)&addr, sizeof(addr)) < 0) {
+    perror("bind");
+    return -1;
+  }
+  if (listen(fd, (int)g_config.tcp_backlog) < 0) {
+    perror("listen");
+    return -1;
+  }
+  fd_set_nb(fd);
+  log_info("listening on %s", path.c_str());
+  return fd;
+}
+
+int main(int argc, char *argv[]) {
+  if (!config_parse_args(argc, argv)) {
+    return 1;
+  }
+  // a client that went away is seen as a write error instead
+  signal(SIGPIPE, SIG_IGN);
+  if (!log_init(g_config.logfile.c_str())) {
+    return 1;
+  }
+  dlist_init(&g_data.idle_list);
+  dlist_init(&g_data.tracking_order);
+  thread_pool_init(&g_data.tp, 4);
+  bg_init();
+  keyidx_sync();
+  cluster_init();
+  g_data.now_us = get_monotonic_usec();
+  g_data.start_us = g_data.now_us;
+  g_data.start_ticks = clock_ticks();
+  // a first estimate of the tick rate, stats_cron refines it
+  timespec calib = {0, 10 * 1000 * 1000};
+  nanosleep(&calib, NULL);
+  g_data.ticks_per_us =
+      1000.0 * clock_ticks_per_ns(g_data.start_ticks, g_data.start_us * 1000,
+                                  clock_ticks(), get_monotonic_usec() * 1000);
+
+  // the TCP listener comes first
+  vector<Listener> listeners;
+  Listener tcp;
+  tcp.fd = listen_tcp();
+  if (tcp.fd < 0) {
+    return 1;
+  }
+  listeners.push_back(tcp);
+  if (!g_config.unixsocket.empty()) {
+    Listener local;
+    local.fd = listen_unix(g_config.unixsocket);
+    local.tcp = false;
+    if (local.fd < 0) {
+      return 1;
+    }
+    listeners.push_back(local);
+  }
 
+  if (g_config.io_backend == IO_BACKEND_URING && uring_loop(listeners)) {
+    return 0;
   }
-  
+  poll_loop(listeners);
   return 0;
 }